@@ -0,0 +1,106 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/DetectorGeometry.h"
+#include "../include/GeometryPlan.h"
+#include "../include/JFApp.h"
+
+DetectorGeometry::DetectorGeometry(size_t in_ncards, size_t in_modules_per_card) :
+        ncards(in_ncards), modules_per_card(in_modules_per_card) {}
+
+size_t DetectorGeometry::GetCardsNum() const {
+    return ncards;
+}
+
+size_t DetectorGeometry::GetModulesPerCard() const {
+    return modules_per_card;
+}
+
+size_t DetectorGeometry::GetModulesNum() const {
+    return ncards * modules_per_card;
+}
+
+size_t DetectorGeometry::GetModulePixels() const {
+    return GeometryPlan::ModuleCols * GeometryPlan::ModuleLines;
+}
+
+size_t DetectorGeometry::GetCardPixels() const {
+    return modules_per_card * GetModulePixels();
+}
+
+size_t DetectorGeometry::GetCardLines() const {
+    return (modules_per_card / ModulesPerRow) * GeometryPlan::ComposedModuleLines;
+}
+
+size_t DetectorGeometry::GetCardComposedPixels() const {
+    return GetCardLines() * GetXPixels();
+}
+
+size_t DetectorGeometry::GetCardLineOffset(size_t card) const {
+    return (ncards - card - 1) * GetCardLines();
+}
+
+size_t DetectorGeometry::GetCardPixelOffset(size_t card) const {
+    return GetCardLineOffset(card) * GetXPixels();
+}
+
+size_t DetectorGeometry::GetXPixels() const {
+    return ModulesPerRow * GeometryPlan::ComposedModuleCols;
+}
+
+size_t DetectorGeometry::GetYPixels() const {
+    return ncards * GetCardLines();
+}
+
+size_t DetectorGeometry::GetPixels() const {
+    return GetXPixels() * GetYPixels();
+}
+
+size_t DetectorGeometry::GetModuleX(size_t module) const {
+    return (module % ModulesPerRow) * GeometryPlan::ComposedModuleCols;
+}
+
+size_t DetectorGeometry::GetModuleY(size_t module) const {
+    return (module / ModulesPerRow) * GeometryPlan::ComposedModuleLines;
+}
+
+double DetectorGeometry::GetModuleXWithGaps(size_t module) const {
+    return (module % ModulesPerRow) * (GeometryPlan::ComposedModuleCols + VERTICAL_GAP_PIXELS);
+}
+
+double DetectorGeometry::GetModuleYWithGaps(size_t module) const {
+    return (module / ModulesPerRow) * (GeometryPlan::ComposedModuleLines + HORIZONTAL_GAP_PIXELS);
+}
+
+double DetectorGeometry::GetXPixelsWithGaps() const {
+    return GetXPixels() + (ModulesPerRow - 1) * VERTICAL_GAP_PIXELS;
+}
+
+double DetectorGeometry::GetYPixelsWithGaps() const {
+    size_t rows = GetModulesNum() / ModulesPerRow;
+    return GetYPixels() + (rows - 1) * HORIZONTAL_GAP_PIXELS;
+}
+
+size_t DetectorGeometry::GetModuleIndex(float x, float y) const {
+    return (size_t) (x / GeometryPlan::ComposedModuleCols) + ModulesPerRow * (size_t) (y / GeometryPlan::ComposedModuleLines);
+}
+
+std::string DetectorGeometry::GetName() const {
+    size_t nmodules = GetModulesNum();
+    std::string name = "JF" + std::to_string(nmodules / 2);
+    if (nmodules % 2) name += ".5";
+    return name + "M";
+}
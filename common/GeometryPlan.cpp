@@ -0,0 +1,82 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/GeometryPlan.h"
+
+GeometryPlan::GeometryPlan(size_t in_nmodules) : nmodules(in_nmodules) {
+    // 4 chips of 256 pixels in a line, pixels at chip border are extended to fill 2 pixel gap
+    for (int chip = 0; chip < 4; chip++) {
+        uint16_t src = chip * 256;
+        uint16_t dst = (chip == 0) ? 0 : chip * 258 - 1;
+        if (chip > 0) {
+            runs.push_back(GeometryRun{src, dst, 1, 2});
+            src += 1;
+            dst += 2;
+        }
+        uint16_t len = (chip == 0 || chip == 3) ? 255 : 254;
+        runs.push_back(GeometryRun{src, dst, len, 1});
+        if (chip < 3)
+            runs.push_back(GeometryRun{(uint16_t) (src + len), (uint16_t) (dst + len), 1, 2});
+    }
+
+    // Lines 255 and 256 are at chip border and are extended in vertical direction
+    for (size_t module = 0; module < nmodules; module++) {
+        // Module 0 is at the bottom, lines are flipped
+        size_t first_line_out = ComposedModuleLines * (nmodules / 2 - module / 2) - 1;
+        for (size_t line = 0; line < ModuleLines; line++) {
+            size_t line_out;
+            if (line < 255) line_out = first_line_out - line;
+            else if (line == 255) line_out = first_line_out - 256;
+            else if (line == 256) line_out = first_line_out - 258;
+            else line_out = first_line_out - line - 2;
+
+            GeometryLine geom_line;
+            geom_line.src = (module * ModuleLines + line) * ModuleCols;
+            geom_line.dst = line_out * GetComposedCols() + (module % 2) * ComposedModuleCols;
+            geom_line.multipixel = (line == 255) || (line == 256);
+            geom_line.dst_copy = geom_line.multipixel ? geom_line.dst + GetComposedCols() : geom_line.dst;
+            lines.push_back(geom_line);
+        }
+    }
+}
+
+size_t GeometryPlan::GetModulesNum() const {
+    return nmodules;
+}
+
+size_t GeometryPlan::GetComposedCols() const {
+    return 2 * ComposedModuleCols;
+}
+
+size_t GeometryPlan::GetComposedLines() const {
+    return (nmodules / 2) * ComposedModuleLines;
+}
+
+size_t GeometryPlan::GetComposedPixels() const {
+    return GetComposedCols() * GetComposedLines();
+}
+
+const std::vector<GeometryRun> &GeometryPlan::GetRuns() const {
+    return runs;
+}
+
+const std::vector<GeometryLine> &GeometryPlan::GetLines() const {
+    return lines;
+}
+
+const GeometryLine &GeometryPlan::GetLine(size_t module, size_t line) const {
+    return lines[module * ModuleLines + line];
+}
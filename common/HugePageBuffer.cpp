@@ -0,0 +1,139 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../include/HugePageBuffer.h"
+
+#define HUGE_PAGE_2M (2UL*1024*1024)
+#define HUGE_PAGE_1G (1024UL*1024*1024)
+
+// Page size encoding for mmap flags (linux/mman.h)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define MAP_HUGE_2M_FLAG (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1G_FLAG (30 << MAP_HUGE_SHIFT)
+
+static size_t round_up(size_t size, size_t page) {
+    return (size + page - 1) / page * page;
+}
+
+static char *map_huge(size_t size, size_t page, int flags) {
+#ifdef MAP_HUGETLB
+    // Hugepages are reserved at mmap time, so lack of pages is reported here and not as SIGBUS later
+    void *ret = mmap(NULL, round_up(size, page), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flags, -1, 0);
+    if (ret == MAP_FAILED) return NULL;
+    return (char *) ret;
+#else
+    return NULL;
+#endif
+}
+
+HugePageBuffer::HugePageBuffer() : ptr(NULL), size(0), mapped_size(0), page_size(0) {}
+
+HugePageBuffer::~HugePageBuffer() {
+    Free();
+}
+
+int HugePageBuffer::Allocate(size_t in_size) {
+    Free();
+    if (in_size == 0) return 1;
+
+    size = in_size;
+
+    // 1 GiB pages only when buffer is large enough, otherwise too much memory is lost for rounding
+    if (size >= HUGE_PAGE_1G) {
+        ptr = map_huge(size, HUGE_PAGE_1G, MAP_HUGE_1G_FLAG);
+        page_size = HUGE_PAGE_1G;
+    }
+
+    if (ptr == NULL) {
+        ptr = map_huge(size, HUGE_PAGE_2M, MAP_HUGE_2M_FLAG);
+        page_size = HUGE_PAGE_2M;
+    }
+
+    if (ptr == NULL) {
+        // No hugepages reserved - use regular pages, but ask for transparent hugepages
+        page_size = sysconf(_SC_PAGESIZE);
+        void *ret = mmap(NULL, round_up(size, page_size), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ret == MAP_FAILED) {
+            size = 0;
+            page_size = 0;
+            return 1;
+        }
+        ptr = (char *) ret;
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, round_up(size, page_size), MADV_HUGEPAGE);
+#endif
+    }
+    mapped_size = round_up(size, page_size);
+    return 0;
+}
+
+void HugePageBuffer::Free() {
+    if (ptr != NULL) munmap(ptr, mapped_size);
+    ptr = NULL;
+    size = 0;
+    mapped_size = 0;
+    page_size = 0;
+}
+
+void HugePageBuffer::Prefault(size_t nthreads) {
+    if (ptr == NULL) return;
+    if (nthreads == 0) nthreads = std::thread::hardware_concurrency();
+    if (nthreads == 0) nthreads = 1;
+
+    // Each thread touches contiguous range of pages, writing zero doesn't change content
+    size_t npages = mapped_size / page_size;
+    if (nthreads > npages) nthreads = npages;
+    size_t pages_per_thread = (npages + nthreads - 1) / nthreads;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nthreads; i++) {
+        threads.push_back(std::thread([this, i, pages_per_thread, npages] {
+            size_t end = std::min((i + 1) * pages_per_thread, npages);
+            for (size_t page = i * pages_per_thread; page < end; page++)
+                ((volatile char *) ptr)[page * page_size] = 0;
+        }));
+    }
+    for (auto &t : threads) t.join();
+}
+
+char *HugePageBuffer::Get() const {
+    return ptr;
+}
+
+size_t HugePageBuffer::GetSize() const {
+    return size;
+}
+
+size_t HugePageBuffer::GetPageSize() const {
+    return page_size;
+}
+
+std::string HugePageBuffer::GetPageSizeString() const {
+    if (page_size >= HUGE_PAGE_1G) return std::to_string(page_size / HUGE_PAGE_1G) + " GiB";
+    if (page_size >= HUGE_PAGE_2M) return std::to_string(page_size / (1024*1024)) + " MiB";
+    return std::to_string(page_size / 1024) + " kiB";
+}
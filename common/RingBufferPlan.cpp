@@ -0,0 +1,76 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iomanip>
+
+#include "../include/RingBufferPlan.h"
+
+#define MIB (1024.0 * 1024.0)
+
+RingBufferPlan::RingBufferPlan(size_t in_memory_budget) : memory_budget(in_memory_budget), used(0) {}
+
+size_t RingBufferPlan::GetAvailable() const {
+    if (used >= memory_budget) return 0;
+    return memory_budget - used;
+}
+
+size_t RingBufferPlan::GetUsed() const {
+    return used;
+}
+
+size_t RingBufferPlan::GetBudget() const {
+    return memory_budget;
+}
+
+bool RingBufferPlan::IsOverBudget() const {
+    return used > memory_budget;
+}
+
+size_t RingBufferPlan::FitElements(size_t element_size, size_t granularity, size_t max_elements) const {
+    if ((element_size == 0) || (granularity == 0)) return 0;
+    size_t elements = GetAvailable() / element_size;
+    if (elements > max_elements) elements = max_elements;
+    return elements / granularity * granularity;
+}
+
+void RingBufferPlan::AddBuffer(const std::string &name, size_t size) {
+    AddRing(name, 1, size, 0.0);
+}
+
+void RingBufferPlan::AddRing(const std::string &name, size_t elements, size_t element_size, double elements_per_second) {
+    Entry entry;
+    entry.name = name;
+    entry.elements = elements;
+    entry.element_size = element_size;
+    entry.elements_per_second = elements_per_second;
+    entries.push_back(entry);
+    used += elements * element_size;
+}
+
+void RingBufferPlan::Print(std::ostream &out) const {
+    out << "Memory map (budget " << std::fixed << std::setprecision(0) << memory_budget / MIB << " MiB):" << std::endl;
+    for (const Entry &entry : entries) {
+        out << "   " << std::left << std::setw(24) << entry.name << std::right
+            << std::setw(10) << std::setprecision(1) << entry.elements * entry.element_size / MIB << " MiB";
+        if (entry.elements_per_second > 0)
+            out << std::setw(8) << entry.elements << " elements, backlog "
+                << std::setprecision(3) << entry.elements / entry.elements_per_second << " s";
+        out << std::endl;
+    }
+    out << "   total " << std::setprecision(1) << used / MIB << " MiB" << (IsOverBudget() ? " - OVER BUDGET" : "") << std::endl;
+    out.unsetf(std::ios::floatfield);
+    out << std::setprecision(6);
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "../include/ThreadPlacement.h"
+
+// Memory policy constants from linux/mempolicy.h, so libnuma is not needed
+#define PLACEMENT_MPOL_PREFERRED 1
+#define PLACEMENT_MPOL_MF_MOVE   (1 << 1)
+
+static std::string trim(const std::string &s) {
+    size_t first = s.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) return "";
+    size_t last = s.find_last_not_of(" \t\r\n");
+    return s.substr(first, last - first + 1);
+}
+
+static const std::vector<int> empty_cpu_list;
+
+ThreadPlacement::ThreadPlacement() {
+    for (int node = 0; ; node++) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!file.is_open()) break;
+        std::string list;
+        std::getline(file, list);
+        std::vector<int> cpus;
+        ParseCPUList(trim(list), cpus);
+        node_cpus.push_back(cpus);
+    }
+}
+
+size_t ThreadPlacement::GetNodesNum() const {
+    return node_cpus.size();
+}
+
+const std::vector<int> &ThreadPlacement::GetNodeCPUs(int node) const {
+    if ((node < 0) || (node >= (int) node_cpus.size())) return empty_cpu_list;
+    return node_cpus[node];
+}
+
+int ThreadPlacement::GetSysfsNode(const std::string &sysfs_device_path) {
+    std::ifstream file(sysfs_device_path + "/numa_node");
+    int node = -1;
+    if (file.is_open()) file >> node;
+    if (file.fail()) return -1;
+    return node;
+}
+
+int ThreadPlacement::GetInfinibandNode(const std::string &ib_device_name) {
+    return GetSysfsNode("/sys/class/infiniband/" + ib_device_name + "/device");
+}
+
+int ThreadPlacement::GetPCIDeviceNode(const std::string &pci_bus_id) {
+    std::string id = pci_bus_id;
+    std::transform(id.begin(), id.end(), id.begin(), ::tolower);
+    return GetSysfsNode("/sys/bus/pci/devices/" + id);
+}
+
+int ThreadPlacement::ParseCPUList(const std::string &list, std::vector<int> &cpus) {
+    std::stringstream ss(list);
+    std::string range;
+    cpus.clear();
+    while (std::getline(ss, range, ',')) {
+        range = trim(range);
+        if (range.empty()) continue;
+        char *end;
+        long first = strtol(range.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        if ((*end != '\0') || (first < 0) || (last < first)) return 1;
+        for (long i = first; i <= last; i++) cpus.push_back(i);
+    }
+    return 0;
+}
+
+void ThreadPlacement::AssignRole(const std::string &role, int node) {
+    if (role_from_config[role]) return;
+    role_node[role] = node;
+}
+
+int ThreadPlacement::GetRoleNode(const std::string &role) const {
+    auto it = role_node.find(role);
+    if (it == role_node.end()) return -1;
+    return it->second;
+}
+
+int ThreadPlacement::LoadConfig(const std::string &file_name) {
+    std::ifstream file(file_name);
+    if (!file.is_open()) {
+        std::cerr << "Placement: cannot open config file " << file_name << std::endl;
+        return 1;
+    }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "Placement: missing '=' in " << file_name << ":" << line_number << std::endl;
+            return 1;
+        }
+        std::string role = trim(line.substr(0, eq));
+        std::string value = trim(line.substr(eq + 1));
+
+        if (value.compare(0, 5, "node ") == 0) {
+            char *end;
+            long node = strtol(value.c_str() + 5, &end, 10);
+            if ((*end != '\0') || (node < -1) || (node >= (long) node_cpus.size())) {
+                std::cerr << "Placement: wrong NUMA node in " << file_name << ":" << line_number << std::endl;
+                return 1;
+            }
+            role_node[role] = node;
+            role_cpus.erase(role);
+        } else if (value.compare(0, 5, "cpus ") == 0) {
+            std::vector<int> cpus;
+            if (ParseCPUList(trim(value.substr(5)), cpus) || cpus.empty()) {
+                std::cerr << "Placement: wrong CPU list in " << file_name << ":" << line_number << std::endl;
+                return 1;
+            }
+            role_cpus[role] = cpus;
+            // Memory follows node of the first CPU
+            role_node[role] = -1;
+            for (int node = 0; node < (int) node_cpus.size(); node++)
+                if (std::find(node_cpus[node].begin(), node_cpus[node].end(), cpus[0]) != node_cpus[node].end())
+                    role_node[role] = node;
+        } else {
+            std::cerr << "Placement: expected 'node <n>' or 'cpus <list>' in " << file_name << ":" << line_number << std::endl;
+            return 1;
+        }
+        role_from_config[role] = true;
+    }
+    return 0;
+}
+
+std::vector<int> ThreadPlacement::GetRoleCPUs(const std::string &role) const {
+    auto it = role_cpus.find(role);
+    if (it != role_cpus.end()) return it->second;
+    return GetNodeCPUs(GetRoleNode(role));
+}
+
+int ThreadPlacement::PinThread(const std::string &role) const {
+    std::vector<int> cpus = GetRoleCPUs(role);
+    if (cpus.empty()) return 0; // Nothing known about the role
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int cpu : cpus)
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpu_set);
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+    if (ret != 0) {
+        std::cerr << "Placement: failed to pin " << role << " thread: " << strerror(ret) << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int ThreadPlacement::PlaceMemory(void *ptr, size_t size, const std::string &role) const {
+    int node = GetRoleNode(role);
+    if ((node < 0) || (ptr == NULL) || (size == 0)) return 0;
+
+    // mbind requires page aligned address
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) ptr) / page_size * page_size;
+    size_t len = (uintptr_t) ptr + size - start;
+
+    unsigned long nodemask[16];
+    memset(nodemask, 0, sizeof(nodemask));
+    if (node >= (int) (sizeof(nodemask) * 8)) return 1;
+    nodemask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_mbind, start, len, PLACEMENT_MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8,
+                PLACEMENT_MPOL_MF_MOVE) != 0) {
+        std::cerr << "Placement: failed to place " << role << " on NUMA node " << node << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+void ThreadPlacement::Print(std::ostream &out) const {
+    out << "Placement: " << node_cpus.size() << " NUMA node(s)" << std::endl;
+    for (auto &it : role_node) {
+        out << "   " << it.first << ": ";
+        auto cpus = role_cpus.find(it.first);
+        if (cpus != role_cpus.end()) {
+            out << "cpus";
+            for (int cpu : cpus->second) out << " " << cpu;
+        } else if (it.second < 0)
+            out << "not pinned";
+        else
+            out << "node " << it.second << " (" << GetNodeCPUs(it.second).size() << " cpus)";
+        auto from_config = role_from_config.find(it.first);
+        if ((from_config != role_from_config.end()) && from_config->second) out << " [config]";
+        out << std::endl;
+    }
+}
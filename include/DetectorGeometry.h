@@ -0,0 +1,73 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DETECTORGEOMETRY_H
+#define DETECTORGEOMETRY_H
+
+#include <cstddef>
+#include <string>
+
+// Layout of the whole detector, chosen at startup.
+// Each card delivers composed image of its modules (2 modules per row, see GeometryPlan),
+// composed images of cards are stacked vertically, with card 0 at the bottom of the full image.
+// Number of modules per card is fixed by FPGA design, number of cards is a runtime parameter.
+// Modules are numbered in the full image from the top, 2 per row (0 = top left).
+//
+// Limitation: only a single column of cards, 2 modules wide, can be described.
+// With NMODULES = 4 this covers 2M, 4M, ... up to MAX_NCARDS cards (8 x 2M, 2 x 16 modules).
+// Detectors with different number of modules per row or with cards placed side by side
+// (e.g. 1M, 9M as 3x6 modules or 16M as 4x8 modules) need both modules per row and
+// card position to become part of the layout, together with strided card output in GeometryPlan.
+
+class DetectorGeometry {
+    size_t ncards;
+    size_t modules_per_card;
+public:
+    static const size_t ModulesPerRow = 2;
+
+    DetectorGeometry(size_t ncards, size_t modules_per_card);
+
+    size_t GetCardsNum() const;
+    size_t GetModulesPerCard() const;
+    size_t GetModulesNum() const;
+
+    size_t GetModulePixels() const;        // pixels per module, as received from detector (1024x512)
+    size_t GetCardPixels() const;          // pixels of all modules of one card, as received from detector
+
+    size_t GetCardLines() const;           // lines of composed image of one card
+    size_t GetCardComposedPixels() const;  // pixels of composed image of one card
+    size_t GetCardLineOffset(size_t card) const;  // first line of card in the full image
+    size_t GetCardPixelOffset(size_t card) const; // first pixel of card in the full image
+
+    size_t GetXPixels() const;             // full composed image, without inter-module gaps
+    size_t GetYPixels() const;
+    size_t GetPixels() const;
+
+    // Position of module in the full image, without (pixel) and with (pixel_with_gaps) inter-module gaps
+    size_t GetModuleX(size_t module) const;
+    size_t GetModuleY(size_t module) const;
+    double GetModuleXWithGaps(size_t module) const;
+    double GetModuleYWithGaps(size_t module) const;
+    double GetXPixelsWithGaps() const;
+    double GetYPixelsWithGaps() const;
+
+    // Module covering given position in the full image (gaps not included)
+    size_t GetModuleIndex(float x, float y) const;
+
+    std::string GetName() const;           // e.g. JF4M (1 module = 0.5 Mpixel)
+};
+
+#endif //DETECTORGEOMETRY_H
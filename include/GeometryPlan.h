@@ -0,0 +1,86 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GEOMETRYPLAN_H
+#define GEOMETRYPLAN_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+// Mapping of module data (1024x512 pixels per module, modules one after another)
+// into composed image of one card: 2 modules per row, first module at the bottom,
+// module lines flipped, 2 pixel gaps between chips filled by extending multipixels.
+// Mapping is described by run-length descriptors, calculated once per detector layout.
+
+// Part of a module line, copied to the composed image line
+struct GeometryRun {
+    uint16_t src;    // first pixel in module line
+    uint16_t dst;    // first pixel in composed module line
+    uint16_t len;    // number of module pixels
+    uint16_t width;  // 1 = regular pixels, 2 = multipixels (each covering 2 pixels of composed image)
+};
+
+// Module line and its location in composed image
+struct GeometryLine {
+    size_t src;       // offset of the line in module data (pixels)
+    size_t dst;       // offset of the line in composed image (pixels)
+    size_t dst_copy;  // offset of the second copy of the line (multipixel lines between chips)
+    bool   multipixel;
+};
+
+class GeometryPlan {
+    size_t nmodules;
+    std::vector<GeometryRun>  runs;   // the same for each module line
+    std::vector<GeometryLine> lines;  // module by module, line by line
+public:
+    static const size_t ModuleCols = 1024;
+    static const size_t ModuleLines = 512;
+    static const size_t ComposedModuleCols = 1030;
+    static const size_t ComposedModuleLines = 514;
+
+    GeometryPlan(size_t nmodules);
+
+    size_t GetModulesNum() const;
+    size_t GetComposedCols() const;   // pixels per line of composed image
+    size_t GetComposedLines() const;
+    size_t GetComposedPixels() const;
+
+    const std::vector<GeometryRun> &GetRuns() const;
+    const std::vector<GeometryLine> &GetLines() const;
+    const GeometryLine &GetLine(size_t module, size_t line) const;
+
+    // Copy module data into composed image, without dividing multipixels (e.g. pixel mask)
+    template <class Tout, class Tin> void Transform(Tout *out, const Tin *in) const {
+        for (const GeometryLine &line : lines) {
+            Tout *out_line = out + line.dst;
+            const Tin *in_line = in + line.src;
+            for (const GeometryRun &run : runs) {
+                if (run.width == 1)
+                    std::copy(in_line + run.src, in_line + run.src + run.len, out_line + run.dst);
+                else {
+                    for (size_t i = 0; i < run.len; i++)
+                        std::fill(out_line + run.dst + i * run.width, out_line + run.dst + (i + 1) * run.width, in_line[run.src + i]);
+                }
+            }
+            if (line.multipixel)
+                std::copy(out_line, out_line + ComposedModuleCols, out + line.dst_copy);
+        }
+    }
+};
+
+#endif //GEOMETRYPLAN_H
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef HITFINDING_H_
+#define HITFINDING_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "JFApp.h"
+
+// Hit finding table of the writer - results of all cards are summed for each image
+struct image_hit_t {
+    uint32_t spots;          // sum over cards
+    uint32_t strong_pixels;  // sum over cards
+    uint16_t cards;          // cards, which reported the image
+    bool hit;
+};
+
+// Adds results of one card for a chunk starting at image0. Chunks of a card arrive in any order,
+// as each spot finding thread sends its chunk when done, so image0 must come from the message.
+// Image is classified, when the last card reported it. Returns number of newly classified images.
+inline size_t add_image_spot_counts(std::vector<image_hit_t> &hits, size_t image0,
+                                    const std::vector<image_spot_count_t> &counts, uint16_t ncards,
+                                    uint32_t min_spots, uint32_t min_strong_pixels, size_t &new_hits) {
+    size_t classified = 0;
+    for (size_t i = 0; (i < counts.size()) && (image0 + i < hits.size()); i++) {
+        image_hit_t &image = hits[image0 + i];
+        image.spots += counts[i].spots;
+        image.strong_pixels += counts[i].strong_pixels;
+        image.cards++;
+        if (image.cards == ncards) {
+            image.hit = (image.spots >= min_spots) && (image.strong_pixels >= min_strong_pixels);
+            classified++;
+            if (image.hit) new_hits++;
+        }
+    }
+    return classified;
+}
+
+#endif // HITFINDING_H_
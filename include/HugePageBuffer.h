@@ -0,0 +1,54 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HUGEPAGEBUFFER_H
+#define HUGEPAGEBUFFER_H
+
+#include <cstddef>
+#include <string>
+
+// Large buffer mapped with the largest available page size:
+// 1 GiB hugepages (for buffers of at least 1 GiB), then 2 MiB hugepages,
+// then regular pages with transparent hugepages requested.
+// Memory comes zeroed from the kernel, so no memset is needed after allocation.
+// Allocation doesn't touch the memory, so NUMA policy can be set before pages are faulted in with Prefault().
+
+class HugePageBuffer {
+    char *ptr;
+    size_t size;
+    size_t mapped_size;
+    size_t page_size;
+
+    HugePageBuffer(const HugePageBuffer &other) = delete;
+    HugePageBuffer &operator=(const HugePageBuffer &other) = delete;
+public:
+    HugePageBuffer();
+    ~HugePageBuffer();
+
+    // Returns 1 on error
+    int Allocate(size_t size);
+    void Free();
+
+    // Fault in all pages using nthreads threads (0 = number of hardware threads)
+    void Prefault(size_t nthreads = 0);
+
+    char *Get() const;
+    size_t GetSize() const;
+    size_t GetPageSize() const; // 4096 (or system page size) if hugepages are not available
+    std::string GetPageSizeString() const;
+};
+
+#endif //HUGEPAGEBUFFER_H
@@ -18,6 +18,7 @@
 #define JFAPP_H_
 
 #include <stdlib.h>
+#include <cmath>
 #include <string>
 #include <pthread.h>
 #include <lz4.h>
@@ -31,18 +32,20 @@
 #define TCPIP_CONN_MAGIC_NUMBER 123434L
 #define TCPIP_DONE_MAGIC_NUMBER  56789L
 
-// Number of images per single CUDA run
+// Maximum number of images per single CUDA run (limited by GPU memory)
+// Actual number is chosen by receiver at startup from memory budget and reported to writer
 // This number is 1/2 if 32-bit pixel depth is used
 #define NIMAGES_PER_STREAM 320L
 
-// Number of FPGA boards in total for the whole setup
-#define NCARDS 2
+// Number of FPGA boards in the whole setup is chosen at startup (see DetectorGeometry),
+// arrays with per-card data are sized for the largest supported detector (8 cards with 4 modules each)
+#define MAX_NCARDS     8
+#define DEFAULT_NCARDS 2
 
 #define WVL_1A_IN_KEV           12.39854
 #define SENSOR_THICKNESS_IN_UM 320.0
 #define PIXEL_SIZE_IN_UM        75.0
 #define PIXEL_SIZE_IN_MM       (PIXEL_SIZE_IN_UM/1000.0)
-#define DETECTOR_NAME          "JF4M"
 #define SOURCE_NAME_SHORT      "SLS"
 #define SOURCE_NAME            "Swiss Light Source"
 #define INSTRUMENT_NAME        "X06DA"
@@ -52,6 +55,14 @@
 #define HORIZONTAL_GAP_PIXELS  36
 #define VERTICAL_GAP_PIXELS     8
 
+// Bit of pixel mask set for hot pixels (bits 1-3 are set by pedestal, bit 4 is "noisy" in NeXus)
+#define HOT_PIXEL_MASK_BIT      4
+
+// Powder rings of hexagonal ice (d-spacing in Angstrom), ring covers 1/d +/- ICE_RING_HALF_WIDTH (in 1/Angstrom)
+#define ICE_RINGS              10
+#define ICE_RING_HALF_WIDTH     0.004
+static const double ice_ring_d[ICE_RINGS] = {3.897, 3.669, 3.441, 2.671, 2.249, 2.072, 1.948, 1.918, 1.883, 1.721};
+
 #define OVERFLOW_32BIT         (1<<27)
 #define UNDERFLOW_32BIT        (-OVERFLOW_32BIT)
 
@@ -68,10 +79,11 @@ struct experiment_settings_t {
     uint32_t pedestalG1_frames;
     uint32_t pedestalG2_frames;
     uint32_t summation;
+    uint32_t summation_stride;      // frames between consecutive images, if lower than summation images overlap (sliding window); 0 = summation
 
     bool     jf_full_speed;
     double   count_time;            // in s Beamline
-    double   frame_time;            // in s Beamline
+    double   frame_time;            // in s Beamline, exposure of summed image - time between images is image_time()
     double   frame_time_detector;   // in s Detector
     double   count_time_detector;   // in s Detector
     size_t   pixel_depth;           // in byte !! code is only safe for pixe depth of 2 and 4 !!
@@ -96,11 +108,55 @@ struct experiment_settings_t {
     double   strong_pixel;                 // STRONG_PIXEL in XDS
     uint16_t max_spot_depth;               // Maximum images per spot
     uint16_t min_pixels_per_spot;          // Minimum pixels per spot
+    double   hot_pixel_fraction;           // Pixels strong in more than this fraction of images are masked as hot (0 = off)
+    uint16_t spot_box_size;                // Box for local background in pixels (3, 5, 7, 9 or 11, square box)
+    int32_t  spot_min_pixel_value;         // Pixels below this value are not strong (0 = off)
+    int32_t  spot_max_pixel_value;         // Pixels above this value are saturated and not strong (0 = off)
+    uint16_t excluded_ice_rings;           // Bit mask of ice rings (ice_ring_d), spots in these rings are discarded
 
     double   scattering_vector[3];  // S0 in Kabsch Acta D paper
     double   rotation_axis[3];      // m2 in Kabsch Acta D paper
 };
 
+// Ice ring containing resolution d, -1 if none
+inline int ice_ring_index(double d) {
+    for (int i = 0; i < ICE_RINGS; i++) {
+        if (fabs(1.0 / d - 1.0 / ice_ring_d[i]) <= ICE_RING_HALF_WIDTH) return i;
+    }
+    return -1;
+}
+
+// Spot of resolution d is in ice ring excluded from spot finding
+inline bool excluded_ice_ring(const experiment_settings_t &settings, double d) {
+    int ring = ice_ring_index(d);
+    return (ring >= 0) && (settings.excluded_ice_rings & (1 << ring));
+}
+
+// Frames between first frames of consecutive images
+inline uint64_t image_stride(const experiment_settings_t &settings) {
+    if ((settings.summation_stride == 0) || (settings.summation_stride > settings.summation))
+        return settings.summation;
+    return settings.summation_stride;
+}
+
+// Time between first frames of consecutive images (in s), differs from frame_time for overlapping images
+inline double image_time(const experiment_settings_t &settings) {
+    return settings.frame_time_detector * image_stride(settings);
+}
+
+// Frames needed for images of one trigger
+inline uint64_t frames_per_trigger(const experiment_settings_t &settings) {
+    if (settings.nimages_to_write_per_trigger == 0) return 0;
+    return (settings.nimages_to_write_per_trigger - 1) * image_stride(settings) + settings.summation;
+}
+
+// First frame of an image, counting from the first frame after pedestal
+inline uint64_t image_first_frame(const experiment_settings_t &settings, uint64_t image) {
+    if (settings.nimages_to_write_per_trigger == 0) return image * image_stride(settings);
+    return (image / settings.nimages_to_write_per_trigger) * frames_per_trigger(settings)
+           + (image % settings.nimages_to_write_per_trigger) * image_stride(settings);
+}
+
 struct receiver_output_t {
     uint64_t frame_when_trigger_observed;
     uint64_t packets_collected_ok;
@@ -113,6 +169,11 @@ struct ib_comm_settings_t {
     uint32_t rq_psn;
     uint32_t frame_buffer_rkey;
     uint64_t frame_buffer_remote_addr;
+    uint32_t queue_size;         // images in send (receiver) or receive (writer) queue for current pixel depth
+    uint32_t images_per_stream;  // images per CUDA stream run for current pixel depth (receiver only)
+    uint16_t modules_per_card;   // modules handled by the card (receiver: fixed by FPGA design, writer: detector geometry)
+    uint16_t ncards;             // cards in the detector (writer only)
+    uint16_t card_id;            // position of the card in the detector (writer only)
 };
 
 // IB context
@@ -135,6 +196,19 @@ struct spot_t {
     uint32_t first_frame, last_frame; // Limits of the spot in time direction
 };
 
+// Strong pixels, which didn't fit into spot finder output, sent after spots of each chunk
+struct spot_finding_overflow_t {
+    uint64_t fragments;  // half images with lost strong pixels
+    uint64_t pixels;     // strong pixels lost
+};
+
+// Spot finding result of a single image (part handled by one card), used for hit finding,
+// sent for all images of a chunk after the overflow and the chunk number (see HitFinding.h)
+struct image_spot_count_t {
+    uint32_t spots;          // accepted spots starting in the image
+    uint32_t strong_pixels;  // strong pixels found in the image (including lost ones)
+};
+
 // IB Verbs function wrappers
 int setup_ibverbs(ib_settings_t &settings, std::string ib_device_name, size_t send_queue_size, size_t receive_queue_size);
 int switch_to_rtr(ib_settings_t &settings, uint32_t rq_psn, uint16_t dlid, uint32_t dest_qp_num);
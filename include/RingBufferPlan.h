@@ -0,0 +1,59 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RINGBUFFERPLAN_H
+#define RINGBUFFERPLAN_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Memory map of large buffers, built at startup from declared RAM budget.
+// Buffers are added one by one, sizes of rings are chosen by the application from the remaining budget.
+// For rings, expected rate of elements is provided, so it is possible to report how long backlog
+// the ring can absorb.
+
+class RingBufferPlan {
+    struct Entry {
+        std::string name;
+        size_t elements;
+        size_t element_size;
+        double elements_per_second; // 0 = not a ring
+    };
+    size_t memory_budget;
+    size_t used;
+    std::vector<Entry> entries;
+public:
+    explicit RingBufferPlan(size_t memory_budget);
+
+    // Memory not yet assigned, 0 if over budget
+    size_t GetAvailable() const;
+    size_t GetUsed() const;
+    size_t GetBudget() const;
+    bool IsOverBudget() const;
+
+    // Largest number of elements, which fits into remaining budget, rounded down to multiple of granularity
+    // and limited to max_elements
+    size_t FitElements(size_t element_size, size_t granularity, size_t max_elements) const;
+
+    void AddBuffer(const std::string &name, size_t size);
+    void AddRing(const std::string &name, size_t elements, size_t element_size, double elements_per_second);
+
+    void Print(std::ostream &out) const;
+};
+
+#endif //RINGBUFFERPLAN_H
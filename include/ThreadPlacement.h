@@ -0,0 +1,74 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THREADPLACEMENT_H
+#define THREADPLACEMENT_H
+
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Placement of threads and buffers close to the devices they work with.
+// Topology (NUMA nodes and their CPUs, NUMA node of PCIe devices) is read from sysfs.
+// Each thread role (e.g. "send", "poll_cq") and buffer (e.g. "frame_buffer") is assigned to a NUMA node,
+// optionally restricted to explicit list of CPUs. Assignment can be overridden with config file:
+//
+//    # comment
+//    send         = node 0
+//    poll_cq      = cpus 8-11,16
+//    ib_buffer    = node 1
+//
+// Roles without assignment (or with node -1) are not pinned.
+
+class ThreadPlacement {
+    std::vector<std::vector<int> > node_cpus;        // CPUs of each NUMA node
+    std::map<std::string, int> role_node;            // NUMA node of role, -1 = not known
+    std::map<std::string, std::vector<int> > role_cpus; // explicit CPU list of role
+    std::map<std::string, bool> role_from_config;
+
+    std::vector<int> GetRoleCPUs(const std::string &role) const;
+public:
+    ThreadPlacement();
+
+    size_t GetNodesNum() const;
+    const std::vector<int> &GetNodeCPUs(int node) const;
+
+    // NUMA node of devices, -1 if not known
+    static int GetSysfsNode(const std::string &sysfs_device_path);
+    static int GetInfinibandNode(const std::string &ib_device_name);
+    static int GetPCIDeviceNode(const std::string &pci_bus_id); // e.g. 0000:04:00.0
+
+    static int ParseCPUList(const std::string &list, std::vector<int> &cpus);
+
+    // Assign role to NUMA node, doesn't change roles set in config file
+    void AssignRole(const std::string &role, int node);
+    int GetRoleNode(const std::string &role) const;
+
+    // Returns 1 on error
+    int LoadConfig(const std::string &file_name);
+
+    // Pin calling thread to CPUs of the role, returns 1 on error
+    int PinThread(const std::string &role) const;
+
+    // Move pages of the buffer to NUMA node of the role, returns 1 on error
+    int PlaceMemory(void *ptr, size_t size, const std::string &role) const;
+
+    void Print(std::ostream &out) const;
+};
+
+#endif //THREADPLACEMENT_H
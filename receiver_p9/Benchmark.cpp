@@ -0,0 +1,949 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Micro-benchmarks of receiver hot loops, run with JFReceiver -B
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <sched.h>
+
+#include "JFReceiver.h"
+#include "CopyLine.h"
+#include "SpotFinder.h"
+#include "SpotAssembly.h"
+#include "SpotMerge.h"
+#include "FrameSummation.h"
+#include "IBSendSlots.h"
+#include "../include/HitFinding.h"
+
+#define BENCHMARK_TIME 2.0 // seconds per measurement
+#define BENCHMARK_IMAGES 32 // output is rotated over this number of images, so it doesn't fit in cache
+#define BENCHMARK_FRAMES 48 // frames in the ring buffer for summation
+#define BENCHMARK_SUMMATION 10
+#define BENCHMARK_SLOT_THREADS 8 // producers in IB send slot stress test
+#define BENCHMARK_SLOT_RING 64 // slots used in the stress test, small to force contention
+#define BENCHMARK_SLOT_IMAGES 200000L
+#define BENCHMARK_SLOT_MIN_RATE 4000.0 // images/s
+
+// Line expansion with hand-coded geometry, as done before geometry plan was introduced
+template <typename T> static void copy_line_reference(T *destination, const T *source) {
+    for (int i = 0; i < 255; i++) destination[i] = source[i];
+    for (int i = 1; i < 255; i++) destination[i+258] = source[i+256];
+    for (int i = 1; i < 255; i++) destination[i+516] = source[i+512];
+    for (int i = 1; i < 256; i++) destination[i+774] = source[i+768];
+    for (int i = 0; i < 3; i++) {
+        T tmp1 = half_pixel(source[255 + i*256]);
+        destination[255+i*258] = tmp1;
+        destination[256+i*258] = tmp1;
+        T tmp2 = half_pixel(source[256 + i*256]);
+        destination[257+i*258] = tmp2;
+        destination[258+i*258] = tmp2;
+    }
+}
+
+template <typename T> static void copy_line_mid_reference(T *destination, const T *source, size_t offset) {
+    for (int i = 0; i < 255; i++) destination[i] = destination[i+offset] = half_pixel(source[i]);
+    for (int i = 1; i < 255; i++) destination[i+258] = destination[i+258+offset] = half_pixel(source[i+256]);
+    for (int i = 1; i < 255; i++) destination[i+516] = destination[i+516+offset] = half_pixel(source[i+512]);
+    for (int i = 1; i < 256; i++) destination[i+774] = destination[i+774+offset] = half_pixel(source[i+768]);
+    for (int i = 0; i < 3; i++) {
+        T tmp1 = quarter_pixel(source[255 + i*256]);
+        destination[255+i*258] = destination[256+i*258] = tmp1;
+        destination[255+i*258+offset] = destination[256+i*258+offset] = tmp1;
+        T tmp2 = quarter_pixel(source[256 + i*256]);
+        destination[257+i*258] = destination[258+i*258] = tmp2;
+        destination[257+i*258+offset] = destination[258+i*258+offset] = tmp2;
+    }
+}
+
+template <typename T> static void expand_frame_reference(T *output, const T *input) {
+    for (int module = 0; module < NMODULES; module ++) {
+        size_t pixel_in  = module * MODULE_LINES * MODULE_COLS;
+        size_t line_out = (module / 2) * 514;
+        line_out = 514 * NMODULES / 2 - line_out - 1;
+        size_t pixel_out = (line_out * 2  + (module%2)) * 1030;
+        for (size_t i = 0; i < MODULE_LINES; i ++) {
+            if ((i == 255) || (i == 256)) {
+                pixel_out -= 2 * 1030;
+                copy_line_mid_reference(output + pixel_out, input + pixel_in, 2*1030);
+                pixel_out -= 2 * 1030;
+            } else {
+                copy_line_reference(output + pixel_out, input + pixel_in);
+                pixel_out -= 2 * 1030;
+            }
+            pixel_in += MODULE_COLS;
+        }
+    }
+}
+
+void expand_frame16(const copy_line_kernels_t &kernels, int16_t *output, const int16_t *input) {
+    for (const GeometryLine &line : geometry_plan.GetLines())
+        kernels.copy_line(output, input + line.src, line, geometry_plan);
+    kernels.store_fence();
+}
+
+void expand_frame32(const copy_line_kernels_t &kernels, int32_t *output, const int32_t *input) {
+    for (const GeometryLine &line : geometry_plan.GetLines())
+        kernels.copy_line32(output, input + line.src, line, geometry_plan);
+    kernels.store_fence();
+}
+
+// Returns GB/s of composed image written by a single core
+template <typename T> double benchmark_copy_line(const copy_line_kernels_t &kernels, T *output, const T *input,
+        void (*expand)(const copy_line_kernels_t &, T *, const T *)) {
+    size_t iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed;
+    do {
+        for (int i = 0; i < BENCHMARK_IMAGES; i++) expand(kernels, output + i * COMPOSED_IMAGE_SIZE, input);
+        iterations += BENCHMARK_IMAGES;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < BENCHMARK_TIME);
+    return ((double) iterations * COMPOSED_IMAGE_SIZE * sizeof(T)) / elapsed / 1e9;
+}
+
+int benchmark_copy_line_kernels() {
+    std::vector<const copy_line_kernels_t *> kernel_sets;
+    kernel_sets.push_back(&copy_line_kernels_scalar);
+#ifdef __VSX__
+    kernel_sets.push_back(&copy_line_kernels_vsx);
+#endif
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2")) kernel_sets.push_back(&copy_line_kernels_avx2);
+#endif
+
+    int16_t *input16 = NULL;
+    int32_t *input32 = NULL, *output = NULL, *reference = NULL;
+    if (posix_memalign((void **) &input16, 4096, NPIXEL * sizeof(int16_t)) ||
+        posix_memalign((void **) &input32, 4096, NPIXEL * sizeof(int32_t)) ||
+        posix_memalign((void **) &output, 4096, BENCHMARK_IMAGES * COMPOSED_IMAGE_SIZE * sizeof(int32_t)) ||
+        posix_memalign((void **) &reference, 4096, COMPOSED_IMAGE_SIZE * sizeof(int32_t))) {
+        std::cerr << "Memory allocation error" << std::endl;
+        return 1;
+    }
+
+    // Random values, including bad pixel and overload markers
+    srand(1234);
+    for (size_t i = 0; i < NPIXEL; i++) {
+        switch (rand() % 64) {
+            case 0:
+                input16[i] = INT16_MIN + (rand() % 11);
+                input32[i] = UNDERFLOW_32BIT;
+                break;
+            case 1:
+                input16[i] = INT16_MAX - (rand() % 11);
+                input32[i] = OVERFLOW_32BIT;
+                break;
+            default:
+                input16[i] = (int16_t) (rand() % 65536 - 32768);
+                input32[i] = rand() % (2 * OVERFLOW_32BIT) - OVERFLOW_32BIT;
+                break;
+        }
+    }
+
+    int ret = 0;
+    for (size_t k = 0; k < kernel_sets.size(); k++) {
+        const copy_line_kernels_t &kernels = *kernel_sets[k];
+
+        // Check that results are the same as with hand-coded geometry
+        memset(reference, 0, COMPOSED_IMAGE_SIZE * sizeof(int32_t));
+        memset(output, 0, COMPOSED_IMAGE_SIZE * sizeof(int32_t));
+        expand_frame_reference((int16_t *) reference, input16);
+        expand_frame16(kernels, (int16_t *) output, input16);
+        bool identical16 = (memcmp(reference, output, COMPOSED_IMAGE_SIZE * sizeof(int16_t)) == 0);
+
+        expand_frame_reference(reference, input32);
+        expand_frame32(kernels, output, input32);
+        bool identical32 = (memcmp(reference, output, COMPOSED_IMAGE_SIZE * sizeof(int32_t)) == 0);
+
+        if (!identical16 || !identical32) ret = 1;
+
+        double gbps16 = benchmark_copy_line<int16_t>(kernels, (int16_t *) output, input16, expand_frame16);
+        double gbps32 = benchmark_copy_line<int32_t>(kernels, output, input32, expand_frame32);
+
+        std::cout << "Line expansion " << kernels.name << ": "
+                  << " 16-bit " << gbps16 << " GB/s/core" << (identical16 ? "" : " (MISMATCH)")
+                  << " 32-bit " << gbps32 << " GB/s/core" << (identical32 ? "" : " (MISMATCH)") << std::endl;
+    }
+
+    free(input16);
+    free(input32);
+    free(output);
+    free(reference);
+    return ret;
+}
+
+// Summation as done before in run_send_thread, line by line
+static void sum_frames_reference(int32_t *output, const int16_t *frames, size_t first_frame, size_t nframes, size_t module, size_t line0) {
+    for (size_t line = line0; line < line0 + SUMMATION_BLOCK_LINES; line++) {
+        int32_t *summed_buffer = output + (line - line0) * MODULE_COLS;
+        for (int col = 0; col < MODULE_COLS; col++)
+            summed_buffer[col] = 0;
+        for (size_t j = 0; j < nframes; j++) {
+            size_t pixel0_in = ((((first_frame + j) % BENCHMARK_FRAMES) * NMODULES + module) * MODULE_LINES + line) * MODULE_COLS;
+            for (int col = 0; col < MODULE_COLS; col++) {
+                int16_t tmp = frames[pixel0_in + col];
+                if (tmp < INT16_MIN + 10) summed_buffer[col] = UNDERFLOW_32BIT;
+                if ((tmp > INT16_MAX - 10) && (summed_buffer[col] > UNDERFLOW_32BIT)) summed_buffer[col] = OVERFLOW_32BIT;
+                if ((summed_buffer[col] > UNDERFLOW_32BIT) && (summed_buffer[col] < OVERFLOW_32BIT)) summed_buffer[col] += tmp;
+            }
+        }
+    }
+}
+
+// Sums one full image, returns false if result is different from reference
+// Detector is just behind the last summed frame, unless head_frame is given
+static bool sum_image(frame_summation_t &summation, const int16_t *frames, size_t first_frame, int32_t *reference,
+                      size_t head_frame = 0) {
+    if (head_frame == 0) head_frame = first_frame + BENCHMARK_SUMMATION + 1;
+    bool identical = true;
+    for (size_t module = 0; module < NMODULES; module++) {
+        for (size_t line = 0; line < MODULE_LINES; line += SUMMATION_BLOCK_LINES) {
+            int32_t *out = sum_frames(summation, frames, BENCHMARK_FRAMES, head_frame, first_frame, BENCHMARK_SUMMATION, module, line);
+            if (reference != NULL) {
+                sum_frames_reference(reference, frames, first_frame, BENCHMARK_SUMMATION, module, line);
+                if (memcmp(out, reference, SUMMATION_BLOCK_LINES * MODULE_COLS * sizeof(int32_t)) != 0)
+                    identical = false;
+            }
+        }
+    }
+    return identical;
+}
+
+int benchmark_frame_summation() {
+    int16_t *frames = NULL;
+    int32_t *reference = NULL;
+    if (posix_memalign((void **) &frames, 4096, BENCHMARK_FRAMES * NPIXEL * sizeof(int16_t)) ||
+        posix_memalign((void **) &reference, 4096, SUMMATION_BLOCK_LINES * MODULE_COLS * sizeof(int32_t))) {
+        std::cerr << "Memory allocation error" << std::endl;
+        return 1;
+    }
+
+    // Values are small enough, so the sum doesn't reach OVERFLOW_32BIT - then sliding window gives the same result
+    srand(1234);
+    for (size_t i = 0; i < BENCHMARK_FRAMES * NPIXEL; i++) {
+        switch (rand() % 1024) {
+            case 0:
+                frames[i] = INT16_MIN + (rand() % 10);
+                break;
+            case 1:
+                frames[i] = INT16_MAX - (rand() % 10);
+                break;
+            default:
+                frames[i] = (int16_t) (rand() % 2000 - 1000);
+                break;
+        }
+    }
+
+    int ret = 0;
+    for (int sliding = 0; sliding < 2; sliding++) {
+        frame_summation_t summation;
+        if (setup_frame_summation(summation, sliding)) {
+            std::cerr << "Memory allocation error" << std::endl;
+            return 1;
+        }
+
+        // Windows shifted by one frame
+        bool identical = true;
+        for (size_t first_frame = 0; first_frame < 4; first_frame++)
+            identical = sum_image(summation, frames, first_frame, reference) && identical;
+
+        // Thread lags behind the detector: frames 3 and 4, which leave the window, are overwritten
+        // in the ring buffer by frames 51 and 52, so partial sums of the previous window cannot be reused
+        for (size_t i = 3 * NPIXEL; i < 5 * NPIXEL; i++)
+            frames[i] = (int16_t) (rand() % 2000 - 1000);
+        identical = sum_image(summation, frames, 5, reference, 4 + BENCHMARK_FRAMES + 1) && identical;
+        if (!identical) ret = 1;
+
+        size_t images = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed;
+        do {
+            sum_image(summation, frames, images % (BENCHMARK_FRAMES - BENCHMARK_SUMMATION), NULL);
+            images++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < BENCHMARK_TIME);
+
+        std::cout << "Summation of " << BENCHMARK_SUMMATION << " frames" << (sliding ? " (sliding window, stride 1)" : "")
+                  << ": " << images / elapsed << " images/s/core "
+                  << ((double) images * BENCHMARK_SUMMATION * NPIXEL * sizeof(int16_t)) / elapsed / 1e9 << " GB/s/core of summed frames"
+                  << (identical ? "" : " (MISMATCH)") << std::endl;
+
+        free_frame_summation(summation);
+    }
+
+    free(frames);
+    free(reference);
+    return ret;
+}
+
+// Stress test of IB send slots - producer threads take slots in image order (like send threads),
+// single completion thread returns them in the same order (like CQ poll thread)
+static std::atomic<int64_t> slot_posted_image[BENCHMARK_SLOT_RING];
+static std::atomic<int> slot_in_use[BENCHMARK_SLOT_RING];
+static std::atomic<int> slot_errors;
+
+static void *benchmark_slot_producer(void *in_threadarg) {
+    size_t thread_id = *((size_t *) in_threadarg);
+    for (int64_t image = thread_id; image < BENCHMARK_SLOT_IMAGES; image += BENCHMARK_SLOT_THREADS) {
+        size_t slot = image % BENCHMARK_SLOT_RING;
+        wait_for_ib_send_slot(slot, image);
+        if (slot_in_use[slot].exchange(1) != 0) slot_errors++;
+        slot_posted_image[slot].store(image, std::memory_order_release);
+    }
+    pthread_exit(0);
+}
+
+static void *benchmark_slot_completion(void *in_threadarg) {
+    for (int64_t image = 0; image < BENCHMARK_SLOT_IMAGES; image++) {
+        size_t slot = image % BENCHMARK_SLOT_RING;
+        while (slot_posted_image[slot].load(std::memory_order_acquire) != image)
+            sched_yield();
+        slot_in_use[slot] = 0;
+        release_ib_send_slot(slot);
+    }
+    pthread_exit(0);
+}
+
+int benchmark_ib_send_slots() {
+    if (setup_ib_send_slots(BENCHMARK_SLOT_RING)) {
+        std::cerr << "Memory allocation error" << std::endl;
+        return 1;
+    }
+    slot_errors = 0;
+    for (int i = 0; i < BENCHMARK_SLOT_RING; i++) {
+        slot_posted_image[i] = -1;
+        slot_in_use[i] = 0;
+    }
+
+    pthread_t producer[BENCHMARK_SLOT_THREADS];
+    size_t producer_id[BENCHMARK_SLOT_THREADS];
+    pthread_t completion;
+
+    auto start = std::chrono::system_clock::now();
+    pthread_create(&completion, NULL, benchmark_slot_completion, NULL);
+    for (size_t i = 0; i < BENCHMARK_SLOT_THREADS; i++) {
+        producer_id[i] = i;
+        pthread_create(producer + i, NULL, benchmark_slot_producer, producer_id + i);
+    }
+    for (size_t i = 0; i < BENCHMARK_SLOT_THREADS; i++)
+        pthread_join(producer[i], NULL);
+    pthread_join(completion, NULL);
+    auto end = std::chrono::system_clock::now();
+
+    double rate = BENCHMARK_SLOT_IMAGES / std::chrono::duration<double>(end - start).count();
+    std::cout << "IB send slots: " << BENCHMARK_SLOT_THREADS << " producers " << rate << " images/s";
+    if (slot_errors > 0) std::cout << " (" << slot_errors << " slots used twice)";
+    else if (rate < BENCHMARK_SLOT_MIN_RATE) std::cout << " (below " << BENCHMARK_SLOT_MIN_RATE << " images/s)";
+    std::cout << std::endl;
+
+    free_ib_send_slots();
+    return ((slot_errors > 0) || (rate < BENCHMARK_SLOT_MIN_RATE)) ? 1 : 0;
+}
+
+// GPU kernel find_spots_colspot for a single fragment, as in find_spots.cu
+template <typename T, int NBX, int NBY> static size_t find_spots_reference(const T *in, const spot_finding_mask_t *mask, size_t fragment,
+        strong_pixel *out, size_t max_strong, const strong_pixel_cuts_t &cuts) {
+    float strong = cuts.strong;
+    float threshold = strong * strong * (float)((2*NBX+1) * (2*NBY+1)) / (float) ((2*NBX+1) * (2*NBY+1)-1);
+    size_t strong_id = 0;
+    std::vector<int64_t> sum_vert(COLS), sum2_vert(COLS);
+    const uint32_t *masked = mask->masked + fragment * LINES * MASK_WORDS_PER_LINE;
+    const uint32_t *incomplete = mask->incomplete[NBX - 1] + fragment * LINES * MASK_WORDS_PER_LINE;
+    const int16_t *first_col = mask->first_col + fragment * LINES;
+    const int16_t *last_col = mask->last_col + fragment * LINES;
+    std::vector<T> values(LINES * COLS);
+    for (int line = 0; line < LINES; line++)
+        for (int col = 0; col < COLS; col++)
+            values[line * COLS + col] = MASK_BIT(masked, line, col) ? 0 : in[line * COLS + col];
+
+    for (int col = 0; col < COLS; col++) {
+        int64_t tmp = values[col];
+        sum_vert[col] = tmp;
+        sum2_vert[col] = tmp * tmp;
+    }
+    for (size_t line = 1; line < 2*NBY+1; line++) {
+        for (int col = 0; col < COLS; col++) {
+            int64_t tmp = values[line * COLS + col];
+            sum_vert[col] += tmp;
+            sum2_vert[col] += tmp * tmp;
+        }
+    }
+
+    for (int16_t line = NBY; line < LINES - NBY; line++) {
+        int64_t sum = sum_vert[0];
+        int64_t sum2 = sum2_vert[0];
+        for (int i = 1; i < 2*NBX+1; i++) {
+            sum += sum_vert[i];
+            sum2 += sum2_vert[i];
+        }
+        for (int16_t col = NBX; col < COLS - NBX; col++) {
+            int32_t n = (2*NBX+1) * (2*NBY+1);
+            float threshold_n = threshold;
+            if (MASK_BIT(incomplete, line, col)) {
+                n = 0;
+                for (int i = line - NBY; i <= line + NBY; i++)
+                    for (int j = col - NBX; j <= col + NBX; j++)
+                        if (!MASK_BIT(masked, i, j)) n++;
+                threshold_n = strong * strong * (float) n / (float) (n - 1);
+            }
+            // Unsigned math, so overflow wraps around like on GPU
+            int64_t var = (int64_t) ((uint64_t) n * (uint64_t) sum2 - (uint64_t) sum * (uint64_t) sum);
+            int64_t in_minus_mean = (int32_t) ((uint32_t) in[line*COLS+col] * (uint32_t) n) - sum;
+            if (!MASK_BIT(masked, line, col) && (n >= MIN_UNMASKED_BOX_PIXELS((2*NBX+1) * (2*NBY+1))) &&
+                (col >= first_col[line]) && (col < last_col[line]) &&
+                (in_minus_mean > n) &&
+                (in[line*COLS+col] >= cuts.min_value) && (in[line*COLS+col] <= cuts.max_value) &&
+                ((int64_t) ((uint64_t) in_minus_mean * (uint64_t) in_minus_mean) > var * threshold_n)) {
+                if (strong_id < max_strong) {
+                    out[strong_id].line = line;
+                    out[strong_id].col = col;
+                    if (n == (2*NBX+1) * (2*NBY+1))
+                        out[strong_id].photons = in_minus_mean;
+                    else
+                        out[strong_id].photons = (float) in_minus_mean * (float) ((2*NBX+1) * (2*NBY+1)) / (float) n;
+                }
+                strong_id++;
+            }
+            if (col < COLS - NBX - 1) {
+                sum += sum_vert[col + NBX + 1] - sum_vert[col - NBX];
+                sum2 += sum2_vert[col + NBX + 1] - sum2_vert[col - NBX];
+            }
+        }
+        if (line < LINES - NBY - 1) {
+            for (int col = 0; col < COLS; col++) {
+                int64_t tmp_sum = (int64_t) values[(line+NBY+1) * COLS + col] + (int64_t) values[(line-NBY) * COLS + col];
+                int64_t tmp_diff = (int64_t) values[(line+NBY+1) * COLS + col] - (int64_t) values[(line-NBY) * COLS + col];
+                sum_vert[col] += tmp_diff;
+                sum2_vert[col] += tmp_sum * tmp_diff;
+            }
+        }
+    }
+    return strong_id;
+}
+
+#define BENCHMARK_SPOT_FRAGMENTS 8
+#define BENCHMARK_SPOT_MAX_STRONG 16384
+
+static const strong_pixel_cuts_t benchmark_spot_cuts = {3.0f, 1, INT32_MAX};
+// Cuts in the range of pixel values of the test data
+static const strong_pixel_cuts_t benchmark_spot_cuts_range = {3.0f, 50, 5000};
+
+// Returns fragments (half images) per second analyzed by a single core, with default box size
+template <typename T> double benchmark_spot_finder(size_t (*find_spots)(const T *, const spot_finding_mask_t *, size_t, strong_pixel *, size_t, const strong_pixel_cuts_t &),
+        const T *input, const spot_finding_mask_t *mask, strong_pixel *output) {
+    size_t iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed;
+    do {
+        for (int i = 0; i < BENCHMARK_SPOT_FRAGMENTS; i++)
+            find_spots(input + i * COLS * LINES, mask, i % 2, output, BENCHMARK_SPOT_MAX_STRONG, benchmark_spot_cuts);
+        iterations += BENCHMARK_SPOT_FRAGMENTS;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < BENCHMARK_TIME);
+    return iterations / elapsed;
+}
+
+// Compares number of strong pixels and output of each fragment, also if output is too small for all strong pixels
+template <typename T, int NBX, int NBY> static bool check_spot_finder(size_t (*find_spots)(const T *, const spot_finding_mask_t *, size_t, strong_pixel *, size_t, const strong_pixel_cuts_t &),
+        const T *input, const spot_finding_mask_t *mask, strong_pixel *output, strong_pixel *reference,
+        size_t fragments, const strong_pixel_cuts_t &cuts) {
+    for (size_t i = 0; i < fragments; i++) {
+        size_t nstrong = find_spots_reference<T, NBX, NBY>(input + i * COLS * LINES, mask, i % 2, reference, BENCHMARK_SPOT_MAX_STRONG, cuts);
+        size_t nstored = std::min<size_t>(nstrong, BENCHMARK_SPOT_MAX_STRONG);
+        if (find_spots(input + i * COLS * LINES, mask, i % 2, output, BENCHMARK_SPOT_MAX_STRONG, cuts) != nstrong) return false;
+        if (memcmp(reference, output, nstored * sizeof(strong_pixel)) != 0) return false;
+
+        // Output for half of stored pixels, the rest is lost, but counted
+        strong_pixel guard = {-1, -1, -1.0f};
+        output[nstored / 2] = guard;
+        if (find_spots(input + i * COLS * LINES, mask, i % 2, output, nstored / 2, cuts) != nstrong) return false;
+        if (memcmp(reference, output, nstored / 2 * sizeof(strong_pixel)) != 0) return false;
+        if (memcmp(&guard, output + nstored / 2, sizeof(strong_pixel)) != 0) return false;
+    }
+    return true;
+}
+
+// Default box size is checked on all fragments and with pixel value cuts,
+// other box sizes on one image (top and bottom fragment)
+template <typename T> static bool check_spot_finder_box_sizes(size_t (* const *find_spots)(const T *, const spot_finding_mask_t *, size_t, strong_pixel *, size_t, const strong_pixel_cuts_t &),
+        const T *input, const spot_finding_mask_t *mask, strong_pixel *output, strong_pixel *reference) {
+    return check_spot_finder<T, 3, 3>(find_spots[2], input, mask, output, reference, BENCHMARK_SPOT_FRAGMENTS, benchmark_spot_cuts)
+        && check_spot_finder<T, 3, 3>(find_spots[2], input, mask, output, reference, BENCHMARK_SPOT_FRAGMENTS, benchmark_spot_cuts_range)
+        && check_spot_finder<T, 1, 1>(find_spots[0], input, mask, output, reference, 2, benchmark_spot_cuts)
+        && check_spot_finder<T, 2, 2>(find_spots[1], input, mask, output, reference, 2, benchmark_spot_cuts)
+        && check_spot_finder<T, 4, 4>(find_spots[3], input, mask, output, reference, 2, benchmark_spot_cuts)
+        && check_spot_finder<T, 5, 5>(find_spots[4], input, mask, output, reference, 2, benchmark_spot_cuts);
+}
+
+// Mask with resolution range, beam center close to the middle of the card, part of the card is beyond the limit
+#define BENCHMARK_RESOLUTION_LIMIT 2.0
+
+static bool setup_resolution_mask(spot_finding_mask_t *mask, double &fraction) {
+    resolution_map_t *map = new resolution_map_t();
+    experiment_settings_t settings = experiment_settings_t();
+    settings.beam_x = 1000.0;
+    settings.beam_y = 500.0;
+    settings.detector_distance = 100.0;
+    settings.energy_in_keV = 12.4;
+    // Second call with the same geometry must use cached map
+    bool cached = update_resolution_map(*map, settings, 0) && !update_resolution_map(*map, settings, 0);
+    update_spot_finding_resolution(*mask, *map, BENCHMARK_RESOLUTION_LIMIT);
+
+    // Range of each line must contain exactly pixels above the limit
+    bool range_ok = true;
+    size_t tested_pixels = 0;
+    for (size_t line = 0; line < MASK_LINES; line++) {
+        for (size_t col = 0; col < COLS; col++) {
+            bool in_range = ((int) col >= mask->first_col[line]) && ((int) col < mask->last_col[line]);
+            if (in_range != (map->d[line * COLS + col] > BENCHMARK_RESOLUTION_LIMIT)) range_ok = false;
+            if (in_range) tested_pixels++;
+        }
+    }
+    fraction = (double) tested_pixels / (double) (MASK_LINES * COLS);
+    delete map;
+    return cached && range_ok;
+}
+
+template <typename T> static bool check_spot_finder_resolution(size_t (* const *find_spots)(const T *, const spot_finding_mask_t *, size_t, strong_pixel *, size_t, const strong_pixel_cuts_t &),
+        const T *input, const spot_finding_mask_t *mask, strong_pixel *output, strong_pixel *reference) {
+    return check_spot_finder<T, 3, 3>(find_spots[2], input, mask, output, reference, BENCHMARK_SPOT_FRAGMENTS, benchmark_spot_cuts)
+        && check_spot_finder<T, 1, 1>(find_spots[0], input, mask, output, reference, 2, benchmark_spot_cuts)
+        && check_spot_finder<T, 5, 5>(find_spots[4], input, mask, output, reference, 2, benchmark_spot_cuts);
+}
+
+// GPU kernel appends strong pixels of all fragments to a shared pool in order of discovery (find_spots.cu),
+// grouping by fragment must give the same result as fragments stored one after another
+static bool check_strong_pixel_grouping(const spot_finding_mask_t *mask, const int16_t *input) {
+    size_t pool_size = BENCHMARK_SPOT_FRAGMENTS * BENCHMARK_SPOT_MAX_STRONG;
+    std::vector<strong_pixel> expected(pool_size), pool(pool_size);
+    std::vector<uint16_t> pool_fragment(pool_size);
+    std::vector<uint32_t> found(BENCHMARK_SPOT_FRAGMENTS), next(BENCHMARK_SPOT_FRAGMENTS, 0);
+    std::vector<uint32_t> expected_offset(BENCHMARK_SPOT_FRAGMENTS + 1, 0);
+
+    for (int i = 0; i < BENCHMARK_SPOT_FRAGMENTS; i++) {
+        found[i] = find_spots_reference<int16_t, 3, 3>(input + i * COLS * LINES, mask, i % 2, expected.data() + expected_offset[i],
+                                                       BENCHMARK_SPOT_MAX_STRONG, benchmark_spot_cuts);
+        if (found[i] > BENCHMARK_SPOT_MAX_STRONG) return false;
+        expected_offset[i + 1] = expected_offset[i] + found[i];
+    }
+
+    // Random interleaving of fragments, order within fragment is kept
+    size_t pool_used = 0;
+    while (pool_used < expected_offset[BENCHMARK_SPOT_FRAGMENTS]) {
+        int i = rand() % BENCHMARK_SPOT_FRAGMENTS;
+        if (next[i] == found[i]) continue;
+        pool[pool_used] = expected[expected_offset[i] + next[i]++];
+        pool_fragment[pool_used++] = i;
+    }
+
+    strong_pixel_output_t output;
+    allocate_strong_pixel_output(output, BENCHMARK_SPOT_FRAGMENTS, pool_size);
+    group_strong_pixels(pool.data(), pool_fragment.data(), pool_used, found.data(), BENCHMARK_SPOT_FRAGMENTS, output);
+
+    spot_finding_overflow_t overflow = strong_pixel_overflow(output, BENCHMARK_SPOT_FRAGMENTS);
+    return (output.offset == expected_offset) && (overflow.pixels == 0) && (overflow.fragments == 0)
+           && (memcmp(output.pixels.data(), expected.data(), pool_used * sizeof(strong_pixel)) == 0);
+}
+
+int benchmark_spot_finder_kernels() {
+    std::vector<const spot_finder_kernels_t *> kernel_sets;
+    kernel_sets.push_back(&spot_finder_kernels_scalar);
+#ifdef __VSX__
+    kernel_sets.push_back(&spot_finder_kernels_vsx);
+#endif
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2")) kernel_sets.push_back(&spot_finder_kernels_avx2);
+#endif
+
+    size_t npixel = BENCHMARK_SPOT_FRAGMENTS * COLS * LINES;
+    std::vector<int16_t> input16(npixel);
+    std::vector<int32_t> input32(npixel);
+    std::vector<strong_pixel> output(BENCHMARK_SPOT_MAX_STRONG), reference(BENCHMARK_SPOT_MAX_STRONG);
+
+    // Background of few photons with sparse strong pixels, negative values and
+    // full range 32-bit values (to check that overflows wrap around the same way as on GPU)
+    srand(4321);
+    for (size_t i = 0; i < npixel; i++) {
+        int32_t val = rand() % 8 - 2;
+        switch (rand() % 256) {
+            case 0:
+                val = 100 + rand() % 10000;
+                break;
+            case 1:
+                val = - (rand() % 1000);
+                break;
+            case 2:
+                input16[i] = INT16_MAX;
+                input32[i] = rand() - RAND_MAX / 2;
+                continue;
+        }
+        input16[i] = val;
+        input32[i] = val;
+    }
+
+    // Mask with 0.2% isolated bad pixels and a masked block (like a dead chip region)
+    std::vector<uint16_t> composed_mask(MASK_LINES * COLS, 0);
+    for (size_t i = 0; i < composed_mask.size(); i++)
+        if (rand() % 512 == 0) composed_mask[i] = 1;
+    for (size_t line = 300; line < 340; line++)
+        for (size_t col = 500; col < 560; col++)
+            composed_mask[line * COLS + col] = 1;
+    spot_finding_mask_t *mask = new spot_finding_mask_t;
+    update_spot_finding_mask(*mask, composed_mask.data());
+
+    int ret = 0;
+    double resolution_fraction;
+    spot_finding_mask_t *resolution_mask = new spot_finding_mask_t(*mask);
+    if (!setup_resolution_mask(resolution_mask, resolution_fraction)) {
+        std::cout << "Resolution map: MISMATCH" << std::endl;
+        ret = 1;
+    }
+    for (size_t k = 0; k < kernel_sets.size(); k++) {
+        const spot_finder_kernels_t &kernels = *kernel_sets[k];
+
+        bool identical16 = check_spot_finder_box_sizes<int16_t>(kernels.find_spots16, input16.data(), mask, output.data(), reference.data());
+        bool identical32 = check_spot_finder_box_sizes<int32_t>(kernels.find_spots32, input32.data(), mask, output.data(), reference.data());
+        if (!identical16 || !identical32) ret = 1;
+
+        double rate16 = benchmark_spot_finder<int16_t>(kernels.find_spots16[DEFAULT_SPOT_BOX_SIZE / 2 - 1], input16.data(), mask, output.data());
+        double rate32 = benchmark_spot_finder<int32_t>(kernels.find_spots32[DEFAULT_SPOT_BOX_SIZE / 2 - 1], input32.data(), mask, output.data());
+
+        std::cout << "Spot finder " << kernels.name << " (" << DEFAULT_SPOT_BOX_SIZE << "x" << DEFAULT_SPOT_BOX_SIZE << "): "
+                  << " 16-bit " << rate16 << " fragments/s/core" << (identical16 ? "" : " (MISMATCH)")
+                  << " 32-bit " << rate32 << " fragments/s/core" << (identical32 ? "" : " (MISMATCH)") << std::endl;
+
+        bool identical_resolution = check_spot_finder_resolution<int16_t>(kernels.find_spots16, input16.data(), resolution_mask, output.data(), reference.data());
+        if (!identical_resolution) ret = 1;
+        double rate_resolution = benchmark_spot_finder<int16_t>(kernels.find_spots16[DEFAULT_SPOT_BOX_SIZE / 2 - 1], input16.data(), resolution_mask, output.data());
+        std::cout << "Spot finder " << kernels.name << " resolution limit " << BENCHMARK_RESOLUTION_LIMIT << " A ("
+                  << resolution_fraction * 100.0 << "% pixels): 16-bit " << rate_resolution << " fragments/s/core"
+                  << (identical_resolution ? "" : " (MISMATCH)") << std::endl;
+    }
+    bool grouping_ok = check_strong_pixel_grouping(mask, input16.data());
+    std::cout << "Strong pixel grouping: " << (grouping_ok ? "OK" : "MISMATCH") << std::endl;
+    if (!grouping_ok) ret = 1;
+
+    delete resolution_mask;
+    delete mask;
+    return ret;
+}
+
+// Spot assembly as done before in analyze_spots, with recursive search in one std::map per fragment
+typedef std::map<coordxy_t, float> strong_pixel_map_t;
+typedef std::vector<strong_pixel_map_t> strong_pixel_maps_t;
+
+static void merge_spots_reference(spot_t &spot1, const spot_t spot2) {
+    spot1.x = spot1.x + spot2.x;
+    spot1.y = spot1.y + spot2.y;
+    spot1.z = spot1.z + spot2.z;
+    spot1.photons = spot1.photons + spot2.photons;
+    if (spot2.min_line < spot1.min_line) spot1.min_line = spot2.min_line;
+    if (spot2.min_col < spot1.min_col) spot1.min_col = spot2.min_col;
+    if (spot2.max_line > spot1.max_line) spot1.max_line = spot2.max_line;
+    if (spot2.max_col > spot1.max_col) spot1.max_col = spot2.max_col;
+    if (spot2.first_frame < spot1.first_frame) spot1.first_frame = spot2.first_frame;
+    if (spot2.last_frame > spot1.last_frame) spot1.last_frame = spot2.last_frame;
+}
+
+static spot_t add_pixel_reference(strong_pixel_maps_t &strong_pixel_maps, size_t i, strong_pixel_map_t::iterator &it, bool connect_frames) {
+    spot_t ret_value;
+
+    float photons = it->second;
+    int16_t col = it->first.first;
+    int16_t line = it->first.second;
+
+    strong_pixel_maps[i].erase(it);
+
+    ret_value.x = col * photons;
+    ret_value.y = line * photons;
+    ret_value.z = (i / 2) * photons;
+    ret_value.d = 0;
+    ret_value.photons = photons;
+    ret_value.first_frame = i/2;
+    ret_value.last_frame = i/2;
+    ret_value.max_col = col;
+    ret_value.min_col = col;
+    ret_value.max_line = line;
+    ret_value.min_line = line;
+
+    strong_pixel_map_t::iterator it2;
+    const int neighbours[8][2] = {{-1,0}, {-1,1}, {-1,-1}, {1,0}, {1,-1}, {1,1}, {0,-1}, {0,1}};
+    for (int n = 0; n < 8; n++) {
+        if ((it2 = strong_pixel_maps[i].find(coordxy_t(col + neighbours[n][0], line + neighbours[n][1]))) != strong_pixel_maps[i].end())
+            merge_spots_reference(ret_value, add_pixel_reference(strong_pixel_maps, i, it2, connect_frames));
+    }
+    if (connect_frames && (i + 2 < strong_pixel_maps.size())) {
+        if ((it2 = strong_pixel_maps[i+2].find(coordxy_t(col, line))) != strong_pixel_maps[i+2].end())
+            merge_spots_reference(ret_value, add_pixel_reference(strong_pixel_maps, i+2, it2, connect_frames));
+    }
+    if (connect_frames && (i > 1)) {
+        if ((it2 = strong_pixel_maps[i-2].find(coordxy_t(col, line))) != strong_pixel_maps[i-2].end())
+            merge_spots_reference(ret_value, add_pixel_reference(strong_pixel_maps, i-2, it2, connect_frames));
+    }
+    return ret_value;
+}
+
+static void assemble_spots_reference(const strong_pixel *host_out, size_t nfragments, size_t max_strong,
+        bool connect_frames, std::vector<spot_t> &spots) {
+    strong_pixel_maps_t strong_pixel_maps = strong_pixel_maps_t(nfragments);
+    for (size_t i = 0; i < nfragments; i++) {
+        for (size_t k = i * max_strong; host_out[k].col >= 0; k++)
+            strong_pixel_maps[i][coordxy_t(host_out[k].col, host_out[k].line)] = host_out[k].photons;
+    }
+    for (size_t i = 0; i < nfragments; i++) {
+        strong_pixel_map_t::iterator iterator = strong_pixel_maps[i].begin();
+        while (iterator != strong_pixel_maps[i].end()) {
+            spots.push_back(add_pixel_reference(strong_pixel_maps, i, iterator, connect_frames));
+            iterator = strong_pixel_maps[i].begin();
+        }
+    }
+}
+
+static void assemble_spots_host_out(spot_assembly_t &assembly, const strong_pixel *host_out, size_t nfragments, size_t max_strong,
+        bool connect_frames, std::vector<spot_t> &spots) {
+    clear_spot_assembly(assembly);
+    for (size_t i = 0; i < nfragments; i++) {
+        for (size_t k = i * max_strong; host_out[k].col >= 0; k++)
+            add_strong_pixel(assembly, host_out[k].col, host_out[k].line, host_out[k].photons);
+        end_fragment(assembly);
+    }
+    assemble_spots(assembly, connect_frames, spots);
+}
+
+static bool close_enough(float a, float b) {
+    return std::fabs(a - b) <= 1e-4 * std::fabs(a) + 1e-3;
+}
+
+// Spots must be the same and in the same order, sums can differ by rounding
+static bool compare_spots(const std::vector<spot_t> &spots, const std::vector<spot_t> &reference) {
+    if (spots.size() != reference.size()) return false;
+    for (size_t i = 0; i < spots.size(); i++) {
+        if ((spots[i].min_col != reference[i].min_col) || (spots[i].max_col != reference[i].max_col) ||
+            (spots[i].min_line != reference[i].min_line) || (spots[i].max_line != reference[i].max_line) ||
+            (spots[i].first_frame != reference[i].first_frame) || (spots[i].last_frame != reference[i].last_frame) ||
+            !close_enough(spots[i].photons, reference[i].photons) || !close_enough(spots[i].x, reference[i].x) ||
+            !close_enough(spots[i].y, reference[i].y) || !close_enough(spots[i].z, reference[i].z))
+            return false;
+    }
+    return true;
+}
+
+#define BENCHMARK_ASSEMBLY_FRAGMENTS 200
+#define BENCHMARK_ASSEMBLY_MAX_STRONG 16384
+
+// Chunk of strong pixel lists (as written by spot finder): round spots up to radius 3 spanning up to 3 frames,
+// some horizontal/diagonal streaks, repeated pixels (with different photons) where spots overlap
+static void generate_strong_pixels(strong_pixel *host_out, size_t npixels) {
+    std::vector<size_t> nstrong(BENCHMARK_ASSEMBLY_FRAGMENTS, 0);
+    size_t total = 0;
+    srand(5678);
+    while (total < npixels) {
+        size_t fragment = rand() % BENCHMARK_ASSEMBLY_FRAGMENTS;
+        size_t nframes = 1 + rand() % 3;
+        int col0 = rand() % COLS;
+        int line0 = (fragment % 2) * LINES + rand() % LINES;
+        int radius = rand() % 4;
+        int streak = (rand() % 16 == 0) ? 30 : 0;
+        int streak_slope = rand() % 2;
+        for (size_t f = fragment; (f < fragment + 2 * nframes) && (f < BENCHMARK_ASSEMBLY_FRAGMENTS); f += 2) {
+            for (int dl = -radius; dl <= radius + streak * streak_slope; dl++) {
+                for (int dc = -radius; dc <= radius + streak; dc++) {
+                    int col = col0 + dc;
+                    int line = line0 + dl;
+                    if (streak == 0 && dc * dc + dl * dl > radius * radius) continue;
+                    if (streak > 0 && streak_slope && (dl - dc < -radius || dl - dc > radius)) continue;
+                    if ((col < 0) || (col >= COLS) || (line < (int) (f % 2) * LINES) || (line >= (int) (f % 2 + 1) * LINES))
+                        continue;
+                    if (nstrong[f] >= BENCHMARK_ASSEMBLY_MAX_STRONG - 1) continue;
+                    strong_pixel &pixel = host_out[f * BENCHMARK_ASSEMBLY_MAX_STRONG + nstrong[f]++];
+                    pixel.col = col;
+                    pixel.line = line;
+                    pixel.photons = 1 + rand() % 1000 / 10.0f;
+                    total++;
+                }
+            }
+        }
+    }
+    for (size_t f = 0; f < BENCHMARK_ASSEMBLY_FRAGMENTS; f++) {
+        strong_pixel &end = host_out[f * BENCHMARK_ASSEMBLY_MAX_STRONG + nstrong[f]];
+        end.col = -1;
+        end.line = -1;
+        end.photons = nstrong[f];
+    }
+}
+
+#define BENCHMARK_MERGE_CHUNK_IMAGES 10
+
+static bool spot_order(const spot_t &a, const spot_t &b) {
+    if (a.first_frame != b.first_frame) return a.first_frame < b.first_frame;
+    if (a.min_col != b.min_col) return a.min_col < b.min_col;
+    if (a.min_line != b.min_line) return a.min_line < b.min_line;
+    if (a.last_frame != b.last_frame) return a.last_frame < b.last_frame;
+    if (a.max_col != b.max_col) return a.max_col < b.max_col;
+    return a.max_line < b.max_line;
+}
+
+// Assembles the same strong pixels in chunks, analyzed in shuffled order and merged across chunk boundaries,
+// result has to be the same as for the whole data set assembled at once
+static bool check_spot_merge(spot_assembly_t &assembly, const strong_pixel *host_out, const std::vector<spot_t> &reference) {
+    size_t nimages = BENCHMARK_ASSEMBLY_FRAGMENTS / 2;
+    size_t nchunks = nimages / BENCHMARK_MERGE_CHUNK_IMAGES;
+    std::vector<size_t> chunk_order(nchunks);
+    for (size_t i = 0; i < nchunks; i++) chunk_order[i] = i;
+    std::random_shuffle(chunk_order.begin(), chunk_order.end());
+
+    reset_spot_merge(nimages);
+    std::vector<spot_t> spots;
+    for (size_t c = 0; c < nchunks; c++) {
+        size_t image0 = chunk_order[c] * BENCHMARK_MERGE_CHUNK_IMAGES;
+        std::vector<spot_t> chunk_spots;
+        assemble_spots_host_out(assembly, host_out + 2 * image0 * BENCHMARK_ASSEMBLY_MAX_STRONG,
+                                2 * BENCHMARK_MERGE_CHUNK_IMAGES, BENCHMARK_ASSEMBLY_MAX_STRONG, true, chunk_spots);
+        std::vector<labelled_pixel_t> first_pixels[2], last_pixels[2];
+        for (int i = 0; i < 2; i++) {
+            get_fragment_pixels(assembly, i, first_pixels[i]);
+            get_fragment_pixels(assembly, (BENCHMARK_MERGE_CHUNK_IMAGES - 1) * 2 + i, last_pixels[i]);
+        }
+        for (size_t i = 0; i < chunk_spots.size(); i++) {
+            chunk_spots[i].first_frame += image0;
+            chunk_spots[i].last_frame += image0;
+        }
+        std::vector<spot_t> complete_spots;
+        merge_chunk_spots(chunk_spots, first_pixels, last_pixels, BENCHMARK_MERGE_CHUNK_IMAGES, image0, complete_spots);
+        // Bring weighted z to common reference
+        for (size_t i = 0; i < complete_spots.size(); i++) {
+            complete_spots[i].z += image0 * complete_spots[i].photons;
+            spots.push_back(complete_spots[i]);
+        }
+    }
+    if (open_merged_spots() > 0) return false;
+
+    std::vector<spot_t> sorted_reference = reference;
+    std::sort(sorted_reference.begin(), sorted_reference.end(), spot_order);
+    std::sort(spots.begin(), spots.end(), spot_order);
+    return compare_spots(spots, sorted_reference);
+}
+
+int benchmark_spot_assembly() {
+    std::vector<strong_pixel> host_out(BENCHMARK_ASSEMBLY_FRAGMENTS * BENCHMARK_ASSEMBLY_MAX_STRONG);
+    spot_assembly_t assembly;
+    int ret = 0;
+
+    for (size_t npixels = 10000; npixels <= 1000000; npixels *= 10) {
+        generate_strong_pixels(host_out.data(), npixels);
+        for (int connect_frames = 0; connect_frames < 2; connect_frames++) {
+            std::vector<spot_t> spots, reference;
+
+            auto start = std::chrono::steady_clock::now();
+            assemble_spots_reference(host_out.data(), BENCHMARK_ASSEMBLY_FRAGMENTS, BENCHMARK_ASSEMBLY_MAX_STRONG,
+                                     connect_frames, reference);
+            double reference_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            start = std::chrono::steady_clock::now();
+            assemble_spots_host_out(assembly, host_out.data(), BENCHMARK_ASSEMBLY_FRAGMENTS, BENCHMARK_ASSEMBLY_MAX_STRONG,
+                                    connect_frames, spots);
+            double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            bool identical = compare_spots(spots, reference);
+            bool merged = !connect_frames || check_spot_merge(assembly, host_out.data(), spots);
+            if (!identical || !merged) ret = 1;
+
+            std::cout << "Spot assembly: " << npixels << " strong pixels" << (connect_frames ? " (3D) " : " (2D) ")
+                      << spots.size() << " spots " << npixels / time / 1e6 << " Mpixel/s (std::map "
+                      << npixels / reference_time / 1e6 << " Mpixel/s)" << (identical ? "" : " (MISMATCH)")
+                      << (merged ? "" : " (CHUNK MERGE MISMATCH)") << std::endl;
+        }
+    }
+    return ret;
+}
+
+#define BENCHMARK_HIT_IMAGES  1005
+#define BENCHMARK_HIT_CHUNK   20
+#define BENCHMARK_HIT_CARDS   2
+#define BENCHMARK_HIT_THREADS 10
+
+static image_spot_count_t benchmark_image_counts(size_t image, size_t card) {
+    image_spot_count_t ret = {(uint32_t) ((image * 3 + card) % 11), (uint32_t) ((image * 7 + card * 5) % 50)};
+    return ret;
+}
+
+// Chunks of each card arrive in order of completion of spot finding threads (thread t handles chunks t, t + threads, ...),
+// hit table must be the same as if the chunks were in order
+int benchmark_hit_finding() {
+    const uint32_t min_spots = 6, min_strong_pixels = 20;
+    size_t chunks = (BENCHMARK_HIT_IMAGES + BENCHMARK_HIT_CHUNK - 1) / BENCHMARK_HIT_CHUNK;
+
+    std::vector<image_hit_t> hits(BENCHMARK_HIT_IMAGES, image_hit_t{0, 0, 0, false});
+    size_t classified = 0, nhits = 0;
+
+    for (size_t card = 0; card < BENCHMARK_HIT_CARDS; card++) {
+        // Threads finish in reverse order for card 0 and rotated for card 1
+        std::vector<size_t> order;
+        for (size_t round = 0; round * BENCHMARK_HIT_THREADS < chunks; round++) {
+            for (size_t i = 0; i < BENCHMARK_HIT_THREADS; i++) {
+                size_t thread = (card == 0) ? BENCHMARK_HIT_THREADS - 1 - i : (i + 3 * round + 1) % BENCHMARK_HIT_THREADS;
+                size_t chunk = round * BENCHMARK_HIT_THREADS + thread;
+                if (chunk < chunks) order.push_back(chunk);
+            }
+        }
+        for (size_t i = 0; i < order.size(); i++) {
+            size_t image0 = order[i] * BENCHMARK_HIT_CHUNK;
+            std::vector<image_spot_count_t> counts;
+            for (size_t image = image0; (image < image0 + BENCHMARK_HIT_CHUNK) && (image < BENCHMARK_HIT_IMAGES); image++)
+                counts.push_back(benchmark_image_counts(image, card));
+            classified += add_image_spot_counts(hits, image0, counts, BENCHMARK_HIT_CARDS,
+                                                min_spots, min_strong_pixels, nhits);
+        }
+    }
+
+    bool ok = (classified == BENCHMARK_HIT_IMAGES);
+    size_t expected_hits = 0;
+    for (size_t image = 0; image < BENCHMARK_HIT_IMAGES; image++) {
+        uint32_t spots = 0, strong_pixels = 0;
+        for (size_t card = 0; card < BENCHMARK_HIT_CARDS; card++) {
+            spots += benchmark_image_counts(image, card).spots;
+            strong_pixels += benchmark_image_counts(image, card).strong_pixels;
+        }
+        bool hit = (spots >= min_spots) && (strong_pixels >= min_strong_pixels);
+        if (hit) expected_hits++;
+        if ((hits[image].cards != BENCHMARK_HIT_CARDS) || (hits[image].spots != spots)
+            || (hits[image].strong_pixels != strong_pixels) || (hits[image].hit != hit))
+            ok = false;
+    }
+    if (nhits != expected_hits) ok = false;
+
+    std::cout << "Hit finding (chunks out of order): " << nhits << " hits in " << classified << " images "
+              << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
+
+int run_benchmark() {
+    int ret = benchmark_copy_line_kernels();
+    ret |= benchmark_frame_summation();
+    ret |= benchmark_spot_finder_kernels();
+    ret |= benchmark_spot_assembly();
+    ret |= benchmark_hit_finding();
+    ret |= benchmark_ib_send_slots();
+    return ret;
+}
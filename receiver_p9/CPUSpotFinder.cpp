@@ -0,0 +1,144 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Spot finding on CPU, replaces GPU threads (find_spots.cu) if there is no GPU.
+// Work is distributed in the same way: thread i handles chunks i, i + NCUDA_STREAMS, ...
+// Strong pixels are searched directly in IB buffer, so the buffer is released after
+// the kernel finished, not after copy to GPU.
+// Fragments of a chunk are analyzed one after another, so each is stored directly
+// after the previous one in the shared output pool.
+
+#include <algorithm>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include "JFReceiver.h"
+#include "SpotFinder.h"
+
+static strong_pixel_output_t cpu_out[NCUDA_STREAMS];
+
+int setup_cpu_spot_finder() {
+    size_t fragments = receiver_settings.images_per_stream * 2;
+    try {
+        for (int i = 0; i < NCUDA_STREAMS; i++)
+            allocate_strong_pixel_output(cpu_out[i], fragments, fragments * receiver_settings.strong_per_fragment);
+    } catch (const std::bad_alloc &e) {
+        std::cerr << "CPU spot finder: Mem alloc. error (output)" << std::endl;
+        return 1;
+    }
+
+    // Setup synchronization
+    for (int i = 0; i < NCUDA_STREAMS*CUDA_TO_IB_BUFFER; i++) {
+        pthread_mutex_init(cuda_stream_ready_mutex+i, NULL);
+        pthread_cond_init(cuda_stream_ready_cond+i, NULL);
+        pthread_mutex_init(writer_threads_done_mutex+i, NULL);
+        pthread_cond_init(writer_threads_done_cond+i, NULL);
+    }
+    std::cout << "Spot finding on CPU (" << spot_finder_kernels.name << " kernels)" << std::endl;
+    return 0;
+}
+
+void close_cpu_spot_finder() {
+    for (int i = 0; i < NCUDA_STREAMS; i++)
+        cpu_out[i] = strong_pixel_output_t();
+
+    // Close synchronization
+    for (int i = 0; i < NCUDA_STREAMS*CUDA_TO_IB_BUFFER; i++) {
+        pthread_mutex_destroy(cuda_stream_ready_mutex+i);
+        pthread_cond_destroy(cuda_stream_ready_cond+i);
+        pthread_mutex_destroy(writer_threads_done_mutex+i);
+        pthread_cond_destroy(writer_threads_done_cond+i);
+    }
+}
+
+void *run_cpu_spot_thread(void *in_threadarg) {
+    ThreadArg *arg = (ThreadArg *) in_threadarg;
+
+    thread_placement.PinThread("spot_finder");
+
+    // images_per_stream is defined for 16-bit image, so it needs to be adjusted for 32-bit
+    size_t images_per_stream = cuda_stream_images(experiment_settings);
+    size_t image_size = ((NMODULES/2) * COLS * LINES * experiment_settings.pixel_depth);
+    size_t fragment_size = COLS * LINES * experiment_settings.pixel_depth;
+
+    size_t total_chunks = experiment_settings.nimages_to_write / images_per_stream;
+    // Account for leftover
+    if (experiment_settings.nimages_to_write - total_chunks * images_per_stream > 0)
+        total_chunks++;
+
+    size_t thread_id = arg->ThreadID;
+    strong_pixel_output_t &out = cpu_out[thread_id];
+    size_t pool_size = out.pixels.size();
+
+    // Kernels for box size of the collection
+    int nb = spot_box_nb(experiment_settings);
+    find_spots16_t find_spots16 = spot_finder_kernels.find_spots16[nb - 1];
+    find_spots32_t find_spots32 = spot_finder_kernels.find_spots32[nb - 1];
+    strong_pixel_cuts_t cuts = {(float) experiment_settings.strong_pixel,
+                                strong_pixel_min_value(experiment_settings), strong_pixel_max_value(experiment_settings)};
+
+    for (size_t chunk = thread_id;
+         chunk < total_chunks;
+         chunk += NCUDA_STREAMS) {
+
+        std::vector<spot_t> spots;
+        std::vector<image_spot_count_t> image_counts;
+
+        size_t ib_slice = chunk % (NCUDA_STREAMS*CUDA_TO_IB_BUFFER);
+
+        size_t images = experiment_settings.nimages_to_write - chunk * images_per_stream;
+        if (images > images_per_stream) images = images_per_stream;
+
+        pthread_mutex_lock(writer_threads_done_mutex+ib_slice);
+        // Wait till all images of the chunk are written
+        while ((size_t) writer_threads_done[ib_slice] < images)
+            pthread_cond_wait(writer_threads_done_cond+ib_slice,
+                              writer_threads_done_mutex+ib_slice);
+        // Restore full values and continue
+        writer_threads_done[ib_slice] = 0;
+        pthread_mutex_unlock(writer_threads_done_mutex+ib_slice);
+
+        // Each image is split into two fragments (top and bottom half), as in GPU kernel
+        char *input = ib_buffer + ib_slice * images_per_stream * image_size;
+        for (size_t fragment = 0; fragment < images * 2; fragment++) {
+            size_t first = out.offset[fragment];
+            if (experiment_settings.pixel_depth == 2)
+                out.found[fragment] = find_spots16((int16_t *) (input + fragment * fragment_size),
+                                                   &spot_finding_mask, fragment % 2,
+                                                   out.pixels.data() + first, pool_size - first, cuts);
+            else
+                out.found[fragment] = find_spots32((int32_t *) (input + fragment * fragment_size),
+                                                   &spot_finding_mask, fragment % 2,
+                                                   out.pixels.data() + first, pool_size - first, cuts);
+            out.offset[fragment + 1] = first + std::min<size_t>(out.found[fragment], pool_size - first);
+        }
+
+        // Broadcast to everyone waiting, that buffer can be overwritten by next iteration
+        pthread_mutex_lock(cuda_stream_ready_mutex+ib_slice);
+        cuda_stream_ready[ib_slice] = chunk + NCUDA_STREAMS*CUDA_TO_IB_BUFFER;
+        pthread_cond_broadcast(cuda_stream_ready_cond+ib_slice);
+        pthread_mutex_unlock(cuda_stream_ready_mutex+ib_slice);
+
+        // Analyze results to find spots
+        analyze_spots(out, strong_pixel_count + thread_id * STRONG_PIXEL_COUNT_PIXELS, spots, image_counts,
+                      experiment_settings.connect_spots_between_frames, images, chunk * images_per_stream);
+
+        // Send spots found by spot finder via TCP/IP
+        send_spots(spots, strong_pixel_overflow(out, images * 2), image_counts, chunk);
+    }
+    pthread_exit(0);
+}
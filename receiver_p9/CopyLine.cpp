@@ -0,0 +1,109 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+
+#include "CopyLine.h"
+
+#ifdef __VSX__
+#include <altivec.h>
+#undef vector
+#undef pixel
+#undef bool
+#endif
+
+static void no_fence() {}
+
+const copy_line_kernels_t copy_line_kernels_scalar = {
+    "scalar",
+    copy_line_impl<scalar_ops<int16_t> >,
+    copy_line_impl<scalar_ops<int32_t> >,
+    no_fence
+};
+
+#ifdef __VSX__
+// POWER9 has no non-temporal store instruction, instead full 128 byte cache lines
+// are zeroed with dcbz before writing, so these are not read from memory first;
+// division rounds toward zero, to match C integer division
+
+#define POWER_CACHE_LINE 128
+
+static inline void vsx_stream_line(char *p, const char *src) {
+    __asm__ __volatile__ ("dcbz 0,%0" : : "r" (p) : "memory");
+    for (int i = 0; i < POWER_CACHE_LINE; i += 16)
+        vec_xst(vec_xl(i, (const unsigned char *) src), i, (unsigned char *) p);
+}
+
+struct vsx_ops16 {
+    typedef int16_t pixel_t;
+    typedef __vector signed short vec_t;
+    static const size_t lanes = 8;
+    static const bool streaming = true;
+    static const size_t line_pixels = POWER_CACHE_LINE / sizeof(pixel_t);
+    static vec_t load(const pixel_t *p) { return vec_xl(0, p); }
+    static void store(pixel_t *p, vec_t v) { vec_xst(v, 0, p); }
+    static void stream_line(pixel_t *p, const pixel_t *src) { vsx_stream_line((char *) p, (const char *) src); }
+    static vec_t half(vec_t v) {
+        // Same condition as half16()
+        __vector __bool short mask = vec_and(vec_cmpgt(v, vec_splats((int16_t) (INT16_MIN + 10))),
+                                             vec_cmpgt(v, vec_splats((int16_t) (INT16_MAX - 10))));
+        vec_t bias = (vec_t) vec_sr(v, vec_splats((uint16_t) 15));
+        vec_t div = vec_sra(vec_add(v, bias), vec_splats((uint16_t) 1));
+        return vec_sel(v, div, mask);
+    }
+};
+
+struct vsx_ops32 {
+    typedef int32_t pixel_t;
+    typedef __vector signed int vec_t;
+    static const size_t lanes = 4;
+    static const bool streaming = true;
+    static const size_t line_pixels = POWER_CACHE_LINE / sizeof(pixel_t);
+    static vec_t load(const pixel_t *p) { return vec_xl(0, p); }
+    static void store(pixel_t *p, vec_t v) { vec_xst(v, 0, p); }
+    static void stream_line(pixel_t *p, const pixel_t *src) { vsx_stream_line((char *) p, (const char *) src); }
+    static vec_t half(vec_t v) {
+        __vector __bool int mask = vec_and(vec_cmpgt(v, vec_splats((int32_t) UNDERFLOW_32BIT)),
+                                           vec_cmplt(v, vec_splats((int32_t) OVERFLOW_32BIT)));
+        vec_t bias = (vec_t) vec_sr(v, vec_splats((uint32_t) 31));
+        vec_t div = vec_sra(vec_add(v, bias), vec_splats((uint32_t) 1));
+        return vec_sel(v, div, mask);
+    }
+};
+
+const copy_line_kernels_t copy_line_kernels_vsx = {
+    "VSX",
+    copy_line_impl<vsx_ops16>,
+    copy_line_impl<vsx_ops32>,
+    no_fence
+};
+#endif
+
+copy_line_kernels_t copy_line_kernels = copy_line_kernels_scalar;
+
+void setup_copy_line_kernels() {
+    copy_line_kernels = copy_line_kernels_scalar;
+#if defined(__VSX__)
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("vsx"))
+#endif
+        copy_line_kernels = copy_line_kernels_vsx;
+#elif defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        copy_line_kernels = copy_line_kernels_avx2;
+#endif
+    std::cout << "Line expansion kernels: " << copy_line_kernels.name << std::endl;
+}
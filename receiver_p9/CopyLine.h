@@ -0,0 +1,184 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COPYLINE_H
+#define _COPYLINE_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include "../include/JFApp.h"
+#include "../include/GeometryPlan.h"
+
+// Line expansion kernels: one module line (1024 pixels) is converted into one line
+// of the composed image (1030 pixels), following runs of the geometry plan.
+// Multipixels have their intensity divided between the pixels they cover.
+// Kernels are written once as templates over a "vector operations" class V
+// and instantiated for scalar, VSX (POWER9) and AVX2 (x86) code paths.
+// All implementations give bit-identical output.
+
+// Take half of the number, but only if not bad pixel/overload
+static inline int16_t half16(int16_t in) {
+    int16_t tmp = in;
+    if ((in > INT16_MIN + 10) && (in > INT16_MAX - 10)) tmp /= 2;
+    return tmp;
+}
+
+// Take quarter of the number, but only if not bad pixel/overload
+static inline int16_t quarter16(int16_t in) {
+    int16_t tmp = in;
+    if ((in > INT16_MIN + 10) && (in < INT16_MAX - 10)) tmp /= 4;
+    return tmp;
+}
+
+static inline int32_t half32(int32_t in) {
+    int32_t tmp = in;
+    if ((in > UNDERFLOW_32BIT) && (in < OVERFLOW_32BIT)) tmp /= 2;
+    return tmp;
+}
+
+static inline int32_t quarter32(int32_t in) {
+    int32_t tmp = in;
+    if ((in > UNDERFLOW_32BIT) && (in < OVERFLOW_32BIT)) tmp /= 4;
+    return tmp;
+}
+
+static inline int16_t half_pixel(int16_t in)    { return half16(in); }
+static inline int16_t quarter_pixel(int16_t in) { return quarter16(in); }
+static inline int32_t half_pixel(int32_t in)    { return half32(in); }
+static inline int32_t quarter_pixel(int32_t in) { return quarter32(in); }
+
+// Vector operations class V has to provide:
+//   pixel_t, vec_t, lanes
+//   load(p), store(p,v) - unaligned load/store of lanes pixels
+//   half(v)             - same as half_pixel() for each lane
+//   streaming           - if true, lines are first expanded in a local buffer
+//                         and then written with stream_line()
+//   line_pixels         - pixels per cache line
+//   stream_line(p,src)  - writes one full, aligned cache line bypassing read-for-ownership
+//                         (non-temporal store on x86, dcbz on POWER)
+
+template <class V> inline void copy_run(typename V::pixel_t *destination, const typename V::pixel_t *source, size_t n) {
+    size_t i = 0;
+    for (; i + V::lanes <= n; i += V::lanes) V::store(destination + i, V::load(source + i));
+    for (; i < n; i++) destination[i] = source[i];
+}
+
+template <class V> inline void half_run(typename V::pixel_t *destination, const typename V::pixel_t *source, size_t n) {
+    size_t i = 0;
+    for (; i + V::lanes <= n; i += V::lanes) V::store(destination + i, V::half(V::load(source + i)));
+    for (; i < n; i++) destination[i] = half_pixel(source[i]);
+}
+
+// Write n pixels, full cache lines with stream_line(), partial ones with regular stores
+template <class V> inline void stream_run(typename V::pixel_t *destination, const typename V::pixel_t *source, size_t n) {
+    size_t i = 0;
+    for (; (i < n) && ((uintptr_t) (destination + i) % (V::line_pixels * sizeof(typename V::pixel_t)) != 0); i++)
+        destination[i] = source[i];
+    for (; i + V::line_pixels <= n; i += V::line_pixels) V::stream_line(destination + i, source + i);
+    for (; i < n; i++) destination[i] = source[i];
+}
+
+// Copy line and extend multipixels
+template <class V> inline void expand_line(typename V::pixel_t *destination, const typename V::pixel_t *source,
+        const std::vector<GeometryRun> &runs) {
+    typedef typename V::pixel_t pixel_t;
+    for (const GeometryRun &run : runs) {
+        if (run.width == 1)
+            copy_run<V>(destination + run.dst, source + run.src, run.len);
+        else {
+            for (size_t i = 0; i < run.len; i++) {
+                pixel_t tmp = half_pixel(source[run.src + i]);
+                destination[run.dst + 2 * i] = tmp;
+                destination[run.dst + 2 * i + 1] = tmp;
+            }
+        }
+    }
+}
+
+// Copy line with multi-pixels (255 and 256), which is extended in vertical direction
+template <class V> inline void expand_line_mid(typename V::pixel_t *destination, const typename V::pixel_t *source,
+        const std::vector<GeometryRun> &runs) {
+    typedef typename V::pixel_t pixel_t;
+    for (const GeometryRun &run : runs) {
+        if (run.width == 1)
+            half_run<V>(destination + run.dst, source + run.src, run.len);
+        else {
+            for (size_t i = 0; i < run.len; i++) {
+                pixel_t tmp = quarter_pixel(source[run.src + i]);
+                destination[run.dst + 2 * i] = tmp;
+                destination[run.dst + 2 * i + 1] = tmp;
+            }
+        }
+    }
+}
+
+// Place module line (source) in the composed image, as described by geometry plan
+template <class V> void copy_line_impl(typename V::pixel_t *image, const typename V::pixel_t *source,
+        const GeometryLine &line, const GeometryPlan &plan) {
+    typename V::pixel_t tmp[GeometryPlan::ComposedModuleCols];
+    if (line.multipixel) {
+        expand_line_mid<V>(tmp, source, plan.GetRuns());
+        if (V::streaming) {
+            stream_run<V>(image + line.dst, tmp, GeometryPlan::ComposedModuleCols);
+            stream_run<V>(image + line.dst_copy, tmp, GeometryPlan::ComposedModuleCols);
+        } else {
+            copy_run<V>(image + line.dst, tmp, GeometryPlan::ComposedModuleCols);
+            copy_run<V>(image + line.dst_copy, tmp, GeometryPlan::ComposedModuleCols);
+        }
+    } else if (V::streaming) {
+        expand_line<V>(tmp, source, plan.GetRuns());
+        stream_run<V>(image + line.dst, tmp, GeometryPlan::ComposedModuleCols);
+    } else
+        expand_line<V>(image + line.dst, source, plan.GetRuns());
+}
+
+// Reference implementation, one pixel at a time
+template <typename T> struct scalar_ops {
+    typedef T pixel_t;
+    typedef T vec_t;
+    static const size_t lanes = 1;
+    static const bool streaming = false;
+    static const size_t line_pixels = 1;
+    static vec_t load(const pixel_t *p) { return *p; }
+    static void store(pixel_t *p, vec_t v) { *p = v; }
+    static vec_t half(vec_t v) { return half_pixel(v); }
+    static void stream_line(pixel_t *p, const pixel_t *src) { *p = *src; }
+};
+
+// Set of kernels for one instruction set
+struct copy_line_kernels_t {
+    const char *name;
+    void (*copy_line)(int16_t *image, const int16_t *source, const GeometryLine &line, const GeometryPlan &plan);
+    void (*copy_line32)(int32_t *image, const int32_t *source, const GeometryLine &line, const GeometryPlan &plan);
+    void (*store_fence)(); // Has to be called before buffer is handed to IB/GPU
+};
+
+extern const copy_line_kernels_t copy_line_kernels_scalar;
+#ifdef __VSX__
+extern const copy_line_kernels_t copy_line_kernels_vsx;
+#endif
+#ifdef __x86_64__
+extern const copy_line_kernels_t copy_line_kernels_avx2;
+#endif
+
+// Kernels used by send threads
+extern copy_line_kernels_t copy_line_kernels;
+
+// Select the fastest kernels supported by the CPU
+void setup_copy_line_kernels();
+
+#endif
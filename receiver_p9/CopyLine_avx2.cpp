@@ -0,0 +1,80 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file is compiled with -mavx2 (see Makefile), kernels are only used
+// if CPU supports AVX2 - see setup_copy_line_kernels()
+
+#ifdef __x86_64__
+
+#include <immintrin.h>
+#include "CopyLine.h"
+
+// Division rounds toward zero, to match C integer division
+
+struct avx2_ops16 {
+    typedef int16_t pixel_t;
+    typedef __m256i vec_t;
+    static const size_t lanes = 16;
+    static const bool streaming = true;
+    static const size_t line_pixels = 32;
+    static vec_t load(const pixel_t *p) { return _mm256_loadu_si256((const __m256i *) p); }
+    static void store(pixel_t *p, vec_t v) { _mm256_storeu_si256((__m256i *) p, v); }
+    static void stream_line(pixel_t *p, const pixel_t *src) {
+        _mm256_stream_si256((__m256i *) p, load(src));
+        _mm256_stream_si256((__m256i *) (p + lanes), load(src + lanes));
+    }
+    static vec_t half(vec_t v) {
+        // Same condition as half16()
+        __m256i mask = _mm256_and_si256(_mm256_cmpgt_epi16(v, _mm256_set1_epi16(INT16_MIN + 10)),
+                                        _mm256_cmpgt_epi16(v, _mm256_set1_epi16(INT16_MAX - 10)));
+        __m256i div = _mm256_srai_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 15)), 1);
+        return _mm256_blendv_epi8(v, div, mask);
+    }
+};
+
+struct avx2_ops32 {
+    typedef int32_t pixel_t;
+    typedef __m256i vec_t;
+    static const size_t lanes = 8;
+    static const bool streaming = true;
+    static const size_t line_pixels = 16;
+    static vec_t load(const pixel_t *p) { return _mm256_loadu_si256((const __m256i *) p); }
+    static void store(pixel_t *p, vec_t v) { _mm256_storeu_si256((__m256i *) p, v); }
+    static void stream_line(pixel_t *p, const pixel_t *src) {
+        _mm256_stream_si256((__m256i *) p, load(src));
+        _mm256_stream_si256((__m256i *) (p + lanes), load(src + lanes));
+    }
+    static vec_t half(vec_t v) {
+        __m256i mask = _mm256_and_si256(_mm256_cmpgt_epi32(v, _mm256_set1_epi32(UNDERFLOW_32BIT)),
+                                        _mm256_cmpgt_epi32(_mm256_set1_epi32(OVERFLOW_32BIT), v));
+        __m256i div = _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_srli_epi32(v, 31)), 1);
+        return _mm256_blendv_epi8(v, div, mask);
+    }
+};
+
+// Non-temporal stores are weakly ordered
+static void avx2_fence() {
+    _mm_sfence();
+}
+
+const copy_line_kernels_t copy_line_kernels_avx2 = {
+    "AVX2",
+    copy_line_impl<avx2_ops16>,
+    copy_line_impl<avx2_ops32>,
+    avx2_fence
+};
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+
+#include "JFReceiver.h"
+#include "EmulatorThread.h"
+#include "FPGAEmulator.h"
+#include "UDPPacketSource.h"
+
+static FPGAEmulator *emulator = NULL;
+static PacketFile packet_file;
+static UDPPacketSource udp_source;
+
+int setup_emulator() {
+    if (udp_mode()) {
+        if (udp_source.Open(receiver_settings.udp_address, receiver_settings.udp_port, NMODULES,
+                            receiver_settings.fpga_mac_addr, receiver_settings.fpga_ip_addr, TIMEOUT))
+            return 1;
+    } else if (packet_file.Open(receiver_settings.emulator_packet_file, receiver_settings.replay_frame_rate))
+        return 1;
+
+    emulator = new FPGAEmulator();
+    if (emulator->Setup()) {
+        close_emulator();
+        return 1;
+    }
+
+    if (udp_mode()) return 0;
+
+    std::cout << "Emulator: " << packet_file.GetPacketsNum() << " packets from " << receiver_settings.emulator_packet_file;
+    if (receiver_settings.replay_frame_rate > 0)
+        std::cout << " at " << receiver_settings.replay_frame_rate << " Hz" << std::endl;
+    else
+        std::cout << " as fast as possible" << std::endl;
+    return 0;
+}
+
+void close_emulator() {
+    delete emulator;
+    emulator = NULL;
+    packet_file.Close();
+    udp_source.Close();
+}
+
+void *run_emulator_thread(void *in_threadarg) {
+    // Pipeline threads of the emulator inherit placement of this thread
+    thread_placement.PinThread("snap");
+
+    rx100G_job_t job;
+    setup_rx100G_job(job);
+
+    if (udp_mode()) {
+        // Packets which arrived before the collection was started are dropped, like in Ethernet FIFO of the FPGA
+        udp_source.Flush();
+        emulator->Run(job, udp_source);
+    } else {
+        packet_file.Rewind();
+        emulator->Run(job, packet_file);
+    }
+
+    std::cout << "Emulator: Action done" << std::endl;
+    pthread_exit(0);
+}
+
+void print_emulator_statistics() {
+    const FPGAEmulatorStatistics &statistics = emulator->GetStatistics();
+    double frames = statistics.accepted_packets / (double) (NMODULES * 128);
+
+    std::cout << "Emulator: " << statistics.packets << " packets (" << statistics.accepted_packets << " accepted, "
+              << statistics.invalid_packets << " invalid) in " << statistics.elapsed << " s" << std::endl;
+    if (statistics.elapsed > 0)
+        std::cout << "Emulator: " << statistics.packets / statistics.elapsed << " packets/s, "
+                  << frames / statistics.elapsed << " frames/s, " << ib_sent_images() << " images sent" << std::endl;
+    if (udp_mode()) {
+        const UDPPacketSourceStatistics &udp_statistics = udp_source.GetStatistics();
+        std::cout << "UDP: " << udp_statistics.datagrams << " datagrams (" << udp_statistics.wrong_size
+                  << " with wrong size) in " << udp_statistics.batches << " batches" << std::endl;
+    }
+}
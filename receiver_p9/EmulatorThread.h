@@ -0,0 +1,37 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EMULATORTHREAD_H
+#define _EMULATORTHREAD_H
+
+// Software model of the FPGA action (see FPGAEmulator.h) instead of FPGA.
+// JUNGFRAU packets are read from a file of RAW_JFUDP_Packet records, which have to be addressed
+// to the MAC/IP address of the card, or received from UDP sockets (see UDPPacketSource.h).
+// The model gets the same job as the FPGA and fills frame buffer, packet headers, status buffer,
+// pedestal and pixel mask in the same way, so the whole receiver runs without FPGA and without SNAP library calls.
+
+// Map packet file or open UDP sockets and allocate emulated HBM, returns 1 on error
+int setup_emulator();
+void close_emulator();
+
+// Replaces SNAP thread, packets from file are processed at receiver_settings.replay_frame_rate
+// (0 = as fast as possible), UDP packets as they arrive
+void *run_emulator_thread(void *in_threadarg);
+
+// Rate of the emulator in the last collection, to be called after SNAP thread finished
+void print_emulator_statistics();
+
+#endif
@@ -0,0 +1,783 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FPGAEmulator.h"
+
+// Parameters of the HLS design (hw/hw_action_rx100G.h, hw/convert.cpp)
+#define PEDESTAL_WINDOW_SIZE 128
+#define URAM_PARITITION 4
+#define HBM_BURST_G1G2 4
+#define FRAME_NUMBER_MASK 0xFFFFFFL // ap_uint<24>
+#define PEDE_G0_MASK 0xFFFFFFL      // ap_ufixed<24,14>
+#define HBM_HEADER_ADDR_MASK 0xFFFFFFFL // ap_uint<28>
+
+// HBM pseudo-channel, HLS code addresses it in 256-bit cells
+#define HBM_CHANNEL_SIZE (256L*1024*1024)
+#define HBM_CELL_SIZE 32L
+#define HBM_CELLS (HBM_CHANNEL_SIZE / HBM_CELL_SIZE)
+// Part of header and statistics channels zeroed at the beginning of the action (load_data_to_hbm)
+#define HBM_CLEARED_SIZE (NPIXEL * 2 / 64 * HBM_CELL_SIZE)
+
+// Blocks of beats handed over between pipeline stages
+#define STREAM_BLOCKS 8
+#define BEATS_PER_BLOCK 1024
+
+// Position of constants loaded to HBM (same order as in gain_pedestal_data)
+#define GAIN_G0_BLOCK 0
+#define GAIN_G1_BLOCK 1
+#define GAIN_G2_BLOCK 2
+#define PEDE_G1_BLOCK 3
+#define PEDE_G2_BLOCK 4
+#define PEDE_G0_BLOCK 5
+#define MASK_BLOCK    6
+
+enum rcv_state_t {RCV_INIT, RCV_JF_HEADER, RCV_GOOD, RCV_IGNORE};
+
+struct packet_header_t {
+    uint64_t dest_mac;
+    uint16_t ether_type;
+    uint8_t  ip_version;
+    uint8_t  ipv4_protocol;
+    uint16_t ipv4_total_len;
+    uint32_t ipv4_source_ip;
+    uint32_t ipv4_dest_ip;
+    uint16_t udp_src_port;
+    uint16_t udp_dest_port;
+    uint64_t jf_frame_number;
+    uint32_t jf_packet_number;
+    uint64_t jf_bunch_id;
+    uint64_t jf_timestamp;
+    uint32_t jf_debug;
+};
+
+// Fixed point values are kept as raw two's complement integers:
+// pedeG0_t   ap_ufixed<24,14> - 10 fractional bits
+// pedeG1G2_t ap_ufixed<16,14> -  2 fractional bits
+// gainG0_t   ap_ufixed<16,2>  - 14 fractional bits
+// gainG1G2_t ap_ufixed<16,3>  - 13 fractional bits
+// val_diff   ap_fixed<18,16>  -  2 fractional bits
+
+// Overflow of ap_fixed/ap_int (AP_WRAP) - keep lowest bits, as signed value
+static inline int64_t sign_extend(int64_t val, int bits) {
+    return (int64_t) ((uint64_t) val << (64 - bits)) >> (64 - bits);
+}
+
+// AP_RND_CONV - round to nearest, ties to even
+static inline int64_t round_convergent(int64_t val, int shift) {
+    int64_t ret = val >> shift;
+    int64_t remainder = val - ret * (1L << shift);
+    int64_t half = 1L << (shift - 1);
+    if ((remainder > half) || ((remainder == half) && (ret % 2 != 0))) ret++;
+    return ret;
+}
+
+// ap_fixed<18,16> value +/- 0.5 assigned to ap_int<16> (conversion truncates towards zero, like C)
+static inline int16_t round_to_int16(int64_t val) {
+    if (val >= 0) return (int16_t) sign_extend((val + 2) / 4, 16);
+    else return (int16_t) sign_extend((val - 2) / 4, 16);
+}
+
+static inline uint64_t get_big_endian(const uint8_t *ptr, int nbytes) {
+    uint64_t ret = 0;
+    for (int i = 0; i < nbytes; i++) ret = (ret << 8) | ptr[i];
+    return ret;
+}
+
+static inline uint64_t get_little_endian(const uint8_t *ptr, int nbytes) {
+    uint64_t ret = 0;
+    for (int i = nbytes - 1; i >= 0; i--) ret = (ret << 8) | ptr[i];
+    return ret;
+}
+
+// 512-bit AXI beat of Ethernet frame, bytes after end of frame are zero
+static inline void get_beat(const char *packet, size_t length, size_t beat, uint8_t *out) {
+    size_t offset = beat * 64;
+    size_t bytes = std::min(length - offset, (size_t) 64);
+    memcpy(out, packet + offset, bytes);
+    if (bytes < 64) memset(out + bytes, 0, 64 - bytes);
+}
+
+// First beat - Ethernet, IPv4 and UDP header (big endian) and start of JUNGFRAU header (little endian)
+static void decode_eth_1(const uint8_t *beat, packet_header_t &header) {
+    header.dest_mac = get_big_endian(beat, 6);
+    header.ether_type = get_big_endian(beat + 12, 2);
+    header.ip_version = beat[14] >> 4;
+    header.ipv4_protocol = beat[23];
+    header.ipv4_total_len = get_big_endian(beat + 16, 2);
+    header.ipv4_source_ip = get_big_endian(beat + 26, 4);
+    header.ipv4_dest_ip = get_big_endian(beat + 30, 4);
+    header.udp_src_port = get_big_endian(beat + 34, 2);
+    header.udp_dest_port = get_big_endian(beat + 36, 2);
+    header.jf_frame_number = get_little_endian(beat + 42, 8);
+    header.jf_packet_number = get_little_endian(beat + 54, 4);
+    header.jf_bunch_id = (header.jf_bunch_id & 0xFFFF) | (get_little_endian(beat + 58, 6) << 16);
+}
+
+// Second beat - rest of JUNGFRAU header
+static void decode_eth_2(const uint8_t *beat, packet_header_t &header) {
+    header.jf_bunch_id = (header.jf_bunch_id & ~0xFFFFUL) | get_little_endian(beat, 2);
+    header.jf_timestamp = get_little_endian(beat + 2, 8);
+    header.jf_debug = get_little_endian(beat + 18, 4);
+}
+
+static inline char *hbm_cell(const HugePageBuffer &hbm, uint64_t addr) {
+    return hbm.Get() + (addr % HBM_CELLS) * HBM_CELL_SIZE;
+}
+
+PacketFile::PacketFile() : ptr(NULL), size(0), npackets(0), position(0), frame_rate(0.0), first_frame(0), last_frame(0) {}
+
+PacketFile::~PacketFile() {
+    Close();
+}
+
+int PacketFile::Open(const std::string &file_name, double in_frame_rate) {
+    Close();
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Emulator: cannot open " << file_name << " " << strerror(errno) << std::endl;
+        return 1;
+    }
+    struct stat file_stat;
+    if ((fstat(fd, &file_stat) != 0) || (file_stat.st_size < (off_t) sizeof(RAW_JFUDP_Packet))) {
+        std::cerr << "Emulator: " << file_name << " contains no packets" << std::endl;
+        close(fd);
+        return 1;
+    }
+    void *ret = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ret == MAP_FAILED) {
+        std::cerr << "Emulator: cannot map " << file_name << " " << strerror(errno) << std::endl;
+        return 1;
+    }
+    ptr = (char *) ret;
+    size = file_stat.st_size;
+    npackets = size / sizeof(RAW_JFUDP_Packet);
+    if (size % sizeof(RAW_JFUDP_Packet) != 0)
+        std::cerr << "Emulator: incomplete packet at the end of " << file_name << " ignored" << std::endl;
+    madvise(ptr, size, MADV_SEQUENTIAL);
+
+    frame_rate = in_frame_rate;
+    Rewind();
+    return 0;
+}
+
+void PacketFile::Close() {
+    if (ptr != NULL) munmap(ptr, size);
+    ptr = NULL;
+    size = 0;
+    npackets = 0;
+    position = 0;
+}
+
+void PacketFile::Rewind() {
+    position = 0;
+}
+
+size_t PacketFile::GetPacketsNum() const {
+    return npackets;
+}
+
+bool PacketFile::Next(const char *&packet, size_t &length, bool &error) {
+    if (position >= npackets) return false;
+    packet = ptr + position * sizeof(RAW_JFUDP_Packet);
+    length = sizeof(RAW_JFUDP_Packet);
+    error = false;
+
+    if (frame_rate > 0) {
+        // Packets of a frame are sent together, next frame is delayed according to its number
+        uint64_t frame;
+        memcpy(&frame, packet + offsetof(RAW_JFUDP_Packet, framenum), sizeof(uint64_t));
+        if (position == 0) {
+            first_frame = frame;
+            last_frame = frame;
+            start = std::chrono::steady_clock::now();
+        } else if ((frame != last_frame) && (frame > first_frame)) {
+            last_frame = frame;
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>((frame - first_frame) / frame_rate)));
+        }
+    }
+    position++;
+    return true;
+}
+
+BeatStream::BeatStream(size_t nblocks, size_t beats_per_block) : blocks(nblocks), read_block(NULL),
+                                                                 read_position(0), exit_read(false) {
+    for (Block &block : blocks) {
+        block.beats.resize(beats_per_block);
+        block.count = 0;
+        free_blocks.push_back(&block);
+    }
+    write_block = free_blocks.front();
+    free_blocks.pop_front();
+    memset(&exit_beat, 0, sizeof(EmulatedBeat));
+}
+
+void BeatStream::Put(Block *block, std::deque<Block *> &queue, std::condition_variable &cond) {
+    std::unique_lock<std::mutex> lock(blocks_mutex);
+    queue.push_back(block);
+    cond.notify_one();
+}
+
+BeatStream::Block *BeatStream::Take(std::deque<Block *> &queue, std::condition_variable &cond) {
+    std::unique_lock<std::mutex> lock(blocks_mutex);
+    cond.wait(lock, [&queue] { return !queue.empty(); });
+    Block *ret = queue.front();
+    queue.pop_front();
+    return ret;
+}
+
+void BeatStream::Write(const EmulatedBeat &beat) {
+    write_block->beats[write_block->count++] = beat;
+    if (beat.exit) {
+        // Nothing is written after exit
+        Put(write_block, full_blocks, full_cond);
+        write_block = NULL;
+    } else if (write_block->count == write_block->beats.size()) {
+        Put(write_block, full_blocks, full_cond);
+        write_block = Take(free_blocks, free_cond);
+        write_block->count = 0;
+    }
+}
+
+void BeatStream::Read(EmulatedBeat &beat) {
+    if (exit_read) {
+        beat = exit_beat;
+        return;
+    }
+    if ((read_block == NULL) || (read_position == read_block->count)) {
+        if (read_block != NULL) Put(read_block, free_blocks, free_cond);
+        read_block = Take(full_blocks, full_cond);
+        read_position = 0;
+    }
+    beat = read_block->beats[read_position++];
+    if (beat.exit) {
+        exit_read = true;
+        exit_beat = beat;
+    }
+}
+
+FPGAEmulator::FPGAEmulator() : packed_pedeG0(NPIXEL), pixel_mask(NPIXEL / 32), hbm_constants(5 * NPIXEL) {
+    memset(&statistics, 0, sizeof(FPGAEmulatorStatistics));
+}
+
+int FPGAEmulator::Setup() {
+    if (hbm_headers.Allocate(HBM_CHANNEL_SIZE) || hbm_stat.Allocate(HBM_CHANNEL_SIZE)) {
+        std::cerr << "Emulator: cannot allocate HBM" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+const FPGAEmulatorStatistics &FPGAEmulator::GetStatistics() const {
+    return statistics;
+}
+
+// load_pedestal - pedeG1G2_t to pedeG0_t
+void FPGAEmulator::LoadPedestal(const uint16_t *in) {
+    for (size_t i = 0; i < NPIXEL; i++)
+        packed_pedeG0[i] = ((uint32_t) in[i]) << 8;
+}
+
+// save_pedestal - pedeG0_t to pedeG1G2_t with convergent rounding
+void FPGAEmulator::SavePedestal(uint16_t *out) const {
+    for (size_t i = 0; i < NPIXEL; i++)
+        out[i] = round_convergent(packed_pedeG0[i], 8) & 0xFFFF;
+}
+
+void FPGAEmulator::UpdatePixelMask(uint16_t *out, int bit) const {
+    for (size_t i = 0; i < NPIXEL; i++) {
+        if (pixel_mask[i / 32] & (1u << (i % 32))) out[i] |= (1 << bit);
+        else out[i] &= ~(1 << bit);
+    }
+}
+
+void FPGAEmulator::ReadEthPacket(PacketSource &source, BeatStream &out, const eth_settings_t &eth_settings) {
+    rcv_state_t rcv_state = RCV_INIT;
+    uint8_t axis_packet = 0;
+    EmulatedBeat packet_out;
+    packet_header_t header;
+    memset(&packet_out, 0, sizeof(EmulatedBeat));
+    memset(&header, 0, sizeof(packet_header_t));
+
+    uint8_t  encountered_triggers = 0;
+    uint32_t frame_number_last_trigger = 0;
+    uint32_t frame_number_last_no_trigger = 0;
+    bool     trigger_set = false; // This is only for beginning, to filter situation, where no filter was used
+
+    const char *packet;
+    size_t length;
+    bool error;
+    uint8_t beat[64];
+
+    while ((packet_out.exit == 0) && source.Next(packet, length, error)) {
+        statistics.packets++;
+        size_t nbeats = (length + 63) / 64;
+
+        for (size_t k = 0; (k < nbeats) && (packet_out.exit == 0); k++) {
+            get_beat(packet, length, k, beat);
+            bool last = (k == nbeats - 1);
+            uint8_t user = (error && last) ? 1 : 0;
+
+            switch (rcv_state) {
+                case RCV_INIT:
+                    rcv_state = RCV_IGNORE;
+                    decode_eth_1(beat, header);
+                    if ((header.dest_mac == eth_settings.fpga_mac_addr) &&
+                        (header.ether_type == 0x0800) &&
+                        (header.ip_version == 4) &&
+                        (header.ipv4_dest_ip == eth_settings.fpga_ipv4_addr) &&
+                        (header.ipv4_protocol == 0x11) &&
+                        (header.ipv4_total_len == 8268)) {
+                        if (header.jf_frame_number >= eth_settings.first_frame_number) {
+                            header.jf_frame_number -= eth_settings.first_frame_number;
+                            if (header.jf_frame_number >= eth_settings.frame_number_to_quit) packet_out.exit = 1;
+                            else if (header.jf_frame_number < eth_settings.frame_number_to_stop) {
+                                axis_packet = 0;
+                                rcv_state = RCV_JF_HEADER;
+                            }
+                        }
+                    }
+                    break;
+                case RCV_JF_HEADER: {
+                    decode_eth_2(beat, header);
+                    packet_out.frame_number = header.jf_frame_number & FRAME_NUMBER_MASK;
+
+                    // Even IP = second interface
+                    if (header.ipv4_source_ip % 2 == 0) packet_out.eth_packet = header.jf_packet_number + 64;
+                    else packet_out.eth_packet = header.jf_packet_number;
+
+                    packet_out.module = header.udp_dest_port % NMODULES;
+                    packet_out.trigger = (header.jf_debug >> 31) & 1;
+
+                    if (header.jf_frame_number < eth_settings.pedestalG0_frames) {
+                        packet_out.pedestal = 1;
+                        packet_out.save = 0;
+                    } else {
+                        packet_out.frame_number = (packet_out.frame_number - eth_settings.pedestalG0_frames) & FRAME_NUMBER_MASK;
+
+                        if (eth_settings.expected_triggers == 0) {
+                            packet_out.pedestal = 0;
+                            packet_out.save = 1;
+                        } else {
+                            packet_out.pedestal = 0;
+                            packet_out.save = 0;
+                            // ap_int<25>
+                            int64_t delta = sign_extend((int64_t) packet_out.frame_number
+                                    - ((int64_t) frame_number_last_trigger + eth_settings.delay_per_trigger), 25);
+                            int64_t frames_per_trigger = eth_settings.frames_per_trigger;
+                            int64_t delay_per_trigger = eth_settings.delay_per_trigger;
+
+                            if ((encountered_triggers == eth_settings.expected_triggers) &&
+                                (delta > frames_per_trigger + DELAY_FRAMES_STOP_AND_QUIT)) {
+                                packet_out.exit = 1;
+                            } else if (packet_out.trigger && !trigger_set) {
+                                trigger_set = true;
+                                frame_number_last_trigger = packet_out.frame_number;
+                                encountered_triggers = 1;
+                                if (delay_per_trigger == 0) {
+                                    packet_out.frame_number = 0;
+                                    packet_out.save = 1;
+                                }
+                            } else if (packet_out.trigger
+                                       && (frame_number_last_no_trigger > frame_number_last_trigger + 2 * delay_per_trigger + frames_per_trigger)
+                                       && (delta > frames_per_trigger)
+                                       && (encountered_triggers < eth_settings.expected_triggers)) {
+                                trigger_set = true;
+                                frame_number_last_trigger = packet_out.frame_number;
+                                encountered_triggers++;
+                                if (delay_per_trigger == 0) {
+                                    packet_out.frame_number = ((encountered_triggers - 1) * frames_per_trigger) & FRAME_NUMBER_MASK;
+                                    packet_out.save = 1;
+                                }
+                            } else if (trigger_set && (delta >= 0) && (delta < frames_per_trigger)) {
+                                packet_out.frame_number = ((encountered_triggers - 1) * frames_per_trigger + delta) & FRAME_NUMBER_MASK;
+                                packet_out.save = 1;
+                            } else if (!packet_out.trigger && (packet_out.frame_number > frame_number_last_no_trigger)
+                                       && (delta >= frames_per_trigger + delay_per_trigger)) {
+                                frame_number_last_no_trigger = packet_out.frame_number;
+                            } else if (!packet_out.trigger && !trigger_set) {
+                                packet_out.pedestal = 1;
+                            }
+                        }
+                    }
+
+                    // First AXI-stream packet contains only 304-bits of frame payload
+                    memcpy(packet_out.data, beat + 26, 38);
+
+                    if (packet_out.save && (packet_out.eth_packet == 0)) {
+                        // Same layout as header_info_t
+                        char *cell = hbm_cell(hbm_headers, ((uint64_t) packet_out.frame_number * NMODULES + packet_out.module)
+                                                           & HBM_HEADER_ADDR_MASK);
+                        memcpy(cell, &header.jf_frame_number, 8);
+                        memcpy(cell + 8, &header.udp_src_port, 2);
+                        memcpy(cell + 10, &header.udp_dest_port, 2);
+                        memcpy(cell + 12, &header.jf_debug, 4);
+                        memcpy(cell + 16, &header.jf_timestamp, 8);
+                        memcpy(cell + 24, &header.jf_bunch_id, 8);
+                    }
+
+                    if (packet_out.save || packet_out.pedestal) {
+                        if (packet_out.eth_packet < 128) {
+                            rcv_state = RCV_GOOD;
+                            statistics.accepted_packets++;
+                        } else {
+                            rcv_state = RCV_IGNORE;
+                            statistics.invalid_packets++;
+                        }
+                    } else
+                        rcv_state = RCV_IGNORE;
+                    break;
+                }
+                case RCV_GOOD:
+                    packet_out.axis_packet = axis_packet;
+                    memcpy((uint8_t *) packet_out.data + 38, beat, 26);
+                    out.Write(packet_out);
+                    memcpy(packet_out.data, beat + 26, 38);
+                    packet_out.axis_user = user;
+                    axis_packet++;
+                    if (axis_packet == 128) rcv_state = RCV_IGNORE;
+                    break;
+                case RCV_IGNORE:
+                    break;
+            }
+            if (last) rcv_state = RCV_INIT;
+        }
+    }
+    // Last beat informs later stages to quit
+    packet_out.exit = 1;
+    out.Write(packet_out);
+}
+
+// update_pedestal - pedestal tracking for 32 pixels and pedestal G0 subtraction
+static void update_pedestal(const uint16_t *data_in, int32_t *data_out, uint32_t *pedestal,
+                            bool accumulate, uint8_t mode, uint32_t &mask) {
+    uint32_t tmp_mask = 0;
+    bool pedestal_mode = (mode == MODE_PEDEG0) || (mode == MODE_PEDEG1) || (mode == MODE_PEDEG2);
+
+    for (int j = 0; j < 32; j++) {
+        uint16_t gain = data_in[j] >> 14;
+        int64_t adu = data_in[j] & 0x3FFF;
+
+        // ap_fixed<18,16> val_diff = adu - pedestal - exact difference truncated to 2 fractional bits
+        int32_t val_diff = sign_extend(((adu << 10) - (int64_t) pedestal[j]) >> 8, 18);
+
+        bool gain_matches = ((gain == 0x0) && (mode == MODE_PEDEG0)) ||
+                            ((gain == 0x1) && (mode == MODE_PEDEG1)) ||
+                            ((gain == 0x3) && (mode == MODE_PEDEG2));
+        if (gain_matches) {
+            // Division by integer keeps fractional bits of the dividend and truncates towards zero
+            if (accumulate)
+                pedestal[j] = (pedestal[j] + ((uint32_t) adu << 10) / PEDESTAL_WINDOW_SIZE) & PEDE_G0_MASK;
+            else
+                pedestal[j] = (pedestal[j] + (uint32_t) (val_diff / PEDESTAL_WINDOW_SIZE) * (1u << 8)) & PEDE_G0_MASK;
+        }
+        if (pedestal_mode && !gain_matches) tmp_mask |= 1u << j;
+
+        data_out[j] = val_diff;
+    }
+    mask |= tmp_mask;
+}
+
+void FPGAEmulator::PedestalG0(BeatStream &in, BeatStream &out, uint8_t conversion_mode) {
+    EmulatedBeat packet_in, packet_out;
+
+    // Pedestal is neither tracked nor subtracted in other modes, so the stage only forwards data
+    bool active = (conversion_mode == MODE_CONV) || (conversion_mode == MODE_PEDEG0) ||
+                  (conversion_mode == MODE_PEDEG1) || (conversion_mode == MODE_PEDEG2);
+
+    in.Read(packet_in);
+    while (packet_in.exit == 0) {
+        while ((packet_in.exit == 0) && (packet_in.axis_packet % URAM_PARITITION == 0)) {
+            uint8_t mode = conversion_mode;
+            if ((mode == MODE_CONV) && (packet_in.pedestal == 1)) mode = MODE_PEDEG0;
+
+            bool accumulate_pede = (packet_in.frame_number < PEDESTAL_WINDOW_SIZE);
+
+            size_t offset = packet_in.module * 128 * 128 + 128 * packet_in.eth_packet + packet_in.axis_packet;
+            for (int i = 0; (i < URAM_PARITITION) && (packet_in.exit == 0); i++) {
+                packet_out = packet_in;
+                if (active)
+                    update_pedestal(packet_in.data, packet_out.conv_data, packed_pedeG0.data() + (offset + i) * 32,
+                                    accumulate_pede, mode, pixel_mask[offset + i]);
+                if (packet_in.save) out.Write(packet_out);
+                in.Read(packet_in);
+            }
+        }
+        while ((packet_in.exit == 0) && (packet_in.axis_packet % URAM_PARITITION != 0)) in.Read(packet_in);
+    }
+    out.Write(packet_in);
+}
+
+// convert - gain correction of 32 pixels, constants start at given pixel
+static void convert(const uint16_t *data_in, uint16_t *data_out, const int32_t *after_pedeG0,
+                    const uint16_t *constants, size_t pixel) {
+    for (int i = 0; i < 32; i++) {
+        uint16_t in_val = data_in[i];
+        int16_t out_val;
+        if (in_val == 0xc000) out_val = 32766; // can saturate G2 - overload
+        else if (in_val == 0xffff) out_val = -32763; //error
+        else if (in_val == 0x4000) out_val = -32764; //cannot saturate G1 - error
+        else {
+            uint16_t gain = in_val >> 14;
+            int64_t adu = in_val & 0x3FFF;
+            int64_t val_diff, val_result;
+            switch (gain) {
+                case 0:
+                    // gainG0 / 512 keeps 14 fractional bits, product has 16 fractional bits
+                    val_diff = after_pedeG0[i];
+                    val_result = val_diff * (constants[GAIN_G0_BLOCK * NPIXEL + pixel + i] / 512);
+                    out_val = round_to_int16(sign_extend(round_convergent(val_result, 14), 18));
+                    break;
+                case 1:
+                    // pedeG1 (2 fractional bits) * gainG1 (13 fractional bits)
+                    val_diff = (int64_t) constants[PEDE_G1_BLOCK * NPIXEL + pixel + i] - adu * 4;
+                    val_result = val_diff * constants[GAIN_G1_BLOCK * NPIXEL + pixel + i];
+                    out_val = round_to_int16(sign_extend(round_convergent(val_result, 13), 18));
+                    break;
+                case 2:
+                    out_val = -32762; // invalid gain
+                    break;
+                default:
+                    val_diff = (int64_t) constants[PEDE_G2_BLOCK * NPIXEL + pixel + i] - adu * 4;
+                    val_result = val_diff * constants[GAIN_G2_BLOCK * NPIXEL + pixel + i];
+                    out_val = round_to_int16(sign_extend(round_convergent(val_result, 13), 18));
+                    break;
+            }
+        }
+        data_out[i] = out_val;
+    }
+}
+
+void FPGAEmulator::ApplyGainCorrection(BeatStream &in, BeatStream &out, bool output_conv) {
+    EmulatedBeat packet_in, packet_out;
+
+    in.Read(packet_in);
+    while (packet_in.exit == 0) {
+        while ((packet_in.exit == 0) && (packet_in.axis_packet % HBM_BURST_G1G2 == 0)) {
+            size_t offset = packet_in.module * 128 * 128 + 128 * packet_in.eth_packet + packet_in.axis_packet;
+            for (int i = 0; (i < HBM_BURST_G1G2) && (packet_in.exit == 0); i++) {
+                packet_out = packet_in;
+                // RAW + all pedestal modes return raw data to host memory
+                if (output_conv)
+                    convert(packet_in.data, packet_out.data, packet_in.conv_data, hbm_constants.data(), (offset + i) * 32);
+                out.Write(packet_out);
+                in.Read(packet_in);
+            }
+        }
+        while ((packet_in.exit == 0) && (packet_in.axis_packet % HBM_BURST_G1G2 != 0)) in.Read(packet_in);
+    }
+    out.Write(packet_in);
+}
+
+void FPGAEmulator::WriteData(BeatStream &in, int16_t *frame_buffer, char *status) {
+    EmulatedBeat packet_in;
+    in.Read(packet_in);
+
+    uint32_t counter_ok = 0;
+    uint32_t counter_wrong = 0;
+
+    uint32_t hbm_cache[NMODULES][HBM_CELL_SIZE / 4]; // Cache for HBM statistics
+    uint64_t hbm_cache_addr[NMODULES];
+    uint32_t head[NMODULES]; // number of the newest packet received for the frame
+    for (int i = 0; i < NMODULES; i++) {
+        memset(hbm_cache[i], 0, HBM_CELL_SIZE);
+        hbm_cache_addr[i] = i;
+        head[i] = 0;
+    }
+
+    // online_statistics_t padded to 512 bits
+    uint32_t statistics_out[16];
+    memset(statistics_out, 0, sizeof(statistics_out));
+
+    uint16_t buffer[128 * 32];
+
+    while (packet_in.exit == 0) {
+        while ((packet_in.exit == 0) && (packet_in.axis_packet == 0)) {
+            int16_t *out_frame = frame_buffer + (packet_in.frame_number % FRAME_BUF_SIZE) * NPIXEL
+                                 + packet_in.module * MODULE_COLS * MODULE_LINES + packet_in.eth_packet * 4096;
+
+            uint32_t frame_number0 = packet_in.frame_number;
+            uint8_t module0 = packet_in.module;
+            uint8_t eth_packet0 = packet_in.eth_packet;
+
+            uint64_t hbm_cell_addr = (packet_in.frame_number / 2) * NMODULES + packet_in.module;
+            uint32_t hbm_bit_addr = eth_packet0;
+            if (frame_number0 % 2 == 1) hbm_bit_addr += 128;
+
+            if (hbm_cache_addr[packet_in.module] != hbm_cell_addr) {
+                memcpy(hbm_cell(hbm_stat, hbm_cache_addr[packet_in.module]), hbm_cache[packet_in.module], HBM_CELL_SIZE);
+                hbm_cache_addr[packet_in.module] = hbm_cell_addr;
+                memcpy(hbm_cache[packet_in.module], hbm_cell(hbm_stat, hbm_cell_addr), HBM_CELL_SIZE);
+            }
+
+            if (packet_in.frame_number > head[packet_in.module]) {
+                head[packet_in.module] = packet_in.frame_number;
+
+                statistics_out[0] = counter_ok;
+                statistics_out[1] = counter_wrong;
+
+                // Save information about last trigger signal timing
+                if ((packet_in.module == 0) && (packet_in.trigger == 1))
+                    statistics_out[2 + NMODULES] = packet_in.frame_number;
+
+                for (int i = 0; i < NMODULES; i++)
+                    statistics_out[2 + i] = head[i];
+
+                // Status info is filled only every NMODULES frames, but interleaved between modules.
+                if (packet_in.frame_number % NMODULES == packet_in.module)
+                    memcpy(status, statistics_out, sizeof(statistics_out));
+            }
+
+            memcpy(buffer, packet_in.data, 64);
+            for (int i = 1; (i < 128) && (packet_in.exit == 0); i++) {
+                in.Read(packet_in);
+                memcpy(buffer + i * 32, packet_in.data, 64);
+            }
+            // FPGA would wait for rest of the packet forever
+            if (packet_in.exit) break;
+
+            memcpy(out_frame, buffer, 128 * 64);
+
+            if ((packet_in.axis_packet == 127) && (packet_in.axis_user == 0)) {
+                hbm_cache[module0][hbm_bit_addr / 32] |= (1u << (hbm_bit_addr % 32));
+                counter_ok++;
+            } else
+                counter_wrong++;
+
+            in.Read(packet_in);
+        }
+        // forward, to get to a beginning of a meaningful packet:
+        while ((packet_in.exit == 0) && (packet_in.axis_packet != 0))
+            in.Read(packet_in);
+    }
+
+    for (int i = 0; i < NMODULES; i++)
+        memcpy(hbm_cell(hbm_stat, hbm_cache_addr[i]), hbm_cache[i], HBM_CELL_SIZE);
+
+    statistics_out[0] = counter_ok;
+    statistics_out[1] = counter_wrong;
+
+    // For all packets, set head as MAX number
+    for (int i = 0; i < NMODULES; i++)
+        statistics_out[2 + i] = INT32_MAX;
+
+    memcpy(status, statistics_out, sizeof(statistics_out));
+}
+
+void FPGAEmulator::Run(const rx100G_job_t &job, PacketSource &source) {
+    auto start_time = std::chrono::steady_clock::now();
+
+    uint16_t *gain_pedestal_data = (uint16_t *) job.in_gain_pedestal_data_addr;
+    int16_t *frame_buffer = (int16_t *) job.out_frame_buffer_addr;
+    char *status = (char *) job.out_frame_status_addr;
+    char *jf_packet_headers = (char *) job.out_jf_packet_headers_addr;
+
+    eth_settings_t eth_settings;
+    eth_settings.fpga_mac_addr = job.fpga_mac_addr;
+    eth_settings.fpga_ipv4_addr = job.fpga_ipv4_addr;
+    eth_settings.frame_number_to_stop = job.expected_frames;
+    eth_settings.frame_number_to_quit = job.expected_frames + DELAY_FRAMES_STOP_AND_QUIT;
+    eth_settings.first_frame_number = job.first_frame_number;
+    eth_settings.expected_triggers = job.expected_triggers;
+    eth_settings.frames_per_trigger = job.frames_per_trigger & FRAME_NUMBER_MASK;
+    eth_settings.delay_per_trigger = job.delay_per_trigger;
+    if (job.mode == MODE_CONV)
+        eth_settings.pedestalG0_frames = job.pedestalG0_frames & FRAME_NUMBER_MASK;
+    else eth_settings.pedestalG0_frames = 0; // This is only necessary for conversion
+
+    uint8_t conversion_mode = job.mode;
+
+    // Load constants (HBM is cleared only partially, rest is kept from previous collections)
+    memcpy(hbm_constants.data(), gain_pedestal_data, 5 * NPIXEL * sizeof(uint16_t));
+    memset(hbm_headers.Get(), 0, HBM_CLEARED_SIZE);
+    memset(hbm_stat.Get(), 0, HBM_CLEARED_SIZE);
+
+    switch (conversion_mode) {
+        case MODE_PEDEG0:
+        case MODE_CONV:
+            LoadPedestal(gain_pedestal_data + PEDE_G0_BLOCK * NPIXEL);
+            break;
+        case MODE_PEDEG1:
+            LoadPedestal(gain_pedestal_data + PEDE_G1_BLOCK * NPIXEL);
+            break;
+        case MODE_PEDEG2:
+            LoadPedestal(gain_pedestal_data + PEDE_G2_BLOCK * NPIXEL);
+            break;
+    }
+    std::fill(pixel_mask.begin(), pixel_mask.end(), 0);
+
+    statistics.packets = 0;
+    statistics.accepted_packets = 0;
+    statistics.invalid_packets = 0;
+
+    // Dataflow - each stage in own thread, write_data in the calling thread
+    {
+        BeatStream raw(STREAM_BLOCKS, BEATS_PER_BLOCK);
+        BeatStream after_pedeG0(STREAM_BLOCKS, BEATS_PER_BLOCK);
+        BeatStream converted(STREAM_BLOCKS, BEATS_PER_BLOCK);
+
+        std::thread read_eth_thread(&FPGAEmulator::ReadEthPacket, this, std::ref(source), std::ref(raw),
+                                    std::cref(eth_settings));
+        std::thread pedestal_thread(&FPGAEmulator::PedestalG0, this, std::ref(raw), std::ref(after_pedeG0),
+                                    conversion_mode);
+        std::thread conversion_thread(&FPGAEmulator::ApplyGainCorrection, this, std::ref(after_pedeG0),
+                                      std::ref(converted), job.mode == MODE_CONV);
+        WriteData(converted, frame_buffer, status);
+        read_eth_thread.join();
+        pedestal_thread.join();
+        conversion_thread.join();
+    }
+
+    // Save calculated pedestal and pixel mask back to memory
+    switch (conversion_mode) {
+        case MODE_PEDEG0:
+        case MODE_CONV:
+            SavePedestal(gain_pedestal_data + PEDE_G0_BLOCK * NPIXEL);
+            UpdatePixelMask(gain_pedestal_data + MASK_BLOCK * NPIXEL, 1);
+            break;
+        case MODE_PEDEG1:
+            SavePedestal(gain_pedestal_data + PEDE_G1_BLOCK * NPIXEL);
+            UpdatePixelMask(gain_pedestal_data + MASK_BLOCK * NPIXEL, 2);
+            break;
+        case MODE_PEDEG2:
+            SavePedestal(gain_pedestal_data + PEDE_G2_BLOCK * NPIXEL);
+            UpdatePixelMask(gain_pedestal_data + MASK_BLOCK * NPIXEL, 3);
+            break;
+    }
+
+    // Save JF packet headers and status bits, copied in 512-bit words
+    size_t headers_size = std::min((size_t) (job.expected_frames * NMODULES) / 2 * 64, (size_t) HBM_CHANNEL_SIZE);
+    memcpy(jf_packet_headers, hbm_headers.Get(), headers_size);
+    size_t stat_size = std::min((size_t) (job.expected_frames * NMODULES * 16) / 64 * 64, (size_t) HBM_CHANNEL_SIZE);
+    memcpy(status + 64, hbm_stat.Get(), stat_size);
+
+    statistics.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
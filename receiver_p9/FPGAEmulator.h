@@ -0,0 +1,180 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FPGAEMULATOR_H
+#define _FPGAEMULATOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../include/action_rx100G.h"
+#include "../include/HugePageBuffer.h"
+
+// Software model of the rx100G FPGA action (hw/hw_action_rx100G.cpp).
+// The four dataflow stages of collect_data() - read_eth_packet, pedestalG0, apply_gain_correction
+// and write_data - run in separate threads connected by streams of 512-bit beats, with the same
+// control flow as the HLS code. Fixed point arithmetic of ap_fixed types is done on raw integers,
+// so frame buffer, packet headers, status buffer (statistics and packet bitmap), pedestal and pixel mask
+// written to host memory are the same as produced by the FPGA.
+// Known differences:
+// - packets with JUNGFRAU packet number giving position outside of module (>= 128) are dropped,
+//   FPGA behavior is undefined for these (writes outside of frame buffer slot)
+// - FPGA stalls if Ethernet packet is truncated just before the end of collection, the model finishes instead
+// - when packet source is exhausted, collection is finished as if frame_number_to_quit was reached
+//   (FPGA would wait for more packets)
+// - HBM addresses beyond the size of single HBM pseudo-channel wrap around
+
+// Source of Ethernet frames for the emulated 100G interface
+class PacketSource {
+public:
+    virtual ~PacketSource() {}
+    // Next Ethernet frame (starting with destination MAC address),
+    // error = frame marked as bad by MAC (TUSER on the last beat)
+    // Returns false if there are no more frames
+    virtual bool Next(const char *&packet, size_t &length, bool &error) = 0;
+};
+
+// File with RAW_JFUDP_Packet records, optionally paced to given frame rate
+class PacketFile : public PacketSource {
+    char *ptr;
+    size_t size;
+    size_t npackets;
+    size_t position;
+    double frame_rate;
+    uint64_t first_frame;
+    uint64_t last_frame;
+    std::chrono::steady_clock::time_point start;
+
+    PacketFile(const PacketFile &other) = delete;
+    PacketFile &operator=(const PacketFile &other) = delete;
+public:
+    PacketFile();
+    ~PacketFile();
+
+    // Returns 1 on error, frame_rate = 0 means as fast as possible
+    int Open(const std::string &file_name, double frame_rate);
+    void Close();
+    // Start from the first packet
+    void Rewind();
+    size_t GetPacketsNum() const;
+
+    bool Next(const char *&packet, size_t &length, bool &error) override;
+};
+
+// data_packet_t of the HLS design
+struct EmulatedBeat {
+    uint16_t data[32];       // 512-bit beat (raw or converted pixels)
+    int32_t  conv_data[32];  // pixel with G0 pedestal subtracted (ap_fixed<18,16>, 2 fractional bits)
+    uint32_t frame_number;   // 24-bit
+    uint8_t  module;
+    uint8_t  eth_packet;
+    uint8_t  axis_packet;
+    uint8_t  axis_user;
+    uint8_t  pedestal;
+    uint8_t  save;
+    uint8_t  exit;
+    uint8_t  trigger;
+};
+
+// hls::stream<data_packet_t> - beats are handed over between threads in blocks
+class BeatStream {
+    struct Block {
+        std::vector<EmulatedBeat> beats;
+        size_t count;
+    };
+    std::vector<Block> blocks;
+    std::deque<Block *> full_blocks;
+    std::deque<Block *> free_blocks;
+    std::mutex blocks_mutex;
+    std::condition_variable full_cond;
+    std::condition_variable free_cond;
+
+    Block *write_block;
+    Block *read_block;
+    size_t read_position;
+    bool exit_read;
+    EmulatedBeat exit_beat;
+
+    void Put(Block *block, std::deque<Block *> &queue, std::condition_variable &cond);
+    Block *Take(std::deque<Block *> &queue, std::condition_variable &cond);
+
+    BeatStream(const BeatStream &other) = delete;
+    BeatStream &operator=(const BeatStream &other) = delete;
+public:
+    BeatStream(size_t nblocks, size_t beats_per_block);
+    // Block is passed to reader when full or after exit beat
+    void Write(const EmulatedBeat &beat);
+    // After exit beat was read, it is returned for all subsequent reads
+    void Read(EmulatedBeat &beat);
+};
+
+struct FPGAEmulatorStatistics {
+    uint64_t packets;          // Ethernet frames taken from source
+    uint64_t accepted_packets; // frames passed to pedestal and conversion stages
+    uint64_t invalid_packets;  // frames dropped, as the packet number is out of range
+    double   elapsed;          // seconds
+};
+
+class FPGAEmulator {
+    // URAM
+    std::vector<uint32_t> packed_pedeG0; // pedeG0_t (ap_ufixed<24,14>) per pixel
+    std::vector<uint32_t> pixel_mask;    // bit per pixel
+
+    // HBM
+    std::vector<uint16_t> hbm_constants; // gain G0, G1, G2 and pedestal G1, G2 (p0-p9)
+    HugePageBuffer hbm_headers;          // JF packet headers (p10)
+    HugePageBuffer hbm_stat;             // packet bitmap (p11)
+
+    FPGAEmulatorStatistics statistics;
+
+    struct eth_settings_t {
+        uint64_t frame_number_to_stop;
+        uint64_t frame_number_to_quit;
+        uint64_t first_frame_number;
+        uint64_t fpga_mac_addr;
+        uint32_t fpga_ipv4_addr;
+        uint8_t  expected_triggers;
+        uint32_t frames_per_trigger; // 24-bit
+        uint32_t pedestalG0_frames;  // 24-bit
+        uint16_t delay_per_trigger;
+    };
+
+    void LoadPedestal(const uint16_t *in);
+    void SavePedestal(uint16_t *out) const;
+    void UpdatePixelMask(uint16_t *out, int bit) const;
+
+    void ReadEthPacket(PacketSource &source, BeatStream &out, const eth_settings_t &eth_settings);
+    void PedestalG0(BeatStream &in, BeatStream &out, uint8_t conversion_mode);
+    void ApplyGainCorrection(BeatStream &in, BeatStream &out, bool output_conv);
+    void WriteData(BeatStream &in, int16_t *frame_buffer, char *status);
+
+    FPGAEmulator(const FPGAEmulator &other) = delete;
+    FPGAEmulator &operator=(const FPGAEmulator &other) = delete;
+public:
+    FPGAEmulator();
+    // Allocate HBM, returns 1 on error
+    int Setup();
+    // Executes the action for the job, like snap_action_sync_execute_job (addresses in job are host pointers)
+    void Run(const rx100G_job_t &job, PacketSource &source);
+    const FPGAEmulatorStatistics &GetStatistics() const;
+};
+
+#endif
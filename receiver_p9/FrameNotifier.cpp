@@ -0,0 +1,127 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <unistd.h>
+
+#include "JFReceiver.h"
+#include "FrameNotifier.h"
+#include "Futex.h"
+
+static std::atomic<uint32_t> published_frame(0);
+static std::atomic<uint32_t> sleeping_threads(0);
+static std::atomic<bool> notifier_stop(false);
+static uint32_t frame_wait_spin_us = 0;
+
+static std::atomic<uint64_t> frame_wait_histogram[FRAME_WAIT_HISTOGRAM_BINS];
+
+uint32_t lastModuleFrameNumber() {
+    uint32_t retVal = online_statistics->head[0];
+    for (int i = 1; i < NMODULES; i++) {
+        if (online_statistics->head[i] < retVal) retVal = online_statistics->head[i];
+    }
+    return retVal;
+}
+
+uint32_t newestModuleFrameNumber() {
+    uint32_t retVal = online_statistics->head[0];
+    for (int i = 1; i < NMODULES; i++) {
+        if (online_statistics->head[i] > retVal) retVal = online_statistics->head[i];
+    }
+    return retVal;
+}
+
+void setup_frame_notifier(uint32_t spin_us) {
+    frame_wait_spin_us = spin_us;
+    notifier_stop = false;
+    published_frame = lastModuleFrameNumber();
+    for (int i = 0; i < FRAME_WAIT_HISTOGRAM_BINS; i++)
+        frame_wait_histogram[i] = 0;
+}
+
+void *run_frame_watcher_thread(void *in_threadarg) {
+    thread_placement.PinThread("watcher");
+
+    while (!notifier_stop.load(std::memory_order_relaxed)) {
+        uint32_t frame = lastModuleFrameNumber();
+        if (frame != published_frame.load(std::memory_order_relaxed)) {
+            // Frame data are written by FPGA before the status, so release is enough to make these visible
+            published_frame.store(frame, std::memory_order_release);
+            if (sleeping_threads.load() > 0) futex_wake_all(&published_frame);
+        } else
+            usleep(FRAME_WATCHER_POLL_US);
+    }
+    pthread_exit(0);
+}
+
+void stop_frame_notifier() {
+    notifier_stop = true;
+    futex_wake_all(&published_frame);
+}
+
+static void record_wait_time(std::chrono::steady_clock::time_point start) {
+    int64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    int bin = 0;
+    while ((wait_us > 0) && (bin < FRAME_WAIT_HISTOGRAM_BINS - 1)) {
+        wait_us /= 2;
+        bin++;
+    }
+    frame_wait_histogram[bin].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint32_t wait_for_frame(uint32_t frame) {
+    uint32_t current_frame = published_frame.load(std::memory_order_acquire);
+    if (current_frame >= frame) {
+        frame_wait_histogram[0].fetch_add(1, std::memory_order_relaxed);
+        return current_frame;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto spin_end = start + std::chrono::microseconds(frame_wait_spin_us);
+
+    // Spin first - frame is likely to arrive soon, if thread is not much ahead of the detector
+    while ((current_frame < frame) && (std::chrono::steady_clock::now() < spin_end)) {
+        cpu_relax();
+        current_frame = published_frame.load(std::memory_order_acquire);
+    }
+
+    // Then sleep until woken up by the watcher thread
+    // Frame number is checked again after registering as sleeping thread, so no wake up is lost
+    while ((current_frame < frame) && !notifier_stop.load(std::memory_order_relaxed)) {
+        sleeping_threads.fetch_add(1);
+        current_frame = published_frame.load(std::memory_order_acquire);
+        if (current_frame < frame) {
+            futex_wait(&published_frame, current_frame, FRAME_WAIT_TIMEOUT_US);
+            current_frame = published_frame.load(std::memory_order_acquire);
+        }
+        sleeping_threads.fetch_sub(1);
+    }
+
+    record_wait_time(start);
+    return current_frame;
+}
+
+void print_frame_wait_histogram() {
+    std::cout << "Frame wait time histogram:" << std::endl;
+    std::cout << "   no wait: " << frame_wait_histogram[0] << std::endl;
+    for (int i = 1; i < FRAME_WAIT_HISTOGRAM_BINS; i++) {
+        uint64_t count = frame_wait_histogram[i];
+        if (count > 0)
+            std::cout << "   " << (1L << (i - 1)) << "-" << (1L << i) << " us: " << count << std::endl;
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FRAMENOTIFIER_H
+#define _FRAMENOTIFIER_H
+
+#include <cstdint>
+#include <cstddef>
+
+// FPGA only updates status buffer (online_statistics->head) and doesn't raise interrupt per frame.
+// Single watcher thread polls the status buffer and publishes the last frame present for all modules.
+// Send threads wait for their frames by spinning for a short time and then sleeping on futex,
+// watcher wakes them up as soon as new frame is published.
+
+#define FRAME_WATCHER_POLL_US 5          // Polling interval of the status buffer
+#define FRAME_WAIT_TIMEOUT_US 10000      // Upper limit of single futex sleep
+#define FRAME_WAIT_HISTOGRAM_BINS 24     // Bin 0 - no wait, bin i - wait time in [2^(i-1), 2^i) us
+
+// Last frame number that arrived for all modules
+uint32_t lastModuleFrameNumber();
+
+// Last frame number that arrived for any module, i.e. how far the ring buffer is already overwritten
+uint32_t newestModuleFrameNumber();
+
+// Must be called before starting watcher and send threads
+// spin_us - time to spin before going to sleep, 0 = block immediately
+void setup_frame_notifier(uint32_t spin_us);
+
+void *run_frame_watcher_thread(void *in_threadarg);
+
+// Stop watcher thread and wake up all waiting threads
+void stop_frame_notifier();
+
+// Wait until frame is present for all modules, returns last frame number present for all modules
+uint32_t wait_for_frame(uint32_t frame);
+
+void print_frame_wait_histogram();
+
+#endif
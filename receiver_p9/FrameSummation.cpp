@@ -0,0 +1,169 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "FrameSummation.h"
+
+#define BLOCK_PIXELS (SUMMATION_BLOCK_LINES * MODULE_COLS)
+
+// Loops below are written without branches, so these are vectorized by the compiler
+
+// Same as summing one frame with:
+//   if (tmp < INT16_MIN + 10) sum = UNDERFLOW_32BIT;
+//   if ((tmp > INT16_MAX - 10) && (sum > UNDERFLOW_32BIT)) sum = OVERFLOW_32BIT;
+//   if ((sum > UNDERFLOW_32BIT) && (sum < OVERFLOW_32BIT)) sum += tmp;
+static inline void accumulate(int32_t *__restrict__ sum, const int16_t *__restrict__ in, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t s = sum[i];
+        int32_t t = in[i];
+        s = (t < INT16_MIN + 10) ? UNDERFLOW_32BIT : s;
+        s = ((t > INT16_MAX - 10) && (s > UNDERFLOW_32BIT)) ? OVERFLOW_32BIT : s;
+        s = ((s > UNDERFLOW_32BIT) && (s < OVERFLOW_32BIT)) ? s + t : s;
+        sum[i] = s;
+    }
+}
+
+static inline void window_add(int32_t *__restrict__ sum, uint16_t *__restrict__ underflow, uint16_t *__restrict__ overflow,
+        const int16_t *__restrict__ in, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t t = in[i];
+        bool bad = (t < INT16_MIN + 10);
+        bool overload = (t > INT16_MAX - 10);
+        underflow[i] += bad;
+        overflow[i] += overload;
+        sum[i] += (bad || overload) ? 0 : t;
+    }
+}
+
+static inline void window_remove(int32_t *__restrict__ sum, uint16_t *__restrict__ underflow, uint16_t *__restrict__ overflow,
+        const int16_t *__restrict__ in, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t t = in[i];
+        bool bad = (t < INT16_MIN + 10);
+        bool overload = (t > INT16_MAX - 10);
+        underflow[i] -= bad;
+        overflow[i] -= overload;
+        sum[i] -= (bad || overload) ? 0 : t;
+    }
+}
+
+static inline void window_output(int32_t *__restrict__ out, const int32_t *__restrict__ sum,
+        const uint16_t *__restrict__ underflow, const uint16_t *__restrict__ overflow, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t s = sum[i];
+        s = (s > OVERFLOW_32BIT) ? OVERFLOW_32BIT : s;
+        s = (s < UNDERFLOW_32BIT) ? UNDERFLOW_32BIT : s;
+        s = (overflow[i] > 0) ? OVERFLOW_32BIT : s;
+        s = (underflow[i] > 0) ? UNDERFLOW_32BIT : s;
+        out[i] = s;
+    }
+}
+
+// Location of the first pixel of the block in the frame
+static inline const int16_t *block_start(const int16_t *frames, size_t buffer_frames, size_t frame, size_t module, size_t line0) {
+    return frames + (((frame % buffer_frames) * NMODULES + module) * MODULE_LINES + line0) * MODULE_COLS;
+}
+
+int setup_frame_summation(frame_summation_t &summation, bool sliding_window) {
+    summation.sliding_window = sliding_window;
+    summation.window_nframes = 0;
+    summation.window_sum = NULL;
+    summation.window_underflow = NULL;
+    summation.window_overflow = NULL;
+
+    for (int i = 0; i < SUMMATION_BLOCKS; i++)
+        summation.window_first_frame[i] = -1;
+
+    summation.output = (int32_t *) malloc(BLOCK_PIXELS * sizeof(int32_t));
+    if (summation.output == NULL) return 1;
+
+    if (sliding_window) {
+        summation.window_sum = (int32_t *) malloc(NPIXEL * sizeof(int32_t));
+        summation.window_underflow = (uint16_t *) malloc(NPIXEL * sizeof(uint16_t));
+        summation.window_overflow = (uint16_t *) malloc(NPIXEL * sizeof(uint16_t));
+        if ((summation.window_sum == NULL) || (summation.window_underflow == NULL) || (summation.window_overflow == NULL)) {
+            free_frame_summation(summation);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void free_frame_summation(frame_summation_t &summation) {
+    free(summation.output);
+    free(summation.window_sum);
+    free(summation.window_underflow);
+    free(summation.window_overflow);
+    summation.output = NULL;
+    summation.window_sum = NULL;
+    summation.window_underflow = NULL;
+    summation.window_overflow = NULL;
+}
+
+static void sum_frames_sliding(frame_summation_t &summation, const int16_t *frames, size_t buffer_frames, size_t head_frame,
+        size_t first_frame, size_t nframes, size_t module, size_t line0) {
+    size_t block = (module * MODULE_LINES + line0) / SUMMATION_BLOCK_LINES;
+    size_t offset = (module * MODULE_LINES + line0) * MODULE_COLS;
+
+    int32_t  *sum       = summation.window_sum + offset;
+    uint16_t *underflow = summation.window_underflow + offset;
+    uint16_t *overflow  = summation.window_overflow + offset;
+
+    int64_t prev_first_frame = summation.window_first_frame[block];
+
+    // Partial sums can be reused, if windows are overlapping and frames removed from the window
+    // are still present in the frame buffer - thread can lag behind the detector, so the oldest of these
+    // is checked against the current head of the ring buffer, otherwise the window is summed from scratch
+    bool reuse = (prev_first_frame >= 0)
+            && (summation.window_nframes == nframes)
+            && (first_frame >= (size_t) prev_first_frame)
+            && (first_frame < prev_first_frame + nframes)
+            && (first_frame + nframes - prev_first_frame <= buffer_frames)
+            && (head_frame + SUMMATION_HEAD_MARGIN < prev_first_frame + buffer_frames);
+
+    if (reuse) {
+        for (size_t frame = prev_first_frame; frame < first_frame; frame++)
+            window_remove(sum, underflow, overflow, block_start(frames, buffer_frames, frame, module, line0), BLOCK_PIXELS);
+        for (size_t frame = prev_first_frame + nframes; frame < first_frame + nframes; frame++)
+            window_add(sum, underflow, overflow, block_start(frames, buffer_frames, frame, module, line0), BLOCK_PIXELS);
+    } else {
+        memset(sum, 0, BLOCK_PIXELS * sizeof(int32_t));
+        memset(underflow, 0, BLOCK_PIXELS * sizeof(uint16_t));
+        memset(overflow, 0, BLOCK_PIXELS * sizeof(uint16_t));
+        for (size_t frame = first_frame; frame < first_frame + nframes; frame++)
+            window_add(sum, underflow, overflow, block_start(frames, buffer_frames, frame, module, line0), BLOCK_PIXELS);
+    }
+
+    summation.window_first_frame[block] = first_frame;
+    summation.window_nframes = nframes;
+
+    window_output(summation.output, sum, underflow, overflow, BLOCK_PIXELS);
+}
+
+int32_t *sum_frames(frame_summation_t &summation, const int16_t *frames, size_t buffer_frames, size_t head_frame,
+        size_t first_frame, size_t nframes, size_t module, size_t line0) {
+    if (summation.sliding_window)
+        sum_frames_sliding(summation, frames, buffer_frames, head_frame, first_frame, nframes, module, line0);
+    else {
+        memset(summation.output, 0, BLOCK_PIXELS * sizeof(int32_t));
+        for (size_t frame = first_frame; frame < first_frame + nframes; frame++)
+            accumulate(summation.output, block_start(frames, buffer_frames, frame, module, line0), BLOCK_PIXELS);
+    }
+    return summation.output;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FRAMESUMMATION_H
+#define _FRAMESUMMATION_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include "../include/JFApp.h"
+
+// Frames are summed in blocks of module lines, iterating over frames in the outer loop.
+// 16 lines x 1024 pixels x 4 bytes = 64 kB accumulator, which stays in L2 cache,
+// while each frame contributes one contiguous 32 kB read.
+#define SUMMATION_BLOCK_LINES 16L
+#define SUMMATION_BLOCKS (NMODULES * MODULE_LINES / SUMMATION_BLOCK_LINES)
+
+// Frames close to the detector head, which can be in the process of being overwritten by the FPGA
+#define SUMMATION_HEAD_MARGIN 2L
+
+// Per thread state of the summation engine
+struct frame_summation_t {
+    int32_t  *output;             // SUMMATION_BLOCK_LINES * MODULE_COLS summed pixels
+
+    // Sliding window - sum of valid pixels and count of bad/overloaded frames in the current window
+    bool      sliding_window;
+    int32_t  *window_sum;         // NPIXEL
+    uint16_t *window_underflow;   // NPIXEL
+    uint16_t *window_overflow;    // NPIXEL
+    int64_t   window_first_frame[SUMMATION_BLOCKS]; // -1 if block is empty
+    size_t    window_nframes;
+};
+
+int setup_frame_summation(frame_summation_t &summation, bool sliding_window);
+void free_frame_summation(frame_summation_t &summation);
+
+// Sums frames [first_frame, first_frame + nframes) of ring buffer with buffer_frames elements
+// for lines [line0, line0 + SUMMATION_BLOCK_LINES) of module.
+// head_frame is the newest frame number reported by the detector, frames older than
+// head_frame + SUMMATION_HEAD_MARGIN - buffer_frames are already overwritten in the ring buffer.
+// Result is the same as summing frame by frame:
+// bad pixel in any frame gives UNDERFLOW_32BIT, otherwise overload in any frame gives OVERFLOW_32BIT.
+// In sliding window mode, sums that exceed 32-bit range are clamped to OVERFLOW_32BIT/UNDERFLOW_32BIT.
+// Returns pointer to summed lines.
+int32_t *sum_frames(frame_summation_t &summation, const int16_t *frames, size_t buffer_frames, size_t head_frame,
+        size_t first_frame, size_t nframes, size_t module, size_t line0);
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <climits>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Futex operates on 32-bit word
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "std::atomic<uint32_t> must be 32-bit");
+
+// Sleep as long as *addr == expected, timeout_us == 0 means no timeout
+// Spurious wake ups are possible, so condition needs to be checked by the caller
+static inline void futex_wait(std::atomic<uint32_t> *addr, uint32_t expected, uint32_t timeout_us = 0) {
+    timespec timeout;
+    timeout.tv_sec = timeout_us / 1000000;
+    timeout.tv_nsec = (timeout_us % 1000000) * 1000L;
+    syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAIT_PRIVATE, expected, (timeout_us > 0) ? &timeout : NULL, NULL, 0);
+}
+
+static inline void futex_wake(std::atomic<uint32_t> *addr, int nthreads) {
+    syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAKE_PRIVATE, nthreads, NULL, NULL, 0);
+}
+
+static inline void futex_wake_all(std::atomic<uint32_t> *addr) {
+    futex_wake(addr, INT_MAX);
+}
+
+static inline void cpu_relax() {
+#if defined(__powerpc64__)
+    __asm__ __volatile__ ("or 27,27,27" : : : "memory"); // yield - lower SMT thread priority
+#elif defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <new>
+
+#include "JFReceiver.h"
+#include "IBSendSlots.h"
+#include "Futex.h"
+
+// One slot per cache line, to avoid false sharing between send threads
+struct alignas(128) ib_send_slot_t {
+    std::atomic<uint32_t> turn;       // image allowed to use the slot
+    std::atomic<uint32_t> waiters;    // threads sleeping on the slot
+    std::atomic<uint32_t> parts_done; // parts of the image already written
+};
+
+static ib_send_slot_t *ib_send_slots = NULL;
+static uint32_t ib_send_max_slots = 0;
+static uint32_t ib_send_nslots = 0;
+
+// Slots of the batch, indexed by slot of the last (signaled) work request
+static uint32_t (*ib_send_batch_slots)[IB_SEND_BATCH] = NULL;
+static size_t   *ib_send_batch_size = NULL;
+
+int setup_ib_send_slots(size_t max_slots) {
+    free_ib_send_slots();
+    if (posix_memalign((void **) &ib_send_slots, sizeof(ib_send_slot_t), max_slots * sizeof(ib_send_slot_t)))
+        return 1;
+    ib_send_batch_slots = (uint32_t (*)[IB_SEND_BATCH]) malloc(max_slots * IB_SEND_BATCH * sizeof(uint32_t));
+    ib_send_batch_size = (size_t *) malloc(max_slots * sizeof(size_t));
+    if ((ib_send_batch_slots == NULL) || (ib_send_batch_size == NULL)) return 1;
+    ib_send_max_slots = max_slots;
+    for (size_t i = 0; i < max_slots; i++)
+        new (ib_send_slots + i) ib_send_slot_t();
+    reset_ib_send_slots(max_slots);
+    return 0;
+}
+
+void free_ib_send_slots() {
+    free(ib_send_slots);
+    free(ib_send_batch_slots);
+    free(ib_send_batch_size);
+    ib_send_slots = NULL;
+    ib_send_batch_slots = NULL;
+    ib_send_batch_size = NULL;
+    ib_send_max_slots = 0;
+}
+
+void reset_ib_send_slots(size_t nslots) {
+    ib_send_nslots = nslots;
+    for (size_t i = 0; i < ib_send_max_slots; i++) {
+        ib_send_slots[i].turn = i;
+        ib_send_slots[i].waiters = 0;
+        ib_send_slots[i].parts_done = 0;
+    }
+}
+
+bool ib_send_slot_ready(size_t slot, uint32_t image) {
+    return (ib_send_slots[slot].turn.load(std::memory_order_acquire) == image);
+}
+
+void wait_for_ib_send_slot(size_t slot, uint32_t image) {
+    ib_send_slot_t &s = ib_send_slots[slot];
+    // Fast path - slot is free
+    if (s.turn.load(std::memory_order_acquire) == image) return;
+
+    // Slow path - register as waiting thread, then check again and sleep till slot is released
+    s.waiters.fetch_add(1);
+    uint32_t c = s.turn.load();
+    while (c != image) {
+        futex_wait(&s.turn, c);
+        c = s.turn.load();
+    }
+    s.waiters.fetch_sub(1);
+}
+
+bool finish_ib_send_slot_part(size_t slot, uint32_t nparts) {
+    return (ib_send_slots[slot].parts_done.fetch_add(1, std::memory_order_acq_rel) + 1 == nparts);
+}
+
+void release_ib_send_slot(size_t slot) {
+    ib_send_slot_t &s = ib_send_slots[slot];
+    s.parts_done.store(0, std::memory_order_relaxed);
+    // Slot is passed to the image, which is nslots images later
+    s.turn.store(s.turn.load(std::memory_order_relaxed) + ib_send_nslots);
+    if (s.waiters.load() > 0)
+        futex_wake_all(&s.turn);
+}
+
+void set_ib_send_batch(size_t last_slot, const uint32_t *slots, size_t nslots) {
+    for (size_t i = 0; i < nslots; i++)
+        ib_send_batch_slots[last_slot][i] = slots[i];
+    ib_send_batch_size[last_slot] = nslots;
+}
+
+size_t release_ib_send_batch(size_t last_slot) {
+    size_t nslots = ib_send_batch_size[last_slot];
+    // Record can be overwritten as soon as the last slot is released, so it goes last (slots[nslots-1] == last_slot)
+    for (size_t i = 0; i < nslots; i++)
+        release_ib_send_slot(ib_send_batch_slots[last_slot][i]);
+    return nslots;
+}
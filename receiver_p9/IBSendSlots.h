@@ -0,0 +1,58 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IBSENDSLOTS_H
+#define _IBSENDSLOTS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Credit ring of IB send buffer slots.
+// Image is written to slot image % nslots. Each slot has own atomic turn - number of the image,
+// which is allowed to use the slot. Send threads wait for the turn of their image, completion thread
+// passes the slot to the image nslots later, when send is completed.
+// Only threads waiting for the particular slot are woken up, there is no global lock.
+
+// Allocate slots, number of slots is chosen at startup, returns 1 on error
+int setup_ib_send_slots(size_t max_slots);
+void free_ib_send_slots();
+
+// Prepare for data collection using nslots slots (nslots <= max_slots)
+void reset_ib_send_slots(size_t nslots);
+
+// Check without waiting, if slot can be used for the image
+bool ib_send_slot_ready(size_t slot, uint32_t image);
+
+// Wait till slot can be used for the image
+void wait_for_ib_send_slot(size_t slot, uint32_t image);
+
+// Image can be written to the slot in parts by multiple threads,
+// thread writing the last part of the image is responsible for sending it.
+// Returns true, if this was the last part of the image.
+bool finish_ib_send_slot_part(size_t slot, uint32_t nparts);
+
+// Pass slot to the next image using it
+void release_ib_send_slot(size_t slot);
+
+// Images are posted in batches, with only the last work request signaled.
+// Completion of the last request means all requests of the batch are completed,
+// so slots of the whole batch are recorded under the slot of the last request.
+void set_ib_send_batch(size_t last_slot, const uint32_t *slots, size_t nslots);
+
+// Release all slots of the batch, returns number of released slots
+size_t release_ib_send_batch(size_t last_slot);
+
+#endif
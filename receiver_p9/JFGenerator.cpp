@@ -0,0 +1,466 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Generator of JUNGFRAU UDP packet streams, for testing receiver without the detector.
+// Packets are written to a file of RAW_JFUDP_Packet records (input for FPGA emulator, option -e of JFReceiver),
+// sent as UDP datagrams (e.g. over loopback, received with option -u of JFReceiver)
+// or written directly to network interface with AF_PACKET TX ring.
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "PacketGenerator.h"
+
+#define UDP_PAYLOAD_OFFSET offsetof(RAW_JFUDP_Packet, framenum)
+#define UDP_PAYLOAD_SIZE (sizeof(RAW_JFUDP_Packet) - UDP_PAYLOAD_OFFSET)
+
+#define SEND_BATCH 64
+
+// AF_PACKET TX ring
+#define RING_FRAME_SIZE 16384
+#define RING_BLOCK_SIZE (64 * RING_FRAME_SIZE)
+#define RING_BLOCKS 16
+
+enum output_t {OUTPUT_FILE, OUTPUT_UDP, OUTPUT_RING};
+
+struct GeneratorOptions {
+    output_t output;
+    std::string output_name;
+    std::string image_file_name;
+    std::string loss_log_name;
+    std::string source_address;
+};
+
+static void print_usage(const char *name) {
+    std::cerr << "Usage: " << name << " (-o <file> | -u <IPv4 address> | -i <interface>) [options]" << std::endl
+              << "  -o <file>       write RAW_JFUDP_Packet records to file" << std::endl
+              << "  -u <address>    send UDP datagrams to the address (port = JUNGFRAU destination port)" << std::endl
+              << "  -a <address>    local (odd) IPv4 address for UDP, next address is used for second interface" << std::endl
+              << "  -i <interface>  send Ethernet frames with AF_PACKET TX ring (requires CAP_NET_RAW)" << std::endl
+              << "  -n <modules>    number of modules (default " << NMODULES << ")" << std::endl
+              << "  -N <frames>     number of frames" << std::endl
+              << "  -s <number>     first frame number" << std::endl
+              << "  -F <rate>       frame rate in Hz (default as fast as possible)" << std::endl
+              << "  -x <file>       pixel values (uint16, all modules)" << std::endl
+              << "  -T <number>     frame number of the first trigger" << std::endl
+              << "  -t <frames>     frames between triggers" << std::endl
+              << "  -c <count>      number of triggers" << std::endl
+              << "  -k <number>     bunch ID of the first frame" << std::endl
+              << "  -S <seed>       seed for error injection" << std::endl
+              << "  -l <prob>       packet loss probability" << std::endl
+              << "  -b <packets>    packets lost in a single loss event" << std::endl
+              << "  -d <prob>       packet duplication probability" << std::endl
+              << "  -R <prob>       packet reordering probability" << std::endl
+              << "  -D <packets>    distance of reordered packet" << std::endl
+              << "  -L <file>       log of lost packets (frame module packet)" << std::endl;
+}
+
+static int parse_input(int argc, char **argv, GeneratorOptions &options, PacketGeneratorSettings &settings) {
+    int opt;
+    bool output_set = false;
+
+    while ((opt = getopt(argc, argv, ":o:u:a:i:n:N:s:F:x:T:t:c:k:S:l:b:d:R:D:L:")) != EOF)
+        switch (opt) {
+            case 'o':
+                options.output = OUTPUT_FILE;
+                options.output_name = std::string(optarg);
+                output_set = true;
+                break;
+            case 'u':
+                options.output = OUTPUT_UDP;
+                options.output_name = std::string(optarg);
+                output_set = true;
+                break;
+            case 'a':
+                options.source_address = std::string(optarg);
+                break;
+            case 'i':
+                options.output = OUTPUT_RING;
+                options.output_name = std::string(optarg);
+                output_set = true;
+                break;
+            case 'n':
+                settings.modules = atoi(optarg);
+                break;
+            case 'N':
+                settings.frames = atol(optarg);
+                break;
+            case 's':
+                settings.first_frame_number = atol(optarg);
+                break;
+            case 'F':
+                settings.frame_rate = atof(optarg);
+                if (settings.frame_rate > 0) settings.timestamp_step = 1e7 / settings.frame_rate;
+                break;
+            case 'x':
+                options.image_file_name = std::string(optarg);
+                break;
+            case 'T':
+                settings.trigger_first_frame = atol(optarg);
+                if (settings.triggers == 0) settings.triggers = 1;
+                break;
+            case 't':
+                settings.trigger_period = atol(optarg);
+                break;
+            case 'c':
+                settings.triggers = atol(optarg);
+                break;
+            case 'k':
+                settings.bunch_id_start = strtoull(optarg, NULL, 0);
+                break;
+            case 'S':
+                settings.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'l':
+                settings.loss_probability = atof(optarg);
+                break;
+            case 'b':
+                settings.loss_burst = atoi(optarg);
+                break;
+            case 'd':
+                settings.duplicate_probability = atof(optarg);
+                break;
+            case 'R':
+                settings.reorder_probability = atof(optarg);
+                break;
+            case 'D':
+                settings.reorder_distance = atoi(optarg);
+                break;
+            case 'L':
+                options.loss_log_name = std::string(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+
+    if (!output_set) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if ((settings.modules <= 0) || (settings.frames == 0)) {
+        std::cerr << "Number of modules and frames must be positive" << std::endl;
+        return 1;
+    }
+    if (settings.frame_rate < 0) {
+        std::cerr << "Frame rate cannot be negative" << std::endl;
+        return 1;
+    }
+    if ((settings.loss_burst == 0) || (settings.reorder_distance == 0)) {
+        std::cerr << "Loss burst and reorder distance must be positive" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int load_image(const std::string &file_name, size_t modules, std::vector<uint16_t> &image) {
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Cannot open " << file_name << std::endl;
+        return 1;
+    }
+    image.resize(modules * MODULE_COLS * MODULE_LINES);
+    file.read((char *) image.data(), image.size() * sizeof(uint16_t));
+    if ((size_t) file.gcount() != image.size() * sizeof(uint16_t)) {
+        std::cerr << file_name << " is too small for " << modules << " modules" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int send_to_file(PacketGenerator &generator, const std::string &file_name) {
+    std::ofstream file(file_name, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Cannot open " << file_name << std::endl;
+        return 1;
+    }
+    const char *packet;
+    size_t length;
+    bool error;
+    while (generator.Next(packet, length, error))
+        file.write(packet, length);
+    file.close();
+    if (file.fail()) {
+        std::cerr << "Error writing " << file_name << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int open_udp_socket(const struct in_addr &source_addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        std::cerr << "Cannot open UDP socket " << strerror(errno) << std::endl;
+        return -1;
+    }
+    int buffer_size = 64 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    if (source_addr.s_addr != htonl(INADDR_ANY)) {
+        struct sockaddr_in bind_addr;
+        memset(&bind_addr, 0, sizeof(bind_addr));
+        bind_addr.sin_family = AF_INET;
+        bind_addr.sin_addr = source_addr;
+        if (bind(fd, (struct sockaddr *) &bind_addr, sizeof(bind_addr)) != 0) {
+            std::cerr << "Cannot bind UDP socket to " << inet_ntoa(source_addr) << " " << strerror(errno) << std::endl;
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static int send_batch(int fd, struct mmsghdr *messages, int count) {
+    int sent = 0;
+    while (sent < count) {
+        int ret = sendmmsg(fd, messages + sent, count - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error sending UDP packets " << strerror(errno) << std::endl;
+            return 1;
+        }
+        sent += ret;
+    }
+    return 0;
+}
+
+// Receiver recognizes second half of the module by even source IP address, so packets
+// of the two interfaces are sent from two consecutive local addresses (odd and even)
+static int send_udp(PacketGenerator &generator, const std::string &address, const std::string &source_address) {
+    struct sockaddr_in dest_addr;
+    memset(&dest_addr, 0, sizeof(dest_addr));
+    dest_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, address.c_str(), &dest_addr.sin_addr) != 1) {
+        std::cerr << "Wrong IPv4 address " << address << std::endl;
+        return 1;
+    }
+
+    struct in_addr source_addr[2];
+    source_addr[0].s_addr = htonl(INADDR_ANY);
+    if (!source_address.empty()) {
+        if (inet_pton(AF_INET, source_address.c_str(), &source_addr[0]) != 1) {
+            std::cerr << "Wrong IPv4 address " << source_address << std::endl;
+            return 1;
+        }
+    } else if ((ntohl(dest_addr.sin_addr.s_addr) >> 24) == 127)
+        source_addr[0].s_addr = htonl(INADDR_LOOPBACK);
+    else
+        std::cerr << "Warning: no source address given, receiver will not distinguish module halves" << std::endl;
+
+    if ((source_addr[0].s_addr != htonl(INADDR_ANY)) && (ntohl(source_addr[0].s_addr) % 2 == 0)) {
+        std::cerr << "Source address must be odd" << std::endl;
+        return 1;
+    }
+    if (source_addr[0].s_addr == htonl(INADDR_ANY)) source_addr[1] = source_addr[0];
+    else source_addr[1].s_addr = htonl(ntohl(source_addr[0].s_addr) + 1);
+
+    int fd[2];
+    fd[0] = open_udp_socket(source_addr[0]);
+    if (fd[0] < 0) return 1;
+    fd[1] = open_udp_socket(source_addr[1]);
+    if (fd[1] < 0) {
+        close(fd[0]);
+        return 1;
+    }
+
+    // Generator packets are valid only until next call, so payloads are copied to the batch
+    std::vector<char> payloads(2 * SEND_BATCH * UDP_PAYLOAD_SIZE);
+    struct sockaddr_in addresses[2][SEND_BATCH];
+    struct iovec iov[2][SEND_BATCH];
+    struct mmsghdr messages[2][SEND_BATCH];
+    memset(messages, 0, sizeof(messages));
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < SEND_BATCH; i++) {
+            iov[j][i].iov_base = payloads.data() + (j * SEND_BATCH + i) * UDP_PAYLOAD_SIZE;
+            iov[j][i].iov_len = UDP_PAYLOAD_SIZE;
+            messages[j][i].msg_hdr.msg_iov = &iov[j][i];
+            messages[j][i].msg_hdr.msg_iovlen = 1;
+            messages[j][i].msg_hdr.msg_name = &addresses[j][i];
+            messages[j][i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+    }
+
+    const char *packet;
+    size_t length;
+    bool error;
+    int count[2] = {0, 0};
+    int ret = 0;
+    while ((ret == 0) && generator.Next(packet, length, error)) {
+        const RAW_JFUDP_Packet *jf_packet = (const RAW_JFUDP_Packet *) packet;
+        int j = (ntohl(jf_packet->ipv4_header_sour_ip) % 2 == 0) ? 1 : 0;
+        addresses[j][count[j]] = dest_addr;
+        addresses[j][count[j]].sin_port = jf_packet->udp_dest_port; // already in network byte order
+        memcpy(iov[j][count[j]].iov_base, packet + UDP_PAYLOAD_OFFSET, UDP_PAYLOAD_SIZE);
+        if (++count[j] == SEND_BATCH) {
+            ret = send_batch(fd[j], messages[j], count[j]);
+            count[j] = 0;
+        }
+    }
+    for (int j = 0; (j < 2) && (ret == 0); j++)
+        ret = send_batch(fd[j], messages[j], count[j]);
+
+    close(fd[0]);
+    close(fd[1]);
+    return ret;
+}
+
+static int send_ring(PacketGenerator &generator, const std::string &interface) {
+    int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        std::cerr << "Cannot open AF_PACKET socket " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    int version = TPACKET_V2;
+    struct tpacket_req req;
+    req.tp_block_size = RING_BLOCK_SIZE;
+    req.tp_block_nr = RING_BLOCKS;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCKS;
+
+    struct sockaddr_ll ll_addr;
+    memset(&ll_addr, 0, sizeof(ll_addr));
+    ll_addr.sll_family = AF_PACKET;
+    ll_addr.sll_protocol = htons(ETH_P_ALL);
+    ll_addr.sll_ifindex = if_nametoindex(interface.c_str());
+
+    if ((ll_addr.sll_ifindex == 0) ||
+        (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) ||
+        (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0) ||
+        (bind(fd, (struct sockaddr *) &ll_addr, sizeof(ll_addr)) != 0)) {
+        std::cerr << "Cannot setup TX ring on " << interface << " " << strerror(errno) << std::endl;
+        close(fd);
+        return 1;
+    }
+
+    size_t ring_size = (size_t) req.tp_block_size * req.tp_block_nr;
+    char *ring = (char *) mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        std::cerr << "Cannot map TX ring " << strerror(errno) << std::endl;
+        close(fd);
+        return 1;
+    }
+
+    const char *packet;
+    size_t length;
+    bool error;
+    size_t position = 0;
+    int pending = 0;
+    int ret = 0;
+    while (generator.Next(packet, length, error)) {
+        struct tpacket2_hdr *header = (struct tpacket2_hdr *) (ring + position * RING_FRAME_SIZE);
+        // Wait for kernel to release the slot
+        while (*(volatile uint32_t *) &header->tp_status != TP_STATUS_AVAILABLE) {
+            if ((send(fd, NULL, 0, 0) < 0) && (errno != EAGAIN) && (errno != ENOBUFS)) {
+                std::cerr << "Error sending packets " << strerror(errno) << std::endl;
+                ret = 1;
+                break;
+            }
+            pending = 0;
+        }
+        if (ret) break;
+
+        memcpy((char *) header + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll), packet, length);
+        header->tp_len = length;
+        __sync_synchronize();
+        header->tp_status = TP_STATUS_SEND_REQUEST;
+
+        position = (position + 1) % req.tp_frame_nr;
+        if (++pending == SEND_BATCH) {
+            send(fd, NULL, 0, MSG_DONTWAIT);
+            pending = 0;
+        }
+    }
+    // Flush and wait for the last frames to be sent
+    if (send(fd, NULL, 0, 0) < 0) ret = 1;
+
+    munmap(ring, ring_size);
+    close(fd);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    GeneratorOptions options;
+    PacketGeneratorSettings settings = PacketGenerator::DefaultSettings();
+    if (parse_input(argc, argv, options, settings)) exit(EXIT_FAILURE);
+
+    PacketGenerator generator(settings);
+
+    if (!options.image_file_name.empty()) {
+        std::vector<uint16_t> image;
+        if (load_image(options.image_file_name, settings.modules, image)) exit(EXIT_FAILURE);
+        generator.SetImage(image);
+    }
+
+    std::ofstream loss_log;
+    if (!options.loss_log_name.empty()) {
+        loss_log.open(options.loss_log_name);
+        if (!loss_log.is_open()) {
+            std::cerr << "Cannot open " << options.loss_log_name << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        generator.SetLossLog(&loss_log);
+    }
+
+    std::cout << "Generating " << settings.frames << " frames of " << settings.modules << " modules ("
+              << generator.GetPacketsPerFrame() << " packets/frame)";
+    if (settings.frame_rate > 0) std::cout << " at " << settings.frame_rate << " Hz" << std::endl;
+    else std::cout << " as fast as possible" << std::endl;
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    int ret = 0;
+    switch (options.output) {
+        case OUTPUT_FILE:
+            ret = send_to_file(generator, options.output_name);
+            break;
+        case OUTPUT_UDP:
+            ret = send_udp(generator, options.output_name, options.source_address);
+            break;
+        case OUTPUT_RING:
+            ret = send_ring(generator, options.output_name);
+            break;
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    const PacketGeneratorStatistics &statistics = generator.GetStatistics();
+
+    std::cout << "Packets: " << statistics.generated << " generated, " << statistics.sent << " sent, "
+              << statistics.lost << " lost, " << statistics.duplicated << " duplicated, "
+              << statistics.reordered << " reordered" << std::endl;
+    if (elapsed > 0)
+        std::cout << "Time: " << elapsed << " s, "
+                  << statistics.generated / (double) generator.GetPacketsPerFrame() / elapsed << " frames/s, "
+                  << statistics.sent * sizeof(RAW_JFUDP_Packet) * 8 / elapsed / 1e9 << " Gbit/s" << std::endl;
+
+    if (ret) exit(EXIT_FAILURE);
+    exit(EXIT_SUCCESS);
+}
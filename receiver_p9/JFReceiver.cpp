@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <chrono>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <infiniband/verbs.h>
@@ -22,13 +24,20 @@
 #include <cstring>
 #include <unistd.h>
 
-#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
 #include "JFReceiver.h"
+#include "CopyLine.h"
+#include "SpotFinder.h"
+#include "SpotMerge.h"
+#include "FrameNotifier.h"
+#include "IBSendSlots.h"
+#include "ReplayThread.h"
+#include "EmulatorThread.h"
+#include "../include/HugePageBuffer.h"
 
 int parse_input(int argc, char **argv) {
     int opt;
@@ -44,6 +53,21 @@ int parse_input(int argc, char **argv) {
     receiver_settings.tcp_port = 52320;
     receiver_settings.pedestal_file_name = "pedestal_card0.dat";
     receiver_settings.gpu_device = 0;
+    receiver_settings.detector_card = 0;
+    receiver_settings.replay_directory = "";
+    receiver_settings.replay_frame_rate = 0.0;
+    receiver_settings.emulator_packet_file = "";
+    receiver_settings.udp_address = "";
+    receiver_settings.udp_port = DEFAULT_UDP_PORT;
+    receiver_settings.cpu_spot_finding = false;
+    receiver_settings.run_benchmark = false;
+    receiver_settings.frame_wait_spin_us = 50;
+    receiver_settings.send_task_modules = NMODULES;
+    receiver_settings.send_task_portion = 1;
+    receiver_settings.placement_file_name = "";
+    receiver_settings.memory_budget = DEFAULT_MEMORY_BUDGET;
+    receiver_settings.frame_rate = DEFAULT_FRAME_RATE;
+    receiver_settings.strong_per_fragment = DEFAULT_STRONG_PER_FRAGMENT;
 
     receiver_settings.gain_file_name[0] =
             "/home/jungfrau/JF4M_X06SA_200511/gainMaps_M352_2020-01-31.bin";
@@ -54,7 +78,7 @@ int parse_input(int argc, char **argv) {
     receiver_settings.gain_file_name[3] =
             "/home/jungfrau/JF4M_X06SA_200511/gainMaps_M253_2019-07-29.bin";
 
-    while ((opt = getopt(argc,argv,":C:t:I:P:p:0:1:2:3:G")) != EOF)
+    while ((opt = getopt(argc,argv,":C:t:I:P:p:w:m:g:N:M:F:S:r:f:e:u:0:1:2:3:GBc")) != EOF)
         switch(opt)
         {
             case 'C':
@@ -92,6 +116,81 @@ int parse_input(int argc, char **argv) {
             case 'p':
                 receiver_settings.pedestal_file_name = std::string(optarg);
                 break;
+            case 'B':
+                receiver_settings.run_benchmark = true;
+                break;
+            case 'c':
+                receiver_settings.cpu_spot_finding = true;
+                break;
+            case 'w':
+                receiver_settings.frame_wait_spin_us = atoi(optarg);
+                break;
+            case 'm':
+                receiver_settings.send_task_modules = atoi(optarg);
+                if ((receiver_settings.send_task_modules <= 0) || (NMODULES % receiver_settings.send_task_modules != 0)) {
+                    std::cerr << "Modules per send task must divide number of modules (" << NMODULES << ")" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'g':
+                receiver_settings.send_task_portion = atoi(optarg);
+                if (receiver_settings.send_task_portion <= 0) {
+                    std::cerr << "Send task portion must be positive" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'N':
+                receiver_settings.placement_file_name = std::string(optarg);
+                break;
+            case 'M': {
+                double budget = atof(optarg);
+                if (budget <= 0) {
+                    std::cerr << "Memory budget must be positive" << std::endl;
+                    return 1;
+                }
+                receiver_settings.memory_budget = budget * 1024L * 1024L * 1024L;
+                break;
+            }
+            case 'F':
+                receiver_settings.frame_rate = atof(optarg);
+                if (receiver_settings.frame_rate <= 0) {
+                    std::cerr << "Frame rate must be positive" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'S':
+                receiver_settings.strong_per_fragment = atol(optarg);
+                if (receiver_settings.strong_per_fragment < 1) {
+                    std::cerr << "Number of strong pixels per half image must be at least 1" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'r':
+                receiver_settings.replay_directory = std::string(optarg);
+                break;
+            case 'f':
+                receiver_settings.replay_frame_rate = atof(optarg);
+                if (receiver_settings.replay_frame_rate < 0) {
+                    std::cerr << "Replay frame rate cannot be negative" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'e':
+                receiver_settings.emulator_packet_file = std::string(optarg);
+                break;
+            case 'u': {
+                // address[:port]
+                std::string address(optarg);
+                size_t colon = address.find(':');
+                receiver_settings.udp_address = address.substr(0, colon);
+                if (colon != std::string::npos)
+                    receiver_settings.udp_port = atoi(address.substr(colon + 1).c_str());
+                if (receiver_settings.udp_port % NMODULES != 0) {
+                    std::cerr << "UDP port of module 0 must be multiple of " << NMODULES << std::endl;
+                    return 1;
+                }
+                break;
+            }
             case 0:
                 receiver_settings.gain_file_name[0] = std::string(optarg);
                 break;
@@ -105,37 +204,145 @@ int parse_input(int argc, char **argv) {
                 receiver_settings.gain_file_name[3] = std::string(optarg);
                 break;
         }
+    if (replay_mode() && emulator_mode()) {
+        std::cerr << "Replay and FPGA emulator cannot be used together" << std::endl;
+        return 1;
+    }
+    if (udp_mode() && !receiver_settings.emulator_packet_file.empty()) {
+        std::cerr << "FPGA emulator takes packets either from file or from UDP" << std::endl;
+        return 1;
+    }
     return 0;
 }
 
-int allocate_memory() {
-    // TODO: Put all as const variables declared externally
+// Threads and buffers are placed on NUMA node of the device they mostly work with:
+// FPGA writes frames and status, which are then read by send, watcher and SNAP threads,
+// IB buffer is written by send threads and read by IB card and GPU (via DMA)
+int setup_thread_placement() {
+    int fpga_node = fpga_numa_node(receiver_settings.card_number);
+    int ib_node = ThreadPlacement::GetInfinibandNode(receiver_settings.ib_dev_name);
+    int gpu_node = receiver_settings.cpu_spot_finding ? -1 : gpu_numa_node(receiver_settings.gpu_device);
+
+    thread_placement.AssignRole("send", fpga_node);
+    thread_placement.AssignRole("watcher", fpga_node);
+    thread_placement.AssignRole("snap", fpga_node);
+    thread_placement.AssignRole("frame_buffer", fpga_node);
+    thread_placement.AssignRole("poll_cq", ib_node);
+    thread_placement.AssignRole("ib_buffer", ib_node);
+    thread_placement.AssignRole("gpu", gpu_node);
+    thread_placement.AssignRole("spot_finder", ib_node);
+
+    if (!receiver_settings.placement_file_name.empty() &&
+        thread_placement.LoadConfig(receiver_settings.placement_file_name))
+        return 1;
+
+    std::cout << "FPGA NUMA node " << fpga_node << " IB NUMA node " << ib_node << " GPU NUMA node " << gpu_node << std::endl;
+    thread_placement.Print(std::cout);
+    return 0;
+}
+
+// Job of the FPGA action (or its emulator) for the current collection
+void setup_rx100G_job(rx100G_job_t &job) {
+    job.first_frame_number = 1;
+    job.expected_frames    = experiment_settings.nframes_to_collect;
+    job.pedestalG0_frames  = experiment_settings.pedestalG0_frames;
+
+    job.fpga_mac_addr      = receiver_settings.fpga_mac_addr;   // AA:BB:CC:DD:EE:F1
+    job.fpga_ipv4_addr     = receiver_settings.fpga_ip_addr;    // 10.1.50.5
+    job.expected_triggers  = experiment_settings.ntrigger;
+    job.frames_per_trigger = frames_per_trigger(experiment_settings);
+    job.delay_per_trigger  = std::lround(experiment_settings.shutter_delay / experiment_settings.frame_time_detector);
+    job.mode               = experiment_settings.conversion_mode;
+
+    job.in_gain_pedestal_data_addr = (uint64_t) gain_pedestal_data;
+    job.out_frame_buffer_addr      = (uint64_t) frame_buffer;
+    job.out_frame_status_addr      = (uint64_t) online_statistics;
+    job.out_jf_packet_headers_addr = (uint64_t) jf_packet_headers;
+}
+
+// Ring buffers are sized from memory budget:
+// frame buffer size is fixed by the FPGA, IB buffer (together with GPU output) takes the rest,
+// as number of images per CUDA stream run, up to NIMAGES_PER_STREAM (limited by GPU memory).
+int plan_buffers() {
     frame_buffer_size       = FRAME_BUF_SIZE * NPIXEL * sizeof(int16_t); // can store FRAME_BUF_SIZE frames
     status_buffer_size      = FRAME_LIMIT*NMODULES*128/8+64;   // can store 1 bit per each ETH packet expected
     gain_pedestal_data_size = 7 * 2 * NPIXEL;  // each entry to in_parameters_array is 2 bytes and there are 6 constants per pixel + mask
     jf_packet_headers_size  = FRAME_LIMIT * NMODULES * sizeof(header_info_t);
 
-    // Arrays are allocated with mmap for the higest possible performance. Output is page aligned, so it will be also 64b aligned.
-    frame_buffer       = (int16_t *)  mmap (NULL, frame_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0) ;
-    status_buffer      = (char *) mmap (NULL, status_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-    gain_pedestal_data = (uint16_t *) mmap (NULL, gain_pedestal_data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-    jf_packet_headers  = (header_info_t *) mmap (NULL, jf_packet_headers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-    ib_buffer          = (char *) mmap (NULL, ib_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-    strong_pixel_count = (uint64_t *) malloc(strong_pixel_count_size);
-
-    if ((frame_buffer == NULL) || (status_buffer == NULL) ||
-        (gain_pedestal_data == NULL) || (jf_packet_headers == NULL) ||
-        (ib_buffer == NULL) || (strong_pixel_count == NULL)) {
-        std::cerr << "Memory allocation error" << std::endl;
+    RingBufferPlan plan(receiver_settings.memory_budget);
+    plan.AddRing("frame_buffer", FRAME_BUF_SIZE, NPIXEL * sizeof(int16_t), receiver_settings.frame_rate);
+    plan.AddBuffer("status_buffer", status_buffer_size);
+    plan.AddBuffer("gain_pedestal_data", gain_pedestal_data_size);
+    plan.AddBuffer("jf_packet_headers", jf_packet_headers_size);
+    plan.AddBuffer("strong_pixel_count", strong_pixel_count_size);
+
+    // Kernel is run with 32 threads per block, each thread handles half of image,
+    // so number of images must be multiple of 32 (also for 32-bit images, where there is half of images)
+    // Spot finder output is accounted for GPU (pool with fragment numbers + copy grouped by fragment)
+    size_t spot_finder_output_per_image = 2 * receiver_settings.strong_per_fragment * (2 * sizeof(strong_pixel) + sizeof(uint16_t));
+    size_t cost_per_image = NCUDA_STREAMS * (CUDA_TO_IB_BUFFER * COMPOSED_IMAGE_SIZE * sizeof(int16_t)
+                                             + spot_finder_output_per_image);
+    receiver_settings.images_per_stream = plan.FitElements(cost_per_image, 32, NIMAGES_PER_STREAM);
+    receiver_settings.send_queue_size = NCUDA_STREAMS * CUDA_TO_IB_BUFFER * receiver_settings.images_per_stream;
+    ib_buffer_size = COMPOSED_IMAGE_SIZE * receiver_settings.send_queue_size * sizeof(int16_t);
+
+    plan.AddRing("ib_buffer", receiver_settings.send_queue_size, COMPOSED_IMAGE_SIZE * sizeof(int16_t),
+                 receiver_settings.frame_rate);
+    plan.AddRing("spot_finder_output", NCUDA_STREAMS * receiver_settings.images_per_stream,
+                 spot_finder_output_per_image, receiver_settings.frame_rate);
+
+    plan.Print(std::cout);
+    std::cout << "Images per CUDA stream: " << receiver_settings.images_per_stream
+              << " IB send queue: " << receiver_settings.send_queue_size << std::endl;
+
+    if (receiver_settings.images_per_stream == 0) {
+        std::cerr << "Memory budget too small" << std::endl;
         return 1;
     }
+    return 0;
+}
+
+// Hot buffers are backed by hugepages when available
+static HugePageBuffer frame_buffer_memory;
+static HugePageBuffer status_buffer_memory;
+static HugePageBuffer gain_pedestal_data_memory;
+static HugePageBuffer jf_packet_headers_memory;
+static HugePageBuffer ib_buffer_memory;
 
-    // Fill output arrays with zeros
-    memset(frame_buffer, 0x0, frame_buffer_size);
-    memset(status_buffer, 0x0, status_buffer_size);
-    memset(gain_pedestal_data, 0x0, gain_pedestal_data_size);
-    memset(jf_packet_headers, 0x0, jf_packet_headers_size);
-    memset(ib_buffer, 0x0, ib_buffer_size);
+static int allocate_buffer(HugePageBuffer &buffer, size_t size, const std::string &name) {
+    if (buffer.Allocate(size)) {
+        std::cerr << "Memory allocation error (" << name << ")" << std::endl;
+        return 1;
+    }
+    // Move buffer to the right NUMA node before pages are faulted in
+    // Failure is not critical, it only affects performance
+    thread_placement.PlaceMemory(buffer.Get(), size, name);
+    buffer.Prefault();
+    std::cout << "   " << name << ": " << size / (1024*1024) << " MiB, " << buffer.GetPageSizeString() << " pages" << std::endl;
+    return 0;
+}
+
+int allocate_memory() {
+    // Memory is zeroed by the kernel, so there is no need to clear the buffers.
+    // Pages are faulted in by multiple threads, as it dominates startup time.
+    if (allocate_buffer(frame_buffer_memory, frame_buffer_size, "frame_buffer") ||
+        allocate_buffer(status_buffer_memory, status_buffer_size, "status_buffer") ||
+        allocate_buffer(gain_pedestal_data_memory, gain_pedestal_data_size, "gain_pedestal_data") ||
+        allocate_buffer(jf_packet_headers_memory, jf_packet_headers_size, "jf_packet_headers") ||
+        allocate_buffer(ib_buffer_memory, ib_buffer_size, "ib_buffer"))
+        return 1;
+
+    frame_buffer       = (int16_t *) frame_buffer_memory.Get();
+    status_buffer      = status_buffer_memory.Get();
+    gain_pedestal_data = (uint16_t *) gain_pedestal_data_memory.Get();
+    jf_packet_headers  = (header_info_t *) jf_packet_headers_memory.Get();
+    ib_buffer          = ib_buffer_memory.Get();
+    strong_pixel_count = (uint32_t *) calloc(NCUDA_STREAMS * STRONG_PIXEL_COUNT_PIXELS, sizeof(uint32_t));
+
+    if (strong_pixel_count == NULL) {
+        std::cerr << "Memory allocation error" << std::endl;
+        return 1;
+    }
 
     packet_counter = (char *) (status_buffer + 64);
     online_statistics = (online_statistics_t *) status_buffer;
@@ -144,11 +351,11 @@ int allocate_memory() {
 }
 
 void deallocate_memory() {
-    munmap(frame_buffer, frame_buffer_size);
-    munmap(status_buffer, status_buffer_size);
-    munmap(gain_pedestal_data, gain_pedestal_data_size);
-    munmap(jf_packet_headers, jf_packet_headers_size);
-    munmap(ib_buffer, ib_buffer_size);
+    frame_buffer_memory.Free();
+    status_buffer_memory.Free();
+    gain_pedestal_data_memory.Free();
+    jf_packet_headers_memory.Free();
+    ib_buffer_memory.Free();
 
     free(strong_pixel_count);
 }
@@ -206,18 +413,70 @@ void save_pedestal(std::string fname) {
     }
 }
 
-void update_bad_pixel_list() {
-    bad_pixels.clear();
-    for (int i = 0; i < NPIXEL; i++) {
-        if (gain_pedestal_data[6*NPIXEL+i] != 0) {
-            size_t module = i / (MODULE_LINES * MODULE_COLS);
-            size_t line = (i / MODULE_LINES) % MODULE_COLS;
-            size_t column = i % (MODULE_COLS * MODULE_LINES);
-            uint16_t line_out = (513L - line - (line / 256) * 2L + 514L * (3 - (module / 2))) * 2L + module % 2;
-            uint16_t column_out = column + (column / 256) * 2L;
-            bad_pixels.insert(std::pair<int16_t, int16_t>(column_out, line_out));
+// Pixels strong in more than hot_pixel_fraction of images are marked in the mask plane of gain_pedestal_data,
+// so these are excluded from spot finding in next collections and written by writer to HDF5 pixel_mask.
+// Masked pixels are never strong, so hot pixel marks are only cleared by new pedestal G0.
+void mark_hot_pixels() {
+    uint16_t *pixel_mask = gain_pedestal_data + 6 * NPIXEL;
+
+    if (experiment_settings.conversion_mode == MODE_PEDEG0) {
+        for (size_t i = 0; i < NPIXEL; i++)
+            pixel_mask[i] &= ~(1 << HOT_PIXEL_MASK_BIT);
+        return;
+    }
+
+    if (!experiment_settings.enable_spot_finding || (experiment_settings.hot_pixel_fraction <= 0.0)
+        || (experiment_settings.nimages_to_write < HOT_PIXEL_MIN_IMAGES))
+        return;
+
+    // Merge histograms of spot finding threads into the first one
+    for (size_t i = 1; i < NCUDA_STREAMS; i++) {
+        const uint32_t *thread_count = strong_pixel_count + i * STRONG_PIXEL_COUNT_PIXELS;
+        for (size_t j = 0; j < STRONG_PIXEL_COUNT_PIXELS; j++)
+            strong_pixel_count[j] += thread_count[j];
+    }
+
+    // Module pixel for each pixel of composed image
+    std::vector<uint32_t> module_pixel(geometry_plan.GetComposedPixels());
+    std::vector<uint32_t> pixel_index(NPIXEL);
+    for (size_t i = 0; i < NPIXEL; i++) pixel_index[i] = i;
+    geometry_plan.Transform(module_pixel.data(), pixel_index.data());
+
+    double threshold = experiment_settings.hot_pixel_fraction * experiment_settings.nimages_to_write;
+    size_t hot_pixels = 0;
+    for (size_t i = 0; i < STRONG_PIXEL_COUNT_PIXELS; i++) {
+        uint16_t &mask = pixel_mask[module_pixel[i]];
+        if ((strong_pixel_count[i] > threshold) && !(mask & (1 << HOT_PIXEL_MASK_BIT))) {
+            mask |= 1 << HOT_PIXEL_MASK_BIT;
+            hot_pixels++;
         }
     }
+    std::cout << "Hot pixels marked " << hot_pixels << std::endl;
+}
+
+void update_bad_pixel_list() {
+    // Mask is transformed the same way as images, so coordinates match spot finding
+    std::vector<uint16_t> composed_mask(geometry_plan.GetComposedPixels());
+    geometry_plan.Transform(composed_mask.data(), gain_pedestal_data + 6 * NPIXEL);
+
+    update_spot_finding_mask(spot_finding_mask, composed_mask.data());
+    // Resolution range of the last collection is kept
+    update_spot_finding_resolution(spot_finding_mask, resolution_map, experiment_settings.spot_finding_resolution_limit);
+}
+
+// Resolution map is recalculated only if geometry has changed, resolution range of spot finding is set for every collection
+void update_resolution_range() {
+    if (update_resolution_map(resolution_map, experiment_settings,
+                              detector_geometry.GetCardLineOffset(receiver_settings.detector_card)))
+        std::cout << "Resolution map updated" << std::endl;
+    update_spot_finding_resolution(spot_finding_mask, resolution_map, experiment_settings.spot_finding_resolution_limit);
+    if (!receiver_settings.cpu_spot_finding) upload_gpu_spot_finding_mask();
+
+    size_t tested_pixels = 0;
+    for (size_t line = 0; line < MASK_LINES; line++)
+        tested_pixels += std::max(spot_finding_mask.last_col[line] - spot_finding_mask.first_col[line], 0);
+    std::cout << "Spot finding resolution limit: " << experiment_settings.spot_finding_resolution_limit
+              << " A pixels within range: " << (double) tested_pixels / (double) (MASK_LINES * COLS) * 100.0 << "%" << std::endl;
 }
 
 
@@ -268,29 +527,52 @@ void TCP_close_connection() {
     close(sockfd);
 }
 
-void TCP_exchange_IB_parameters(ib_comm_settings_t *remote) {
+int TCP_receive(int sockfd, char *buffer, size_t size) {
+    size_t remaining_size = size;
+    while (remaining_size > 0) {
+        ssize_t received = read(sockfd, buffer + (size - remaining_size), remaining_size);
+        if (received <= 0) {
+            std::cerr << "Error reading from TCP/IP socket" << std::endl;
+            return 1;
+        }
+        else remaining_size -= received;
+    }
+    return 0;
+}
+
+// Exchange IB parameters and check that buffer sizes of the writer match
+int TCP_exchange_IB_parameters(ib_comm_settings_t *remote) {
     ib_comm_settings_t local;
     local.qp_num = ib_settings.qp->qp_num;
     local.dlid = ib_settings.port_attr.lid;
     local.rq_psn = RDMA_SQ_PSN;
+    local.queue_size = ib_send_queue_images(experiment_settings);
+    local.images_per_stream = cuda_stream_images(experiment_settings);
+    local.modules_per_card = NMODULES;
+    local.ncards = 0;
+    local.card_id = 0;
 
     // Send parameters
     send(accepted_socket, &local, sizeof(ib_comm_settings_t), 0);
 
     // Receive parameters
-    read(accepted_socket, remote, sizeof(ib_comm_settings_t));
-}
+    if (TCP_receive(accepted_socket, (char *) remote, sizeof(ib_comm_settings_t))) return 1;
 
-int TCP_receive(int sockfd, char *buffer, size_t size) {
-    size_t remaining_size = size;
-    while (remaining_size > 0) {
-        ssize_t received = read(sockfd, buffer + (size - remaining_size), remaining_size);
-        if (received <= 0) {
-            std::cerr << "Error reading from TCP/IP socket" << std::endl;
-            return 1;
-        }
-        else remaining_size -= received;
+    // Send queue cannot have more outstanding images than receive queue of the writer
+    if (remote->queue_size < local.queue_size) {
+        std::cerr << "Writer receive queue (" << remote->queue_size << ") smaller than receiver send queue ("
+                  << local.queue_size << ")" << std::endl;
+        return 1;
+    }
+    // Modules per card are fixed by FPGA design, number of cards and position of this card come from the writer
+    if ((remote->modules_per_card != NMODULES) || (remote->ncards == 0) || (remote->card_id >= remote->ncards)) {
+        std::cerr << "Detector geometry of the writer (" << remote->ncards << " cards with " << remote->modules_per_card
+                  << " modules, this card " << remote->card_id << ") not supported by FPGA design with "
+                  << NMODULES << " modules" << std::endl;
+        return 1;
     }
+    detector_geometry = DetectorGeometry(remote->ncards, NMODULES);
+    receiver_settings.detector_card = remote->card_id;
     return 0;
 }
 
@@ -302,30 +584,39 @@ int main(int argc, char **argv) {
     // Parse input parameters
     if (parse_input(argc, argv) == 1) exit(EXIT_FAILURE);
 
-    // Allocate memory
-    if (allocate_memory() == 1) exit(EXIT_FAILURE);
-    std::cout << "Memory allocated" << std::endl;
+    // Select SIMD kernels
+    setup_copy_line_kernels();
+    setup_spot_finder_kernels();
 
-    // Load pedestal file
-    load_pedestal(receiver_settings.pedestal_file_name);
+    // Run micro-benchmarks instead of data collection
+    if (receiver_settings.run_benchmark) return run_benchmark();
 
-    // Load test data
-#ifdef RECEIVE_FROM_FILE
-    std::ifstream ifile1("output_data" + std::to_string(receiver_settings.card_number) + ".dat", std::ios::binary | std::ios::in);
-    ifile1.read((char *) frame_buffer, frame_buffer_size);
-    ifile1.close();
+    // Spot finding on CPU, if requested or there is no GPU
+    if (!receiver_settings.cpu_spot_finding && (gpu_device_count() == 0)) {
+        std::cout << "GPU: no device found" << std::endl;
+        receiver_settings.cpu_spot_finding = true;
+    }
 
-    std::ifstream ifile2("packet_headers" + std::to_string(receiver_settings.card_number) + ".dat", std::ios::binary | std::ios::in);
-    ifile2.read((char *) jf_packet_headers, jf_packet_headers_size);
-    ifile2.close();
+    // Check topology and decide on thread and memory placement
+    if (setup_thread_placement() == 1) exit(EXIT_FAILURE);
 
-    std::ifstream ifile3("status_buffer" + std::to_string(receiver_settings.card_number) + ".dat", std::ios::binary | std::ios::in);
-    ifile3.read((char *) status_buffer, status_buffer_size);
-    ifile3.close();
-#endif
+    // Choose size of ring buffers
+    if (plan_buffers() == 1) exit(EXIT_FAILURE);
+    if (setup_ib_send_slots(receiver_settings.send_queue_size) == 1) exit(EXIT_FAILURE);
+
+    // Allocate memory
+    auto startup_time = std::chrono::steady_clock::now();
+    std::cout << "Allocating memory" << std::endl;
+    if (allocate_memory() == 1) exit(EXIT_FAILURE);
+    std::cout << "Memory allocated in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - startup_time).count() << " s" << std::endl;
+
+    // Load pedestal file (and pixel mask used for spot finding)
+    load_pedestal(receiver_settings.pedestal_file_name);
+    update_bad_pixel_list();
 
     // Establish RDMA link
-    if (setup_ibverbs(ib_settings, receiver_settings.ib_dev_name.c_str(), RDMA_SQ_SIZE, 0) == 1) exit(EXIT_FAILURE);
+    if (setup_ibverbs(ib_settings, receiver_settings.ib_dev_name.c_str(), receiver_settings.send_queue_size, 0) == 1) exit(EXIT_FAILURE);
     std::cout << "IB link ready" << std::endl;
 
     // Register memory regions
@@ -335,16 +626,23 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // Allocate space on GPU
-    if (setup_gpu(receiver_settings.gpu_device) == 1) exit(EXIT_FAILURE);
+    // Allocate space on GPU (or for CPU spot finder)
+    if (receiver_settings.cpu_spot_finding) {
+        if (setup_cpu_spot_finder() == 1) exit(EXIT_FAILURE);
+    } else if (setup_gpu(receiver_settings.gpu_device) == 1) exit(EXIT_FAILURE);
 
     // Establish TCP/IP server
     if (TCP_server(receiver_settings.tcp_port) == 1) exit(EXIT_FAILURE);
 
-#ifndef RECEIVE_FROM_FILE
-    // Connect to FPGA board
-    if (setup_snap(receiver_settings.card_number) == 1) exit(EXIT_FAILURE);
-#endif
+    // Connect to FPGA board, map recorded capture or setup FPGA emulator (with packet file or UDP sockets)
+    if (replay_mode()) {
+        if (setup_replay(receiver_settings.replay_directory, receiver_settings.card_number) == 1) exit(EXIT_FAILURE);
+    } else if (emulator_mode()) {
+        if (setup_emulator() == 1) exit(EXIT_FAILURE);
+    } else if (setup_snap(receiver_settings.card_number) == 1) exit(EXIT_FAILURE);
+    std::cout << "Startup done in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - startup_time).count() << " s" << std::endl;
+
     while (1) {
         // Accept TCP/IP communication
         while (TCP_accept_connection() != 0);
@@ -358,7 +656,10 @@ int main(int argc, char **argv) {
 
         // Exchange IB information
         ib_comm_settings_t remote;
-        TCP_exchange_IB_parameters(&remote);
+        if (TCP_exchange_IB_parameters(&remote)) {
+            close(accepted_socket);
+            continue;
+        }
 
         // Switch to ready to send state for IB
         if (switch_to_rtr(ib_settings, 0, remote.dlid, remote.qp_num) == 1) exit(EXIT_FAILURE);
@@ -368,10 +669,25 @@ int main(int argc, char **argv) {
         std::cout << "Pixel depth " << experiment_settings.pixel_depth << " byte" << std::endl;
         std::cout << "Energy: " << experiment_settings.energy_in_keV << " keV" << std::endl;
         std::cout << "Images to write: " << experiment_settings.nimages_to_write << std::endl;
-        std::cout << "Summation: " << experiment_settings.summation << std::endl;
+        std::cout << "Summation: " << experiment_settings.summation << " stride: " << image_stride(experiment_settings) << std::endl;
         std::cout << "Spot finding enabled: " << experiment_settings.enable_spot_finding << std::endl;
+        if (experiment_settings.enable_spot_finding) {
+            if (!valid_spot_box_size(experiment_settings))
+                std::cerr << "Spot finding box size " << experiment_settings.spot_box_size << " not supported, using "
+                          << DEFAULT_SPOT_BOX_SIZE << "x" << DEFAULT_SPOT_BOX_SIZE << " instead" << std::endl;
+            std::cout << "Spot finding box: " << 2 * spot_box_nb(experiment_settings) + 1 << "x" << 2 * spot_box_nb(experiment_settings) + 1
+                      << " pixel value range: " << strong_pixel_min_value(experiment_settings)
+                      << " - " << strong_pixel_max_value(experiment_settings) << std::endl;
+            update_resolution_range();
+            if (experiment_settings.excluded_ice_rings != 0) {
+                std::cout << "Spots excluded in ice rings:";
+                for (int i = 0; i < ICE_RINGS; i++)
+                    if (experiment_settings.excluded_ice_rings & (1 << i)) std::cout << " " << ice_ring_d[i];
+                std::cout << " A" << std::endl;
+            }
+        }
 
-        memset(ib_buffer_occupancy, 0, RDMA_SQ_SIZE * sizeof(uint16_t));
+        reset_ib_send_slots(ib_send_queue_images(experiment_settings));
 
         for (int i = 0; i < NMODULES; i++)
             online_statistics->head[i] = 0;
@@ -387,6 +703,7 @@ int main(int argc, char **argv) {
 
         pthread_t poll_cq_thread;
         pthread_t snap_thread;
+        pthread_t frame_watcher_thread;
         pthread_t gpu_thread[NCUDA_STREAMS];
         pthread_t send_thread[receiver_settings.compression_threads];
         ThreadArg gpu_thread_arg[NCUDA_STREAMS];
@@ -395,17 +712,28 @@ int main(int argc, char **argv) {
 
         // Reset counter for GPU synchronization
         if (experiment_settings.enable_spot_finding) {
+            reset_spot_merge(experiment_settings.nimages_to_write);
             for (int i = 0; i < NCUDA_STREAMS*CUDA_TO_IB_BUFFER; i++) {
                 writer_threads_done[i] = 0;
                 cuda_stream_ready[i]   = i;
             }
+            void *(*gpu_thread_function)(void *) = run_gpu_thread;
+            if (receiver_settings.cpu_spot_finding) gpu_thread_function = run_cpu_spot_thread;
             for (int i = 0; i < NCUDA_STREAMS; i++) {
                 gpu_thread_arg[i].ThreadID = i;
-                ret = pthread_create(gpu_thread+i, NULL, run_gpu_thread, gpu_thread_arg+i);
+                ret = pthread_create(gpu_thread+i, NULL, gpu_thread_function, gpu_thread_arg+i);
                 PTHREAD_ERROR(ret,pthread_create);
             }
         }
 
+        // Reset work distribution for send threads
+        setup_send_threads();
+
+        // Start thread notifying send threads about arrived frames
+        setup_frame_notifier(receiver_settings.frame_wait_spin_us);
+        ret = pthread_create(&frame_watcher_thread, NULL, run_frame_watcher_thread, NULL);
+        PTHREAD_ERROR(ret,pthread_create);
+
         for (int i = 0; i < receiver_settings.compression_threads ; i++) {
             send_thread_arg[i].ThreadID = i;
             ret = pthread_create(send_thread+i, NULL, run_send_thread, send_thread_arg+i);
@@ -415,18 +743,12 @@ int main(int argc, char **argv) {
         ret = pthread_create(&poll_cq_thread, NULL, run_poll_cq_thread, NULL);
         PTHREAD_ERROR(ret, pthread_create);
 
-        // Just for test - set collected frames to expected
-#ifdef RECEIVE_FROM_FILE
-        for (int i = 0; i < NMODULES; i++)
-              online_statistics->head[i] = experiment_settings.nframes_to_collect - 1;
-           online_statistics->good_packets = NMODULES * 128 * experiment_settings.nframes_to_collect;
-#endif
-
-#ifndef RECEIVE_FROM_FILE
-        // Start SNAP thread
-        ret = pthread_create(&snap_thread, NULL, run_snap_thread, NULL);
+        // Start SNAP thread (or replay of capture/FPGA emulator, which take its role)
+        void *(*snap_thread_function)(void *) = run_snap_thread;
+        if (replay_mode()) snap_thread_function = run_replay_thread;
+        else if (emulator_mode()) snap_thread_function = run_emulator_thread;
+        ret = pthread_create(&snap_thread, NULL, snap_thread_function, NULL);
         PTHREAD_ERROR(ret,pthread_create);
-#endif
 
         // Barrier #2
         TCP_exchange_magic_number();
@@ -437,11 +759,14 @@ int main(int argc, char **argv) {
                 ret = pthread_join(gpu_thread[i], NULL);
                 PTHREAD_ERROR(ret, pthread_join);
             }
+            if (open_merged_spots() > 0)
+                std::cerr << "Spots not merged across chunks: " << open_merged_spots() << std::endl;
         }
 
         // Check for thread completion
         ret = pthread_join(poll_cq_thread, NULL);
         PTHREAD_ERROR(ret, pthread_join);
+        if (replay_mode()) print_replay_statistics();
 
         // Check for sending threads completion
         for	(int i = 0; i <	receiver_settings.compression_threads ; i++) {
@@ -449,31 +774,41 @@ int main(int argc, char **argv) {
             PTHREAD_ERROR(ret,pthread_join);
         }
 
+        // Stop frame watcher
+        stop_frame_notifier();
+        ret = pthread_join(frame_watcher_thread, NULL);
+        PTHREAD_ERROR(ret, pthread_join);
+
         // Check for SNAP thread completion
-#ifndef RECEIVE_FROM_FILE
         ret = pthread_join(snap_thread, NULL);
         PTHREAD_ERROR(ret, pthread_join);
-#endif
+        if (emulator_mode()) print_emulator_statistics();
 
         // Print some quick statistics
         std::cout << "Good packets " << online_statistics->good_packets << " Frames to collect: " << experiment_settings.nframes_to_collect << std::endl;
 
         // For conversion only packets contributing to images are written
         if ((experiment_settings.conversion_mode == MODE_CONV) && (experiment_settings.ntrigger > 0))
-            std::cout << "Images collected " << ((double)(online_statistics->good_packets / NMODULES / 128)) / (double) (experiment_settings.nimages_to_write * experiment_settings.summation) * 100.0 << "%" << std::endl;
+            std::cout << "Images collected " << ((double)(online_statistics->good_packets / NMODULES / 128)) / (double) (experiment_settings.ntrigger * frames_per_trigger(experiment_settings)) * 100.0 << "%" << std::endl;
         else
             std::cout << "Frames collected " << ((double)(online_statistics->good_packets / NMODULES / 128)) / (double) experiment_settings.nframes_to_collect * 100.0 << "%" << std::endl;
 
         std::cout << "First frame collected/written - frame number: " << jf_packet_headers[0].jf_frame_number << " Timestamp " << jf_packet_headers[0].jf_timestamp << std::endl;
         std::cout << "Second frame collected/written - frame number: " << jf_packet_headers[1].jf_frame_number << " Timestamp " << jf_packet_headers[1].jf_timestamp << std::endl;
+        print_frame_wait_histogram();
+        print_send_thread_statistics();
         // Send header data and collection statistics
         send(accepted_socket, online_statistics, sizeof(online_statistics_t), 0);
+        // Hot pixels found in this collection are added to pixel mask
+        mark_hot_pixels();
+
         // Send gain, pedestal and pixel mask
         send(accepted_socket, gain_pedestal_data, 7*NPIXEL*sizeof(uint16_t), 0);
 
         // Update bad pixel pixel list for spot finding;
         update_bad_pixel_list();
-        std::cout << "Bad pixel count " << bad_pixels.size() << std::endl;
+        if (!receiver_settings.cpu_spot_finding) upload_gpu_spot_finding_mask();
+        std::cout << "Bad pixel count " << spot_finding_mask.count << std::endl;
 
         // Reset QP
         switch_to_reset(ib_settings);
@@ -511,12 +846,13 @@ int main(int argc, char **argv) {
         memset(strong_pixel_count, 0x0, strong_pixel_count_size);
     }
 
-#ifndef RECEIVE_FROM_FILE
     // Close SNAP
-    close_snap();
-#endif
+    if (replay_mode()) close_replay();
+    else if (emulator_mode()) close_emulator();
+    else close_snap();
     // Close GPU
-    close_gpu();
+    if (receiver_settings.cpu_spot_finding) close_cpu_spot_finder();
+    else close_gpu();
 
     // Save pedestal
     save_pedestal(receiver_settings.pedestal_file_name);
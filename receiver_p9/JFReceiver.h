@@ -17,11 +17,15 @@
 #ifndef _JFRECEIVER_H
 #define _JFRECEIVER_H
 
+#include <cstdint>
 #include <vector>
-#include <set>
 #include <map>
 
 #include "../include/JFApp.h"
+#include "../include/GeometryPlan.h"
+#include "../include/DetectorGeometry.h"
+#include "../include/ThreadPlacement.h"
+#include "../include/RingBufferPlan.h"
 #define FRAME_LIMIT 1000000L
 
 #define RECEIVING_DELAY 5
@@ -34,16 +38,27 @@
 #define CUDA_TO_IB_BUFFER 2L // How much larger is IB buffer as compared to CUDA
 
 #define RDMA_SQ_PSN 532
-#define RDMA_SQ_SIZE (NCUDA_STREAMS*CUDA_TO_IB_BUFFER*NIMAGES_PER_STREAM) // 3840, size of send queue, must be multiplier of frames per CUDA stream
+// Size of send queue is NCUDA_STREAMS*CUDA_TO_IB_BUFFER*images per CUDA stream, it is chosen at startup (see plan_buffers)
+#define IB_SEND_BATCH 8 // Maximum number of images posted together by a send thread, only the last one is signaled
+#define IB_CQ_BATCH 16  // Maximum number of completions handled by a single poll
 
-// Maximum number of strong pixel in 2 veritcal modules
-// if there are more pixels, these will be overwritten
-// in ring buffer fashion
-#define MAX_STRONG 16384L
+// Default number of strong pixels reserved per 2 vertical modules in output of spot finder.
+// Output is shared by all fragments of a chunk, so a single fragment can have more,
+// if there are more pixels in the chunk, these are lost and reported to writer
+#define DEFAULT_STRONG_PER_FRAGMENT 1024L
 
-// Size of bounding box for pixel
-#define NBX 3
-#define NBY 3
+// Defaults for buffer sizing
+#define DEFAULT_MEMORY_BUDGET (96L*1024*1024*1024) // bytes
+#define DEFAULT_FRAME_RATE    2200.0               // Hz, JUNGFRAU full speed
+
+// UDP port of module 0 for software receive (-u), same as used by JFGenerator
+#define DEFAULT_UDP_PORT 0xC0CC
+
+// Size of bounding box for pixel is (2*NBX+1) x (2*NBY+1), with NBX = NBY = 1 ... MAX_SPOT_BOX_NB,
+// so square box 3x3 up to 11x11 is selected for each collection (experiment_settings.spot_box_size).
+// Spot finding kernels are compiled for each box size, NBX and NBY are template parameters.
+#define MAX_SPOT_BOX_NB 5
+#define DEFAULT_SPOT_BOX_SIZE 7
 
 // TODO - this should be in common header
 #define COLS (2*1030L)
@@ -62,26 +77,141 @@ struct receiver_settings_t {
 	std::string pedestal_file_name;
 	std::string ib_dev_name;
         int gpu_device;
+	bool     run_benchmark;
+	uint32_t frame_wait_spin_us; // spin time of send threads before sleeping while waiting for frame
+	int      send_task_modules;  // modules per send task (1 ... NMODULES)
+	int      send_task_portion;  // send tasks taken by a thread at once
+	std::string placement_file_name; // overrides of thread/memory placement, empty = automatic only
+	size_t   memory_budget;      // RAM for large buffers (bytes)
+	double   frame_rate;         // expected frame rate (Hz), used to report backlog of rings
+	size_t   strong_per_fragment; // strong pixels reserved in spot finder output per half of image
+	size_t   images_per_stream;  // 16-bit images per CUDA stream run (half for 32-bit), chosen from memory budget
+	size_t   send_queue_size;    // 16-bit images in IB buffer and RDMA send queue (half for 32-bit)
+	size_t   detector_card;      // position of the card in the detector, reported by writer
+	std::string replay_directory; // recorded capture replayed instead of FPGA, empty = use FPGA
+	double   replay_frame_rate;  // frame rate of replay or FPGA emulator (Hz), 0 = as fast as possible
+	std::string emulator_packet_file; // JUNGFRAU packets processed by FPGA emulator, empty = use FPGA
+	std::string udp_address;     // JUNGFRAU packets received on network interface with this IPv4 address
+	                             // and processed by FPGA emulator, empty = use FPGA
+	uint16_t udp_port;           // UDP port of module 0, module N uses port + N
+	bool     cpu_spot_finding;   // spot finding on CPU instead of GPU (also chosen, if there is no GPU)
 };
 extern receiver_settings_t receiver_settings;
 
+// Images per CUDA stream run and IB buffer slots adjusted for pixel depth of the current collection
+inline size_t cuda_stream_images(const experiment_settings_t &settings) {
+	return receiver_settings.images_per_stream * 2 / settings.pixel_depth;
+}
+
+// Kernels exist only for odd box sizes from 3x3 to (2*MAX_SPOT_BOX_NB+1)x(2*MAX_SPOT_BOX_NB+1)
+inline bool valid_spot_box_size(const experiment_settings_t &settings) {
+	int nb = settings.spot_box_size / 2;
+	return (settings.spot_box_size % 2 != 0) && (nb >= 1) && (nb <= MAX_SPOT_BOX_NB);
+}
+
+// Half size of spot finding box (NBX = NBY), default box is used for invalid size (reported at collection start)
+inline int spot_box_nb(const experiment_settings_t &settings) {
+	if (!valid_spot_box_size(settings))
+		return DEFAULT_SPOT_BOX_SIZE / 2;
+	return settings.spot_box_size / 2;
+}
+
+inline int32_t spot_box_pixels(const experiment_settings_t &settings) {
+	return (2 * spot_box_nb(settings) + 1) * (2 * spot_box_nb(settings) + 1);
+}
+
+// Strong pixel must be above zero (and above minimum value if given)
+inline int32_t strong_pixel_min_value(const experiment_settings_t &settings) {
+	return (settings.spot_min_pixel_value > 1) ? settings.spot_min_pixel_value : 1;
+}
+
+// Pixels above maximum value (saturated) are never strong, 0 = no limit
+inline int32_t strong_pixel_max_value(const experiment_settings_t &settings) {
+	return (settings.spot_max_pixel_value > 0) ? settings.spot_max_pixel_value : INT32_MAX;
+}
+
+inline size_t ib_send_queue_images(const experiment_settings_t &settings) {
+	return receiver_settings.send_queue_size * 2 / settings.pixel_depth;
+}
+
+// Frames come from recorded capture instead of FPGA
+inline bool replay_mode() {
+	return !receiver_settings.replay_directory.empty();
+}
+
+// Packets come from UDP sockets instead of FPGA
+inline bool udp_mode() {
+	return !receiver_settings.udp_address.empty();
+}
+
+// Frames come from software model of the FPGA action
+inline bool emulator_mode() {
+	return !receiver_settings.emulator_packet_file.empty() || udp_mode();
+}
+
 // Definition of strong pixel
 struct strong_pixel {
     int16_t col;           // column
     int16_t line;          // line (relative to chunk (2x vertical modules) read by GPU)
-    float photons;      // intensity of the pixel divide by (2*NBX+1) * (2*NBY+1) to get background subtracted photon count
+    float photons;      // intensity of the pixel divide by box size in pixels to get background subtracted photon count
 };
 
 typedef std::pair<int16_t, int16_t> coordxy_t; // This is simply (x, y)
-typedef std::map<coordxy_t, float> strong_pixel_map_t;
-// This is mapping (x,y) --> intensity
-// it allows to find if there is spot in (x,y) in log time
-typedef std::vector<strong_pixel_map_t> strong_pixel_maps_t;
-// There is one map per 1/2 frame
 
-extern uint64_t *strong_pixel_count;
+// Strong pixels of one chunk - fragments are stored one after another in a shared pool,
+// fragment i is in pixels [offset[i], offset[i+1]); found[i] above that count means
+// that the pool was full and the remaining strong pixels of the fragment were lost
+struct strong_pixel_output_t {
+    std::vector<strong_pixel> pixels; // size is fixed at setup (pool size)
+    std::vector<uint32_t> offset;     // fragments + 1
+    std::vector<uint32_t> found;      // fragments
+};
+
+// Pixel mask for spot finding - one bit per pixel of composed image of the card (the same as strong_pixel_count).
+// Bitmap is used directly by spot finding kernels (CPU and GPU): masked pixels are excluded from box statistics
+// and are never strong. Each line is padded, so that 64 bits can be read starting from any column.
+#define MASK_LINES ((NMODULES/2) * LINES)
+#define MASK_WORDS_PER_LINE (COLS / 32 + 2)
+#define MASK_BIT(rows, line, col) (((rows)[(line) * MASK_WORDS_PER_LINE + (col) / 32] >> ((col) % 32)) & 1)
+
+// Minimum number of unmasked pixels in the box to test pixel for being strong
+#define MIN_UNMASKED_BOX_PIXELS(box_pixels) (((box_pixels) + 1) / 2)
+
+struct spot_finding_mask_t {
+    uint32_t masked[MASK_LINES * MASK_WORDS_PER_LINE];     // pixel is excluded
+    uint32_t incomplete[MAX_SPOT_BOX_NB][MASK_LINES * MASK_WORDS_PER_LINE]; // box around the pixel contains masked pixel (per NBX - 1)
+    bool     line_masked[MASK_LINES];                      // line contains masked pixel
+    size_t   count;                                        // number of masked pixels
+    int16_t  first_col[MASK_LINES];                        // only pixels in [first_col, last_col) of the line are tested,
+    int16_t  last_col[MASK_LINES];                         // rest is outside of resolution range (see resolution_map_t)
+};
+
+extern spot_finding_mask_t spot_finding_mask;
+
+// Resolution (d-spacing in Angstrom) of each pixel of composed image of the card (the same layout as strong_pixel_count).
+// Map is calculated only, if geometry changes between collections. As resolution limit is a circle around the beam center,
+// accepted pixels (d above the limit) of each line are a single range of columns, which is put in spot_finding_mask_t.
+struct resolution_map_t {
+    float    d[MASK_LINES * COLS];
+    bool     valid;
+    double   beam_x;            // geometry used to calculate the map
+    double   beam_y;
+    double   detector_distance;
+    double   energy_in_keV;
+    int64_t  line_offset;       // first line of the card in the detector
+};
+
+extern resolution_map_t resolution_map;
+
+// Number of images, in which pixel of composed image was strong - one histogram per spot finding thread,
+// so threads don't need to synchronize; histograms are merged, once collection is finished
+#define STRONG_PIXEL_COUNT_PIXELS (MASK_LINES * COLS)
+
+// Hot pixels are only identified, if enough images were analyzed
+#define HOT_PIXEL_MIN_IMAGES 100
+
+extern uint32_t *strong_pixel_count;
 extern const size_t strong_pixel_count_size;
-extern pthread_mutex_t strong_pixel_count_mutex;
 
 // Buffers for communication with the FPGA
 extern int16_t *frame_buffer;
@@ -101,7 +231,7 @@ extern header_info_t *jf_packet_headers;
 extern ib_settings_t ib_settings;
 
 // IB buffer
-extern const size_t ib_buffer_size;
+extern size_t ib_buffer_size;
 extern char *ib_buffer;
 
 // TCP/IP socket
@@ -109,6 +239,16 @@ extern int sockfd;
 extern int accepted_socket; // There is only one accepted socket at the time
 extern pthread_mutex_t accepted_socket_mutex; // For sending spot finding results, mutex is necessary to ensure data consistency on accepted_socket
 
+// Utilisation of send threads
+struct send_thread_statistics_t {
+	uint64_t tasks;       // tasks (parts of image) done
+	uint64_t images_sent; // images completed and posted by the thread
+	double   busy_time;   // in seconds
+	double   wait_time;   // waiting for frames, IB buffer or GPU (seconds)
+	send_thread_statistics_t() : tasks(0), images_sent(0), busy_time(0), wait_time(0) {}
+};
+extern std::vector<send_thread_statistics_t> send_thread_statistics;
+
 // Thread information
 struct ThreadArg {
 	uint16_t ThreadID;
@@ -120,33 +260,66 @@ extern uint32_t trigger_frame;
 extern pthread_mutex_t trigger_frame_mutex; 
 extern pthread_cond_t  trigger_frame_cond;
 
-// IB buffer usage
-extern int16_t ib_buffer_occupancy[RDMA_SQ_SIZE];
-extern pthread_mutex_t ib_buffer_occupancy_mutex;
-extern pthread_cond_t ib_buffer_occupancy_cond;
-
 int setup_snap(uint32_t card_number);
 void close_snap();
+int fpga_numa_node(uint32_t card_number);
 
+void setup_rx100G_job(rx100G_job_t &job); // FPGA job for the current collection
 void *run_snap_thread(void *in_threadarg);
 void *run_poll_cq_thread(void *in_threadarg);
+uint64_t ib_sent_images(); // images with completed IB send in the current collection
 void *run_send_thread(void *in_threadarg);
+void setup_send_threads();
+void print_send_thread_statistics();
 void *run_gpu_thread(void *in_threadarg);
 
 int parse_input(int argc, char **argv);
+int plan_buffers();
+
+int run_benchmark();
 
 int setup_gpu(int device); 
 int close_gpu();
+int gpu_numa_node(int device);
+int gpu_device_count();
+
+// Spot finding mask - built from mask plane of gain_pedestal_data, copied to GPU
+void update_spot_finding_mask(spot_finding_mask_t &mask, const uint16_t *composed_mask);
+// Resolution map - returns true, if geometry has changed and the map was recalculated
+bool update_resolution_map(resolution_map_t &map, const experiment_settings_t &settings, int64_t line_offset);
+// Range of columns to test in each line, pixels with resolution d <= resolution_limit are skipped (limit <= 0 - all pixels)
+void update_spot_finding_resolution(spot_finding_mask_t &mask, const resolution_map_t &map, double resolution_limit);
+int upload_gpu_spot_finding_mask();
+
+// Spot finding on CPU, replaces GPU threads
+int setup_cpu_spot_finder();
+void close_cpu_spot_finder();
+void *run_cpu_spot_thread(void *in_threadarg);
+
+// Placement of threads and buffers on NUMA nodes of FPGA, IB and GPU
+extern ThreadPlacement thread_placement;
+int setup_thread_placement();
 
 extern pthread_mutex_t cuda_stream_ready_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 extern pthread_cond_t  cuda_stream_ready_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 extern int cuda_stream_ready[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 
+// Number of images written to IB buffer for given chunk
 extern pthread_mutex_t writer_threads_done_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 extern pthread_cond_t writer_threads_done_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 extern int writer_threads_done[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 
-extern std::set<std::pair<int16_t, int16_t> > bad_pixels;
-void analyze_spots(strong_pixel *host_out, std::vector<spot_t> &spots, bool connect_frames, size_t images, size_t image0);
+// Mapping of modules into composed image
+extern const GeometryPlan geometry_plan;
+extern DetectorGeometry detector_geometry; // whole detector, number of cards is reported by writer
+
+void allocate_strong_pixel_output(strong_pixel_output_t &output, size_t fragments, size_t pool_size);
+void group_strong_pixels(const strong_pixel *pool, const uint16_t *pool_fragment, size_t pool_used,
+                         const uint32_t *found, size_t fragments, strong_pixel_output_t &output);
+spot_finding_overflow_t strong_pixel_overflow(const strong_pixel_output_t &output, size_t fragments);
+void analyze_spots(const strong_pixel_output_t &output, uint32_t *pixel_count, std::vector<spot_t> &spots,
+                   std::vector<image_spot_count_t> &image_counts, bool connect_frames, size_t images, size_t image0);
+void send_spots(const std::vector<spot_t> &spots, const spot_finding_overflow_t &overflow,
+                const std::vector<image_spot_count_t> &image_counts, size_t chunk);
 
 #endif
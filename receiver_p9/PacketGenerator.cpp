@@ -0,0 +1,252 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <thread>
+
+#include <arpa/inet.h>
+
+#include "PacketGenerator.h"
+
+#define JF_HEADER_SIZE 48
+#define UDP_HEADER_SIZE 8
+#define IPV4_HEADER_SIZE 20
+#define ETHER_HEADER_SIZE 14
+
+static void put_mac_addr(char *out, uint64_t mac) {
+    for (int i = 0; i < 6; i++)
+        out[i] = (mac >> (8 * (5 - i))) & 0xFF;
+}
+
+// RFC 1071 checksum over IPv4 header (in network byte order)
+static uint16_t ipv4_checksum(const RAW_JFUDP_Packet &packet) {
+    const uint8_t *header = (const uint8_t *) &packet + ETHER_HEADER_SIZE;
+    uint32_t sum = 0;
+    for (int i = 0; i < IPV4_HEADER_SIZE; i += 2)
+        sum += (header[i] << 8) | header[i + 1];
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return htons(~sum & 0xFFFF);
+}
+
+PacketGeneratorSettings PacketGenerator::DefaultSettings() {
+    PacketGeneratorSettings ret;
+    ret.modules = NMODULES;
+    ret.first_frame_number = 1;
+    ret.frames = 1000;
+    ret.frame_rate = 0.0;
+
+    ret.dest_mac_addr = 0xAABBCCDDEEF1;   // AA:BB:CC:DD:EE:F1
+    ret.dest_ipv4_addr = 0x0A013205;      // 10.1.50.5
+    ret.dest_udp_port = 0xC0CC;
+    ret.source_mac_addr = 0x001B21000001;
+    ret.source_ipv4_addr = 0x0A013265;    // 10.1.50.101
+    ret.source_udp_port = 0xDFAC;
+
+    ret.exptime = 100;                    // 10 us
+    ret.bunch_id_start = 0;
+    ret.bunch_id_step = 1;
+    ret.timestamp_start = 0;
+    ret.timestamp_step = 5000;            // 2 kHz
+
+    ret.trigger_first_frame = 0;
+    ret.trigger_period = 0;
+    ret.triggers = 0;
+
+    ret.seed = 0;
+    ret.loss_probability = 0.0;
+    ret.loss_burst = 1;
+    ret.duplicate_probability = 0.0;
+    ret.reorder_probability = 0.0;
+    ret.reorder_distance = 1;
+    return ret;
+}
+
+PacketGenerator::PacketGenerator(const PacketGeneratorSettings &in_settings) :
+        settings(in_settings), templates(in_settings.modules * GENERATOR_PACKETS_PER_MODULE), loss_log(NULL) {
+    for (size_t module = 0; module < settings.modules; module++) {
+        for (int eth_packet = 0; eth_packet < GENERATOR_PACKETS_PER_MODULE; eth_packet++) {
+            RAW_JFUDP_Packet &packet = templates[module * GENERATOR_PACKETS_PER_MODULE + eth_packet];
+            memset(&packet, 0, sizeof(RAW_JFUDP_Packet));
+
+            size_t card = module / NMODULES;
+            uint32_t interface = module * 2 + eth_packet / GENERATOR_PACKETS_PER_INTERFACE;
+
+            put_mac_addr(packet.dest_mac, settings.dest_mac_addr + card);
+            put_mac_addr(packet.sour_mac, settings.source_mac_addr + interface);
+            packet.ether_type = htons(0x0800);
+
+            packet.ipv4_header_h = htons(0x4500); // IPv4, header length 20 bytes
+            packet.ipv4_header_total_length = htons(IPV4_HEADER_SIZE + UDP_HEADER_SIZE + JF_HEADER_SIZE + 8192);
+            packet.ipv4_header_flags_frag = htons(0x4000); // Don't fragment
+            packet.ipv4_header_ttl_protocol = htons(0x4011); // TTL 64, UDP
+            packet.ipv4_header_sour_ip = htonl(settings.source_ipv4_addr + interface);
+            packet.ipv4_header_dest_ip = htonl(settings.dest_ipv4_addr + card);
+            packet.ipv4_header_checksum = ipv4_checksum(packet);
+
+            packet.udp_sour_port = htons(settings.source_udp_port + interface);
+            packet.udp_dest_port = htons(settings.dest_udp_port + module);
+            packet.udp_length = htons(UDP_HEADER_SIZE + JF_HEADER_SIZE + 8192);
+
+            packet.exptime = settings.exptime;
+            packet.packetnum = eth_packet % GENERATOR_PACKETS_PER_INTERFACE;
+            packet.moduleID = module;
+            packet.xCoord = module;
+            packet.yCoord = eth_packet / GENERATOR_PACKETS_PER_INTERFACE;
+            packet.detectortype = 3;  // JUNGFRAU
+            packet.headerVersion = 2;
+
+            for (int i = 0; i < 4096; i++)
+                packet.data[i] = 3000 + (i * 7 + eth_packet * 13 + module * 31) % 64;
+        }
+    }
+    Rewind();
+}
+
+void PacketGenerator::SetImage(const std::vector<uint16_t> &image) {
+    for (size_t module = 0; module < settings.modules; module++) {
+        for (int eth_packet = 0; eth_packet < GENERATOR_PACKETS_PER_MODULE; eth_packet++) {
+            size_t offset = module * MODULE_COLS * MODULE_LINES + eth_packet * 4096;
+            if (offset + 4096 <= image.size())
+                memcpy(templates[module * GENERATOR_PACKETS_PER_MODULE + eth_packet].data, image.data() + offset, 8192);
+        }
+    }
+}
+
+void PacketGenerator::SetLossLog(std::ostream *out) {
+    loss_log = out;
+}
+
+void PacketGenerator::Rewind() {
+    memset(&statistics, 0, sizeof(PacketGeneratorStatistics));
+    random_engine.seed(settings.seed);
+    held_packets.clear();
+    frame = 0;
+    packet = 0;
+    burst_remaining = 0;
+    duplicate = NULL;
+}
+
+size_t PacketGenerator::GetPacketsPerFrame() const {
+    return templates.size();
+}
+
+const PacketGeneratorStatistics &PacketGenerator::GetStatistics() const {
+    return statistics;
+}
+
+// Uniform in [0,1), the same on all platforms for given seed
+double PacketGenerator::Random() {
+    return (random_engine() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Within a frame, packet n of all interfaces is sent before packet n+1
+RAW_JFUDP_Packet &PacketGenerator::GetTemplate(size_t in_packet) {
+    size_t interfaces = settings.modules * 2;
+    size_t interface = in_packet % interfaces;
+    size_t interface_packet = in_packet / interfaces;
+    return templates[(interface / 2) * GENERATOR_PACKETS_PER_MODULE
+                     + (interface % 2) * GENERATOR_PACKETS_PER_INTERFACE + interface_packet];
+}
+
+bool PacketGenerator::Next(const char *&out_packet, size_t &length, bool &error) {
+    length = sizeof(RAW_JFUDP_Packet);
+    error = false;
+
+    if (duplicate != NULL) {
+        out_packet = (const char *) duplicate;
+        duplicate = NULL;
+        statistics.sent++;
+        return true;
+    }
+
+    if (!held_packets.empty() && (held_packets.front().release <= statistics.sent)) {
+        output = held_packets.front().packet;
+        held_packets.pop_front();
+        out_packet = (const char *) &output;
+        statistics.sent++;
+        return true;
+    }
+
+    while (frame < settings.frames) {
+        if (packet == 0) {
+            if (frame == 0)
+                start = std::chrono::steady_clock::now();
+            else if (settings.frame_rate > 0)
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(frame / settings.frame_rate)));
+        }
+
+        uint64_t frame_number = settings.first_frame_number + frame;
+        RAW_JFUDP_Packet &jf_packet = GetTemplate(packet);
+        jf_packet.framenum = frame_number;
+        jf_packet.bunchid = settings.bunch_id_start + frame * settings.bunch_id_step;
+        jf_packet.timestamp = settings.timestamp_start + frame * settings.timestamp_step;
+        jf_packet.debug = 0;
+        if ((settings.triggers > 0) && (frame_number >= settings.trigger_first_frame)) {
+            uint64_t delta = frame_number - settings.trigger_first_frame;
+            if ((delta == 0) || ((settings.trigger_period > 0) && (delta % settings.trigger_period == 0)
+                                 && (delta / settings.trigger_period < settings.triggers)))
+                jf_packet.debug = 1u << 31;
+        }
+
+        packet++;
+        if (packet == templates.size()) {
+            packet = 0;
+            frame++;
+        }
+        statistics.generated++;
+
+        if ((burst_remaining == 0) && (settings.loss_probability > 0) && (Random() < settings.loss_probability))
+            burst_remaining = settings.loss_burst;
+        if (burst_remaining > 0) {
+            burst_remaining--;
+            statistics.lost++;
+            if (loss_log != NULL)
+                *loss_log << jf_packet.framenum << " " << jf_packet.moduleID << " "
+                          << jf_packet.yCoord * GENERATOR_PACKETS_PER_INTERFACE + jf_packet.packetnum << std::endl;
+            continue;
+        }
+
+        if ((settings.reorder_probability > 0) && (Random() < settings.reorder_probability)) {
+            HeldPacket held;
+            held.release = statistics.sent + settings.reorder_distance;
+            held.packet = jf_packet;
+            held_packets.push_back(held);
+            statistics.reordered++;
+            continue;
+        }
+
+        if ((settings.duplicate_probability > 0) && (Random() < settings.duplicate_probability)) {
+            duplicate = &jf_packet;
+            statistics.duplicated++;
+        }
+
+        out_packet = (const char *) &jf_packet;
+        statistics.sent++;
+        return true;
+    }
+
+    // Packets delayed past the last frame
+    if (!held_packets.empty()) {
+        output = held_packets.front().packet;
+        held_packets.pop_front();
+        out_packet = (const char *) &output;
+        statistics.sent++;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PACKETGENERATOR_H
+#define _PACKETGENERATOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../include/action_rx100G.h"
+#include "FPGAEmulator.h"
+
+// Each module sends 128 packets per frame over two 10G interfaces (64 packets each).
+#define GENERATOR_PACKETS_PER_MODULE 128
+#define GENERATOR_PACKETS_PER_INTERFACE 64
+
+struct PacketGeneratorSettings {
+    size_t   modules;              // NMODULES per card, more modules are spread over consecutive cards
+    uint64_t first_frame_number;
+    uint64_t frames;
+    double   frame_rate;           // Hz, 0 = as fast as possible
+
+    uint64_t dest_mac_addr;        // card 0, card N gets address + N
+    uint32_t dest_ipv4_addr;       // card 0, card N gets address + N
+    uint16_t dest_udp_port;        // module 0, module N gets port + N
+    uint64_t source_mac_addr;      // interface 0 of module 0, consecutive for other interfaces
+    uint32_t source_ipv4_addr;     // must be odd - receiver recognizes second interface by even IP
+    uint16_t source_udp_port;
+
+    uint32_t exptime;              // x 1e-7 s
+    uint64_t bunch_id_start;
+    uint64_t bunch_id_step;
+    uint64_t timestamp_start;      // 10 MHz clock
+    uint64_t timestamp_step;
+
+    uint64_t trigger_first_frame;  // frame number with the first trigger bit
+    uint64_t trigger_period;       // frames between triggers
+    uint64_t triggers;             // number of frames with trigger bit, 0 = none
+
+    // Injected errors are drawn from a pseudo-random generator with fixed seed,
+    // so the same settings always give the same packet stream
+    uint64_t seed;
+    double   loss_probability;     // probability that loss burst starts at a given packet
+    uint32_t loss_burst;           // consecutive packets lost in a burst
+    double   duplicate_probability;
+    double   reorder_probability;  // packet is delayed ...
+    uint32_t reorder_distance;     // ... by this number of packets
+};
+
+struct PacketGeneratorStatistics {
+    uint64_t generated;    // packets of the JUNGFRAU frames
+    uint64_t sent;         // packets returned by Next(), including duplicates
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t reordered;
+};
+
+// Generates stream of RAW_JFUDP_Packet, as sent by JUNGFRAU detector to the receiver.
+// Ethernet, IPv4 and UDP headers are in network byte order with valid IPv4 checksum (UDP checksum is not used),
+// JUNGFRAU header is little endian. Packets of one frame are interleaved between modules and interfaces,
+// as they come from the switch. Pixel values are constant from frame to frame.
+class PacketGenerator : public PacketSource {
+    PacketGeneratorSettings settings;
+    PacketGeneratorStatistics statistics;
+
+    // Packets are prepared in advance, only JUNGFRAU header is updated for each frame
+    std::vector<RAW_JFUDP_Packet> templates;
+
+    struct HeldPacket {
+        uint64_t release;  // sent after this number of packets was sent
+        RAW_JFUDP_Packet packet;
+    };
+    std::deque<HeldPacket> held_packets;
+    RAW_JFUDP_Packet output;
+
+    std::mt19937_64 random_engine;
+    uint64_t frame;          // frames since start
+    size_t   packet;         // packet of the current frame
+    uint32_t burst_remaining;
+    const RAW_JFUDP_Packet *duplicate;
+    std::ostream *loss_log;
+    std::chrono::steady_clock::time_point start;
+
+    double Random();
+    void SetFrame(uint64_t frame);
+    RAW_JFUDP_Packet &GetTemplate(size_t packet);
+
+    PacketGenerator(const PacketGenerator &other) = delete;
+    PacketGenerator &operator=(const PacketGenerator &other) = delete;
+public:
+    explicit PacketGenerator(const PacketGeneratorSettings &settings);
+
+    // Pixel values for all modules, by default pattern similar to pedestal in G0
+    void SetImage(const std::vector<uint16_t> &image);
+    // Frame, module and packet number of each lost packet are written to the stream
+    void SetLossLog(std::ostream *out);
+    // Start again from the first frame, with the same sequence of injected errors
+    void Rewind();
+
+    size_t GetPacketsPerFrame() const;
+    const PacketGeneratorStatistics &GetStatistics() const;
+
+    bool Next(const char *&packet, size_t &length, bool &error) override;
+
+    static PacketGeneratorSettings DefaultSettings();
+};
+
+#endif
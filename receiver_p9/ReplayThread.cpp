@@ -0,0 +1,192 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "JFReceiver.h"
+#include "ReplayThread.h"
+
+// Frames kept free between replay and the oldest frame still needed by send threads
+#define REPLAY_RING_MARGIN 64
+
+struct mapped_file_t {
+    char *ptr;
+    size_t size;
+};
+
+static mapped_file_t capture_frames = {NULL, 0};
+static mapped_file_t capture_headers = {NULL, 0};
+static mapped_file_t capture_status = {NULL, 0};
+static size_t capture_nframes = 0;
+
+struct replay_statistics_t {
+    uint64_t frames;          // frames replayed
+    uint64_t stalled_frames;  // frames delayed, as the receiver was more than frame buffer behind
+    uint64_t max_backlog;     // frames replayed, but not yet sent
+    std::chrono::steady_clock::time_point start;
+};
+
+static replay_statistics_t replay_statistics;
+
+static int map_file(mapped_file_t &file, const std::string &name) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Replay: cannot open " << name << " " << strerror(errno) << std::endl;
+        return 1;
+    }
+    struct stat file_stat;
+    if ((fstat(fd, &file_stat) != 0) || (file_stat.st_size == 0)) {
+        std::cerr << "Replay: " << name << " is empty" << std::endl;
+        close(fd);
+        return 1;
+    }
+    void *ret = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ret == MAP_FAILED) {
+        std::cerr << "Replay: cannot map " << name << " " << strerror(errno) << std::endl;
+        return 1;
+    }
+    file.ptr = (char *) ret;
+    file.size = file_stat.st_size;
+    return 0;
+}
+
+static void unmap_file(mapped_file_t &file) {
+    if (file.ptr != NULL) munmap(file.ptr, file.size);
+    file.ptr = NULL;
+    file.size = 0;
+}
+
+int setup_replay(const std::string &directory, uint32_t card_number) {
+    std::string suffix = std::to_string(card_number) + ".dat";
+    if (map_file(capture_frames, directory + "/output_data" + suffix) ||
+        map_file(capture_headers, directory + "/packet_headers" + suffix) ||
+        map_file(capture_status, directory + "/status_buffer" + suffix)) {
+        close_replay();
+        return 1;
+    }
+
+    capture_nframes = std::min(capture_frames.size / (NPIXEL * sizeof(int16_t)), (size_t) FRAME_BUF_SIZE);
+
+    // Only frames collected in the capture are replayed, as the rest of the dump is empty
+    if (capture_status.size >= sizeof(online_statistics_t)) {
+        const online_statistics_t *captured = (const online_statistics_t *) capture_status.ptr;
+        size_t collected = captured->good_packets / (NMODULES * 128);
+        if ((collected > 0) && (collected < capture_nframes)) capture_nframes = collected;
+    }
+
+    if (capture_nframes == 0) {
+        std::cerr << "Replay: no complete frame in capture" << std::endl;
+        close_replay();
+        return 1;
+    }
+
+    // Captured frames are read in a loop, so these should stay in page cache
+    madvise(capture_frames.ptr, capture_nframes * NPIXEL * sizeof(int16_t), MADV_WILLNEED);
+
+    std::cout << "Replay: " << capture_nframes << " frames from " << directory;
+    if (receiver_settings.replay_frame_rate > 0)
+        std::cout << " at " << receiver_settings.replay_frame_rate << " Hz" << std::endl;
+    else
+        std::cout << " as fast as possible" << std::endl;
+    return 0;
+}
+
+void close_replay() {
+    unmap_file(capture_frames);
+    unmap_file(capture_headers);
+    unmap_file(capture_status);
+    capture_nframes = 0;
+}
+
+// Frames replayed, but not yet sent to the writer
+static uint64_t replay_backlog(uint64_t frame) {
+    uint64_t sent = ib_sent_images();
+    if (sent >= experiment_settings.nimages_to_write) return 0;
+    uint64_t oldest_frame = image_first_frame(experiment_settings, sent);
+    if (frame <= oldest_frame) return 0;
+    return frame - oldest_frame;
+}
+
+void *run_replay_thread(void *in_threadarg) {
+    thread_placement.PinThread("snap");
+
+    uint64_t nframes = experiment_settings.nframes_to_collect;
+    double frame_period = (receiver_settings.replay_frame_rate > 0) ? 1.0 / receiver_settings.replay_frame_rate : 0.0;
+
+    // Headers are not used in the data path, so they are copied only once
+    memcpy(jf_packet_headers, capture_headers.ptr, std::min(capture_headers.size, jf_packet_headers_size));
+
+    replay_statistics.frames = 0;
+    replay_statistics.stalled_frames = 0;
+    replay_statistics.max_backlog = 0;
+    replay_statistics.start = std::chrono::steady_clock::now();
+
+    for (uint64_t frame = 0; frame < nframes; frame++) {
+        // Frame buffer is a ring, frame cannot be written over frame, which is still needed
+        uint64_t backlog = replay_backlog(frame);
+        if (backlog >= FRAME_BUF_SIZE - REPLAY_RING_MARGIN) {
+            replay_statistics.stalled_frames++;
+            while (replay_backlog(frame) >= FRAME_BUF_SIZE - REPLAY_RING_MARGIN)
+                usleep(10);
+        }
+        replay_statistics.max_backlog = std::max(replay_statistics.max_backlog, backlog);
+
+        if (frame_period > 0)
+            std::this_thread::sleep_until(replay_statistics.start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(frame * frame_period)));
+
+        memcpy(frame_buffer + (frame % FRAME_BUF_SIZE) * NPIXEL,
+               capture_frames.ptr + (frame % capture_nframes) * NPIXEL * sizeof(int16_t),
+               NPIXEL * sizeof(int16_t));
+
+        // As with FPGA, frame data are visible before status is updated
+        std::atomic_thread_fence(std::memory_order_release);
+        online_statistics->good_packets += NMODULES * 128;
+        for (int i = 0; i < NMODULES; i++)
+            online_statistics->head[i] = frame;
+        replay_statistics.frames++;
+    }
+
+    // FPGA marks end of collection by setting heads to maximum value
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < NMODULES; i++)
+        online_statistics->head[i] = INT32_MAX;
+
+    std::cout << "Replay: Done" << std::endl;
+    pthread_exit(0);
+}
+
+void print_replay_statistics() {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_statistics.start).count();
+    uint64_t images = ib_sent_images();
+
+    std::cout << "Replay: " << replay_statistics.frames << " frames, " << images << " images sent in " << elapsed << " s" << std::endl;
+    if (elapsed > 0)
+        std::cout << "Replay: sustained " << images / elapsed << " images/s, " << replay_statistics.frames / elapsed << " frames/s" << std::endl;
+    std::cout << "Replay: max backlog " << replay_statistics.max_backlog << " frames (frame buffer "
+              << FRAME_BUF_SIZE << "), stalled frames " << replay_statistics.stalled_frames << std::endl;
+}
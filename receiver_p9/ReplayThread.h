@@ -0,0 +1,42 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _REPLAYTHREAD_H
+#define _REPLAYTHREAD_H
+
+#include <cstdint>
+#include <string>
+
+// Replay of a recorded capture instead of FPGA.
+// Capture is the frame buffer, packet headers and status buffer of a previous collection
+// (output_data<card>.dat, packet_headers<card>.dat and status_buffer<card>.dat, saved with SAVE_DEBUG_INFO).
+// Files are memory mapped, replay thread copies captured frames into the frame buffer and advances
+// module heads in the status buffer, like the FPGA does. Send, spot finding and IB threads run unchanged,
+// so full receiver pipeline can be benchmarked without FPGA.
+// Replay never overwrites frames of images not yet sent - if the receiver is behind, replay is stalled
+// and stalled frames are reported (with FPGA these frames would be lost).
+
+// Map capture files, returns 1 on error
+int setup_replay(const std::string &directory, uint32_t card_number);
+void close_replay();
+
+// Replaces SNAP thread, replays frames at receiver_settings.replay_frame_rate (0 = as fast as possible)
+void *run_replay_thread(void *in_threadarg);
+
+// Sustained rate and backlog of the last collection, to be called after all images were sent
+void print_replay_statistics();
+
+#endif
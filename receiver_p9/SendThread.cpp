@@ -18,190 +18,160 @@
 #include <malloc.h>
 #include <iostream>
 #include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 
 #include "JFReceiver.h"
+#include "CopyLine.h"
+#include "FrameSummation.h"
+#include "FrameNotifier.h"
+#include "IBSendSlots.h"
 
-uint32_t lastModuleFrameNumber() {
-    uint32_t retVal = online_statistics->head[0];
-    for (int i = 1; i < NMODULES; i++) {
-        if (online_statistics->head[i] < retVal) retVal = online_statistics->head[i];
-    }
-    return retVal;
-}
 
+static std::atomic<uint64_t> sent_images(0);
 
-// Take half of the number, but only if not bad pixel/overload
-inline int16_t half16(int16_t in) {
-    int16_t tmp = in;
-    if ((in > INT16_MIN + 10) && (in > INT16_MAX - 10)) tmp /= 2;
-    return tmp;
+uint64_t ib_sent_images() {
+	return sent_images.load(std::memory_order_relaxed);
 }
 
-// Take quarter of the number, but only if not bad pixel/overload
-inline int16_t quarter16(int16_t in) {
-    int16_t tmp = in;
-    if ((in > INT16_MIN + 10) && (in < INT16_MAX - 10)) tmp /= 4;
-    return tmp;
-}
+void *run_poll_cq_thread(void *in_threadarg) {
+	thread_placement.PinThread("poll_cq");
 
-// Copy line and extend multipixels
-void copy_line(int16_t *destination, int16_t* source) {
-    for (int i = 0; i < 255; i++) destination[i] = source[i];
-    for (int i = 1; i < 255; i++) destination[i+258] = source[i+256];
-    for (int i = 1; i < 255; i++) destination[i+516] = source[i+512];
-    for (int i = 1; i < 256; i++) destination[i+774] = source[i+768];
-    for (int i = 0; i < 3; i++) {
-        int16_t tmp1 = half16(source[255 + i*256]);
-        destination[255+i*258] = tmp1;
-        destination[256+i*258] = tmp1;
-        int16_t tmp2 = half16(source[256 + i*256]);
-        destination[257+i*258] = tmp2;
-        destination[258+i*258] = tmp2;
-    }
-}
+	size_t finished_images = 0;
+	while (finished_images < experiment_settings.nimages_to_write) {
+		// Poll CQ to reuse ID
+		ibv_wc ib_wc[IB_CQ_BATCH];
+		int num_comp  = ibv_poll_cq(ib_settings.cq, IB_CQ_BATCH, ib_wc); // number of completions present in the CQ
+		while (num_comp == 0) {
+			usleep(100);
+			num_comp = ibv_poll_cq(ib_settings.cq, IB_CQ_BATCH, ib_wc);
+		}
 
-// Copy line with multi-pixels (255 and 256)
-void copy_line_mid(int16_t *destination, int16_t* source, ssize_t offset) {
-    for (int i = 0; i < 255; i++) {
-         int16_t tmp = half16(source[i]);
-         destination[i] = tmp;
-         destination[i+offset] = tmp;
-    }
-    for (int i = 1; i < 255; i++) {
-         int16_t tmp = half16(source[i+256]);
-         destination[i+258] = tmp;
-         destination[i+258+offset] = tmp;
-    }
+		if (num_comp < 0) {
+			std::cerr << "Failed polling IB Verbs completion queue" << std::endl;
+			pthread_exit(0);
+		}
 
-    for (int i = 1; i < 255; i++) {
-         int16_t tmp = half16(source[i+512]);
-         destination[i+516] = tmp;
-         destination[i+516+offset] = tmp;
-    }
+		for (int i = 0; i < num_comp; i++) {
+			if (ib_wc[i].status != IBV_WC_SUCCESS) {
+				std::cerr << "Failed status " << ibv_wc_status_str(ib_wc[i].status) << " of IB Verbs send request #" << (int)ib_wc[i].wr_id << std::endl;
+				pthread_exit(0);
+			}
+			// Only last request of the batch is signaled
+			finished_images += release_ib_send_batch(ib_wc[i].wr_id);
+		}
+		sent_images.store(finished_images, std::memory_order_relaxed);
+	}
+        std::cout << "CQ Poll: Done" << std::endl;
+	pthread_exit(0);
+}
 
-    for (int i = 1; i < 256; i++) {
-         int16_t tmp = half16(source[i+768]);
-         destination[i+774] = tmp;
-         destination[i+774+offset] = tmp;
+// Work requests prepared by a send thread, which are posted together
+struct ib_send_batch_t {
+    size_t      max_requests;
+    size_t      nrequests;
+    uint32_t    slots[IB_SEND_BATCH];
+    ibv_sge     sg[IB_SEND_BATCH];
+    ibv_send_wr wr[IB_SEND_BATCH];
+};
+
+void post_send_batch(ib_send_batch_t &batch) {
+    if (batch.nrequests == 0) return;
+
+    for (size_t i = 0; i < batch.nrequests; i++) {
+        batch.wr[i].next = (i == batch.nrequests - 1) ? NULL : &batch.wr[i + 1];
+        batch.wr[i].send_flags = (i == batch.nrequests - 1) ? IBV_SEND_SIGNALED : 0;
     }
-
-    for (int i = 0; i < 3; i++) {
-        int16_t tmp1 = quarter16(source[255 + i*256]);
-        destination[255+i*258] = tmp1;
-        destination[256+i*258] = tmp1;
-        destination[255+i*258+offset] = tmp1;
-        destination[256+i*258+offset] = tmp1;
-        int16_t tmp2 = quarter16(source[256 + i*256]);
-        destination[257+i*258] = tmp2;
-        destination[258+i*258] = tmp2;
-        destination[257+i*258+offset] = tmp2;
-        destination[258+i*258+offset] = tmp2;
+    set_ib_send_batch(batch.slots[batch.nrequests - 1], batch.slots, batch.nrequests);
+
+    ibv_send_wr *ib_wr = batch.wr;
+    ibv_send_wr *ib_bad_wr;
+    int ret;
+    while ((ret = ibv_post_send(ib_settings.qp, ib_wr, &ib_bad_wr))) {
+        if (ret != ENOMEM)
+            std::cerr << "Sending with IB Verbs failed (ret: " << ret << " buffer: " << ib_bad_wr->wr_id << " len: " << ib_bad_wr->sg_list->length << ")" << std::endl;
+        // ENONEM error doesn't seem to be problematic
+        // Requests before the failed one are already posted
+        ib_wr = ib_bad_wr;
+        usleep(10);
     }
+    batch.nrequests = 0;
 }
 
+void add_to_send_batch(ib_send_batch_t &batch, uint32_t buffer_id, size_t image, size_t length) {
+    size_t i = batch.nrequests;
 
-inline int32_t half32(int32_t in) {
-    int32_t tmp = in;
-    if ((in > UNDERFLOW_32BIT) && (in < OVERFLOW_32BIT)) tmp /= 2;
-    return tmp;
-}
+    batch.slots[i] = buffer_id;
 
-inline int32_t quarter32(int32_t in) {
-    int32_t tmp = in;
-    if ((in > UNDERFLOW_32BIT) && (in < OVERFLOW_32BIT)) tmp /= 4;
-    return tmp;
-}
-
-void copy_line32(int32_t *destination, int32_t* source) {
-    for (int i = 0; i < 255; i++) destination[i] = source[i];
-    for (int i = 1; i < 255; i++) destination[i+258] = source[i+256];
-    for (int i = 1; i < 255; i++) destination[i+516] = source[i+512];
-    for (int i = 1; i < 256; i++) destination[i+774] = source[i+768];
-    for (int i = 0; i < 3; i++) {
-        int32_t tmp1 = half32(source[255 + i*256]);
-        destination[255+i*258] = tmp1;
-        destination[256+i*258] = tmp1;
-        int32_t tmp2 = half32(source[256 + i*256]);
-        destination[257+i*258] = tmp2;
-        destination[258+i*258] = tmp2;
-    }
-}
+    memset(&batch.sg[i], 0, sizeof(ibv_sge));
+    batch.sg[i].addr   = (uintptr_t)(ib_buffer + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * buffer_id);
+    batch.sg[i].length = length;
+    batch.sg[i].lkey   = ib_settings.buffer_mr->lkey;
 
-void copy_line_mid32(int32_t *destination, int32_t* source, size_t offset) {
-    for (int i = 0; i < 255; i++) {
-         int32_t tmp = half32(source[i]);
-         destination[i] = tmp;
-         destination[i+offset] = tmp;
-    }
-    for (int i = 1; i < 255; i++) {
-         int32_t tmp = half32(source[i+256]);
-         destination[i+258] = tmp;
-         destination[i+258+offset] = tmp;
-    }
+    memset(&batch.wr[i], 0, sizeof(ibv_send_wr));
+    batch.wr[i].wr_id    = buffer_id;
+    batch.wr[i].sg_list  = &batch.sg[i];
+    batch.wr[i].num_sge  = 1;
+    batch.wr[i].opcode   = IBV_WR_SEND_WITH_IMM;
+    batch.wr[i].imm_data = htonl(image); // Network order
 
-    for (int i = 1; i < 255; i++) {
-         int32_t tmp = half32(source[i+512]);
-         destination[i+516] = tmp;
-         destination[i+516+offset] = tmp;
-    }
+    batch.nrequests++;
+    if (batch.nrequests == batch.max_requests) post_send_batch(batch);
+}
 
-    for (int i = 1; i < 256; i++) {
-         int32_t tmp = half32(source[i+768]);
-         destination[i+774] = tmp;
-         destination[i+774+offset] = tmp;
+// Shared cursor of send tasks - task is a group of modules of one image,
+// tasks are handed out in image order, in portions of send_task_portion tasks
+static std::atomic<uint64_t> send_task_cursor(0);
+static size_t send_tasks_per_image = 1;
+static size_t send_task_portion = 1;
+
+std::vector<send_thread_statistics_t> send_thread_statistics;
+
+void setup_send_threads() {
+    send_task_cursor = 0;
+    sent_images = 0;
+    send_tasks_per_image = NMODULES / receiver_settings.send_task_modules;
+    send_task_portion = receiver_settings.send_task_portion;
+
+    // Sliding window partial sums are kept per thread, so overlapping images are handed out in runs
+    // of consecutive images (up to one image length), each thread reuses sums of its previous image.
+    // Runs are limited, so threads don't wait for each other's IB send slots.
+    uint64_t stride = image_stride(experiment_settings);
+    if (stride < experiment_settings.summation) {
+        size_t run = (experiment_settings.summation + stride - 1) / stride;
+        size_t max_run = ib_send_queue_images(experiment_settings) / (2 * receiver_settings.compression_threads);
+        if (run > max_run) run = max_run;
+        if (run * send_tasks_per_image > send_task_portion) send_task_portion = run * send_tasks_per_image;
     }
+    send_thread_statistics.assign(receiver_settings.compression_threads, send_thread_statistics_t());
+}
 
-    for (int i = 0; i < 3; i++) {
-        int32_t tmp1 = quarter32(source[255 + i*256]);
-        destination[255+i*258] = tmp1;
-        destination[256+i*258] = tmp1;
-        destination[255+i*258+offset] = tmp1;
-        destination[256+i*258+offset] = tmp1;
-        int32_t tmp2 = quarter32(source[256 + i*256]);
-        destination[257+i*258] = tmp2;
-        destination[258+i*258] = tmp2;
-        destination[257+i*258+offset] = tmp2;
-        destination[258+i*258+offset] = tmp2;
+void print_send_thread_statistics() {
+    for (int i = 0; i < receiver_settings.compression_threads; i++) {
+        const send_thread_statistics_t &stat = send_thread_statistics[i];
+        double total_time = stat.busy_time + stat.wait_time;
+        std::cout << "Send thread " << i << ": tasks " << stat.tasks << " images sent " << stat.images_sent
+                  << " busy " << stat.busy_time << " s wait " << stat.wait_time << " s utilisation "
+                  << ((total_time > 0) ? (stat.busy_time / total_time * 100.0) : 0.0) << "%" << std::endl;
     }
 }
 
-void *run_poll_cq_thread(void *in_threadarg) {
-	for (size_t finished_wc = 0; finished_wc < experiment_settings.nimages_to_write; finished_wc++) {
-		// Poll CQ to reuse ID
-		ibv_wc ib_wc;
-		int num_comp  = ibv_poll_cq(ib_settings.cq, 1, &ib_wc);; // number of completions present in the CQ
-		while (num_comp == 0) {
-			usleep(100);
-			num_comp = ibv_poll_cq(ib_settings.cq, 1, &ib_wc);
-		}
-
-		if (num_comp < 0) {
-			std::cerr << "Failed polling IB Verbs completion queue" << std::endl;
-			pthread_exit(0);
-		}
+// Number of images written to IB buffer in the chunk handled by the GPU
+void mark_image_done(size_t image) {
+     size_t images_per_stream = cuda_stream_images(experiment_settings);
+     size_t chunk = image / images_per_stream;
+     size_t ib_slice = chunk % (NCUDA_STREAMS*CUDA_TO_IB_BUFFER);
 
-		if (ib_wc.status != IBV_WC_SUCCESS) {
-			std::cerr << "Failed status " << ibv_wc_status_str(ib_wc.status) << " of IB Verbs send request #" << (int)ib_wc.wr_id << std::endl;
-			pthread_exit(0);
-		}
+     size_t images_in_chunk = experiment_settings.nimages_to_write - chunk * images_per_stream;
+     if (images_in_chunk > images_per_stream) images_in_chunk = images_per_stream;
 
-		pthread_mutex_lock(&ib_buffer_occupancy_mutex);
-		ib_buffer_occupancy[ib_wc.wr_id] = 0;
-		pthread_cond_signal(&ib_buffer_occupancy_cond);
-		pthread_mutex_unlock(&ib_buffer_occupancy_mutex);
-	}
-        std::cout << "CQ Poll: Done" << std::endl;
-	pthread_exit(0);
-}
-
-void mark_chunk_done(size_t chunk) {
-     size_t ib_slice = chunk % (NCUDA_STREAMS*CUDA_TO_IB_BUFFER);
      pthread_mutex_lock(writer_threads_done_mutex+ib_slice);
 
-     // Increment counter of writers done
+     // Increment counter of images done
      writer_threads_done[ib_slice] ++;
-     // If all writers done - wake up GPU thread
-     if (writer_threads_done[ib_slice] == receiver_settings.compression_threads)
+     // If all images done - wake up GPU thread
+     if ((size_t) writer_threads_done[ib_slice] == images_in_chunk)
           pthread_cond_signal(writer_threads_done_cond+ib_slice);
 
      pthread_mutex_unlock(writer_threads_done_mutex+ib_slice);
@@ -218,167 +188,159 @@ void wait_for_write_to_chunk(size_t chunk) {
      pthread_mutex_unlock(cuda_stream_ready_mutex+ib_slice);
 }
 
+static double elapsed(std::chrono::steady_clock::time_point &since) {
+    auto now = std::chrono::steady_clock::now();
+    double ret = std::chrono::duration<double>(now - since).count();
+    since = now;
+    return ret;
+}
+
 void *run_send_thread(void *in_threadarg) {
     ThreadArg *arg = (ThreadArg *) in_threadarg;
+    send_thread_statistics_t &statistics = send_thread_statistics[arg->ThreadID];
 
-    uint32_t current_frame_number = lastModuleFrameNumber();
-
-    size_t images_per_stream = NIMAGES_PER_STREAM * 2 / experiment_settings.pixel_depth;
+    thread_placement.PinThread("send");
 
-    // Account for leftover
-    size_t total_chunks = experiment_settings.nimages_to_write / images_per_stream;
-    if (experiment_settings.nimages_to_write - total_chunks * images_per_stream > 0)
-           total_chunks++;
+    uint32_t current_frame_number = lastModuleFrameNumber();
 
-    size_t current_chunk = 0; // assume that receiver_settings.compression_threads << NIMAGES_PER_STREAM
+    size_t images_per_stream = cuda_stream_images(experiment_settings);
 
-    for (size_t image = arg->ThreadID;
-    		image < experiment_settings.nimages_to_write;
-    		image += receiver_settings.compression_threads) {
-        if (experiment_settings.enable_spot_finding) {
-            // Synchronization of GPU part with GPU threads
-            size_t new_chunk = image / images_per_stream;
+    // Chunk, which is known to be ready for writing
+    int64_t ready_chunk = -1;
 
-            // If we operate in the same chunk as before, there is no need to synchronize
-            if (current_chunk != new_chunk) {
+    size_t modules_per_task = receiver_settings.send_task_modules;
+    size_t total_tasks = experiment_settings.nimages_to_write * send_tasks_per_image;
 
-                mark_chunk_done(current_chunk);
-                wait_for_write_to_chunk(new_chunk);
+    // Sliding window is used only if images are overlapping
+    frame_summation_t summation;
+    if (setup_frame_summation(summation, image_stride(experiment_settings) < experiment_settings.summation)) {
+        std::cerr << "Memory allocation error for summation" << std::endl;
+        pthread_exit(0);
+    }
 
-                // Update chunk
-                current_chunk = new_chunk;
+    // Slots held in unposted batches of all threads must be well below number of slots,
+    // otherwise threads could wait for each other
+    size_t nslots = ib_send_queue_images(experiment_settings);
+    ib_send_batch_t send_batch;
+    send_batch.nrequests = 0;
+    send_batch.max_requests = std::min((size_t) IB_SEND_BATCH, nslots / (2 * receiver_settings.compression_threads));
+    if (send_batch.max_requests == 0) send_batch.max_requests = 1;
+
+    auto time_mark = std::chrono::steady_clock::now();
+
+    while (true) {
+        // Take next portion of tasks
+        size_t first_task = send_task_cursor.fetch_add(send_task_portion);
+        if (first_task >= total_tasks) break;
+        size_t last_task = std::min(first_task + send_task_portion, total_tasks);
+
+        for (size_t task = first_task; task < last_task; task++) {
+            size_t image = task / send_tasks_per_image;
+            size_t first_module = (task % send_tasks_per_image) * modules_per_task;
+
+            statistics.busy_time += elapsed(time_mark);
+
+            if (experiment_settings.enable_spot_finding) {
+                // Synchronization of GPU part with GPU threads
+                size_t chunk = image / images_per_stream;
+
+                // If chunk was already checked, there is no need to synchronize
+                if ((int64_t) chunk > ready_chunk) {
+                    // Don't keep images while waiting
+                    post_send_batch(send_batch);
+                    wait_for_write_to_chunk(chunk);
+                    ready_chunk = chunk;
+                }
             }
-        }
-
-    	// Find free buffer to write
-    	int32_t buffer_id;
 
-        // If pixel_depth == 4, then only half of buffer size available
-        if  (experiment_settings.pixel_depth == 2) buffer_id = image % (RDMA_SQ_SIZE);
-        else  buffer_id = image % (RDMA_SQ_SIZE / 2);
+            // Find free buffer to write
+            int32_t buffer_id;
 
-        // Make sure buffer is free
-    	pthread_mutex_lock(&ib_buffer_occupancy_mutex);
+            // If pixel_depth == 4, then only half of buffer size available
+            buffer_id = image % nslots;
 
-        while (ib_buffer_occupancy[buffer_id] != 0)
-            pthread_cond_wait(&ib_buffer_occupancy_cond, &ib_buffer_occupancy_mutex);
-
-    	pthread_mutex_unlock(&ib_buffer_occupancy_mutex);
+            // Make sure buffer is free
+            if (!ib_send_slot_ready(buffer_id, image)) {
+                post_send_batch(send_batch);
+                wait_for_ib_send_slot(buffer_id, image);
+            }
 
-        size_t collected_frame = image*experiment_settings.summation;
+            size_t collected_frame = image_first_frame(experiment_settings, image);
 
-        if (current_frame_number < (collected_frame+experiment_settings.summation-1) + 2) {
-    	// Ensure that all frames were already collected, if not wait to try again
-    	    while (current_frame_number < (collected_frame+experiment_settings.summation-1) + 2) {
-                float delay_in_frames = (collected_frame+experiment_settings.summation-1) + 2 - current_frame_number;
-                if (delay_in_frames < 2) usleep(20);
-                else  usleep ((delay_in_frames-1)*experiment_settings.frame_time_detector*1000.0);
-                current_frame_number = lastModuleFrameNumber();
+            // Ensure that all frames were already collected
+            if (current_frame_number < (collected_frame+experiment_settings.summation-1) + 2) {
+                // Thread is ahead of the detector, so images are posted now instead of waiting to fill the batch
+                post_send_batch(send_batch);
+                current_frame_number = wait_for_frame((collected_frame+experiment_settings.summation-1) + 2);
             }
-        }
 
-        if (image % 100 == 0) {
-           std::cout << "Frame :" << image << " Backlog = " << current_frame_number - (collected_frame+experiment_settings.summation-1) << " " << online_statistics->head[0] << " " << online_statistics->head[1] << " " << online_statistics->head[2] << " " << online_statistics->head[3] << " " << online_statistics->good_packets << std::endl;
-        }
+            statistics.wait_time += elapsed(time_mark);
 
-        if (experiment_settings.conversion_mode == MODE_CONV) {
-          // Expand multi-pixels and switch to 2x2 modules settings
-          if (experiment_settings.summation == 1) {
-            // For summation of 1 buffer is 16-bit, otherwise 32-bit
-            int16_t *output_buffer = (int16_t *) (ib_buffer + buffer_id * COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth);
-            // Correct geometry to make 2x2 module arrangement
-            // Add inter-chip gaps
-            // Inter module gaps are not added and should be corrected in processing software
-            for (int module = 0; module < NMODULES; module ++) {
-                size_t pixel_in  = ((collected_frame % FRAME_BUF_SIZE) * NMODULES + module) * MODULE_LINES * MODULE_COLS;
-                size_t line_out = (module / 2) * 514; // Two modules will get the same line
-                line_out = 514 * NMODULES / 2 - line_out - 1; // Flip upside down
-                size_t pixel_out = (line_out * 2  + (module%2)) * 1030; // 2 modules in one row
-
-                for (uint64_t i = 0; i < MODULE_LINES; i ++) {
-                    if ((i == 255) || (i == 256)) {
-                       pixel_out -= 2 * 1030;
-                       copy_line_mid(output_buffer+pixel_out, frame_buffer + pixel_in, 2*1030);
-                       pixel_out -= 2 * 1030;
-                    } else {
-                       copy_line(output_buffer+pixel_out, frame_buffer + pixel_in);
-                       pixel_out -= 2 * 1030;
-                    }
-                    pixel_in += MODULE_COLS;
-               }
+            if ((image % 100 == 0) && (first_module == 0)) {
+               std::cout << "Frame :" << image << " Backlog = " << current_frame_number - (collected_frame+experiment_settings.summation-1) << " " << online_statistics->head[0] << " " << online_statistics->head[1] << " " << online_statistics->head[2] << " " << online_statistics->head[3] << " " << online_statistics->good_packets << std::endl;
             }
-          } else {
-            // For summation of >= 2 32-bit integers are used
-            int32_t *output_buffer = (int32_t *) (ib_buffer + buffer_id * COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth);
-            for (int module = 0; module < NMODULES; module ++) {
-                size_t line_out = (module / 2) * 514;
-                line_out = 514 * NMODULES / 2 - line_out - 1; // Flip upside down
-                size_t pixel_out = (line_out * 2 + (module % 2)) * 1030; // 2 modules in one row
-
-                for (uint64_t line = 0; line < MODULE_LINES; line ++) {
-                    int32_t summed_buffer[MODULE_COLS];
-		    for (int col = 0; col < MODULE_COLS; col++)
-                        summed_buffer[col] = 0;
-
-                    for (int j = 0; j < experiment_settings.summation; j++) {
-                        size_t pixel0_in = ((((collected_frame + j) % FRAME_BUF_SIZE) * NMODULES +  module) * MODULE_LINES + line ) * MODULE_COLS;
-                        for (int col = 0; col < MODULE_COLS; col++) {
-                            int16_t tmp = frame_buffer[pixel0_in + col];
-                            if (tmp < INT16_MIN + 10) summed_buffer[col] = UNDERFLOW_32BIT;
-                            if ((tmp > INT16_MAX - 10) && (summed_buffer[col] > UNDERFLOW_32BIT)) summed_buffer[col] = OVERFLOW_32BIT;
-                            if ((summed_buffer[col] > UNDERFLOW_32BIT) && (summed_buffer[col] < OVERFLOW_32BIT)) summed_buffer[col] += tmp;
-                        }
+
+            if (experiment_settings.conversion_mode == MODE_CONV) {
+              // Expand multi-pixels and switch to 2x2 modules settings
+              // Add inter-chip gaps
+              // Inter module gaps are not added and should be corrected in processing software
+              if (experiment_settings.summation == 1) {
+                // For summation of 1 buffer is 16-bit, otherwise 32-bit
+                int16_t *output_buffer = (int16_t *) (ib_buffer + buffer_id * COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth);
+                int16_t *frame = frame_buffer + (collected_frame % FRAME_BUF_SIZE) * NPIXEL;
+                for (size_t module = first_module; module < first_module + modules_per_task; module++) {
+                    for (size_t line = 0; line < MODULE_LINES; line++) {
+                        const GeometryLine &geom_line = geometry_plan.GetLine(module, line);
+                        copy_line_kernels.copy_line(output_buffer, frame + geom_line.src, geom_line, geometry_plan);
                     }
-                    if ((line == 255) || (line == 256)) {
-                       pixel_out -= 2 * 1030;
-                       copy_line_mid32(output_buffer+pixel_out, summed_buffer, 2*1030);
-                       pixel_out -= 2 * 1030;
-                    } else {
-                       copy_line32(output_buffer+pixel_out, summed_buffer);
-                       pixel_out -= 2 * 1030;
+                }
+              } else {
+                // For summation of >= 2 32-bit integers are used
+                int32_t *output_buffer = (int32_t *) (ib_buffer + buffer_id * COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth);
+                // Sliding window checks, if frames summed for the previous image are still in the frame buffer
+                size_t head_frame = newestModuleFrameNumber();
+                for (size_t module = first_module; module < first_module + modules_per_task; module++) {
+                    for (size_t line = 0; line < MODULE_LINES; line += SUMMATION_BLOCK_LINES) {
+                        int32_t *summed_buffer = sum_frames(summation, frame_buffer, FRAME_BUF_SIZE, head_frame, collected_frame,
+                                                            experiment_settings.summation, module, line);
+                        for (size_t i = 0; i < SUMMATION_BLOCK_LINES; i++)
+                            copy_line_kernels.copy_line32(output_buffer, summed_buffer + i * MODULE_COLS,
+                                                          geometry_plan.GetLine(module, line + i), geometry_plan);
                     }
                 }
+              }
+            } else {
+                // For raw data, just copy contest of the buffer
+                size_t offset = first_module * MODULE_LINES * MODULE_COLS;
+                memcpy(ib_buffer + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * buffer_id + offset * sizeof(uint16_t),
+                       frame_buffer + (collected_frame % FRAME_BUF_SIZE) * NPIXEL + offset,
+                       modules_per_task * MODULE_LINES * MODULE_COLS * sizeof(uint16_t));
             }
-          }
-        } else
-            // For raw data, just copy contest of the buffer
-            memcpy(ib_buffer + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * buffer_id,
-                   frame_buffer + (collected_frame % FRAME_BUF_SIZE) * NPIXEL, NPIXEL * sizeof(uint16_t));
-
-    	// Send the frame via RDMA
-    	ibv_sge ib_sg;
-    	ibv_send_wr ib_wr;
-    	ibv_send_wr *ib_bad_wr;
-
-    	memset(&ib_sg, 0, sizeof(ib_sg));
-    	ib_sg.addr	 = (uintptr_t)(ib_buffer + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * buffer_id);
-        if (experiment_settings.conversion_mode == MODE_CONV)
-                ib_sg.length = COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth;
-        else ib_sg.length = NPIXEL * sizeof(uint16_t);
-
-        ib_sg.lkey	 = ib_settings.buffer_mr->lkey;
-
-    	memset(&ib_wr, 0, sizeof(ib_wr));
-    	ib_wr.wr_id      = buffer_id;
-    	ib_wr.sg_list    = &ib_sg;
-    	ib_wr.num_sge    = 1;
-    	ib_wr.opcode     = IBV_WR_SEND_WITH_IMM;
-    	ib_wr.send_flags = IBV_SEND_SIGNALED;
-        ib_wr.imm_data   = htonl(image); // Network order
-        int ret;
-    	while ((ret = ibv_post_send(ib_settings.qp, &ib_wr, &ib_bad_wr))) {
-                if (ret != ENOMEM)
-    		   std::cerr << "Sending with IB Verbs failed (ret: " << ret << " buffer: " << buffer_id << " len: " << ib_sg.length << ")" << std::endl;
-                // ENONEM error doesn't seem to be problematic
-                usleep(10);
-    	}
+
+            // Non-temporal stores need to be visible before RDMA
+            copy_line_kernels.store_fence();
+
+            statistics.tasks++;
+
+            // Thread that wrote the last part of the image sends it
+            if (finish_ib_send_slot_part(buffer_id, send_tasks_per_image)) {
+                if (experiment_settings.enable_spot_finding)
+                    mark_image_done(image);
+
+                // Send the frame via RDMA
+                if (experiment_settings.conversion_mode == MODE_CONV)
+                    add_to_send_batch(send_batch, buffer_id, image, COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth);
+                else
+                    add_to_send_batch(send_batch, buffer_id, image, NPIXEL * sizeof(uint16_t));
+                statistics.images_sent++;
+            }
+        }
     }
 
-    mark_chunk_done(current_chunk);
+    post_send_batch(send_batch);
+    statistics.busy_time += elapsed(time_mark);
 
-    // Case when last chunk has handful of elements and is not covered by this thread
-    if (current_chunk != total_chunks - 1)
-        mark_chunk_done(total_chunks - 1);
+    free_frame_summation(summation);
 
     std::cout << arg->ThreadID << ": Sending done" << std::endl;
     pthread_exit(0);
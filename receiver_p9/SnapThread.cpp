@@ -74,6 +74,17 @@ int setup_snap(uint32_t card_number) {
     return 0;
 }
 
+// NUMA node of the FPGA card, -1 if not known
+int fpga_numa_node(uint32_t card_number) {
+#ifdef OCACCEL
+    char pci_bus_id[32];
+    snprintf(pci_bus_id, sizeof(pci_bus_id)-1, "000%d:00:00.1", card_number);
+    return ThreadPlacement::GetPCIDeviceNode(pci_bus_id);
+#else
+    return ThreadPlacement::GetSysfsNode("/sys/class/cxl/card" + std::to_string(card_number) + "/device");
+#endif
+}
+
 void close_snap() {
     // Detach action + deallocate the card
     snap_detach_action(action);
@@ -83,25 +94,14 @@ void close_snap() {
 void *run_snap_thread(void *in_threadarg) {
     int rc = 0;
 
+    thread_placement.PinThread("snap");
+
     // Control register
     struct snap_job cjob;
     struct rx100G_job mjob;
 
-    mjob.first_frame_number = 1;
-    mjob.expected_frames    = experiment_settings.nframes_to_collect;
-    mjob.pedestalG0_frames  = experiment_settings.pedestalG0_frames;
-
-    mjob.fpga_mac_addr      = receiver_settings.fpga_mac_addr;   // AA:BB:CC:DD:EE:F1
-    mjob.fpga_ipv4_addr     = receiver_settings.fpga_ip_addr;    // 10.1.50.5
-    mjob.expected_triggers  = experiment_settings.ntrigger;
-    mjob.frames_per_trigger = experiment_settings.nimages_to_write_per_trigger * experiment_settings.summation;
-    mjob.delay_per_trigger  = std::lround(experiment_settings.shutter_delay / experiment_settings.frame_time_detector);
-    mjob.mode               = experiment_settings.conversion_mode;
-
-    mjob.in_gain_pedestal_data_addr = (uint64_t) gain_pedestal_data;
-    mjob.out_frame_buffer_addr      = (uint64_t) frame_buffer;
-    mjob.out_frame_status_addr      = (uint64_t) online_statistics;
-    mjob.out_jf_packet_headers_addr = (uint64_t) jf_packet_headers;
+    setup_rx100G_job(mjob);
+
     // Launch the actual action
 
     // Call the action will:
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SpotAssembly.h"
+
+// Line of strong pixel includes offset of the bottom fragment, so it can be up to 2*LINES-1
+#define ASSEMBLY_MAX_LINE (2*LINES)
+
+static uint32_t find_root(std::vector<uint32_t> &parent, uint32_t run) {
+    while (parent[run] != run) {
+        parent[run] = parent[parent[run]]; // path halving
+        run = parent[run];
+    }
+    return run;
+}
+
+// Lower run becomes the root
+static void join_runs(std::vector<uint32_t> &parent, uint32_t run1, uint32_t run2) {
+    run1 = find_root(parent, run1);
+    run2 = find_root(parent, run2);
+    if (run1 < run2) parent[run2] = run1;
+    else if (run2 < run1) parent[run1] = run2;
+}
+
+// Stable counting sort of in by key (col or line) into out
+template <typename K> static void counting_sort(std::vector<uint32_t> &count, const strong_pixel *in, strong_pixel *out,
+        size_t n, size_t nkeys, K key) {
+    count.assign(nkeys + 1, 0);
+    for (size_t i = 0; i < n; i++) count[key(in[i]) + 1]++;
+    for (size_t k = 1; k <= nkeys; k++) count[k] += count[k-1];
+    for (size_t i = 0; i < n; i++) out[count[key(in[i])]++] = in[i];
+}
+
+static size_t pixel_line(const strong_pixel &pixel) { return pixel.line; }
+static size_t pixel_col(const strong_pixel &pixel) { return pixel.col; }
+
+void clear_spot_assembly(spot_assembly_t &assembly) {
+    assembly.input.clear();
+    assembly.sorted.clear();
+    assembly.fragment_start.assign(1, 0);
+    assembly.run_start.clear();
+    assembly.pixel_run.clear();
+}
+
+void end_fragment(spot_assembly_t &assembly) {
+    size_t n = assembly.input.size();
+
+    if (n > 0) {
+        // Sort by line, then by col - as sorting is stable, result is ordered by (col, line)
+        // and pixels with the same location are kept in the order they were added
+        assembly.scratch.resize(n);
+        counting_sort(assembly.count, assembly.input.data(), assembly.scratch.data(), n, ASSEMBLY_MAX_LINE, pixel_line);
+        counting_sort(assembly.count, assembly.scratch.data(), assembly.input.data(), n, COLS, pixel_col);
+
+        const strong_pixel *pixels = assembly.input.data();
+        for (size_t i = 0; i < n; i++) {
+            // Only the last of repeated pixels is used
+            if ((i + 1 < n) && (pixels[i+1].col == pixels[i].col) && (pixels[i+1].line == pixels[i].line))
+                continue;
+            // New vertical run starts, if pixel is not directly below the previous one
+            size_t nsorted = assembly.sorted.size();
+            if ((nsorted == assembly.fragment_start.back()) ||
+                (assembly.sorted[nsorted-1].col != pixels[i].col) ||
+                (assembly.sorted[nsorted-1].line + 1 != pixels[i].line))
+                assembly.run_start.push_back(nsorted);
+            assembly.pixel_run.push_back(assembly.run_start.size() - 1);
+            assembly.sorted.push_back(pixels[i]);
+        }
+    }
+    assembly.fragment_start.push_back(assembly.sorted.size());
+    assembly.input.clear();
+}
+
+// Joins runs of one fragment, which touch runs in the previous column
+static void join_columns(spot_assembly_t &assembly, uint32_t first_run, uint32_t last_run) {
+    const strong_pixel *pixels = assembly.sorted.data();
+    const uint32_t *run_start = assembly.run_start.data();
+
+    uint32_t prev = first_run; // first run of previous column, which could touch the current run
+    for (uint32_t run = first_run; run < last_run; run++) {
+        int16_t col = pixels[run_start[run]].col;
+        int16_t first_line = pixels[run_start[run]].line;
+        int16_t last_line = pixels[run_start[run+1] - 1].line;
+
+        while ((prev < run) && ((pixels[run_start[prev]].col < col - 1) ||
+                                ((pixels[run_start[prev]].col == col - 1) && (pixels[run_start[prev+1] - 1].line < first_line - 1))))
+            prev++;
+
+        for (uint32_t i = prev; (i < run) && (pixels[run_start[i]].col == col - 1)
+                                && (pixels[run_start[i]].line <= last_line + 1); i++)
+            join_runs(assembly.parent, i, run);
+    }
+}
+
+// Joins pixels at the same location in two fragments (both sorted by (col, line))
+static void join_fragments(spot_assembly_t &assembly, size_t fragment1, size_t fragment2) {
+    const strong_pixel *pixels = assembly.sorted.data();
+    size_t i = assembly.fragment_start[fragment1];
+    size_t j = assembly.fragment_start[fragment2];
+    size_t end1 = assembly.fragment_start[fragment1+1];
+    size_t end2 = assembly.fragment_start[fragment2+1];
+
+    while ((i < end1) && (j < end2)) {
+        if ((pixels[i].col < pixels[j].col) || ((pixels[i].col == pixels[j].col) && (pixels[i].line < pixels[j].line)))
+            i++;
+        else if ((pixels[i].col == pixels[j].col) && (pixels[i].line == pixels[j].line)) {
+            join_runs(assembly.parent, assembly.pixel_run[i], assembly.pixel_run[j]);
+            i++;
+            j++;
+        } else
+            j++;
+    }
+}
+
+void assemble_spots(spot_assembly_t &assembly, bool connect_frames, std::vector<spot_t> &spots) {
+    size_t nfragments = assembly.fragment_start.size() - 1;
+    uint32_t nruns = assembly.run_start.size();
+    assembly.run_start.push_back(assembly.sorted.size());
+
+    assembly.parent.resize(nruns);
+    for (uint32_t run = 0; run < nruns; run++) assembly.parent[run] = run;
+
+    for (size_t i = 0; i < nfragments; i++) {
+        size_t first_pixel = assembly.fragment_start[i];
+        size_t end_pixel = assembly.fragment_start[i+1];
+        if (first_pixel == end_pixel) continue;
+        join_columns(assembly, assembly.pixel_run[first_pixel], assembly.pixel_run[end_pixel - 1] + 1);
+        if (connect_frames && (i + 2 < nfragments)) join_fragments(assembly, i, i + 2);
+    }
+
+    // Number spots in order of their root, which is the first run of the spot
+    // (parent of each run is lower or the same, so it is already numbered)
+    size_t first_spot = spots.size();
+    assembly.run_spot.resize(nruns);
+    for (uint32_t run = 0; run < nruns; run++) {
+        if (assembly.parent[run] == run) {
+            assembly.run_spot[run] = spots.size() - first_spot;
+            spot_t spot;
+            spot.x = 0;
+            spot.y = 0;
+            spot.z = 0;
+            spot.d = 0;
+            spot.photons = 0;
+            spot.min_col = INT16_MAX;
+            spot.max_col = INT16_MIN;
+            spot.min_line = INT16_MAX;
+            spot.max_line = INT16_MIN;
+            spot.first_frame = UINT32_MAX;
+            spot.last_frame = 0;
+            spots.push_back(spot);
+        } else
+            assembly.run_spot[run] = assembly.run_spot[assembly.parent[run]];
+    }
+
+    for (size_t i = 0; i < nfragments; i++) {
+        uint32_t frame = i / 2;
+        for (size_t k = assembly.fragment_start[i]; k < assembly.fragment_start[i+1]; k++) {
+            const strong_pixel &pixel = assembly.sorted[k];
+            spot_t &spot = spots[first_spot + assembly.run_spot[assembly.pixel_run[k]]];
+            spot.x += pixel.col * pixel.photons; // position is weighted by number of photon counts
+            spot.y += pixel.line * pixel.photons;
+            spot.z += frame * pixel.photons;
+            spot.photons += pixel.photons;
+            if (pixel.col < spot.min_col) spot.min_col = pixel.col;
+            if (pixel.col > spot.max_col) spot.max_col = pixel.col;
+            if (pixel.line < spot.min_line) spot.min_line = pixel.line;
+            if (pixel.line > spot.max_line) spot.max_line = pixel.line;
+            if (frame < spot.first_frame) spot.first_frame = frame;
+            if (frame > spot.last_frame) spot.last_frame = frame;
+        }
+    }
+    assembly.run_start.pop_back();
+}
+
+void get_fragment_pixels(const spot_assembly_t &assembly, size_t fragment, std::vector<labelled_pixel_t> &pixels) {
+    pixels.clear();
+    if (fragment + 1 >= assembly.fragment_start.size()) return;
+    for (size_t k = assembly.fragment_start[fragment]; k < assembly.fragment_start[fragment+1]; k++) {
+        labelled_pixel_t pixel;
+        pixel.col = assembly.sorted[k].col;
+        pixel.line = assembly.sorted[k].line;
+        pixel.spot = assembly.run_spot[assembly.pixel_run[k]];
+        pixels.push_back(pixel);
+    }
+}
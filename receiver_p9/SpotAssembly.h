@@ -0,0 +1,76 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SPOTASSEMBLY_H
+#define _SPOTASSEMBLY_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "JFReceiver.h"
+
+// Connected-component labelling of strong pixels into spots.
+// Strong pixels of each fragment are sorted with two counting sort passes into (col, line) order,
+// the same order as std::map<coordxy_t, float> used before, and split into vertical runs.
+// Runs touching runs in the neighbouring column (8-connectivity) and pixels at the same location
+// in fragments i and i+2 (consecutive frames) are joined with union-find.
+// Union always keeps the lower run as the root, so spots come out in the order of their first pixel,
+// like with the previous recursive search. Total cost is linear in number of strong pixels.
+
+// Buffers are kept between chunks to avoid allocation
+struct spot_assembly_t {
+    std::vector<strong_pixel> input;    // strong pixels of the current fragment, as added
+    std::vector<strong_pixel> sorted;   // all fragments, each sorted by (col, line), no duplicates
+    std::vector<size_t> fragment_start; // first pixel of each fragment in sorted, plus end
+    std::vector<uint32_t> run_start;    // first pixel of each vertical run, plus end
+    std::vector<uint32_t> pixel_run;    // run of each pixel in sorted
+    std::vector<uint32_t> parent;       // union-find forest of runs
+    std::vector<uint32_t> run_spot;     // spot number of each run
+    std::vector<uint32_t> count;        // counting sort histogram
+    std::vector<strong_pixel> scratch;  // counting sort temporary
+};
+
+// Starts new chunk
+void clear_spot_assembly(spot_assembly_t &assembly);
+
+// Adds strong pixel to the current fragment; for repeated location the last value is used
+inline void add_strong_pixel(spot_assembly_t &assembly, int16_t col, int16_t line, float photons) {
+    strong_pixel pixel;
+    pixel.col = col;
+    pixel.line = line;
+    pixel.photons = photons;
+    assembly.input.push_back(pixel);
+}
+
+// Closes current fragment; fragment i is frame i/2, fragments i and i+2 can be connected
+void end_fragment(spot_assembly_t &assembly);
+
+// Strong pixel with number of its spot
+struct labelled_pixel_t {
+    int16_t col;
+    int16_t line;
+    uint32_t spot;
+};
+
+// Appends spots to the list. x, y, z and photons are sums weighted by photons (not yet divided),
+// z is relative to the first frame of the chunk.
+void assemble_spots(spot_assembly_t &assembly, bool connect_frames, std::vector<spot_t> &spots);
+
+// Strong pixels of the fragment in (col, line) order, spot is relative to the first spot added by assemble_spots
+void get_fragment_pixels(const spot_assembly_t &assembly, size_t fragment, std::vector<labelled_pixel_t> &pixels);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include <iostream>
+#include <cstring>
+
+#include "SpotFinder.h"
+#include "../include/xray.h"
+
+#ifdef __VSX__
+#include <altivec.h>
+#undef vector
+#undef pixel
+#undef bool
+#endif
+
+const spot_finder_kernels_t spot_finder_kernels_scalar = SPOT_FINDER_KERNELS("scalar", scalar_spot_ops);
+
+#ifdef __VSX__
+// POWER9 has no 64-bit vector multiply, squares are calculated from 32-bit values with even-word multiply
+struct vsx_spot_ops {
+    typedef __vector signed long long vec_t;
+    static const size_t lanes = 2;
+    static vec_t load(const int64_t *p) { return vec_xl(0, (const signed long long *) p); }
+    static void store(int64_t *p, vec_t v) { vec_xst(v, 0, (signed long long *) p); }
+    static vec_t add(vec_t a, vec_t b) { return vec_add(a, b); }
+    static vec_t sub(vec_t a, vec_t b) { return vec_sub(a, b); }
+    static vec_t widen(const int16_t *p) { return (vec_t) {p[0], p[1]}; }
+    static vec_t widen(const int32_t *p) { return (vec_t) {p[0], p[1]}; }
+    static vec_t square(vec_t v) {
+        // Low word of each 64-bit lane is even element on little endian and odd element on big endian
+        __vector signed int w = (__vector signed int) v;
+#ifdef __LITTLE_ENDIAN__
+        return vec_mule(w, w);
+#else
+        return vec_mulo(w, w);
+#endif
+    }
+    template <int32_t N, typename T> static unsigned candidates(const T *p, vec_t sum) {
+        vec_t in_minus_mean = vec_sub((vec_t) {box_times(p[0], N), box_times(p[1], N)}, sum);
+        __vector __bool long long mask = vec_and(vec_cmpgt(in_minus_mean, vec_splats((signed long long) N)),
+                                                 vec_cmpgt(widen(p), vec_splats((signed long long) 0)));
+        return (mask[0] ? 1 : 0) | (mask[1] ? 2 : 0);
+    }
+};
+
+const spot_finder_kernels_t spot_finder_kernels_vsx = SPOT_FINDER_KERNELS("VSX", vsx_spot_ops);
+#endif
+
+spot_finder_kernels_t spot_finder_kernels = spot_finder_kernels_scalar;
+
+// composed_mask is mask plane of gain_pedestal_data transformed to composed image,
+// so multipixels (covering 2 or 4 pixels of composed image) are masked as a whole
+void update_spot_finding_mask(spot_finding_mask_t &mask, const uint16_t *composed_mask) {
+    memset(mask.masked, 0, sizeof(mask.masked));
+    mask.count = 0;
+
+    for (size_t line = 0; line < MASK_LINES; line++) {
+        mask.line_masked[line] = false;
+        // All pixels are tested, till resolution range is set
+        mask.first_col[line] = 0;
+        mask.last_col[line] = COLS;
+        for (size_t col = 0; col < COLS; col++) {
+            if (composed_mask[line * COLS + col] != 0) {
+                mask.masked[line * MASK_WORDS_PER_LINE + col / 32] |= 1u << (col % 32);
+                mask.line_masked[line] = true;
+                mask.count++;
+            }
+        }
+    }
+
+    // Box around pixel contains masked pixel - box has to be within the same fragment (LINES lines)
+    for (size_t nb = 1; nb <= MAX_SPOT_BOX_NB; nb++) {
+        uint32_t *incomplete_rows = mask.incomplete[nb - 1];
+        memset(incomplete_rows, 0, sizeof(mask.incomplete[nb - 1]));
+        for (size_t line = 0; line < MASK_LINES; line++) {
+            size_t fragment_line0 = line / LINES * LINES;
+            size_t first_line = (line >= fragment_line0 + nb) ? line - nb : fragment_line0;
+            size_t last_line = (line + nb < fragment_line0 + LINES) ? line + nb : fragment_line0 + LINES - 1;
+            for (size_t col = 0; col < COLS; col++) {
+                size_t first_col = (col >= nb) ? col - nb : 0;
+                size_t last_col = (col + nb < COLS) ? col + nb : COLS - 1;
+                bool incomplete = false;
+                for (size_t i = first_line; (i <= last_line) && !incomplete; i++) {
+                    if (mask.line_masked[i] && mask_bits(mask.masked, i, first_col, last_col - first_col + 1))
+                        incomplete = true;
+                }
+                if (incomplete) incomplete_rows[line * MASK_WORDS_PER_LINE + col / 32] |= 1u << (col % 32);
+            }
+        }
+    }
+}
+
+bool update_resolution_map(resolution_map_t &map, const experiment_settings_t &settings, int64_t line_offset) {
+    if (map.valid && (map.beam_x == settings.beam_x) && (map.beam_y == settings.beam_y)
+        && (map.detector_distance == settings.detector_distance) && (map.energy_in_keV == settings.energy_in_keV)
+        && (map.line_offset == line_offset))
+        return false;
+
+    float wavelength = WVL_1A_IN_KEV / settings.energy_in_keV;
+    for (size_t line = 0; line < MASK_LINES; line++) {
+        for (size_t col = 0; col < COLS; col++) {
+            float lab[3];
+            detector_to_lab(col, line + line_offset, lab, settings.beam_x, settings.beam_y, settings.detector_distance);
+            map.d[line * COLS + col] = get_resolution(lab, wavelength);
+        }
+    }
+    map.beam_x = settings.beam_x;
+    map.beam_y = settings.beam_y;
+    map.detector_distance = settings.detector_distance;
+    map.energy_in_keV = settings.energy_in_keV;
+    map.line_offset = line_offset;
+    map.valid = true;
+    return true;
+}
+
+void update_spot_finding_resolution(spot_finding_mask_t &mask, const resolution_map_t &map, double resolution_limit) {
+    for (size_t line = 0; line < MASK_LINES; line++) {
+        if (!map.valid || (resolution_limit <= 0.0)) {
+            mask.first_col[line] = 0;
+            mask.last_col[line] = COLS;
+            continue;
+        }
+        // Columns between the first and the last accepted pixel of the line, empty range if there is none
+        const float *d = map.d + line * COLS;
+        int16_t first = 0;
+        while ((first < COLS) && (d[first] <= resolution_limit)) first++;
+        int16_t last = COLS;
+        while ((last > first) && (d[last - 1] <= resolution_limit)) last--;
+        mask.first_col[line] = first;
+        mask.last_col[line] = last;
+    }
+}
+
+void setup_spot_finder_kernels() {
+    spot_finder_kernels = spot_finder_kernels_scalar;
+#if defined(__VSX__)
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("vsx"))
+#endif
+        spot_finder_kernels = spot_finder_kernels_vsx;
+#elif defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        spot_finder_kernels = spot_finder_kernels_avx2;
+#endif
+    std::cout << "Spot finder kernels: " << spot_finder_kernels.name << std::endl;
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SPOTFINDER_H
+#define _SPOTFINDER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#include "JFReceiver.h"
+
+// CPU version of find_spots_colspot (find_spots.cu): strong pixels of one fragment
+// (two modules stacked vertically, LINES x COLS pixels) are written to out, up to max_strong pixels.
+// Kernel returns number of strong pixels found, if it is above max_strong, the remaining pixels were lost.
+// Sums over (2*NBX+1) x (2*NBY+1) box are 64-bit integers, like in the GPU kernel, so these are exact.
+// Vector code updates the sums and selects candidates (pixels above local mean and above zero),
+// threshold test for candidates is done in scalar code with the same float operations as on GPU.
+// Minimum and maximum pixel value cuts are applied to candidates only.
+// Output is bit-identical to the GPU kernel.
+// Kernels are written once as templates over a "vector operations" class V and box size,
+// and instantiated for scalar, VSX (POWER9) and AVX2 (x86) code paths and each box size.
+//
+// Masked pixels (spot_finding_mask_t) are read as zero, lines with masked pixels are copied to a small ring
+// of line buffers first. Pixels, whose box contains masked pixel, are always tested in scalar code
+// with statistics of unmasked pixels only.
+//
+// Only pixels within resolution range (first_col/last_col of spot_finding_mask_t) are tested, sums are calculated
+// only for lines and columns necessary for these pixels, so work scales with the area within resolution range.
+
+// Ring of line buffers is large enough for the largest box
+#define SPOT_LINE_RING (2*MAX_SPOT_BOX_NB+2)
+
+// Vector operations class V has to provide:
+//   vec_t, lanes        - lanes of 64-bit integers
+//   load(p), store(p,v) - unaligned load/store of lanes int64_t
+//   add(a,b), sub(a,b)  - 64-bit, wrap around
+//   widen(p)            - lanes pixels (int16_t or int32_t) sign extended to 64-bit
+//   square(v)           - square of each lane, lanes are within int32_t range
+//   candidates<N>(p,sum) - bit mask of lanes, where box_times(p, N) - sum > N and p > 0
+
+// Pixel multiplied by box size, in GPU kernel this is done in 32-bit int
+template <typename T> static inline int64_t box_times(T in, int32_t n) {
+    return (int32_t) ((uint32_t) (int32_t) in * (uint32_t) n);
+}
+
+// Threshold for signal^2 / var, N/(N-1) factor is included, as in GPU kernel
+static inline float spot_threshold(float strong, int32_t n) {
+    return strong * strong * (float) n / (float) (n - 1);
+}
+
+// Strong pixel condition for pixel, which is above local mean (64-bit math wraps around like on GPU)
+static inline bool strong_pixel_test(int64_t in_minus_mean, int64_t sum, int64_t sum2, float threshold, int32_t n) {
+    int64_t var = (int64_t) ((uint64_t) n * (uint64_t) sum2 - (uint64_t) sum * (uint64_t) sum);
+    int64_t in_minus_mean_2 = (int64_t) ((uint64_t) in_minus_mean * (uint64_t) in_minus_mean);
+    return (float) in_minus_mean_2 > (float) var * threshold;
+}
+
+// Bits of count (<= 32) mask pixels starting at col
+static inline uint32_t mask_bits(const uint32_t *rows, size_t line, size_t col, size_t count) {
+    const uint32_t *word = rows + line * MASK_WORDS_PER_LINE + col / 32;
+    uint64_t bits = ((uint64_t) word[1] << 32) | word[0];
+    return (uint32_t) (bits >> (col % 32)) & (uint32_t) ((1ULL << count) - 1);
+}
+
+// Number of unmasked pixels in the box around pixel
+template <int NBX, int NBY> static inline int32_t unmasked_box_pixels(const uint32_t *masked, size_t line, size_t col) {
+    int32_t n = (2*NBX+1) * (2*NBY+1);
+    for (size_t i = line - NBY; i <= line + NBY; i++)
+        n -= __builtin_popcount(mask_bits(masked, i, col - NBX, 2*NBX+1));
+    return n;
+}
+
+// Minimum/maximum pixel value cuts, min_value is at least 1 (pixel above zero)
+struct strong_pixel_cuts_t {
+    float   strong;
+    int32_t min_value;
+    int32_t max_value;
+};
+
+template <typename T> static inline bool pixel_value_ok(T in, const strong_pixel_cuts_t &cuts) {
+    return (in >= cuts.min_value) && (in <= cuts.max_value);
+}
+
+template <int NBX, int NBY, typename T> static inline void check_pixel(const T *in_line, const int64_t *box_sum, const int64_t *box_sum2,
+        const uint32_t *masked, const uint32_t *incomplete,
+        int16_t line, int16_t col, float threshold, const strong_pixel_cuts_t &cuts, strong_pixel *out, size_t max_strong, size_t &strong_id) {
+    const int32_t box = (2*NBX+1) * (2*NBY+1);
+    if (!MASK_BIT(incomplete, line, col)) {
+        int64_t in_minus_mean = box_times(in_line[col], box) - box_sum[col];
+        if ((in_minus_mean > box) && pixel_value_ok(in_line[col], cuts) &&
+            strong_pixel_test(in_minus_mean, box_sum[col], box_sum2[col], threshold, box)) {
+            if (strong_id < max_strong) {
+                out[strong_id].line = line;
+                out[strong_id].col = col;
+                out[strong_id].photons = in_minus_mean;
+            }
+            strong_id++;
+        }
+    } else if (!MASK_BIT(masked, line, col)) {
+        // Statistics of unmasked pixels only, photons are scaled to the full box
+        int32_t n = unmasked_box_pixels<NBX, NBY>(masked, line, col);
+        if (n < MIN_UNMASKED_BOX_PIXELS(box)) return;
+        int64_t in_minus_mean = box_times(in_line[col], n) - box_sum[col];
+        if ((in_minus_mean > n) && pixel_value_ok(in_line[col], cuts) &&
+            strong_pixel_test(in_minus_mean, box_sum[col], box_sum2[col], spot_threshold(cuts.strong, n), n)) {
+            if (strong_id < max_strong) {
+                out[strong_id].line = line;
+                out[strong_id].col = col;
+                out[strong_id].photons = (float) in_minus_mean * (float) box / (float) n;
+            }
+            strong_id++;
+        }
+    }
+}
+
+// Returns line of the fragment with masked pixels set to zero (copied to the ring of line buffers if necessary)
+template <typename T> static inline const T *unmasked_line(const T *in, const uint32_t *masked, const bool *line_masked,
+        size_t line, T *ring) {
+    const T *in_line = in + line * COLS;
+    if (!line_masked[line]) return in_line;
+    T *out_line = ring + (line % SPOT_LINE_RING) * COLS;
+    for (size_t col = 0; col < COLS; col++) out_line[col] = in_line[col];
+    for (size_t word = 0; word < MASK_WORDS_PER_LINE; word++) {
+        uint32_t bits = masked[line * MASK_WORDS_PER_LINE + word];
+        while (bits) {
+            out_line[word * 32 + __builtin_ctz(bits)] = 0;
+            bits &= bits - 1;
+        }
+    }
+    return out_line;
+}
+
+// fragment selects part of the mask (0 = lines [0, LINES), 1 = lines [LINES, 2*LINES) ...)
+template <class V, typename T, int NBX, int NBY> size_t find_spots_impl(const T *in, const spot_finding_mask_t *mask, size_t fragment,
+        strong_pixel *out, size_t max_strong, const strong_pixel_cuts_t &cuts) {
+    const int32_t box = (2*NBX+1) * (2*NBY+1);
+    const float threshold = spot_threshold(cuts.strong, box);
+    size_t strong_id = 0;
+
+    const uint32_t *masked = mask->masked + fragment * LINES * MASK_WORDS_PER_LINE;
+    const uint32_t *incomplete = mask->incomplete[NBX - 1] + fragment * LINES * MASK_WORDS_PER_LINE;
+    const bool *line_masked = mask->line_masked + fragment * LINES;
+    const int16_t *first_col = mask->first_col + fragment * LINES;
+    const int16_t *last_col = mask->last_col + fragment * LINES;
+
+    // Lines [line_begin, line_end) and columns [col_begin, col_end) containing pixels to test
+    int line_begin = LINES, line_end = 0;
+    size_t col_begin = COLS, col_end = 0;
+    for (int line = NBY; line < LINES - NBY; line++) {
+        size_t first = std::max<size_t>(first_col[line], NBX);
+        size_t last = std::min<size_t>(last_col[line], COLS - NBX);
+        if (first < last) {
+            line_begin = std::min(line_begin, line);
+            line_end = line + 1;
+            col_begin = std::min(col_begin, first);
+            col_end = std::max(col_end, last);
+        }
+    }
+    if (line_begin >= line_end) return 0;
+
+    // Sum and sum of squares of (2*NBY+1) vertical elements
+    int64_t sum_vert[COLS];
+    int64_t sum2_vert[COLS];
+    // Sum and sum of squares of (2*NBX+1) x (2*NBY+1) box around pixel
+    int64_t box_sum[COLS];
+    int64_t box_sum2[COLS];
+    // Copies of lines with masked pixels
+    T ring[SPOT_LINE_RING * COLS];
+
+    // Vertical sums are necessary for columns [vert_begin, vert_end)
+    const size_t vert_begin = col_begin - NBX;
+    const size_t vert_end = col_end + NBX;
+    size_t vec_vert_end = vert_begin + (vert_end - vert_begin) / V::lanes * V::lanes;
+
+    const T *lines[2*NBY+1];
+    for (size_t line = 0; line < 2*NBY+1; line++)
+        lines[line] = unmasked_line(in, masked, line_masked, line_begin - NBY + line, ring);
+
+    for (size_t col = vert_begin; col < vec_vert_end; col += V::lanes) {
+        typename V::vec_t sum = V::widen(lines[0] + col);
+        typename V::vec_t sum2 = V::square(sum);
+        for (size_t line = 1; line < 2*NBY+1; line++) {
+            typename V::vec_t tmp = V::widen(lines[line] + col);
+            sum = V::add(sum, tmp);
+            sum2 = V::add(sum2, V::square(tmp));
+        }
+        V::store(sum_vert + col, sum);
+        V::store(sum2_vert + col, sum2);
+    }
+    for (size_t col = vec_vert_end; col < vert_end; col++) {
+        sum_vert[col] = 0;
+        sum2_vert[col] = 0;
+        for (size_t line = 0; line < 2*NBY+1; line++) {
+            int64_t tmp = lines[line][col];
+            sum_vert[col] += tmp;
+            sum2_vert[col] += tmp * tmp;
+        }
+    }
+
+    for (int line = line_begin; line < line_end; line++) {
+        const T *in_line = in + line * COLS;
+        const size_t first = std::max<size_t>(first_col[line], NBX);
+        const size_t last = std::min<size_t>(last_col[line], COLS - NBX); // exclusive
+        size_t vec_last = (last > first) ? first + (last - first) / V::lanes * V::lanes : first;
+
+        // Box sums, these are the same as sliding sums in GPU kernel, as integer addition is exact
+        for (size_t col = first; col < vec_last; col += V::lanes) {
+            typename V::vec_t sum = V::load(sum_vert + col - NBX);
+            typename V::vec_t sum2 = V::load(sum2_vert + col - NBX);
+            for (size_t i = 1; i < 2*NBX+1; i++) {
+                sum = V::add(sum, V::load(sum_vert + col - NBX + i));
+                sum2 = V::add(sum2, V::load(sum2_vert + col - NBX + i));
+            }
+            V::store(box_sum + col, sum);
+            V::store(box_sum2 + col, sum2);
+
+            // Pixels close to masked pixels are always checked in scalar code
+            unsigned candidates = V::template candidates<box>(in_line + col, sum) | mask_bits(incomplete, line, col, V::lanes);
+            while (candidates) {
+                int i = __builtin_ctz(candidates);
+                check_pixel<NBX, NBY>(in_line, box_sum, box_sum2, masked, incomplete, line, col + i, threshold, cuts,
+                                      out, max_strong, strong_id);
+                candidates &= candidates - 1;
+            }
+        }
+        for (size_t col = vec_last; col < last; col++) {
+            box_sum[col] = 0;
+            box_sum2[col] = 0;
+            for (size_t i = 0; i < 2*NBX+1; i++) {
+                box_sum[col] += sum_vert[col - NBX + i];
+                box_sum2[col] += sum2_vert[col - NBX + i];
+            }
+            check_pixel<NBX, NBY>(in_line, box_sum, box_sum2, masked, incomplete, line, col, threshold, cuts,
+                                  out, max_strong, strong_id);
+        }
+
+        // Shift sum_vert and sum2_vert by one line
+        if (line < line_end - 1) {
+            // Line to remove is still in the ring, as the ring has one line more than the box
+            const T *in_remove = line_masked[line - NBY] ? ring + ((line - NBY) % SPOT_LINE_RING) * COLS : in + (line - NBY) * COLS;
+            const T *in_add = unmasked_line(in, masked, line_masked, line + NBY + 1, ring);
+            for (size_t col = vert_begin; col < vec_vert_end; col += V::lanes) {
+                typename V::vec_t add = V::widen(in_add + col);
+                typename V::vec_t remove = V::widen(in_remove + col);
+                V::store(sum_vert + col, V::add(V::load(sum_vert + col), V::sub(add, remove)));
+                V::store(sum2_vert + col, V::add(V::load(sum2_vert + col), V::sub(V::square(add), V::square(remove))));
+            }
+            for (size_t col = vec_vert_end; col < vert_end; col++) {
+                int64_t add = in_add[col];
+                int64_t remove = in_remove[col];
+                sum_vert[col] += add - remove;
+                sum2_vert[col] += add * add - remove * remove;
+            }
+        }
+    }
+
+    return strong_id;
+}
+
+// Reference implementation, one pixel at a time
+struct scalar_spot_ops {
+    typedef int64_t vec_t;
+    static const size_t lanes = 1;
+    static vec_t load(const int64_t *p) { return *p; }
+    static void store(int64_t *p, vec_t v) { *p = v; }
+    static vec_t add(vec_t a, vec_t b) { return (int64_t) ((uint64_t) a + (uint64_t) b); }
+    static vec_t sub(vec_t a, vec_t b) { return (int64_t) ((uint64_t) a - (uint64_t) b); }
+    template <typename T> static vec_t widen(const T *p) { return *p; }
+    static vec_t square(vec_t v) { return v * v; }
+    template <int32_t N, typename T> static unsigned candidates(const T *p, vec_t sum) {
+        return ((box_times(*p, N) - sum > N) && (*p > 0)) ? 1 : 0;
+    }
+};
+
+typedef size_t (*find_spots16_t)(const int16_t *in, const spot_finding_mask_t *mask, size_t fragment,
+                                 strong_pixel *out, size_t max_strong, const strong_pixel_cuts_t &cuts);
+typedef size_t (*find_spots32_t)(const int32_t *in, const spot_finding_mask_t *mask, size_t fragment,
+                                 strong_pixel *out, size_t max_strong, const strong_pixel_cuts_t &cuts);
+
+// Set of kernels for one instruction set, index is NBX - 1 (box 3x3, 5x5, ... 11x11)
+struct spot_finder_kernels_t {
+    const char *name;
+    find_spots16_t find_spots16[MAX_SPOT_BOX_NB];
+    find_spots32_t find_spots32[MAX_SPOT_BOX_NB];
+};
+
+// Initializer of spot_finder_kernels_t for vector operations class V
+#define SPOT_FINDER_KERNELS(name, V) { name, \
+    { find_spots_impl<V, int16_t, 1, 1>, find_spots_impl<V, int16_t, 2, 2>, find_spots_impl<V, int16_t, 3, 3>, \
+      find_spots_impl<V, int16_t, 4, 4>, find_spots_impl<V, int16_t, 5, 5> }, \
+    { find_spots_impl<V, int32_t, 1, 1>, find_spots_impl<V, int32_t, 2, 2>, find_spots_impl<V, int32_t, 3, 3>, \
+      find_spots_impl<V, int32_t, 4, 4>, find_spots_impl<V, int32_t, 5, 5> } }
+
+extern const spot_finder_kernels_t spot_finder_kernels_scalar;
+#ifdef __VSX__
+extern const spot_finder_kernels_t spot_finder_kernels_vsx;
+#endif
+#ifdef __x86_64__
+extern const spot_finder_kernels_t spot_finder_kernels_avx2;
+#endif
+
+// Kernels used by CPU spot finder threads
+extern spot_finder_kernels_t spot_finder_kernels;
+
+// Select the fastest kernels supported by the CPU
+void setup_spot_finder_kernels();
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// This file is compiled with -mavx2 (see Makefile), kernels are only used
+// if CPU supports AVX2 - see setup_spot_finder_kernels()
+
+#ifdef __x86_64__
+
+#include <immintrin.h>
+#include "SpotFinder.h"
+
+struct avx2_spot_ops {
+    typedef __m256i vec_t;
+    static const size_t lanes = 4;
+    static vec_t load(const int64_t *p) { return _mm256_loadu_si256((const __m256i *) p); }
+    static void store(int64_t *p, vec_t v) { _mm256_storeu_si256((__m256i *) p, v); }
+    static vec_t add(vec_t a, vec_t b) { return _mm256_add_epi64(a, b); }
+    static vec_t sub(vec_t a, vec_t b) { return _mm256_sub_epi64(a, b); }
+    static __m128i load32(const int16_t *p) { return _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) p)); }
+    static __m128i load32(const int32_t *p) { return _mm_loadu_si128((const __m128i *) p); }
+    template <typename T> static vec_t widen(const T *p) { return _mm256_cvtepi32_epi64(load32(p)); }
+    // Signed multiply of low 32 bits of each lane gives exact 64-bit result
+    static vec_t square(vec_t v) { return _mm256_mul_epi32(v, v); }
+    template <int32_t N, typename T> static unsigned candidates(const T *p, vec_t sum) {
+        __m128i in = load32(p);
+        // Multiplication by box size in 32-bit, as box_times()
+        vec_t in_times_box = _mm256_cvtepi32_epi64(_mm_mullo_epi32(in, _mm_set1_epi32(N)));
+        vec_t in_minus_mean = _mm256_sub_epi64(in_times_box, sum);
+        __m256i mask = _mm256_and_si256(_mm256_cmpgt_epi64(in_minus_mean, _mm256_set1_epi64x(N)),
+                                        _mm256_cmpgt_epi64(_mm256_cvtepi32_epi64(in), _mm256_setzero_si256()));
+        return _mm256_movemask_pd(_mm256_castsi256_pd(mask));
+    }
+};
+
+const spot_finder_kernels_t spot_finder_kernels_avx2 = SPOT_FINDER_KERNELS("AVX2", avx2_spot_ops);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <map>
+#include <pthread.h>
+
+#include "SpotMerge.h"
+
+// Spot, which touches a chunk boundary, sums are in double and frames absolute,
+// as merged spots can span multiple chunks
+struct open_spot_t {
+    double x, y, z, photons;
+    int16_t min_col, max_col, min_line, max_line;
+    uint32_t first_frame, last_frame;
+    uint32_t parent;    // union-find of open spots
+    int32_t open_ends;  // unresolved chunk boundaries of the whole merged spot (valid for root)
+};
+
+// Both sides of the boundary between two consecutive chunks
+struct chunk_boundary_t {
+    bool has_before, has_after;
+    std::vector<labelled_pixel_t> before[2]; // last frame of the previous chunk, spot is index of open spot
+    std::vector<labelled_pixel_t> after[2];  // first frame of the next chunk
+    std::vector<uint32_t> spots_before, spots_after;
+    chunk_boundary_t() : has_before(false), has_after(false) {}
+};
+
+static pthread_mutex_t spot_merge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t spot_merge_nimages;
+static std::vector<open_spot_t> open_spots;
+static std::map<size_t, chunk_boundary_t> chunk_boundaries; // key is the first frame after the boundary
+static size_t open_spot_count;
+
+void reset_spot_merge(size_t nimages) {
+    pthread_mutex_lock(&spot_merge_mutex);
+    spot_merge_nimages = nimages;
+    open_spots.clear();
+    chunk_boundaries.clear();
+    open_spot_count = 0;
+    pthread_mutex_unlock(&spot_merge_mutex);
+}
+
+size_t open_merged_spots() {
+    pthread_mutex_lock(&spot_merge_mutex);
+    size_t ret = open_spot_count;
+    pthread_mutex_unlock(&spot_merge_mutex);
+    return ret;
+}
+
+static uint32_t find_open_spot(uint32_t id) {
+    while (open_spots[id].parent != id) {
+        open_spots[id].parent = open_spots[open_spots[id].parent].parent;
+        id = open_spots[id].parent;
+    }
+    return id;
+}
+
+static void join_open_spots(uint32_t id1, uint32_t id2) {
+    id1 = find_open_spot(id1);
+    id2 = find_open_spot(id2);
+    if (id1 == id2) return;
+    if (id2 < id1) std::swap(id1, id2);
+
+    open_spot_t &spot1 = open_spots[id1];
+    const open_spot_t &spot2 = open_spots[id2];
+    spot1.x += spot2.x;
+    spot1.y += spot2.y;
+    spot1.z += spot2.z;
+    spot1.photons += spot2.photons;
+    if (spot2.min_col < spot1.min_col) spot1.min_col = spot2.min_col;
+    if (spot2.max_col > spot1.max_col) spot1.max_col = spot2.max_col;
+    if (spot2.min_line < spot1.min_line) spot1.min_line = spot2.min_line;
+    if (spot2.max_line > spot1.max_line) spot1.max_line = spot2.max_line;
+    if (spot2.first_frame < spot1.first_frame) spot1.first_frame = spot2.first_frame;
+    if (spot2.last_frame > spot1.last_frame) spot1.last_frame = spot2.last_frame;
+    spot1.open_ends += spot2.open_ends;
+    open_spots[id2].parent = id1;
+    open_spot_count--;
+}
+
+// Closes one end of the spot, returns true if merged spot is complete
+static bool close_open_end(uint32_t id) {
+    open_spot_t &root = open_spots[find_open_spot(id)];
+    root.open_ends--;
+    return (root.open_ends == 0);
+}
+
+// Weighted z relative to image0 of the current chunk
+static spot_t complete_spot(const open_spot_t &spot, size_t image0) {
+    spot_t ret;
+    ret.x = spot.x;
+    ret.y = spot.y;
+    ret.z = spot.z - (double) image0 * spot.photons;
+    ret.d = 0;
+    ret.photons = spot.photons;
+    ret.min_col = spot.min_col;
+    ret.max_col = spot.max_col;
+    ret.min_line = spot.min_line;
+    ret.max_line = spot.max_line;
+    ret.first_frame = spot.first_frame;
+    ret.last_frame = spot.last_frame;
+    return ret;
+}
+
+// Pixels on both sides are in (col, line) order
+static void join_boundary_pixels(const std::vector<labelled_pixel_t> &before, const std::vector<labelled_pixel_t> &after) {
+    size_t i = 0, j = 0;
+    while ((i < before.size()) && (j < after.size())) {
+        if ((before[i].col < after[j].col) || ((before[i].col == after[j].col) && (before[i].line < after[j].line)))
+            i++;
+        else if ((before[i].col == after[j].col) && (before[i].line == after[j].line))
+            join_open_spots(before[i++].spot, after[j++].spot);
+        else
+            j++;
+    }
+}
+
+static void resolve_boundary(chunk_boundary_t &boundary, size_t image0, std::vector<spot_t> &complete_spots) {
+    for (int i = 0; i < 2; i++)
+        join_boundary_pixels(boundary.before[i], boundary.after[i]);
+
+    std::vector<uint32_t> roots;
+    for (size_t i = 0; i < boundary.spots_before.size(); i++)
+        if (close_open_end(boundary.spots_before[i])) roots.push_back(find_open_spot(boundary.spots_before[i]));
+    for (size_t i = 0; i < boundary.spots_after.size(); i++)
+        if (close_open_end(boundary.spots_after[i])) roots.push_back(find_open_spot(boundary.spots_after[i]));
+
+    for (size_t i = 0; i < roots.size(); i++) {
+        complete_spots.push_back(complete_spot(open_spots[roots[i]], image0));
+        open_spot_count--;
+    }
+}
+
+// Translates spot of labelled pixels from chunk spot number to open spot number
+static void add_boundary_pixels(std::vector<labelled_pixel_t> &out, const std::vector<labelled_pixel_t> &in,
+                                const std::vector<uint32_t> &open_spot_id) {
+    out = in;
+    for (size_t i = 0; i < out.size(); i++)
+        out[i].spot = open_spot_id[out[i].spot];
+}
+
+void merge_chunk_spots(const std::vector<spot_t> &chunk_spots,
+                       const std::vector<labelled_pixel_t> first_pixels[2], const std::vector<labelled_pixel_t> last_pixels[2],
+                       size_t images, size_t image0, std::vector<spot_t> &complete_spots) {
+    bool open_start = (image0 > 0);
+    bool open_end = (image0 + images < spot_merge_nimages);
+
+    pthread_mutex_lock(&spot_merge_mutex);
+
+    std::vector<uint32_t> open_spot_id(chunk_spots.size(), UINT32_MAX);
+    std::vector<uint32_t> spots_first, spots_last;
+
+    for (size_t i = 0; i < chunk_spots.size(); i++) {
+        const spot_t &spot = chunk_spots[i];
+        bool touches_first = open_start && (spot.first_frame == image0);
+        bool touches_last = open_end && (spot.last_frame == image0 + images - 1);
+
+        if (!touches_first && !touches_last) {
+            complete_spots.push_back(spot);
+            continue;
+        }
+
+        open_spot_t open_spot;
+        open_spot.x = spot.x;
+        open_spot.y = spot.y;
+        open_spot.z = spot.z + (double) image0 * spot.photons;
+        open_spot.photons = spot.photons;
+        open_spot.min_col = spot.min_col;
+        open_spot.max_col = spot.max_col;
+        open_spot.min_line = spot.min_line;
+        open_spot.max_line = spot.max_line;
+        open_spot.first_frame = spot.first_frame;
+        open_spot.last_frame = spot.last_frame;
+        open_spot.parent = open_spots.size();
+        open_spot.open_ends = (touches_first ? 1 : 0) + (touches_last ? 1 : 0);
+
+        open_spot_id[i] = open_spots.size();
+        if (touches_first) spots_first.push_back(open_spots.size());
+        if (touches_last) spots_last.push_back(open_spots.size());
+        open_spots.push_back(open_spot);
+        open_spot_count++;
+    }
+
+    if (open_start) {
+        chunk_boundary_t &boundary = chunk_boundaries[image0];
+        for (int i = 0; i < 2; i++) add_boundary_pixels(boundary.after[i], first_pixels[i], open_spot_id);
+        boundary.spots_after = spots_first;
+        boundary.has_after = true;
+        if (boundary.has_before) {
+            resolve_boundary(boundary, image0, complete_spots);
+            chunk_boundaries.erase(image0);
+        }
+    }
+
+    if (open_end) {
+        chunk_boundary_t &boundary = chunk_boundaries[image0 + images];
+        for (int i = 0; i < 2; i++) add_boundary_pixels(boundary.before[i], last_pixels[i], open_spot_id);
+        boundary.spots_before = spots_last;
+        boundary.has_before = true;
+        if (boundary.has_after) {
+            resolve_boundary(boundary, image0, complete_spots);
+            chunk_boundaries.erase(image0 + images);
+        }
+    }
+
+    pthread_mutex_unlock(&spot_merge_mutex);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SPOTMERGE_H
+#define _SPOTMERGE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "JFReceiver.h"
+#include "SpotAssembly.h"
+
+// Merging of 3D spots across chunk boundaries.
+// Spots touching the first or the last frame of a chunk are kept open, together with labelled strong pixels
+// of the chunk's first and last frame. Boundary between chunks is resolved by the chunk, which arrives second
+// (chunks are analyzed by interleaved threads and can finish out of order): pixels at the same location
+// on both sides of the boundary join the spots. Spot is released, when all its chunk boundaries are resolved.
+// Number of messages sent to the writer stays one per chunk - released spots go with the chunk, which completed them.
+
+// Prepare for data collection with nimages images
+void reset_spot_merge(size_t nimages);
+
+// Number of spots still open (should be zero at the end of data collection)
+size_t open_merged_spots();
+
+// Takes spots of chunk [image0, image0 + images) as returned by assemble_spots, but with absolute frame numbers
+// (sums not divided, weighted z relative to image0) and appends spots, which are complete, in the same form.
+// first_pixels and last_pixels are labelled pixels of the first and the last frame of the chunk (top and bottom fragment).
+void merge_chunk_spots(const std::vector<spot_t> &chunk_spots,
+                       const std::vector<labelled_pixel_t> first_pixels[2], const std::vector<labelled_pixel_t> last_pixels[2],
+                       size_t images, size_t image0, std::vector<spot_t> &complete_spots);
+
+#endif
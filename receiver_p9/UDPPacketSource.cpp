@@ -0,0 +1,195 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "UDPPacketSource.h"
+
+#define UDP_PAYLOAD_OFFSET offsetof(RAW_JFUDP_Packet, framenum)
+#define UDP_PAYLOAD_SIZE (sizeof(RAW_JFUDP_Packet) - UDP_PAYLOAD_OFFSET)
+
+#define UDP_SOCKET_BUFFER (256*1024*1024)
+#define UDP_POLL_INTERVAL_MS 100
+
+UDPPacketSource::UDPPacketSource() : base_port(0), mac_addr(0), ipv4_addr(0), timeout_ms(0), next_socket(0),
+                                     packets(UDP_RECEIVE_BATCH), received(0), position(0), received_socket(0) {
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < UDP_RECEIVE_BATCH; i++) {
+        iov[i].iov_base = (char *) &packets[i] + UDP_PAYLOAD_OFFSET;
+        iov[i].iov_len = UDP_PAYLOAD_SIZE;
+        messages[i].msg_hdr.msg_iov = iov + i;
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = addresses + i;
+    }
+    memset(&statistics, 0, sizeof(UDPPacketSourceStatistics));
+}
+
+UDPPacketSource::~UDPPacketSource() {
+    Close();
+}
+
+int UDPPacketSource::Open(const std::string &address, uint16_t in_base_port, size_t nports,
+                          uint64_t fpga_mac_addr, uint32_t fpga_ipv4_addr, int timeout) {
+    Close();
+    base_port = in_base_port;
+    mac_addr = fpga_mac_addr;
+    ipv4_addr = fpga_ipv4_addr;
+    timeout_ms = timeout * 1000;
+
+    struct sockaddr_in bind_addr;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, address.c_str(), &bind_addr.sin_addr) != 1) {
+        std::cerr << "UDP: wrong IPv4 address " << address << std::endl;
+        return 1;
+    }
+
+    for (size_t i = 0; i < nports; i++) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            std::cerr << "UDP: cannot open socket " << strerror(errno) << std::endl;
+            Close();
+            return 1;
+        }
+        sockets.push_back(fd);
+
+        // Buffer has to absorb packets, when receiver thread is not scheduled
+        int buffer_size = UDP_SOCKET_BUFFER;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size)) != 0)
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+        bind_addr.sin_port = htons(base_port + i);
+        if (bind(fd, (struct sockaddr *) &bind_addr, sizeof(bind_addr)) != 0) {
+            std::cerr << "UDP: cannot bind " << address << ":" << base_port + i << " " << strerror(errno) << std::endl;
+            Close();
+            return 1;
+        }
+    }
+
+    int buffer_size = 0;
+    socklen_t option_len = sizeof(buffer_size);
+    getsockopt(sockets[0], SOL_SOCKET, SO_RCVBUF, &buffer_size, &option_len);
+    std::cout << "UDP: listening on " << address << " ports " << base_port << "-" << base_port + nports - 1
+              << ", socket buffer " << buffer_size / (1024 * 1024) << " MiB" << std::endl;
+    return 0;
+}
+
+void UDPPacketSource::Close() {
+    for (int fd : sockets) close(fd);
+    sockets.clear();
+    received = 0;
+    position = 0;
+}
+
+void UDPPacketSource::Flush() {
+    while (Receive(MSG_DONTWAIT) > 0);
+    received = 0;
+    position = 0;
+    next_socket = 0;
+    memset(&statistics, 0, sizeof(UDPPacketSourceStatistics));
+}
+
+const UDPPacketSourceStatistics &UDPPacketSource::GetStatistics() const {
+    return statistics;
+}
+
+// Batch from the first socket with packets waiting, sockets are served round robin
+int UDPPacketSource::Receive(int flags) {
+    for (size_t i = 0; i < sockets.size(); i++) {
+        size_t socket_index = (next_socket + i) % sockets.size();
+        for (int j = 0; j < UDP_RECEIVE_BATCH; j++)
+            messages[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+        int ret = recvmmsg(sockets[socket_index], messages, UDP_RECEIVE_BATCH, flags, NULL);
+        if (ret > 0) {
+            next_socket = (socket_index + 1) % sockets.size();
+            received_socket = socket_index;
+            return ret;
+        }
+        if ((ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            std::cerr << "UDP: receive error " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bool UDPPacketSource::Next(const char *&packet, size_t &length, bool &error) {
+    if (position == received) {
+        std::vector<struct pollfd> fds(sockets.size());
+        for (size_t i = 0; i < sockets.size(); i++) {
+            fds[i].fd = sockets[i];
+            fds[i].events = POLLIN;
+        }
+
+        int ret;
+        int idle_ms = 0;
+        while ((ret = Receive(MSG_DONTWAIT)) == 0) {
+            if (idle_ms >= timeout_ms) {
+                std::cerr << "UDP: no packets for " << timeout_ms / 1000 << " s" << std::endl;
+                return false;
+            }
+            poll(fds.data(), fds.size(), UDP_POLL_INTERVAL_MS);
+            idle_ms += UDP_POLL_INTERVAL_MS;
+        }
+        if (ret < 0) return false;
+
+        received = ret;
+        position = 0;
+        statistics.batches++;
+    }
+
+    RAW_JFUDP_Packet &jf_packet = packets[position];
+    const struct mmsghdr &message = messages[position];
+    const struct sockaddr_in &source = addresses[position];
+    position++;
+    statistics.datagrams++;
+
+    size_t payload_length = message.msg_len;
+    if ((payload_length != UDP_PAYLOAD_SIZE) || (message.msg_hdr.msg_flags & MSG_TRUNC))
+        statistics.wrong_size++;
+
+    // Headers as seen by the FPGA
+    for (int i = 0; i < 6; i++) {
+        jf_packet.dest_mac[i] = (mac_addr >> (8 * (5 - i))) & 0xFF;
+        jf_packet.sour_mac[i] = 0;
+    }
+    jf_packet.ether_type = htons(0x0800);
+    jf_packet.ipv4_header_h = htons(0x4500);
+    jf_packet.ipv4_header_total_length = htons(payload_length + 28);
+    jf_packet.ipv4_header_identification = 0;
+    jf_packet.ipv4_header_flags_frag = 0;
+    jf_packet.ipv4_header_ttl_protocol = htons(0x4011);
+    jf_packet.ipv4_header_checksum = 0;
+    jf_packet.ipv4_header_sour_ip = source.sin_addr.s_addr;
+    jf_packet.ipv4_header_dest_ip = htonl(ipv4_addr);
+    jf_packet.udp_sour_port = source.sin_port;
+    jf_packet.udp_dest_port = htons(base_port + received_socket);
+    jf_packet.udp_length = htons(payload_length + 8);
+    jf_packet.udp_checksum = 0;
+
+    packet = (const char *) &jf_packet;
+    length = UDP_PAYLOAD_OFFSET + payload_length;
+    error = false;
+    return true;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2020 Paul Scherrer Institute
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UDPPACKETSOURCE_H
+#define _UDPPACKETSOURCE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../include/action_rx100G.h"
+#include "FPGAEmulator.h"
+
+#define UDP_RECEIVE_BATCH 64
+
+struct UDPPacketSourceStatistics {
+    uint64_t datagrams;
+    uint64_t wrong_size;  // datagrams, which are not JUNGFRAU packets (dropped by packet filter)
+    uint64_t batches;     // successful recvmmsg calls
+};
+
+// JUNGFRAU packets received by the operating system network stack, one UDP socket per module
+// (port = base port + module number). Datagrams are received in batches with recvmmsg directly
+// into RAW_JFUDP_Packet records, then Ethernet/IPv4/UDP headers are filled in as if the packet was
+// received by the FPGA: destination MAC/IP are the ones of the card, source IP and port
+// come from the sender. As on the FPGA, packets from even source IP are the second half of the module.
+class UDPPacketSource : public PacketSource {
+    std::vector<int> sockets;
+    uint16_t base_port;
+    uint64_t mac_addr;
+    uint32_t ipv4_addr;
+    int      timeout_ms;
+    size_t   next_socket;
+
+    std::vector<RAW_JFUDP_Packet> packets;
+    struct mmsghdr messages[UDP_RECEIVE_BATCH];
+    struct iovec iov[UDP_RECEIVE_BATCH];
+    struct sockaddr_in addresses[UDP_RECEIVE_BATCH];
+    size_t received;
+    size_t position;
+    size_t received_socket;
+
+    UDPPacketSourceStatistics statistics;
+
+    int Receive(int flags);
+
+    UDPPacketSource(const UDPPacketSource &other) = delete;
+    UDPPacketSource &operator=(const UDPPacketSource &other) = delete;
+public:
+    UDPPacketSource();
+    ~UDPPacketSource();
+
+    // Bind nports sockets to address (base_port ... base_port + nports - 1), returns 1 on error.
+    // Collection is finished, if no packet arrives for timeout seconds.
+    int Open(const std::string &address, uint16_t base_port, size_t nports,
+             uint64_t fpga_mac_addr, uint32_t fpga_ipv4_addr, int timeout);
+    void Close();
+    // Discard packets waiting in socket buffers and reset statistics
+    void Flush();
+
+    const UDPPacketSourceStatistics &GetStatistics() const;
+
+    bool Next(const char *&packet, size_t &length, bool &error) override;
+};
+
+#endif
@@ -15,151 +15,146 @@
  */
 
 #include <cmath>
-#include <map>
-#include "JFReceiver.h"
-#include "../include/xray.h"
-
-// CPU part of spot finding
-// (recursion will not fit well to GPU)
-// Constructing spot from strong pixels
-
-// Adds two spot measurements
-void merge_spots(spot_t &spot1, const spot_t spot2) {
-    spot1.x = spot1.x + spot2.x;
-    spot1.y = spot1.y + spot2.y;
-    spot1.z = spot1.z + spot2.z;
+#include <iostream>
 
-    spot1.photons = spot1.photons + spot2.photons;
+#include <sys/socket.h>
 
-    if (spot2.min_line < spot1.min_line) spot1.min_line = spot2.min_line;
-    if (spot2.min_col < spot1.min_col) spot1.min_col = spot2.min_col;
+#include "JFReceiver.h"
+#include "SpotAssembly.h"
+#include "SpotMerge.h"
 
-    if (spot2.max_line > spot1.max_line) spot1.max_line = spot2.max_line;
-    if (spot2.max_col > spot1.max_col) spot1.max_col = spot2.max_col;
+// CPU part of spot finding
+// Constructing spots from strong pixels (see SpotAssembly.h)
 
-    if (spot2.first_frame < spot1.first_frame) spot1.first_frame = spot2.first_frame;
-    if (spot2.last_frame > spot1.last_frame) spot1.last_frame = spot2.last_frame;
+void allocate_strong_pixel_output(strong_pixel_output_t &output, size_t fragments, size_t pool_size) {
+    output.pixels.resize(pool_size);
+    output.offset.resize(fragments + 1, 0);
+    output.found.resize(fragments, 0);
 }
 
-// Creates a continuous spot
-// strong pixels are loaded into dictionary (one dictionary per frame)
-// and routine checks if neighboring pixels are also in dictionary (likely in log(N) time)
-// i is number of fragment (2 modules in horizontal direction)
-// so assuming this is 2Mpixel, i/2 is frame number and i%2 defines position in vertical direction
-spot_t add_pixel(strong_pixel_maps_t &strong_pixel_maps, size_t i, strong_pixel_map_t::iterator &it, bool connect_frames) {
-    spot_t ret_value;
-
-    float photons = it->second;
-    int16_t col = it->first.first;
-    int16_t line = it->first.second;
-
-    strong_pixel_maps[i].erase(it); // Remove strong pixel from the dictionary, so it is not processed again
-
-    ret_value.x = col * photons; // position is weighted by number of photon counts
-    ret_value.y = line * photons;
-    // Y has to be corrected for vertical position of the fragment
-    ret_value.z = (i / 2) * photons;
-    ret_value.photons = photons;
-
-    ret_value.first_frame = i/2;
-    ret_value.last_frame = i/2;
-    ret_value.max_col = col;
-    ret_value.min_col = col;
-    ret_value.max_line = line;
-    ret_value.min_line = line;
-
-    strong_pixel_map_t::iterator it2;
-
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col-1, line  ))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
-
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col-1, line+1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
-
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col-1, line-1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
-
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col+1, line  ))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+// GPU kernel appends strong pixels of all fragments to the pool in order of discovery, together with fragment number.
+// Pixels are grouped by fragment with counting sort, order within fragment is preserved.
+void group_strong_pixels(const strong_pixel *pool, const uint16_t *pool_fragment, size_t pool_used,
+                         const uint32_t *found, size_t fragments, strong_pixel_output_t &output) {
+    if (pool_used > output.pixels.size()) pool_used = output.pixels.size();
+
+    for (size_t i = 0; i <= fragments; i++) output.offset[i] = 0;
+    for (size_t i = 0; i < pool_used; i++) output.offset[pool_fragment[i] + 1]++;
+    for (size_t i = 0; i < fragments; i++) {
+        output.offset[i + 1] += output.offset[i];
+        output.found[i] = found[i];
+    }
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col+1, line-1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+    std::vector<uint32_t> next(output.offset.begin(), output.offset.end() - 1);
+    for (size_t i = 0; i < pool_used; i++)
+        output.pixels[next[pool_fragment[i]]++] = pool[i];
+}
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col+1, line+1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+spot_finding_overflow_t strong_pixel_overflow(const strong_pixel_output_t &output, size_t fragments) {
+    spot_finding_overflow_t overflow = {0, 0};
+    for (size_t i = 0; i < fragments; i++) {
+        uint32_t stored = output.offset[i + 1] - output.offset[i];
+        if (output.found[i] > stored) {
+            overflow.fragments++;
+            overflow.pixels += output.found[i] - stored;
+        }
+    }
+    return overflow;
+}
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col  , line-1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+void analyze_spots(const strong_pixel_output_t &output, uint32_t *pixel_count, std::vector<spot_t> &spots,
+                   std::vector<image_spot_count_t> &image_counts, bool connect_frames, size_t images, size_t image0) {
+    // there is one fragment analyzed by GPU per half of the image (2 horizontally connected modules)
+    image_counts.assign(images, image_spot_count_t{0, 0});
+    for (size_t i = 0; i < images; i++)
+        image_counts[i].strong_pixels = output.found[2 * i] + output.found[2 * i + 1];
 
-    if ((it2 = strong_pixel_maps[i].find(coordxy_t(col  , line+1))) != strong_pixel_maps[i].end())
-        merge_spots(ret_value, add_pixel(strong_pixel_maps, i, it2, connect_frames));
+    spot_assembly_t assembly;
+    clear_spot_assembly(assembly);
 
-    if (connect_frames && (i + 2 < strong_pixel_maps.size())) {
-        if ((it2 = strong_pixel_maps[i+2].find(coordxy_t(col  , line))) != strong_pixel_maps[i+2].end())
-            merge_spots(ret_value, add_pixel(strong_pixel_maps, i+2, it2, connect_frames));
-    }
+    int32_t box_pixels = spot_box_pixels(experiment_settings);
 
-    if (connect_frames && (i > 1)) {
-        if ((it2 = strong_pixel_maps[i-2].find(coordxy_t(col  , line))) != strong_pixel_maps[i-2].end())
-            merge_spots(ret_value, add_pixel(strong_pixel_maps, i-2, it2, connect_frames));
+    // Transfer strong pixels into spot assembly
+    for (size_t i = 0; i < images*2; i++) {
+        for (size_t k = output.offset[i]; k < output.offset[i + 1]; k++) {
+            // Masked pixels are excluded already by spot finding kernel
+            coordxy_t key = coordxy_t(output.pixels[k].col, output.pixels[k].line + (i%2) * LINES);
+            pixel_count[key.first + key.second * COLS] += 1;
+            add_strong_pixel(assembly, key.first, key.second, output.pixels[k].photons / box_pixels);
+        }
+        end_fragment(assembly);
     }
 
-    return ret_value;
-}
-
-void analyze_spots(strong_pixel *host_out, std::vector<spot_t> &spots, bool connect_frames, size_t images, size_t image0) {
-    // key is location of strong pixel - value is number of photons
-    // there is one map per fragment analyzed by GPU (2 horizontally connected modules)
-    strong_pixel_maps_t strong_pixel_maps = strong_pixel_maps_t(images*2);
+    std::vector<spot_t> chunk_spots;
+    assemble_spots(assembly, connect_frames, chunk_spots);
 
-    pthread_mutex_lock(&strong_pixel_count_mutex);
+    // Frame numbers are absolute from now on
+    for (size_t i = 0; i < chunk_spots.size(); i++) {
+        chunk_spots[i].first_frame += image0;
+        chunk_spots[i].last_frame += image0;
+    }
 
-    // Transfer strong pixels into dictionary
-    for (size_t i = 0; i < images*2; i++) {
-        size_t addr = i * MAX_STRONG;
-        int k = 0;
-        // There is maximum MAX_STRONG pixels
-        // GPU kernel sets col to -1 for next element after last strong pixel
-        // Photons equal zero could mean that kernel was not at all executed
-        while ((k < MAX_STRONG) && (host_out[addr + k].col >= 0) && (host_out[addr + k].line >= 0) && (host_out[addr+k].photons > 0)) {
-            coordxy_t key = coordxy_t(host_out[addr + k].col, host_out[addr + k].line + (i%2) * LINES);
-            strong_pixel_count[key.first + key.second * COLS] += 1;
-            if (bad_pixels.find(key) == bad_pixels.end())
-                strong_pixel_maps[i][key] = host_out[addr + k].photons / ((2*NBX+1)*(2*NBY+1));
-            k++;
+    // Spots spanning chunk boundary are stitched with the neighbouring chunks,
+    // these are reported with the chunk, which is analyzed later
+    std::vector<spot_t> complete_spots;
+    if (connect_frames) {
+        std::vector<labelled_pixel_t> first_pixels[2], last_pixels[2];
+        for (int i = 0; i < 2; i++) {
+            get_fragment_pixels(assembly, i, first_pixels[i]);
+            get_fragment_pixels(assembly, (images - 1) * 2 + i, last_pixels[i]);
         }
-    }
-    pthread_mutex_unlock(&strong_pixel_count_mutex);
-
-    for (int i = 0; i < images*2; i++) {
-        strong_pixel_map_t::iterator iterator = strong_pixel_maps[i].begin();
-        while (iterator != strong_pixel_maps[i].end()) {
-            spot_t spot = add_pixel(strong_pixel_maps, i, iterator, connect_frames);
-
-            // Spot has at least minimum number of pixels
-            if (((spot.last_frame - spot.first_frame + 1) * (spot.max_col - spot.min_col + 1) * (spot.max_line - spot.min_line + 1)) > experiment_settings.min_pixels_per_spot) {
-                // Apply pixel count cut-off and cut-off of number of frames, which spot can span
-                // (spots present in most frames, are likely to be either bad pixels or in spindle axis)
-                spot.x = spot.x / spot.photons;
-                // Account for the fact, that each process handles only part of the detector
-                spot.y = spot.y / spot.photons + (NCARDS - receiver_settings.gpu_device - 1) * 2 * LINES;
-                // Account for frame number
-                spot.z = spot.z / spot.photons + image0;
-
-                // Find lab coordinates of the pixel
-                float lab[3];
-                detector_to_lab(spot.x, spot.y, lab, experiment_settings.beam_x, experiment_settings.beam_y, experiment_settings.detector_distance);
-
-                // Get resolution
-                spot.d = get_resolution(lab, WVL_1A_IN_KEV / (experiment_settings.energy_in_keV));
-
-                // Check spot resolution
-                if (spot.d > experiment_settings.spot_finding_resolution_limit) {
-                    // Spot is put on the list
-                    spots.push_back(spot);
-                }
+        merge_chunk_spots(chunk_spots, first_pixels, last_pixels, images, image0, complete_spots);
+    } else
+        complete_spots.swap(chunk_spots);
+
+    for (size_t i = 0; i < complete_spots.size(); i++) {
+        spot_t &spot = complete_spots[i];
+        // Spot has at least minimum number of pixels
+        if (((spot.last_frame - spot.first_frame + 1) * (spot.max_col - spot.min_col + 1) * (spot.max_line - spot.min_line + 1)) > experiment_settings.min_pixels_per_spot) {
+            // Apply pixel count cut-off and cut-off of number of frames, which spot can span
+            // (spots present in most frames, are likely to be either bad pixels or in spindle axis)
+            spot.x = spot.x / spot.photons;
+            spot.y = spot.y / spot.photons;
+
+            // Resolution of the pixel closest to the spot center (map is for composed image of the card)
+            spot.d = resolution_map.d[lroundf(spot.y) * COLS + lroundf(spot.x)];
+
+            // Account for the fact, that each process handles only part of the detector
+            spot.y += detector_geometry.GetCardLineOffset(receiver_settings.detector_card);
+            // Account for frame number
+            spot.z = spot.z / spot.photons + image0;
+
+            // Check spot resolution, spots in ice rings found in previous collection can be excluded
+            if ((spot.d > experiment_settings.spot_finding_resolution_limit) && !excluded_ice_ring(experiment_settings, spot.d)) {
+                // Spot is put on the list
+                spots.push_back(spot);
+                // Spot is counted for the image, where it starts. Hit finding is done only with 2D spot finding
+                // (connect_frames == false), where every spot is within a single image of this chunk.
+                // With 3D spot finding counts are not used by the writer, spots stitched from previous chunk are skipped.
+                if ((spot.first_frame >= image0) && (spot.first_frame < image0 + images))
+                    image_counts[spot.first_frame - image0].spots++;
             }
-            iterator = strong_pixel_maps[i].begin(); // Get first yet unprocessed spot in this frame
         }
     }
 }
+
+// Send spots found by spot finder via TCP/IP, followed by strong pixels lost in the chunk
+// and chunk number with spot/strong pixel count of each image of the chunk
+void send_spots(const std::vector<spot_t> &spots, const spot_finding_overflow_t &overflow,
+                const std::vector<image_spot_count_t> &image_counts, size_t chunk) {
+    if (overflow.pixels > 0)
+        std::cerr << "Spot finder output full in chunk " << chunk << ": " << overflow.pixels << " strong pixels lost in "
+                  << overflow.fragments << " half images" << std::endl;
+
+    pthread_mutex_lock(&accepted_socket_mutex);
+    size_t spot_data_size = spots.size();
+    send(accepted_socket, &spot_data_size, sizeof(size_t), 0);
+    send(accepted_socket, spots.data(), spot_data_size * sizeof(spot_t), 0);
+    send(accepted_socket, &overflow, sizeof(spot_finding_overflow_t), 0);
+    // Chunks are sent by spot finding threads in order of completion
+    size_t images = image_counts.size();
+    send(accepted_socket, &chunk, sizeof(size_t), 0);
+    send(accepted_socket, &images, sizeof(size_t), 0);
+    send(accepted_socket, image_counts.data(), images * sizeof(image_spot_count_t), 0);
+    pthread_mutex_unlock(&accepted_socket_mutex);
+}
@@ -34,9 +34,42 @@
 // CUDA calculation streams
 cudaStream_t stream[NCUDA_STREAMS];
 
-// GPU kernel to find strong pixels
+// Pixel value, masked pixels are excluded from statistics by reading them as zero
 template<typename T>
-__global__ void find_spots_colspot(T *in, strong_pixel *out, float strong, int N) {
+__device__ inline T unmasked_value(const T *in, const uint32_t *masked, size_t line0, size_t line, size_t col) {
+    return MASK_BIT(masked, line, col) ? 0 : in[(line0 + line) * COLS + col];
+}
+
+// Number of unmasked pixels in the box around pixel
+template<int NBX, int NBY>
+__device__ inline int unmasked_box_pixels(const uint32_t *masked, int line, int col) {
+    int n = 0;
+    for (int i = line - NBY; i <= line + NBY; i++)
+        for (int j = col - NBX; j <= col + NBX; j++)
+            if (!MASK_BIT(masked, i, j)) n++;
+    return n;
+}
+
+// Strong pixels of all fragments of the chunk are appended to a shared pool, together with fragment number,
+// so that these can be grouped by fragment on CPU (group_strong_pixels). Pixels above pool size are counted, but lost.
+__device__ inline void save_strong_pixel(strong_pixel *out, uint16_t *out_fragment, unsigned int *out_used, size_t pool_size,
+                                         uint16_t fragment, int16_t line, int16_t col, float photons) {
+    unsigned int id = atomicAdd(out_used, 1);
+    if (id < pool_size) {
+        out[id].line = line;
+        out[id].col = col;
+        out[id].photons = photons;
+        out_fragment[id] = fragment;
+    }
+}
+
+// GPU kernel to find strong pixels, box size is (2*NBX+1) x (2*NBY+1)
+// Pixel value must be in range [min_value, max_value] (min_value is at least 1)
+// Only pixels within resolution range are tested, sums are calculated only for necessary lines and columns
+template<typename T, int NBX, int NBY>
+__global__ void find_spots_colspot(T *in, const spot_finding_mask_t *mask, strong_pixel *out, uint16_t *out_fragment,
+                                   unsigned int *out_used, uint32_t *found, size_t pool_size, float strong,
+                                   int32_t min_value, int32_t max_value, int N) {
      if (blockIdx.x * blockDim.x + threadIdx.x < N) {
         // Threshold for signal^2 / var
         // To avoid division (see later) N/(N-1) factor is included already in the threshold
@@ -46,88 +79,138 @@ __global__ void find_spots_colspot(T *in, strong_pixel *out, float strong, int N
         // line0 points to the module/frame
         size_t line0 = (blockIdx.x * blockDim.x + threadIdx.x) * LINES;
 
-        // Location of the first strong pixel in the output array 
-        size_t strong_id0 = (blockIdx.x * blockDim.x + threadIdx.x) * MAX_STRONG;
-        size_t strong_id = 0;
+        // Even thread is top, odd thread is bottom part of the image
+        const uint32_t *masked = mask->masked + ((blockIdx.x * blockDim.x + threadIdx.x) % 2) * LINES * MASK_WORDS_PER_LINE;
+        const uint32_t *incomplete = mask->incomplete[NBX - 1] + ((blockIdx.x * blockDim.x + threadIdx.x) % 2) * LINES * MASK_WORDS_PER_LINE;
+        const int16_t *first_col = mask->first_col + ((blockIdx.x * blockDim.x + threadIdx.x) % 2) * LINES;
+        const int16_t *last_col = mask->last_col + ((blockIdx.x * blockDim.x + threadIdx.x) % 2) * LINES;
+
+        // Number of strong pixels found in the fragment
+        uint16_t fragment = blockIdx.x * blockDim.x + threadIdx.x;
+        uint32_t strong_id = 0;
+
+        // Lines [line_begin, line_end) and columns [col_begin, col_end) containing pixels to test
+        int line_begin = LINES, line_end = 0;
+        int col_begin = COLS, col_end = 0;
+        for (int line = NBY; line < LINES - NBY; line++) {
+            int first = max((int) first_col[line], NBX);
+            int last = min((int) last_col[line], (int) COLS - NBX);
+            if (first < last) {
+                line_begin = min(line_begin, line);
+                line_end = line + 1;
+                col_begin = min(col_begin, first);
+                col_end = max(col_end, last);
+            }
+        }
+        if (line_begin >= line_end) {
+            found[fragment] = 0;
+            return;
+        }
 
         // Sum and sum of squares of (2*NBY+1) vertical elements 
         // These are updated after each line is finished
         // 64-bit integer guarantees calculations are made without rounding errors
+        // Only columns [col_begin - NBX, col_end + NBX) are necessary
         int64_t sum_vert[COLS];
         int64_t sum2_vert[COLS];
 
         // Precalculate squares for first 2*NBY+1 lines
-        for (int col = 0; col < COLS; col++) {
-            int64_t tmp = in[(line0) * COLS + col];
+        for (int col = col_begin - NBX; col < col_end + NBX; col++) {
+            int64_t tmp = unmasked_value(in, masked, line0, line_begin - NBY, col);
             sum_vert[col]  = tmp;
             sum2_vert[col] = tmp*tmp;
         }
  
-        for (size_t line = 1; line < 2*NBY+1; line++) {
-            for (int col = 0; col < COLS; col++) {
-                int64_t tmp = in[(line0 + line) * COLS + col];
+        for (size_t line = line_begin - NBY + 1; line < line_begin + NBY + 1; line++) {
+            for (int col = col_begin - NBX; col < col_end + NBX; col++) {
+                int64_t tmp = unmasked_value(in, masked, line0, line, col);
                 sum_vert[col]  += tmp;
                 sum2_vert[col] += tmp*tmp;
             }
         }
 
-        // do calculations for lines NBY to MODULE_LINES - NBY
-        for (int16_t line = NBY; line < LINES - NBY; line++) {
+        // do calculations for lines with pixels in resolution range
+        for (int16_t line = line_begin; line < line_end; line++) {
+            int16_t first = max((int) first_col[line], NBX);
+            int16_t last = min((int) last_col[line], (int) COLS - NBX);
 
             // sum and sum of squares for (2*NBX+1) x (2*NBY+1) elements
-            int64_t sum  = sum_vert[0]; // Should be divided (float)((2*NBX+1) * (2*NBY+1));
-            int64_t sum2 = sum2_vert[0];
+            // (line without pixels in resolution range is only used for vertical sums)
+            int64_t sum  = 0; // Should be divided (float)((2*NBX+1) * (2*NBY+1));
+            int64_t sum2 = 0;
 
-            for (int i = 1; i < 2*NBX+1; i ++) {
-                sum  += sum_vert[i];
-                sum2 += sum2_vert[i];
+            for (int i = 0; (i < 2*NBX+1) && (first < last); i ++) {
+                sum  += sum_vert[first - NBX + i];
+                sum2 += sum2_vert[first - NBX + i];
             }
 
-            for (int16_t col = NBX; col < COLS - NBX; col++) {
-                // At all cost division and sqrt must be avoided
-                // as performance penalty is significant (2x drop)
-                // instead, constants ((2*NBX+1) * (2*NBY+1)) and ((2*NBX+1) * (2*NBY+1)-1)
-                // are included in the threshold
-                int64_t var = (2*NBX+1) * (2*NBY+1) * sum2 - (sum * sum); // This should be divided by ((2*NBX+1) * (2*NBY+1)-1)*((2*NBX+1) * (2*NBY+1))
-                int64_t in_minus_mean = in[(line0 + line)*COLS+col] * ((2*NBX+1) * (2*NBY+1)) - sum; // Should be divided by ((2*NBX+1) * (2*NBY+1));
-
-                if ((in_minus_mean > (2*NBX+1) * (2*NBY+1)) && // pixel value is larger than mean
-                    (in[(line0 + line)*COLS+col] > 0) && // pixel is not bad pixel and is above 0
-                    (in_minus_mean * in_minus_mean > var * threshold)) {
-                       // Save line, column and photon count in output table
-                       out[strong_id0+strong_id].line = line;
-                       out[strong_id0+strong_id].col = col;
-                       out[strong_id0+strong_id].photons = in_minus_mean;
-                       strong_id = (strong_id + 1 ) % MAX_STRONG;
+            for (int16_t col = first; col < last; col++) {
+                if (!MASK_BIT(incomplete, line, col)) {
+                    // At all cost division and sqrt must be avoided
+                    // as performance penalty is significant (2x drop)
+                    // instead, constants ((2*NBX+1) * (2*NBY+1)) and ((2*NBX+1) * (2*NBY+1)-1)
+                    // are included in the threshold
+                    int64_t var = (2*NBX+1) * (2*NBY+1) * sum2 - (sum * sum); // This should be divided by ((2*NBX+1) * (2*NBY+1)-1)*((2*NBX+1) * (2*NBY+1))
+                    int64_t in_minus_mean = in[(line0 + line)*COLS+col] * ((2*NBX+1) * (2*NBY+1)) - sum; // Should be divided by ((2*NBX+1) * (2*NBY+1));
+
+                    if ((in_minus_mean > (2*NBX+1) * (2*NBY+1)) && // pixel value is larger than mean
+                        (in[(line0 + line)*COLS+col] >= min_value) && // pixel is not bad pixel and is above 0
+                        (in[(line0 + line)*COLS+col] <= max_value) && // pixel is not saturated
+                        (in_minus_mean * in_minus_mean > var * threshold)) {
+                           // Save line, column and photon count in output table
+                           save_strong_pixel(out, out_fragment, out_used, pool_size, fragment, line, col, in_minus_mean);
+                           strong_id++;
+                        }
+                } else if (!MASK_BIT(masked, line, col)) {
+                    // Box contains masked pixels - statistics of n unmasked pixels,
+                    // photons are scaled to the full box
+                    int n = unmasked_box_pixels<NBX, NBY>(masked, line, col);
+                    if (n >= MIN_UNMASKED_BOX_PIXELS((2*NBX+1) * (2*NBY+1))) {
+                        float threshold_n = strong * strong * (float) n / (float) (n - 1);
+                        int64_t var = n * sum2 - (sum * sum);
+                        int64_t in_minus_mean = in[(line0 + line)*COLS+col] * n - sum;
+                        if ((in_minus_mean > n) &&
+                            (in[(line0 + line)*COLS+col] >= min_value) &&
+                            (in[(line0 + line)*COLS+col] <= max_value) &&
+                            (in_minus_mean * in_minus_mean > var * threshold_n)) {
+                               save_strong_pixel(out, out_fragment, out_used, pool_size, fragment, line, col,
+                                                 (float) in_minus_mean * (float) ((2*NBX+1) * (2*NBY+1)) / (float) n);
+                               strong_id++;
+                        }
                     }
+                }
 
                 // Updated value of sum and sum2
                 // For last column - these need not to be calculated
-                if (col < COLS - NBX - 1) {
+                if (col < last - 1) {
                    sum += sum_vert[col + NBX + 1] - sum_vert[col - NBX];
                    sum2 += sum2_vert[col + NBX + 1] - sum2_vert[col - NBX];
 
                 }
             }
             // Shift sum_vert and sum2_vert by one line
-            if (line < LINES - NBY - 1) {
-                for (int col = 0; col < COLS; col++) {
-                    int64_t tmp_sum  = (int64_t)in[(line0+line+NBY+1) * COLS + col] + (int64_t)in[(line0 + line-NBY) * COLS + col];
-                    int64_t tmp_diff = (int64_t)in[(line0+line+NBY+1) * COLS + col] - (int64_t)in[(line0 + line-NBY) * COLS + col];
+            if (line < line_end - 1) {
+                for (int col = col_begin - NBX; col < col_end + NBX; col++) {
+                    int64_t tmp_sum  = (int64_t) unmasked_value(in, masked, line0, line+NBY+1, col) + (int64_t) unmasked_value(in, masked, line0, line-NBY, col);
+                    int64_t tmp_diff = (int64_t) unmasked_value(in, masked, line0, line+NBY+1, col) - (int64_t) unmasked_value(in, masked, line0, line-NBY, col);
                     sum_vert[col]  += tmp_diff;
                     sum2_vert[col] += tmp_sum * tmp_diff; // in[(line0+line+NBY+1) * MODULE_COLS + col]^2 - in[(line0 + line-NBY) * MODULE_COLS + col]^2
                 }
             }
         }
-        // Mark, where useful data and in output table
-        out[strong_id0+strong_id].line = -1;
-        out[strong_id0+strong_id].col = -1;
-        out[strong_id0+strong_id].photons = strong_id;
+        found[fragment] = strong_id;
    }
 }
 
 char *gpu_data;
 strong_pixel *gpu_out;
+uint16_t *gpu_out_fragment;
+unsigned int *gpu_out_used;
+uint32_t *gpu_found;
+spot_finding_mask_t *gpu_mask;
+
+// Strong pixels grouped by fragment
+static strong_pixel_output_t host_out[NCUDA_STREAMS];
 
 int setup_gpu(int device) {
     // Set device
@@ -140,10 +223,10 @@ int setup_gpu(int device) {
          return 1;
     }
 
-    // NIMAGES_PER_STREAM * FRAGMENT_SIZE is the same for 16 and 32-bit image
+    // images_per_stream * FRAGMENT_SIZE is the same for 16 and 32-bit image
     // there is half images per stream, but twice in size
     // Initialize input memory on GPU
-    size_t gpu_data_size = NCUDA_STREAMS * NIMAGES_PER_STREAM * FRAGMENT_SIZE_16;
+    size_t gpu_data_size = NCUDA_STREAMS * receiver_settings.images_per_stream * FRAGMENT_SIZE_16;
     err = cudaMalloc((void **) &gpu_data, gpu_data_size);
     if (err != cudaSuccess) {
          std::cerr << "GPU: Mem alloc. error (data) " <<  gpu_data_size / 1024 / 1024 << std::endl;
@@ -151,11 +234,30 @@ int setup_gpu(int device) {
     }
 
     // Initialize output memory as GPU/CPU unified memory
-    err = cudaMallocManaged((void **) &gpu_out, NCUDA_STREAMS * NIMAGES_PER_STREAM * 2 * MAX_STRONG * sizeof(strong_pixel)); // frame is divided into 2 vertical slices
+    // frame is divided into 2 vertical slices, output pool is shared by all fragments of a chunk
+    size_t fragments = receiver_settings.images_per_stream * 2;
+    size_t pool_size = fragments * receiver_settings.strong_per_fragment;
+    err = cudaMallocManaged((void **) &gpu_out, NCUDA_STREAMS * pool_size * sizeof(strong_pixel));
+    if (err == cudaSuccess)
+        err = cudaMallocManaged((void **) &gpu_out_fragment, NCUDA_STREAMS * pool_size * sizeof(uint16_t));
+    if (err == cudaSuccess)
+        err = cudaMallocManaged((void **) &gpu_out_used, NCUDA_STREAMS * sizeof(unsigned int));
+    if (err == cudaSuccess)
+        err = cudaMallocManaged((void **) &gpu_found, NCUDA_STREAMS * fragments * sizeof(uint32_t));
     if (err != cudaSuccess) {
          std::cerr << "GPU: Mem alloc. error (output)" << std::endl;
          return 1;
     }
+    for (int i = 0; i < NCUDA_STREAMS; i++)
+        allocate_strong_pixel_output(host_out[i], fragments, pool_size);
+
+    // Pixel mask for spot finding
+    err = cudaMalloc((void **) &gpu_mask, sizeof(spot_finding_mask_t));
+    if (err != cudaSuccess) {
+         std::cerr << "GPU: Mem alloc. error (mask)" << std::endl;
+         return 1;
+    }
+    if (upload_gpu_spot_finding_mask() == 1) return 1;
 
     // Create computing streams
     for (int i = 0; i < NCUDA_STREAMS; i++) {
@@ -176,8 +278,38 @@ int setup_gpu(int device) {
     return 0;
 }
 
+// NUMA node of the GPU, -1 if not known
+int gpu_numa_node(int device) {
+    char pci_bus_id[32];
+    if (cudaDeviceGetPCIBusId(pci_bus_id, sizeof(pci_bus_id), device) != cudaSuccess) return -1;
+    return ThreadPlacement::GetPCIDeviceNode(pci_bus_id);
+}
+
+// Number of CUDA devices, 0 if there is no driver
+int gpu_device_count() {
+    int count = 0;
+    if (cudaGetDeviceCount(&count) != cudaSuccess) return 0;
+    return count;
+}
+
+// Copy spot finding mask to GPU, must not be called during data collection
+int upload_gpu_spot_finding_mask() {
+    cudaError_t err = cudaMemcpy(gpu_mask, &spot_finding_mask, sizeof(spot_finding_mask_t), cudaMemcpyHostToDevice);
+    if (err != cudaSuccess) {
+         std::cerr << "GPU: mask copy error " << cudaGetErrorString(err) << std::endl;
+         return 1;
+    }
+    return 0;
+}
+
 int close_gpu() {
+    cudaFree(gpu_mask);
+    cudaFree(gpu_found);
+    cudaFree(gpu_out_used);
+    cudaFree(gpu_out_fragment);
     cudaFree(gpu_out);
+    for (int i = 0; i < NCUDA_STREAMS; i++)
+        host_out[i] = strong_pixel_output_t();
     cudaFree(gpu_data);
     cudaError_t err = cudaHostUnregister(ib_buffer);
     for (int i = 0; i < NCUDA_STREAMS; i++)
@@ -194,14 +326,48 @@ int close_gpu() {
     return 0;
 }
 
+// Kernel is compiled for each box size, the one selected for collection is started
+template<typename T>
+void launch_find_spots(size_t blocks, cudaStream_t stream, T *in, strong_pixel *out, uint16_t *out_fragment,
+                       unsigned int *out_used, uint32_t *found, size_t pool_size, int N) {
+    float strong = experiment_settings.strong_pixel;
+    int32_t min_value = strong_pixel_min_value(experiment_settings);
+    int32_t max_value = strong_pixel_max_value(experiment_settings);
+    switch (spot_box_nb(experiment_settings)) {
+        case 1:
+            find_spots_colspot<T, 1, 1> <<<blocks, 32, 0, stream>>>
+                (in, gpu_mask, out, out_fragment, out_used, found, pool_size, strong, min_value, max_value, N);
+            break;
+        case 2:
+            find_spots_colspot<T, 2, 2> <<<blocks, 32, 0, stream>>>
+                (in, gpu_mask, out, out_fragment, out_used, found, pool_size, strong, min_value, max_value, N);
+            break;
+        case 3:
+            find_spots_colspot<T, 3, 3> <<<blocks, 32, 0, stream>>>
+                (in, gpu_mask, out, out_fragment, out_used, found, pool_size, strong, min_value, max_value, N);
+            break;
+        case 4:
+            find_spots_colspot<T, 4, 4> <<<blocks, 32, 0, stream>>>
+                (in, gpu_mask, out, out_fragment, out_used, found, pool_size, strong, min_value, max_value, N);
+            break;
+        case 5:
+            find_spots_colspot<T, 5, 5> <<<blocks, 32, 0, stream>>>
+                (in, gpu_mask, out, out_fragment, out_used, found, pool_size, strong, min_value, max_value, N);
+            break;
+    }
+}
+
 void *run_gpu_thread(void *in_threadarg) {
     ThreadArg *arg = (ThreadArg *) in_threadarg;
 
+    thread_placement.PinThread("gpu");
+
     // GPU device is valid on per-thread basis, so every thread needs to set it
     cudaSetDevice(receiver_settings.gpu_device);
 
-    // NIMAGES_PER_STREAM is defined for 16-bit image, so it needs to be adjusted for 32-bit
-    size_t images_per_stream = NIMAGES_PER_STREAM * 2 / experiment_settings.pixel_depth;
+    // images_per_stream is defined for 16-bit image, so it needs to be adjusted for 32-bit
+    size_t images_per_stream = cuda_stream_images(experiment_settings);
+    size_t pool_size = host_out[0].pixels.size();
     size_t fragment_size = ((NMODULES/2) * COLS * LINES * experiment_settings.pixel_depth);
 
     size_t total_chunks = experiment_settings.nimages_to_write / images_per_stream;
@@ -219,6 +385,7 @@ void *run_gpu_thread(void *in_threadarg) {
          chunk += NCUDA_STREAMS) {
 
          std::vector<spot_t> spots;
+         std::vector<image_spot_count_t> image_counts;
 
          size_t ib_slice = chunk % (NCUDA_STREAMS*CUDA_TO_IB_BUFFER);
 
@@ -226,8 +393,8 @@ void *run_gpu_thread(void *in_threadarg) {
          if (images > images_per_stream) images = images_per_stream;
 
          pthread_mutex_lock(writer_threads_done_mutex+ib_slice);
-         // Wait till everyone is done
-         while (writer_threads_done[ib_slice] < receiver_settings.compression_threads)
+         // Wait till all images of the chunk are written
+         while ((size_t) writer_threads_done[ib_slice] < images)
              pthread_cond_wait(writer_threads_done_cond+ib_slice, 
                                writer_threads_done_mutex+ib_slice);
          // Restore full values and continue
@@ -249,17 +416,20 @@ void *run_gpu_thread(void *in_threadarg) {
 
          cudaEventRecord (event_mem_copied, stream[thread_id]);
 
+         // Empty output pool
+         cudaMemsetAsync(gpu_out_used + thread_id, 0, sizeof(unsigned int), stream[thread_id]);
+
          // Start GPU kernel
          if (experiment_settings.pixel_depth == 2)
-             find_spots_colspot<int16_t> <<<images_per_stream * 2 / 32, 32, 0, stream[thread_id]>>>
-                 ((int16_t *) (gpu_data + thread_id * images_per_stream * fragment_size),
-                  gpu_out + thread_id * images_per_stream * 2 * MAX_STRONG,
-                  experiment_settings.strong_pixel, images * 2);
+             launch_find_spots<int16_t>(images_per_stream * 2 / 32, stream[thread_id],
+                  (int16_t *) (gpu_data + thread_id * images_per_stream * fragment_size),
+                  gpu_out + thread_id * pool_size, gpu_out_fragment + thread_id * pool_size,
+                  gpu_out_used + thread_id, gpu_found + thread_id * images_per_stream * 2, pool_size, images * 2);
          else
-             find_spots_colspot<int32_t> <<<images_per_stream * 2 / 32, 32, 0, stream[thread_id]>>>
-                 ((int32_t *) (gpu_data + thread_id * images_per_stream * fragment_size),
-                  gpu_out + thread_id * images_per_stream * 2 * MAX_STRONG,
-                  experiment_settings.strong_pixel, images * 2);
+             launch_find_spots<int32_t>(images_per_stream * 2 / 32, stream[thread_id],
+                  (int32_t *) (gpu_data + thread_id * images_per_stream * fragment_size),
+                  gpu_out + thread_id * pool_size, gpu_out_fragment + thread_id * pool_size,
+                  gpu_out_used + thread_id, gpu_found + thread_id * images_per_stream * 2, pool_size, images * 2);
 
          // After data are copied, one can release buffer
          err = cudaEventSynchronize(event_mem_copied);
@@ -281,16 +451,16 @@ void *run_gpu_thread(void *in_threadarg) {
              pthread_exit(0);
          }
 
-         // Analyze results to find spots
+         // Group strong pixels by fragment and analyze results to find spots
          // gpu_out is in unified memory and doesn't need to be explicitly copied to CPU
-         analyze_spots(gpu_out + thread_id * images_per_stream * 2 * MAX_STRONG, spots, experiment_settings.connect_spots_between_frames, images, chunk * images_per_stream);
+         group_strong_pixels(gpu_out + thread_id * pool_size, gpu_out_fragment + thread_id * pool_size,
+                             gpu_out_used[thread_id], gpu_found + thread_id * images_per_stream * 2, images * 2,
+                             host_out[thread_id]);
+         analyze_spots(host_out[thread_id], strong_pixel_count + thread_id * STRONG_PIXEL_COUNT_PIXELS, spots,
+                       image_counts, experiment_settings.connect_spots_between_frames, images, chunk * images_per_stream);
 
          // Send spots found by spot finder via TCP/IP
-         pthread_mutex_lock(&accepted_socket_mutex);
-         size_t spot_data_size = spots.size();
-         send(accepted_socket, &spot_data_size, sizeof(size_t), 0);
-         send(accepted_socket, spots.data(), spot_data_size * sizeof(spot_t), 0);
-         pthread_mutex_unlock(&accepted_socket_mutex);
+         send_spots(spots, strong_pixel_overflow(host_out[thread_id], images * 2), image_counts, chunk);
     }
     cudaEventDestroy (event_mem_copied);
     pthread_exit(0);
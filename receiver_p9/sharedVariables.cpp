@@ -20,8 +20,8 @@ size_t frame_buffer_size = 0;
 size_t status_buffer_size = 0;
 size_t gain_pedestal_data_size = 0;
 size_t jf_packet_headers_size = 0;
-const size_t ib_buffer_size = COMPOSED_IMAGE_SIZE * RDMA_SQ_SIZE * sizeof(int16_t);
-const size_t strong_pixel_count_size = LINES * COLS * (NMODULES/2) * sizeof(uint64_t);
+size_t ib_buffer_size = 0;
+const size_t strong_pixel_count_size = NCUDA_STREAMS * STRONG_PIXEL_COUNT_PIXELS * sizeof(uint32_t);
 
 receiver_settings_t receiver_settings;
 ib_settings_t ib_settings;
@@ -32,11 +32,6 @@ uint32_t trigger_frame = 0;
 pthread_mutex_t trigger_frame_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  trigger_frame_cond = PTHREAD_COND_INITIALIZER;
 
-// IB buffer usage
-int16_t ib_buffer_occupancy[RDMA_SQ_SIZE];
-pthread_mutex_t ib_buffer_occupancy_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t ib_buffer_occupancy_cond = PTHREAD_COND_INITIALIZER;
-
 // TCP/IP socket
 int sockfd;
 int accepted_socket; // There is only one accepted socket at the time
@@ -59,7 +54,12 @@ pthread_mutex_t writer_threads_done_mutex[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 pthread_cond_t writer_threads_done_cond[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 int writer_threads_done[NCUDA_STREAMS*CUDA_TO_IB_BUFFER];
 
-std::set<std::pair<int16_t, int16_t> > bad_pixels;
+const GeometryPlan geometry_plan(NMODULES);
+DetectorGeometry detector_geometry(DEFAULT_NCARDS, NMODULES);
+
+ThreadPlacement thread_placement;
+
+spot_finding_mask_t spot_finding_mask;
+resolution_map_t resolution_map;
 
-uint64_t *strong_pixel_count = NULL;
-pthread_mutex_t strong_pixel_count_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint32_t *strong_pixel_count = NULL;
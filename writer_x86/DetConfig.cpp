@@ -154,7 +154,7 @@ int setup_detector() {
         std::cout << "Set number of frames" << std::endl;
         det->setNumberOfFrames(experiment_settings.nframes_to_collect + DELAY_FRAMES_STOP_AND_QUIT+1);
         std::cout << "Check detector size" << std::endl;
-        if (det->size() != NMODULES * NCARDS) {
+        if ((size_t) det->size() != detector_geometry.GetModulesNum()) {
             std::cerr << "Mismatch in detector size" << std::endl;
             return 1;
         }
@@ -404,49 +404,35 @@ int SaveAngleContainer(hid_t location, std::string const& name, double start, do
 
 
 void transform_and_write_mask(hid_t grp, bool replace = false) {
-    uint32_t *pixel_mask = (uint32_t *) calloc(XPIXEL * YPIXEL, sizeof(uint32_t));
-
-    for (int module = 0; module < NMODULES*NCARDS; module ++) {
-        for (uint64_t line = 0; line < MODULE_LINES; line ++) {
-            size_t pixel_in = (module * MODULE_LINES + line) * MODULE_COLS;
-            size_t line_out = (513L - line - (line / 256) * 2L + 514L * (3 - (module / 2))) * 2L + module % 2;
-            // Modules are interleaved to make 2 modules in one line
-            for (uint64_t column = 0; column < MODULE_COLS; column ++) {
-                size_t pixel_out = line_out * (XPIXEL/2) + column + (column / 256) * 2L;
-                pixel_mask[pixel_out] = gain_pedestal.pixel_mask[pixel_in + column];
-                // Vertical multipixel lines
-                if ((column % 256 == 0) && (column != 0)) pixel_mask[pixel_out - 1] = pixel_mask[pixel_out];
-                if ((column % 256 == 255) && (column != MODULE_COLS)) pixel_mask[pixel_out + 1] = pixel_mask[pixel_out];
-            }
-        }
-    }
+    uint32_t *pixel_mask = (uint32_t *) calloc(detector_geometry.GetPixels(), sizeof(uint32_t));
+
+    // Card 0 is at the bottom of the image
+    for (size_t card = 0; card < detector_geometry.GetCardsNum(); card ++)
+        geometry_plan.Transform(pixel_mask + detector_geometry.GetCardPixelOffset(card),
+                                gain_pedestal.pixel_mask.data() + card * NPIXEL);
 
-    // Copy horizontal multi-pixel lines
-    for (int i = 0; i < NMODULES * NCARDS / 2; i ++) {
-        memcpy(pixel_mask + (514 * i + 256) * 1030 * 2, pixel_mask + (514 * i + 255) * 1030 * 2, 2 * 1030 * sizeof(uint32_t));
-        memcpy(pixel_mask + (514 * i + 257) * 1030 * 2, pixel_mask + (514 * i + 258) * 1030 * 2, 2 * 1030 * sizeof(uint32_t));
-    }
     if (replace) {
         hid_t dataset_id = H5Dopen(master_file_id, "/entry/instrument/detector/pixel_mask", H5P_DEFAULT);
         herr_t status = H5Dwrite(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
                           pixel_mask);
         status = H5Dclose(dataset_id);
     } else {
-        saveUInt2D(grp, "pixel_mask", pixel_mask, "", YPIXEL, XPIXEL);
+        saveUInt2D(grp, "pixel_mask", pixel_mask, "", detector_geometry.GetYPixels(), detector_geometry.GetXPixels());
     }
     free(pixel_mask);
 }
 
 void write_metrology() {
-    double moduleOrigin[NMODULES*NCARDS][3];
+    size_t nmodules = detector_geometry.GetModulesNum();
+    double moduleOrigin[NMODULES*MAX_NCARDS][3];
     double detectorCenter[3] = {0.0, 0.0, 0.0};
 
-    double size_pxl_x = 2 * 1030 + VERTICAL_GAP_PIXELS;
-    double size_pxl_y = (NMODULES * NCARDS / 2) * 514 + (NMODULES * NCARDS / 2 - 1) * HORIZONTAL_GAP_PIXELS;
+    double size_pxl_x = detector_geometry.GetXPixelsWithGaps();
+    double size_pxl_y = detector_geometry.GetYPixelsWithGaps();
 
-    for (int i = 0; i < NMODULES*NCARDS; i ++) {
-        double corner_x = (i%2) * (1030 + VERTICAL_GAP_PIXELS); // +GAP
-        double corner_y = (i/2) * (514 + HORIZONTAL_GAP_PIXELS); // +GAP
+    for (size_t i = 0; i < nmodules; i++) {
+        double corner_x = detector_geometry.GetModuleXWithGaps(i);
+        double corner_y = detector_geometry.GetModuleYWithGaps(i);
         // 1. Find module corner in lab coordinates, based on pixel coordinates
         moduleOrigin[i][0] = ((size_pxl_x - corner_x) - (size_pxl_x - experiment_settings.beam_x)) * PIXEL_SIZE_IN_MM;
         moduleOrigin[i][1] = ((size_pxl_y - corner_y) - (size_pxl_y - experiment_settings.beam_y)) * PIXEL_SIZE_IN_MM;
@@ -464,13 +450,14 @@ void write_metrology() {
         detectorCenter[2] += moduleCenter[2];
     }
 
-    detectorCenter[0] /= NMODULES*NCARDS;
-    detectorCenter[1] /= NMODULES*NCARDS;
-    detectorCenter[2] /= NMODULES*NCARDS;
+    detectorCenter[0] /= nmodules;
+    detectorCenter[1] /= nmodules;
+    detectorCenter[2] /= nmodules;
 
     hid_t grp, dataset;
 
-    grp = createGroup(master_file_id, "/entry/instrument/" DETECTOR_NAME "/transformations","NXtransformations");
+    std::string detector_group = "/entry/instrument/" + detector_geometry.GetName();
+    grp = createGroup(master_file_id, (detector_group + "/transformations").c_str(),"NXtransformations");
 
     saveDouble(grp, "AXIS_RAIL", experiment_settings.detector_distance, "mm");
     saveDouble(grp, "AXIS_D0", 0.0, "mm");
@@ -498,7 +485,7 @@ void write_metrology() {
     H5Dclose(dataset);
 
 
-    for (int i = 0; i < NMODULES*NCARDS; i++) {
+    for (size_t i = 0; i < nmodules; i++) {
         double mod_vector[3] = {0, 0, 1};
         double mod_offset[3] = {moduleOrigin[i][0] - detectorCenter[0], moduleOrigin[i][1] - detectorCenter[1], moduleOrigin[i][2] - detectorCenter[2]};
         std::string detModuleAxis = "AXIS_D0M" + std::to_string(i);
@@ -516,11 +503,11 @@ void write_metrology() {
 
     H5Gclose(grp);
 
-    for (int i = 0; i < NMODULES*NCARDS; i++) {
+    for (size_t i = 0; i < nmodules; i++) {
         std::string moduleGroup = "/entry/instrument/detector/ARRAY_D0M" + std::to_string(i);
         grp = createGroup(master_file_id, moduleGroup.c_str() ,"NXdetector_module");
-        int origin[2] = {(i / 2 ) * 514, (i % 2) * 1030};
-        int size[2] = {514,1030};
+        int origin[2] = {(int) detector_geometry.GetModuleY(i), (int) detector_geometry.GetModuleX(i)};
+        int size[2] = {GeometryPlan::ComposedModuleLines, GeometryPlan::ComposedModuleCols};
         saveInt1D(grp, "data_origin", origin, "", 2);
         saveInt1D(grp, "data_size", size, "", 2);
 
@@ -530,7 +517,7 @@ void write_metrology() {
 
         dataset = H5Dopen2(grp , "fast_pixel_direction", H5P_DEFAULT);
         addStringAttribute(dataset, "transformation_type","translation");
-        addStringAttribute(dataset, "depends_on","/entry/instrument/" DETECTOR_NAME "/transformations/AXIS_D0M" + std::to_string(i));
+        addStringAttribute(dataset, "depends_on",detector_group + "/transformations/AXIS_D0M" + std::to_string(i));
         addDoubleAttribute(dataset, "offset", offset_fast, 3);
 
         double vector_fast[3] = {-1,0,0};
@@ -544,7 +531,7 @@ void write_metrology() {
 
         dataset = H5Dopen2(grp , "slow_pixel_direction", H5P_DEFAULT);
         addStringAttribute(dataset, "transformation_type","translation");
-        addStringAttribute(dataset, "depends_on","/entry/instrument/" DETECTOR_NAME "/transformations/AXIS_D0M" + std::to_string(i));
+        addStringAttribute(dataset, "depends_on",detector_group + "/transformations/AXIS_D0M" + std::to_string(i));
         addDoubleAttribute(dataset, "offset", offset_slow, 3);
         double vector_slow[3] = {0,-1,0};
         addDoubleAttribute(dataset, "vector", vector_slow, 3);
@@ -560,7 +547,7 @@ int write_detector_parameters() {
     saveDouble(det_grp,"beam_center_x",experiment_settings.beam_x, "pixel");
     saveDouble(det_grp,"beam_center_y",experiment_settings.beam_y, "pixel");
     saveDouble(det_grp,"count_time",experiment_settings.count_time, "s");
-    saveDouble(det_grp,"frame_time",experiment_settings.frame_time, "s");
+    saveDouble(det_grp,"frame_time",image_time(experiment_settings), "s");
     saveDouble(det_grp,"distance", experiment_settings.detector_distance / 1000.0, "m");
     saveDouble(det_grp,"detector_distance", experiment_settings.detector_distance / 1000.0, "m");
     saveDouble(det_grp,"sensor_thickness", SENSOR_THICKNESS_IN_UM/1000000.0, "m");
@@ -589,8 +576,8 @@ int write_detector_parameters() {
     saveDouble(grp, "frame_time_detector", experiment_settings.frame_time_detector, "s");
     saveDouble(grp, "count_time_detector", experiment_settings.count_time_detector, "s");
     saveInt(grp, "nimages_per_data_file" , experiment_settings.nimages_to_write);
-    saveInt(grp, "x_pixels_in_detector", XPIXEL);
-    saveInt(grp, "y_pixels_in_detector", YPIXEL);
+    saveInt(grp, "x_pixels_in_detector", detector_geometry.GetXPixels());
+    saveInt(grp, "y_pixels_in_detector", detector_geometry.GetYPixels());
 
     if (writer_settings.compression == JF_COMPRESSION_BSHUF_LZ4) saveString(grp,"compression","bslz4");
     else if (writer_settings.compression == JF_COMPRESSION_BSHUF_ZSTD) saveString(grp,"compression","bszstd");
@@ -609,9 +596,9 @@ int write_detector_parameters() {
 }
 
 int write_detector_group() {
-    hid_t grp = createGroup(master_file_id, "/entry/instrument/" DETECTOR_NAME,"NXdetector_group");
+    hid_t grp = createGroup(master_file_id, ("/entry/instrument/" + detector_geometry.GetName()).c_str(),"NXdetector_group");
 
-    std::vector<std::string> group_names = {DETECTOR_NAME, "detector"};
+    std::vector<std::string> group_names = {detector_geometry.GetName(), "detector"};
 
     int32_t group_index[2] = {1,2};
     int32_t group_parent[2] = {-1, 1};
@@ -715,6 +702,23 @@ int write_spots() {
     saveDouble2D(grp, "spot_coord", tmp, "", spots.size(), 2);
 
     free(tmp);
+
+    // Hit finding result per image, images not reported by all cards are not hits
+    if (hit_finding_enabled()) {
+        std::vector<int> hit_tmp(image_hits.size());
+        for (size_t i = 0; i < image_hits.size(); i++)
+            hit_tmp[i] = image_hits[i].spots;
+        saveInt1D(grp, "hit_spot_count", hit_tmp.data(), "", image_hits.size());
+
+        for (size_t i = 0; i < image_hits.size(); i++)
+            hit_tmp[i] = image_hits[i].strong_pixels;
+        saveInt1D(grp, "hit_strong_pixel_count", hit_tmp.data(), "", image_hits.size());
+
+        for (size_t i = 0; i < image_hits.size(); i++)
+            hit_tmp[i] = (image_hits[i].cards == (uint16_t) detector_geometry.GetCardsNum()) && image_hits[i].hit;
+        saveInt1D(grp, "hit", hit_tmp.data(), "", image_hits.size());
+    }
+
     H5Gclose(grp);
     return 0;
 }
@@ -784,7 +788,7 @@ int open_master_hdf5() {
 int close_master_hdf5() {
     hid_t grp = H5Gopen2(master_file_id, "/entry", H5P_DEFAULT);
     saveString(grp, "start_time", time_UTC(time_start.tv_sec, time_start.tv_nsec));
-    saveString(grp, "end_time_estimated", time_UTC(time_start.tv_sec + (time_t) (experiment_settings.nframes_to_collect * experiment_settings.frame_time)));
+    saveString(grp, "end_time_estimated", time_UTC(time_start.tv_sec + (time_t) (experiment_settings.nframes_to_collect * experiment_settings.frame_time_detector)));
     saveString(grp, "end_time", time_UTC(time_end.tv_sec, time_end.tv_nsec));
     H5Gclose(grp);
 
@@ -797,15 +801,15 @@ int close_master_hdf5() {
     H5Gclose(grp);
 
     grp = createGroup(master_file_id, "/entry/instrument/detector/detectorSpecific/adu_to_photon","NXcollection");
-    saveUInt16_3D(grp, "G0", gain_pedestal.gainG0, MODULE_COLS, MODULE_LINES, NMODULES * NCARDS, 1.0/(16384.0*512.0));
-    saveUInt16_3D(grp, "G1", gain_pedestal.gainG1, MODULE_COLS, MODULE_LINES, NMODULES * NCARDS, -1.0/8192);
-    saveUInt16_3D(grp, "G2", gain_pedestal.gainG2, MODULE_COLS, MODULE_LINES, NMODULES * NCARDS, -1.0/8192);
+    saveUInt16_3D(grp, "G0", gain_pedestal.gainG0.data(), MODULE_COLS, MODULE_LINES, detector_geometry.GetModulesNum(), 1.0/(16384.0*512.0));
+    saveUInt16_3D(grp, "G1", gain_pedestal.gainG1.data(), MODULE_COLS, MODULE_LINES, detector_geometry.GetModulesNum(), -1.0/8192);
+    saveUInt16_3D(grp, "G2", gain_pedestal.gainG2.data(), MODULE_COLS, MODULE_LINES, detector_geometry.GetModulesNum(), -1.0/8192);
     H5Gclose(grp);
 
     grp = createGroup(master_file_id, "/entry/instrument/detector/detectorSpecific/pedestal_in_adu","NXcollection");
-    saveUInt16_3D(grp, "G0", gain_pedestal.pedeG0, MODULE_COLS, MODULE_LINES, NMODULES * NCARDS, 0.25);
-    saveUInt16_3D(grp, "G1", gain_pedestal.pedeG1, MODULE_COLS, MODULE_LINES, NMODULES * NCARDS, 0.25);
-    saveUInt16_3D(grp, "G2", gain_pedestal.pedeG2, MODULE_COLS, MODULE_LINES, NMODULES * NCARDS, 0.25);
+    saveUInt16_3D(grp, "G0", gain_pedestal.pedeG0.data(), MODULE_COLS, MODULE_LINES, detector_geometry.GetModulesNum(), 0.25);
+    saveUInt16_3D(grp, "G1", gain_pedestal.pedeG1.data(), MODULE_COLS, MODULE_LINES, detector_geometry.GetModulesNum(), 0.25);
+    saveUInt16_3D(grp, "G2", gain_pedestal.pedeG2.data(), MODULE_COLS, MODULE_LINES, detector_geometry.GetModulesNum(), 0.25);
     H5Gclose(grp);
 
     if (experiment_settings.enable_spot_finding) write_spots();
@@ -857,8 +861,8 @@ int open_data_hdf5() {
         dim1 = 512 * NMODULES; dim2 = 1024;
     }
 
-    hsize_t dims[] = {images, dim1*NCARDS, dim2};
-    hsize_t maxdims[] = {H5S_UNLIMITED, dim1*NCARDS, dim2};
+    hsize_t dims[] = {images, dim1*detector_geometry.GetCardsNum(), dim2};
+    hsize_t maxdims[] = {H5S_UNLIMITED, dim1*detector_geometry.GetCardsNum(), dim2};
     hsize_t chunk[] = {1, dim1, dim2};
 
     // Create the data space for the dataset.
@@ -934,9 +938,9 @@ int save_data_hdf(char *data, size_t size, size_t frame, int chunk) {
     hsize_t offset[3];
     offset[0] = frame;
     if (experiment_settings.conversion_mode == MODE_CONV)
-        offset[1] = (NCARDS - (chunk + 1)) * 514 * NMODULES / 2;
+        offset[1] = detector_geometry.GetCardLineOffset(chunk);
     else
-        offset[1] = (NCARDS - (chunk + 1)) * 512 * NMODULES;
+        offset[1] = (detector_geometry.GetCardsNum() - (chunk + 1)) * 512 * NMODULES;
     offset[2] = 0;
     herr_t h5ret = H5Dwrite_chunk(data_hdf5_dataset, H5P_DEFAULT, 0, offset, size, data);
     HDF5_ERROR(h5ret,H5Dwrite_chunk);
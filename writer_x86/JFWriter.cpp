@@ -29,10 +29,10 @@
 #include "../bitshuffle/bshuf_h5filter.h"
 #include "../include/xray.h"
 
-double mean_pedestalG0[NMODULES*NCARDS];
-double mean_pedestalG1[NMODULES*NCARDS];
-double mean_pedestalG2[NMODULES*NCARDS];
-size_t bad_pixels[NMODULES*NCARDS];
+double mean_pedestalG0[NMODULES*MAX_NCARDS];
+double mean_pedestalG1[NMODULES*MAX_NCARDS];
+double mean_pedestalG2[NMODULES*MAX_NCARDS];
+size_t bad_pixels[NMODULES*MAX_NCARDS];
 
 int jfwriter_setup() {
     // Register HDF5 bitshuffle filter
@@ -46,7 +46,23 @@ int jfwriter_setup() {
         return 1;
     }
 #endif
-    for (int i = 0; i < NCARDS; i++) {
+    std::cout << "Detector " << detector_geometry.GetName() << ": " << detector_geometry.GetCardsNum() << " cards, "
+              << detector_geometry.GetXPixels() << "x" << detector_geometry.GetYPixels() << " pixels" << std::endl;
+
+    // Calibration of all modules, card after card
+    size_t calibration_size = detector_geometry.GetCardsNum() * NPIXEL;
+    gain_pedestal.gainG0.assign(calibration_size, 0);
+    gain_pedestal.gainG1.assign(calibration_size, 0);
+    gain_pedestal.gainG2.assign(calibration_size, 0);
+    gain_pedestal.pedeG0.assign(calibration_size, 0);
+    gain_pedestal.pedeG1.assign(calibration_size, 0);
+    gain_pedestal.pedeG2.assign(calibration_size, 0);
+    gain_pedestal.pixel_mask.assign(calibration_size, 0);
+
+    if (setup_thread_placement()) return 1;
+    if (plan_buffers()) return 1;
+
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++) {
         // Setup IB and allocate memory
         if (setup_infiniband(i)) return 1;
         pthread_mutex_init(&(remaining_images_mutex[i]), NULL);
@@ -55,15 +71,15 @@ int jfwriter_setup() {
     init_influxdb_client();
 
     // Initialize preview image
-    preview = (int32_t *) malloc(MAX_PREVIEW * PREVIEW_SIZE * sizeof(int32_t));
+    preview = (int32_t *) malloc(writer_settings.max_preview * detector_geometry.GetPixels() * sizeof(int32_t));
     if (preview == NULL) return 1;
-    for (int i = 0 ; i < NCARDS*MAX_PREVIEW; i++)  preview_image_available[i] = false;
+    preview_image_available.assign(detector_geometry.GetCardsNum() * writer_settings.max_preview, false);
 
     return 0;
 }
 
 int jfwriter_close() {
-    for (int i = 0; i < NCARDS; i++) {
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++) {
         // Setup IB and allocate memory
         close_infiniband(i);
         pthread_mutex_destroy(&(remaining_images_mutex[i]));
@@ -81,7 +97,7 @@ int jfwriter_close() {
 // Arm, disarm and pedestalG0/1/2 are wrappers for actual tasks
 
 int jfwriter_start() {
-    for (int i = 0; i < NCARDS; i++) {
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++) {
         if (connect_to_power9(i)) return 1;
         remaining_images[i] = experiment_settings.nimages_to_write;
     }
@@ -100,7 +116,7 @@ int jfwriter_start() {
     writer_thread_arg = (writer_thread_arg_t *) calloc(writer_settings.nthreads, sizeof(writer_thread_arg_t));
 
     // Barrier #1 - All threads on P9 are set up running
-    for (int i = 0; i < NCARDS; i++)
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++)
         if (exchange_magic_number(writer_connection_settings[i].sockfd)) return 1;
 
     // Start writer threads - these threads receive images via IB Verbs
@@ -109,18 +125,15 @@ int jfwriter_start() {
             if (open_data_hdf5()) return 1;
 
         for (int i = 0; i < writer_settings.nthreads; i++) {
-            writer_thread_arg[i].thread_id = i / NCARDS;
-            if (NCARDS > 1)
-                writer_thread_arg[i].card_id = i % NCARDS;
-            else
-                writer_thread_arg[i].card_id = 0;
+            writer_thread_arg[i].thread_id = i / detector_geometry.GetCardsNum();
+            writer_thread_arg[i].card_id = i % detector_geometry.GetCardsNum();
             int ret = pthread_create(writer_thread+i, NULL, run_writer_thread, writer_thread_arg+i);
         }
     }
 
     // Start metadata threads - these threads receive metadata via TCP/IP socket
     // When started, these threads will exchange magic number again (barrier #2)
-    for (int i = 0; i < NCARDS; i++) {
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++) {
         metadata_thread_arg[i].card_id = i;
         int ret = pthread_create(metadata_thread+i, NULL, run_metadata_thread, metadata_thread_arg+i);
     }
@@ -153,11 +166,23 @@ int jfwriter_stop() {
     clock_gettime(CLOCK_REALTIME, &time_end);
 
     // Involves barrier after collecting data
-    for (int i = 0; i < NCARDS; i++) {
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++) {
         int ret = pthread_join(metadata_thread[i], NULL);
         if (disconnect_from_power9(i)) return 1;
     }
 
+    if (hit_finding_enabled() && (experiment_settings.nimages_to_write > 0)) {
+        pthread_mutex_lock(&spots_statistics_mutex);
+        std::cout << "Hit finding: " << hit_statistics.hits << " hits in " << hit_statistics.classified << " images";
+        if (hit_statistics.classified > 0)
+            std::cout << " (" << 100.0 * hit_statistics.hits / hit_statistics.classified << "%)";
+        if (hit_veto_enabled())
+            std::cout << ", " << hit_statistics.vetoed << " images not written, "
+                      << hit_statistics.unclassified << " written before classification";
+        std::cout << std::endl;
+        pthread_mutex_unlock(&spots_statistics_mutex);
+    }
+
 #ifndef OFFLINE
     close_detector();
 #endif
@@ -165,8 +190,8 @@ int jfwriter_stop() {
     return 0;
 }
 
-void calc_mean_pedestal(uint16_t in[NCARDS*NPIXEL], double out[NMODULES*NCARDS]) {
-    for (size_t i = 0; i < NMODULES * NCARDS; i++) {
+void calc_mean_pedestal(const std::vector<uint16_t> &in, double out[NMODULES*MAX_NCARDS]) {
+    for (size_t i = 0; i < detector_geometry.GetModulesNum(); i++) {
         double sum = 0;
         double count = 0;
         for (size_t j = 0; j < MODULE_COLS*MODULE_LINES; j++) {
@@ -180,7 +205,7 @@ void calc_mean_pedestal(uint16_t in[NCARDS*NPIXEL], double out[NMODULES*NCARDS])
 }
 
 void count_bad_pixel() {
-    for (size_t i = 0; i < NMODULES * NCARDS; i++) {
+    for (size_t i = 0; i < detector_geometry.GetModulesNum(); i++) {
         size_t count = 0;
         for (size_t j = 0; j < MODULE_COLS*MODULE_LINES; j++) {
             if (gain_pedestal.pixel_mask[i * MODULE_COLS * MODULE_LINES + j] != 0)
@@ -208,7 +233,7 @@ int jfwriter_pedestal() {
         if (jfwriter_pedestal_all()) return 1;
         i++;
         total_bad_pixels = 0;
-        for (int j = 0; j < NMODULES*NCARDS; j++) total_bad_pixels += bad_pixels[j];
+        for (size_t j = 0; j < detector_geometry.GetModulesNum(); j++) total_bad_pixels += bad_pixels[j];
     } while ((i < 10) && (total_bad_pixels > 100000));
     return 0;
 }
@@ -283,6 +308,8 @@ void reset_spot_statistics() {
     spot_count_per_image.clear();
     spot_count_per_image.resize(omega_range, 0);
     spot_statistics_sequence = 0;
+    spot_statistics.overflow.fragments = 0;
+    spot_statistics.overflow.pixels = 0;
 
     // Resolution ring statistics
     // Not ideal, but resolution of edge with smaller d is selected.
@@ -316,6 +343,26 @@ void reset_spot_statistics() {
     for (int i = 0; i < spot_statistics.resolution_bins; i++)
         spot_statistics.mean_one_over_d2.push_back((spot_statistics.one_over_d2[i+1]+spot_statistics.one_over_d2[i])/2.0);
 
+    // Ice rings, excluded rings are always reported as contaminated
+    spot_statistics.ice_rings.resize(ICE_RINGS);
+    spot_statistics.ice_ring_contamination = (experiment_settings.excluded_ice_rings != 0);
+    for (int i = 0; i < ICE_RINGS; i++) {
+        ice_ring_statistics_t &ring = spot_statistics.ice_rings[i];
+        ring.d = ice_ring_d[i];
+        ring.count = 0;
+        ring.background_count = 0;
+        ring.background_width = ice_ring_background_width(i, spot_statistics.resolution_limit);
+        ring.density_ratio = 0;
+        ring.excluded = experiment_settings.excluded_ice_rings & (1 << i);
+        ring.contaminated = ring.excluded;
+        ring.intensity.assign(spot_statistics.resolution_bins, 0);
+        ring.count_per_bin.assign(spot_statistics.resolution_bins, 0);
+    }
+
+    // Hit finding
+    image_hits.assign(hit_finding_enabled() ? experiment_settings.nimages_to_write : 0, image_hit_t{0, 0, 0, false});
+    hit_statistics = hit_statistics_t{0, 0, 0, 0};
+
     pthread_mutex_unlock(&spots_statistics_mutex);
 }
 
@@ -326,6 +373,10 @@ int jfwriter_arm() {
 
     writer_settings.timing_trigger = true;
 
+    // Ice rings found in the previous collection are excluded by spot finder,
+    // rings stay excluded till the option is switched off
+    experiment_settings.excluded_ice_rings = writer_settings.exclude_ice_rings ? contaminated_ice_rings() : 0;
+
     // Reset spots vector (purge spots found previously)
     spots.clear();
     // and also reset statistics
@@ -337,7 +388,7 @@ int jfwriter_arm() {
         if (open_master_hdf5()) return 1;
 
     // Reset preview counters
-    for (int i = 0 ; i < NCARDS*MAX_PREVIEW; i++)  preview_image_available[i] = false;
+    preview_image_available.assign(detector_geometry.GetCardsNum() * writer_settings.max_preview, false);
 
     return jfwriter_start();
 }
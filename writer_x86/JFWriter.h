@@ -29,17 +29,25 @@
 #endif
 
 #include "../include/JFApp.h"
-#define RDMA_RQ_SIZE 16000L // Maximum number of receive elements
-#define YPIXEL       (514L * NMODULES * NCARDS / 2)
-#define XPIXEL       (2 * 1030L)
+#include "../include/GeometryPlan.h"
+#include "../include/ThreadPlacement.h"
+#include "../include/HugePageBuffer.h"
+#include "../include/RingBufferPlan.h"
+#include "../include/DetectorGeometry.h"
+#include "../include/HitFinding.h"
+#define MAX_RDMA_RQ_SIZE 16000L // Maximum number of receive elements, actual number is chosen at startup from memory budget
+#define RDMA_CQ_BATCH 8 // Maximum number of completions handled by a writer thread at once
+#define HIT_DECISION_TIMEOUT 10.0 // s, images waiting for hit finding result are written after the time since the last image
 
 #define LZ4_BLOCK_SIZE  0
 #define ZSTD_BLOCK_SIZE (8*514*1030)
 
-#define MAX_PREVIEW 1000
+#define MAX_PREVIEW 1000 // Maximum number of preview images, actual number is chosen at startup from memory budget
 #define PREVIEW_FREQUENCY 0.2
 
-#define PREVIEW_SIZE (XPIXEL * YPIXEL)
+// Defaults for buffer sizing
+#define DEFAULT_MEMORY_BUDGET (144L*1024*1024*1024) // bytes
+#define DEFAULT_FRAME_RATE    2200.0                // Hz, JUNGFRAU full speed
 
 extern pthread_mutex_t spots_statistics;
 #define PEDESTAL_TIME_CUTOFF (60*60) // collect pedestal every 1 hour
@@ -59,6 +67,15 @@ struct writer_settings_t {
     bool hdf18_compat;          // True = (compatibility with HDF5 1.8), False = (use SWMR and VDS)
     std::string tracking_id;    // Dataset tracking ID, assigned by beamline
     std::string influxdb_url;   // URL of InfluxDB database
+    std::string placement_file_name; // Overrides of thread/memory placement, empty = automatic only
+    size_t memory_budget;       // RAM for large buffers (bytes)
+    double frame_rate;          // Expected frame rate (Hz), used to report backlog of rings
+    size_t receive_queue_size;  // 16-bit images in IB buffer and RDMA receive queue per card (half for 32-bit), chosen from memory budget
+    size_t max_preview;         // Preview images, chosen from memory budget
+    bool exclude_ice_rings;     // Ice rings found in a collection are excluded by spot finder in the following ones
+    uint32_t hit_min_spots;     // Hit finding: minimum spots for an image to be a hit
+    uint32_t hit_min_strong_pixels; // Hit finding: minimum strong pixels for an image to be a hit
+    bool write_only_hits;       // Hit finding: images, which are not hits, are not compressed and written
 };
 
 extern writer_settings_t writer_settings;
@@ -69,24 +86,32 @@ struct writer_connection_settings_t {
 	uint16_t receiver_tcp_port; // Receiver TCP port
 	std::string ib_dev_name;    // IB device name
 	ib_settings_t ib_settings;  // IB settings
+	HugePageBuffer ib_buffer_memory; // Memory of IB buffer
 	char *ib_buffer;            // IB buffer
 	ibv_mr *ib_buffer_mr;       // IB buffer memory region for Verbs
+	size_t images_per_stream;   // Images per spot finding chunk, reported by receiver
 };
 
+// RDMA buffer size is constant, so only half slots are used if pixel is 32-bit (with summation)
+inline size_t receive_queue_images(const experiment_settings_t &settings) {
+	return writer_settings.receive_queue_size * 2 / settings.pixel_depth;
+}
+
 // Thread information
 struct writer_thread_arg_t {
 	uint16_t thread_id;
 	uint16_t card_id;
 };
 
+// NPIXEL per card, card after card - allocated at setup for number of cards of the detector
 struct gain_pedestal_t {
-	uint16_t gainG0[NCARDS*NPIXEL];
-	uint16_t gainG1[NCARDS*NPIXEL];
-	uint16_t gainG2[NCARDS*NPIXEL];
-	uint16_t pedeG1[NCARDS*NPIXEL];
-	uint16_t pedeG2[NCARDS*NPIXEL];
-	uint16_t pedeG0[NCARDS*NPIXEL];
-	uint16_t pixel_mask[NCARDS*NPIXEL];
+	std::vector<uint16_t> gainG0;
+	std::vector<uint16_t> gainG1;
+	std::vector<uint16_t> gainG2;
+	std::vector<uint16_t> pedeG1;
+	std::vector<uint16_t> pedeG2;
+	std::vector<uint16_t> pedeG0;
+	std::vector<uint16_t> pixel_mask;
 };
 
 enum parameter_type_t {
@@ -111,6 +136,24 @@ struct read_only_exception : public std::exception {
 
 };
 
+// Ice ring is contaminated, if it has enough spots and spot density (per 1/d) is much higher
+// than in shells around the ring (outside of other rings)
+#define ICE_RING_BACKGROUND_WIDTH 0.016 // in 1/Angstrom, distance from the ring center
+#define ICE_RING_MIN_SPOTS        20
+#define ICE_RING_DENSITY_RATIO    3.0
+
+struct ice_ring_statistics_t {
+    float d;                       // d-spacing of the ring [Angstrom]
+    size_t count;                  // spots in the ring
+    size_t background_count;       // spots in shells around the ring
+    float background_width;        // width of these shells in 1/d [1/Angstrom], 0 = ring is beyond resolution limit
+    float density_ratio;           // spot density in the ring relative to shells around
+    bool contaminated;             // spots of the ring are excluded from Wilson plot
+    bool excluded;                 // spots of the ring are discarded by spot finder (experiment_settings.excluded_ice_rings)
+    std::vector<float> intensity;  // spots in the ring per resolution bin, these are also included in spot_statistics_t
+    std::vector<size_t> count_per_bin;
+};
+
 struct spot_statistics_t {
     float resolution_limit;
     float wilson_B;
@@ -121,22 +164,50 @@ struct spot_statistics_t {
     std::vector<size_t> count;
     std::vector<float> one_over_d2;
     std::vector<float> mean_one_over_d2;
+    spot_finding_overflow_t overflow;  // strong pixels lost by spot finders (all cards)
+    std::vector<ice_ring_statistics_t> ice_rings; // ICE_RINGS elements
+    bool ice_ring_contamination;       // at least one ice ring is contaminated
+};
+
+// Hit finding is done, if spots are not connected between frames (serial crystallography)
+// Each card reports spot and strong pixel count of its part of the image, decision is made
+// when all cards reported the image
+enum hit_decision_t {HIT_UNKNOWN, HIT_MISS, HIT_FOUND};
+
+struct hit_statistics_t {
+    size_t classified;       // images reported by all cards
+    size_t hits;
+    size_t vetoed;           // images not written, as these are not hits
+    size_t unclassified;     // images written before classification, as receive queue was running out
 };
 
+float ice_ring_background_width(int ring, float resolution_limit);
+uint16_t contaminated_ice_rings();
+
+bool hit_finding_enabled();
+bool hit_veto_enabled();
+hit_decision_t image_hit_decision(size_t image);
+
 void *run_writer_thread(void* thread_arg);
 void *run_metadata_thread(void* thread_arg);
 
 extern pthread_t *writer_thread;
 extern writer_thread_arg_t *writer_thread_arg;
 
-extern pthread_t metadata_thread[NCARDS];
-extern writer_thread_arg_t metadata_thread_arg[NCARDS];
+extern pthread_t metadata_thread[MAX_NCARDS];
+extern writer_thread_arg_t metadata_thread_arg[MAX_NCARDS];
 
 extern gain_pedestal_t gain_pedestal;
-extern online_statistics_t online_statistics[NCARDS];
+extern const GeometryPlan geometry_plan;
+extern DetectorGeometry detector_geometry; // number of cards is set from command line before setup
+
+// Writer threads and IB buffer of each card are placed on NUMA node of the IB card
+// (roles "writer<card>" and "ib_buffer<card>")
+extern ThreadPlacement thread_placement;
+extern online_statistics_t online_statistics[MAX_NCARDS];
 
 extern experiment_settings_t experiment_settings;
-extern writer_connection_settings_t writer_connection_settings[NCARDS];
+extern writer_connection_settings_t writer_connection_settings[MAX_NCARDS];
 
 extern uint8_t writers_done_per_file;
 extern pthread_mutex_t writers_done_per_file_mutex;
@@ -145,8 +216,8 @@ extern pthread_cond_t writers_done_per_file_cond;
 extern size_t total_compressed_size;
 extern pthread_mutex_t total_compressed_size_mutex;
 
-extern uint64_t remaining_images[NCARDS];
-extern pthread_mutex_t remaining_images_mutex[NCARDS];
+extern uint64_t remaining_images[MAX_NCARDS];
+extern pthread_mutex_t remaining_images_mutex[MAX_NCARDS];
 
 extern int32_t *preview; // not protected by mutex!
 extern std::vector<bool> preview_image_available;
@@ -160,6 +231,9 @@ extern int spot_statistics_sequence; // spot statistics sequence is incremented
 
 extern pthread_mutex_t spots_statistics_mutex;
 
+extern std::vector<image_hit_t> image_hits;     // protected by spots_statistics_mutex
+extern hit_statistics_t hit_statistics;         // protected by spots_statistics_mutex
+
 #ifndef OFFLINE
 extern sls::Detector *det;
 #endif
@@ -170,10 +244,10 @@ extern struct timespec time_pedestalG2;
 extern struct timespec time_start;
 extern struct timespec time_end;
 
-extern double mean_pedestalG0[NMODULES*NCARDS];
-extern double mean_pedestalG1[NMODULES*NCARDS];
-extern double mean_pedestalG2[NMODULES*NCARDS];
-extern size_t bad_pixels[NMODULES*NCARDS];
+extern double mean_pedestalG0[NMODULES*MAX_NCARDS];
+extern double mean_pedestalG1[NMODULES*MAX_NCARDS];
+extern double mean_pedestalG2[NMODULES*MAX_NCARDS];
+extern size_t bad_pixels[NMODULES*MAX_NCARDS];
 
 int open_master_hdf5();
 int close_master_hdf5();
@@ -195,6 +269,8 @@ int setup_detector();
 int trigger_detector();
 int close_detector();
 
+int setup_thread_placement();
+int plan_buffers();
 int setup_infiniband(int card_id);
 int close_infiniband(int card_id);
 int tcp_receive(int sockfd, char *buffer, size_t size);
@@ -213,10 +289,10 @@ void close_influxdb_client();
 void update_summation();
 void set_default_parameters();
 
-void mean_pedeG0(double out[NMODULES*NCARDS]);
-void mean_pedeG1(double out[NMODULES*NCARDS]);
-void mean_pedeG2(double out[NMODULES*NCARDS]);
-void count_bad_pixel(size_t out[NMODULES*NCARDS]);
+void mean_pedeG0(double out[NMODULES*MAX_NCARDS]);
+void mean_pedeG1(double out[NMODULES*MAX_NCARDS]);
+void mean_pedeG2(double out[NMODULES*MAX_NCARDS]);
+void count_bad_pixel(size_t out[NMODULES*MAX_NCARDS]);
 
 // ZeroMQ functions - not used at the moment
 int setup_zeromq_context();
@@ -231,6 +307,7 @@ int send_zeromq(void *zeromq_socket, void *data, size_t data_size, int frame, in
 int update_jpeg_preview(std::vector<uint8_t> &jpeg_out, size_t frame, float contrast = 50.0);
 int update_jpeg_preview_log(std::vector<uint8_t> &jpeg_out, size_t frame, float contrast = 50.0);
 int newest_preview_image();
+size_t preview_image_stride();
 size_t expected_preview_images();
 
 #endif // JFWRITER_H_
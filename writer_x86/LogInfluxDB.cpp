@@ -45,49 +45,51 @@ void send_to_influxdb(std::string database, std::string measurement, std::string
 
 void log_pedestal_G0() {
     std::string content = "";
-    for (int i = 0; i < NMODULES*NCARDS; i++) {
+    for (size_t i = 0; i < detector_geometry.GetModulesNum(); i++) {
         content += "mod" + std::to_string(i) + "=" + std::to_string(mean_pedestalG0[i]);
-        if (i < NMODULES*NCARDS-1) content += ",";
+        if (i < detector_geometry.GetModulesNum()-1) content += ",";
     }
     send_to_influxdb("jungfrau","pedestalG0", content, time_pedestalG0.tv_sec);
 }
 
 void log_pedestal_G1() {
     std::string content = "";
-    for (int i = 0; i < NMODULES*NCARDS; i++) {
+    for (size_t i = 0; i < detector_geometry.GetModulesNum(); i++) {
         content += "mod" + std::to_string(i) + "=" + std::to_string(mean_pedestalG1[i]);
-        if (i < NMODULES*NCARDS-1) content += ",";
+        if (i < detector_geometry.GetModulesNum()-1) content += ",";
     }
     send_to_influxdb("jungfrau","pedestalG1", content, time_pedestalG1.tv_sec);
 }
 
 void log_pedestal_G2() {
     std::string content = "";
-    for (int i = 0; i < NMODULES*NCARDS; i++) {
+    for (size_t i = 0; i < detector_geometry.GetModulesNum(); i++) {
         content += "mod" + std::to_string(i) + "=" + std::to_string(mean_pedestalG2[i]);
-        if (i < NMODULES*NCARDS-1) content += ",";
+        if (i < detector_geometry.GetModulesNum()-1) content += ",";
     }
     send_to_influxdb("jungfrau","pedestalG2", content, time_pedestalG2.tv_sec);
 }
 
 void log_measurement() {
-    int64_t packets_received = (int64_t) online_statistics[0].good_packets + (int64_t) online_statistics[1].good_packets;
+    int64_t packets_received = 0;
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++)
+        packets_received += (int64_t) online_statistics[i].good_packets;
 
     // If trigger mode is on, FPGA will only count packets in images to write
     int64_t packets_expected;
     if (experiment_settings.ntrigger > 0)
         packets_expected = (experiment_settings.nimages_to_write * experiment_settings.summation)
-                * NCARDS * NMODULES * 128;
-    else packets_expected = experiment_settings.nframes_to_collect * NCARDS * NMODULES * 128;
+                * detector_geometry.GetModulesNum() * 128;
+    else packets_expected = experiment_settings.nframes_to_collect * detector_geometry.GetModulesNum() * 128;
 
     int64_t packets_lost = packets_expected - packets_received;
 
     std::string content = "frames_to_collect=" + std::to_string(experiment_settings.nframes_to_collect) +
             ",images_to_write=" + std::to_string(experiment_settings.nimages_to_write) +
             ",frame_time_detector=" + std::to_string(experiment_settings.frame_time_detector) +
-            ",frame_time=" + std::to_string(experiment_settings.frame_time) +
+            ",frame_time=" + std::to_string(image_time(experiment_settings)) +
             ",compressed_size=" + std::to_string(total_compressed_size) +
-            ",compression_ratio=" + std::to_string((double) (experiment_settings.nimages_to_write * NCARDS * NPIXEL * experiment_settings.pixel_depth)/ (double) total_compressed_size) +
+            ",compression_ratio=" + std::to_string((double) (experiment_settings.nimages_to_write * detector_geometry.GetCardsNum() * NPIXEL * experiment_settings.pixel_depth)/ (double) total_compressed_size) +
             ",omega_range=" + std::to_string(experiment_settings.omega_angle_per_image *  experiment_settings.nimages_to_write) +
             ",spots=" + std::to_string(spots.size()) +
             ",duration=" + std::to_string((time_end.tv_sec - time_start.tv_sec)*1000.0 + (time_end.tv_nsec - time_start.tv_nsec)/1000.0) +
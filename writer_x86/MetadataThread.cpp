@@ -30,14 +30,19 @@ float calculate_wilson_b() {
     float sum_x2 = 0.0;
     float sum_xy = 0.0;
 
+    int bins = 0;
+
     for (int i = 0; i < spot_statistics.resolution_bins; i++) {
+        // Bins without spots (e.g. all in excluded ice rings) are not fitted
+        if (spot_statistics.mean_intensity[i] <= 0) continue;
         sum_x += spot_statistics.mean_one_over_d2[i];
         sum_y += spot_statistics.log_mean_intensity[i];
         sum_x2 += spot_statistics.mean_one_over_d2[i]*spot_statistics.mean_one_over_d2[i];
         sum_xy += spot_statistics.mean_one_over_d2[i]*spot_statistics.log_mean_intensity[i];
+        bins++;
     }
-    float numerator = (spot_statistics.resolution_bins * sum_xy - sum_x * sum_y);
-    float denominator =  (spot_statistics.resolution_bins * sum_x2 - sum_x * sum_x);
+    float numerator = (bins * sum_xy - sum_x * sum_y);
+    float denominator =  (bins * sum_x2 - sum_x * sum_x);
     // This is fitting ln<i> = a + b (1/d^2)
     // B = -b 2 in XDS terms
     if (denominator != 0) return - 2 * (numerator/ denominator);
@@ -45,6 +50,83 @@ float calculate_wilson_b() {
     else return -1;
 }
 
+// Width of shells around the ring (in 1/d), which are within resolution limit and outside of ice rings
+float ice_ring_background_width(int ring, float resolution_limit) {
+    const int steps = 1000;
+    double one_over_d_ring = 1.0 / ice_ring_d[ring];
+    double one_over_d_max = (resolution_limit > 0) ? 1.0 / resolution_limit : INFINITY;
+    if (one_over_d_ring + ICE_RING_HALF_WIDTH > one_over_d_max) return 0.0;
+
+    double step = 2 * ICE_RING_BACKGROUND_WIDTH / steps;
+    double width = 0.0;
+    for (int i = 0; i < steps; i++) {
+        double one_over_d = one_over_d_ring - ICE_RING_BACKGROUND_WIDTH + (i + 0.5) * step;
+        if ((one_over_d < one_over_d_max) && (ice_ring_index(1.0 / one_over_d) < 0)) width += step;
+    }
+    return width;
+}
+
+// Spot within resolution limit (bin of Wilson plot) is counted either for the ice ring, it belongs to,
+// or as background for all rings around
+static void add_ice_ring_spot(const spot_t &spot, int bin) {
+    int ring = ice_ring_index(spot.d);
+    if (ring >= 0) {
+        spot_statistics.ice_rings[ring].count++;
+        spot_statistics.ice_rings[ring].intensity[bin] += spot.photons;
+        spot_statistics.ice_rings[ring].count_per_bin[bin]++;
+    } else {
+        for (int i = 0; i < ICE_RINGS; i++) {
+            if (fabs(1.0 / spot.d - 1.0 / ice_ring_d[i]) <= ICE_RING_BACKGROUND_WIDTH)
+                spot_statistics.ice_rings[i].background_count++;
+        }
+    }
+}
+
+// Updated after each chunk, so contamination is found early in the collection
+static void check_ice_rings() {
+    spot_statistics.ice_ring_contamination = false;
+    for (int i = 0; i < ICE_RINGS; i++) {
+        ice_ring_statistics_t &ring = spot_statistics.ice_rings[i];
+        if (ring.background_width > 0) {
+            // One spot added to background, so the ratio is defined also for empty shells
+            float ring_density = ring.count / (2 * ICE_RING_HALF_WIDTH);
+            float background_density = (ring.background_count + 1) / ring.background_width;
+            ring.density_ratio = ring_density / background_density;
+        }
+        ring.contaminated = ring.excluded ||
+                ((ring.count >= ICE_RING_MIN_SPOTS) && (ring.density_ratio > ICE_RING_DENSITY_RATIO));
+        if (ring.contaminated) spot_statistics.ice_ring_contamination = true;
+    }
+}
+
+// Bit mask of contaminated rings (for experiment_settings.excluded_ice_rings)
+uint16_t contaminated_ice_rings() {
+    uint16_t ret = 0;
+    pthread_mutex_lock(&spots_statistics_mutex);
+    for (size_t i = 0; i < spot_statistics.ice_rings.size(); i++) {
+        if (spot_statistics.ice_rings[i].contaminated) ret |= 1 << i;
+    }
+    pthread_mutex_unlock(&spots_statistics_mutex);
+    return ret;
+}
+
+bool hit_finding_enabled() {
+    return experiment_settings.enable_spot_finding && !experiment_settings.connect_spots_between_frames;
+}
+
+bool hit_veto_enabled() {
+    return hit_finding_enabled() && writer_settings.write_only_hits;
+}
+
+hit_decision_t image_hit_decision(size_t image) {
+    hit_decision_t ret = HIT_UNKNOWN;
+    pthread_mutex_lock(&spots_statistics_mutex);
+    if ((image < image_hits.size()) && (image_hits[image].cards == (uint16_t) detector_geometry.GetCardsNum()))
+        ret = image_hits[image].hit ? HIT_FOUND : HIT_MISS;
+    pthread_mutex_unlock(&spots_statistics_mutex);
+    return ret;
+}
+
 void *run_metadata_thread(void* thread_arg) {
     // Read thread ID
     writer_thread_arg_t *arg = (writer_thread_arg_t *)thread_arg;
@@ -59,8 +141,8 @@ void *run_metadata_thread(void* thread_arg) {
 
     }
 
-    // NIMAGES_PER_STREAM is defined for 16-bit image, so it needs to be adjusted for 32-bit
-    size_t images_per_stream = NIMAGES_PER_STREAM * 2 / experiment_settings.pixel_depth;
+    // Receiver reports number of images per chunk already adjusted for pixel depth
+    size_t images_per_stream = writer_connection_settings[card_id].images_per_stream;
 
     // TODO: This function must be consistent with P9 receiver, so maybe should be moved to common location
     size_t total_chunks = experiment_settings.nimages_to_write / images_per_stream;
@@ -70,6 +152,7 @@ void *run_metadata_thread(void* thread_arg) {
 
     if (experiment_settings.enable_spot_finding) {
         size_t omega_range = std::lround(experiment_settings.nimages_to_write * experiment_settings.omega_angle_per_image);
+        spot_finding_overflow_t card_overflow = {0, 0};
 
         for (int chunk = 0; chunk < total_chunks; chunk++) {
             // Receive spots found by spot finder
@@ -80,6 +163,20 @@ void *run_metadata_thread(void* thread_arg) {
             if (spot_data_size > 0)
                 tcp_receive(writer_connection_settings[card_id].sockfd, (char *) local_spots.data(), spot_data_size * sizeof(spot_t));
 
+            // Strong pixels, which didn't fit into output of spot finder
+            spot_finding_overflow_t overflow;
+            tcp_receive(writer_connection_settings[card_id].sockfd, (char *) &overflow, sizeof(spot_finding_overflow_t));
+            card_overflow.fragments += overflow.fragments;
+            card_overflow.pixels += overflow.pixels;
+
+            // Spots and strong pixels per image, chunks are not received in order
+            size_t chunk_id, images;
+            tcp_receive(writer_connection_settings[card_id].sockfd, (char *) &chunk_id, sizeof(size_t));
+            tcp_receive(writer_connection_settings[card_id].sockfd, (char *) &images, sizeof(size_t));
+            std::vector<image_spot_count_t> image_counts(images);
+            if (images > 0)
+                tcp_receive(writer_connection_settings[card_id].sockfd, (char *) image_counts.data(), images * sizeof(image_spot_count_t));
+
             // Merge spots with the global list
             pthread_mutex_lock(&spots_mutex);
             spots.insert(spots.end(), local_spots.begin(), local_spots.end());
@@ -87,6 +184,12 @@ void *run_metadata_thread(void* thread_arg) {
 
             // Update spots per frame statistics
             pthread_mutex_lock(&spots_statistics_mutex);
+            spot_statistics.overflow.fragments += overflow.fragments;
+            spot_statistics.overflow.pixels += overflow.pixels;
+            if (hit_finding_enabled())
+                hit_statistics.classified += add_image_spot_counts(image_hits, chunk_id * images_per_stream, image_counts,
+                                                                   detector_geometry.GetCardsNum(), writer_settings.hit_min_spots,
+                                                                   writer_settings.hit_min_strong_pixels, hit_statistics.hits);
             for (int i = 0; i < local_spots.size() ; i++) {
                 size_t omega = (size_t) std::lround(local_spots[i].z * experiment_settings.omega_angle_per_image);
                 if ((omega >= 0) && (omega < omega_range))
@@ -98,21 +201,41 @@ void *run_metadata_thread(void* thread_arg) {
 
                     spot_statistics.intensity[bin] += local_spots[i].photons;
                     spot_statistics.count[bin] += 1;
+                    add_ice_ring_spot(local_spots[i], bin);
                 }
             }
+            check_ice_rings();
 
             // Calculate Wilson plot
             // according to XDS CORRECT.LP
             // needs linear regression of ln(<i>) in function of (1/(4d^2))
+            // spots in contaminated ice rings are not included
             for (int i = 0; i < spot_statistics.resolution_bins; i++) {
-                spot_statistics.mean_intensity[i] = spot_statistics.intensity[i]/ spot_statistics.count[i];
-                spot_statistics.log_mean_intensity[i] = log(spot_statistics.mean_intensity[i]);
+                float intensity = spot_statistics.intensity[i];
+                size_t count = spot_statistics.count[i];
+                for (int j = 0; j < ICE_RINGS; j++) {
+                    if (spot_statistics.ice_rings[j].contaminated) {
+                        intensity -= spot_statistics.ice_rings[j].intensity[i];
+                        count -= spot_statistics.ice_rings[j].count_per_bin[i];
+                    }
+                }
+                if (count > 0) {
+                    spot_statistics.mean_intensity[i] = intensity / count;
+                    spot_statistics.log_mean_intensity[i] = log(spot_statistics.mean_intensity[i]);
+                } else {
+                    spot_statistics.mean_intensity[i] = 0;
+                    spot_statistics.log_mean_intensity[i] = 0;
+                }
             }
             spot_statistics.wilson_B = calculate_wilson_b();
 
             spot_statistics_sequence++;
             pthread_mutex_unlock(&spots_statistics_mutex);
         }
+
+        if (card_overflow.pixels > 0)
+            std::cerr << "Card " << card_id << ": spot finder output full, " << card_overflow.pixels
+                      << " strong pixels lost in " << card_overflow.fragments << " half images" << std::endl;
     }
 
     // Send pedestal, header data and collection statistics
@@ -120,19 +243,19 @@ void *run_metadata_thread(void* thread_arg) {
          &(online_statistics[card_id]), sizeof(online_statistics_t));
 
     tcp_receive(writer_connection_settings[card_id].sockfd,
-                (char *) (gain_pedestal.gainG0 + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
+                (char *) (gain_pedestal.gainG0.data() + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
     tcp_receive(writer_connection_settings[card_id].sockfd,
-                (char *) (gain_pedestal.gainG1 + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
+                (char *) (gain_pedestal.gainG1.data() + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
     tcp_receive(writer_connection_settings[card_id].sockfd,
-                (char *) (gain_pedestal.gainG2 + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
+                (char *) (gain_pedestal.gainG2.data() + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
     tcp_receive(writer_connection_settings[card_id].sockfd,
-                (char *) (gain_pedestal.pedeG1 + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
+                (char *) (gain_pedestal.pedeG1.data() + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
     tcp_receive(writer_connection_settings[card_id].sockfd,
-                (char *) (gain_pedestal.pedeG2 + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
+                (char *) (gain_pedestal.pedeG2.data() + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
     tcp_receive(writer_connection_settings[card_id].sockfd,
-                (char *) (gain_pedestal.pedeG0 + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
+                (char *) (gain_pedestal.pedeG0.data() + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
     tcp_receive(writer_connection_settings[card_id].sockfd,
-                (char *) (gain_pedestal.pixel_mask + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
+                (char *) (gain_pedestal.pixel_mask.data() + card_id * NPIXEL), NPIXEL * sizeof(uint16_t));
 
     // Check magic number again - but don't quit, as the program is finishing anyway soon
     exchange_magic_number(writer_connection_settings[card_id].sockfd);
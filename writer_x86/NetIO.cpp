@@ -20,6 +20,8 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 
 #include "JFWriter.h"
@@ -67,39 +69,111 @@ int TCP_connect(int &sockfd, std::string hostname, uint16_t port) {
 	return exchange_magic_number(sockfd);
 }
 
-void TCP_exchange_IB_parameters(int sockfd, ib_settings_t &ib_settings, ib_comm_settings_t *remote) {
+// Exchange IB parameters and check that buffer sizes of the receiver match
+int TCP_exchange_IB_parameters(int sockfd, int card_id, ib_settings_t &ib_settings, ib_comm_settings_t *remote) {
 	ib_comm_settings_t local;
 	local.qp_num = ib_settings.qp->qp_num;
 	local.dlid = ib_settings.port_attr.lid;
+	local.queue_size = receive_queue_images(experiment_settings);
+	local.images_per_stream = 0;
+	local.modules_per_card = detector_geometry.GetModulesPerCard();
+	local.ncards = detector_geometry.GetCardsNum();
+	local.card_id = card_id;
 
 	// Receive parameters
-	read(sockfd, remote, sizeof(ib_comm_settings_t));
+	if (tcp_receive(sockfd, (char *) remote, sizeof(ib_comm_settings_t))) return 1;
 
-	// Send parameters
+	// Send parameters - also in case of mismatch, so receiver can detect it
 	send(sockfd, &local, sizeof(ib_comm_settings_t), 0);
+
+	// Receiver cannot have more outstanding images than receive queue of the writer
+	if (remote->queue_size > local.queue_size) {
+		std::cerr << "Receiver send queue (" << remote->queue_size << ") larger than writer receive queue ("
+			  << local.queue_size << ")" << std::endl;
+		return 1;
+	}
+	if (remote->modules_per_card != local.modules_per_card) {
+		std::cerr << "Receiver of card " << card_id << " handles " << remote->modules_per_card
+			  << " modules, detector geometry expects " << local.modules_per_card << std::endl;
+		return 1;
+	}
+	if (remote->images_per_stream == 0) {
+		std::cerr << "Receiver reported no images per spot finding chunk" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int setup_thread_placement() {
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++) {
+        int ib_node = ThreadPlacement::GetInfinibandNode(writer_connection_settings[i].ib_dev_name);
+        thread_placement.AssignRole("writer" + std::to_string(i), ib_node);
+        thread_placement.AssignRole("ib_buffer" + std::to_string(i), ib_node);
+    }
+
+    if (!writer_settings.placement_file_name.empty() &&
+        thread_placement.LoadConfig(writer_settings.placement_file_name))
+        return 1;
+
+    thread_placement.Print(std::cout);
+    return 0;
+}
+
+// Receive queue (per card) and preview buffer are sized from memory budget
+int plan_buffers() {
+    RingBufferPlan plan(writer_settings.memory_budget);
+
+    // Preview can take at most 1/8 of the budget (MAX_PREVIEW images of 4M detector with the default budget)
+    writer_settings.max_preview = std::min((size_t) MAX_PREVIEW,
+                                           writer_settings.memory_budget / 8 / (detector_geometry.GetPixels() * sizeof(int32_t)));
+    plan.AddRing("preview", writer_settings.max_preview, detector_geometry.GetPixels() * sizeof(int32_t), 0.0);
+
+    // Number of 16-bit images must be even, as there is half of 32-bit images
+    writer_settings.receive_queue_size = plan.FitElements(detector_geometry.GetCardsNum() * COMPOSED_IMAGE_SIZE * sizeof(uint16_t), 2, MAX_RDMA_RQ_SIZE);
+    for (size_t i = 0; i < detector_geometry.GetCardsNum(); i++)
+        plan.AddRing("ib_buffer" + std::to_string(i), writer_settings.receive_queue_size,
+                     COMPOSED_IMAGE_SIZE * sizeof(uint16_t), writer_settings.frame_rate);
+
+    plan.Print(std::cout);
+    std::cout << "IB receive queue: " << writer_settings.receive_queue_size << " preview images: " << writer_settings.max_preview << std::endl;
+
+    if ((writer_settings.receive_queue_size == 0) || (writer_settings.max_preview == 0)) {
+        std::cerr << "Memory budget too small" << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
 int setup_infiniband(int card_id) {
 	// Setup Infiniband connection
 	setup_ibverbs(writer_connection_settings[card_id].ib_settings,
-			writer_connection_settings[card_id].ib_dev_name, 1, RDMA_RQ_SIZE+1);
+			writer_connection_settings[card_id].ib_dev_name, 1, writer_settings.receive_queue_size+1);
 
-        // IB buffer
-        writer_connection_settings[card_id].ib_buffer = (char *) malloc(RDMA_RQ_SIZE * COMPOSED_IMAGE_SIZE * sizeof(uint16_t));
-	if (writer_connection_settings[card_id].ib_buffer == NULL) {
+        // IB buffer - hugepages if available, memory is zeroed by the kernel
+        auto start_time = std::chrono::steady_clock::now();
+        HugePageBuffer &ib_buffer_memory = writer_connection_settings[card_id].ib_buffer_memory;
+        if (ib_buffer_memory.Allocate(writer_settings.receive_queue_size * COMPOSED_IMAGE_SIZE * sizeof(uint16_t))) {
 		std::cerr << "Memory allocation error" << std::endl;
 		return 1;
 	}
+        writer_connection_settings[card_id].ib_buffer = ib_buffer_memory.Get();
+
+        // Buffer is written by IB card, so it should be local to it
+        // Placement is set before pages are faulted in by multiple threads
+        thread_placement.PlaceMemory(ib_buffer_memory.Get(), ib_buffer_memory.GetSize(), "ib_buffer" + std::to_string(card_id));
+        ib_buffer_memory.Prefault();
 
         // Register IB memory region
 	writer_connection_settings[card_id].ib_buffer_mr =
 			ibv_reg_mr(writer_connection_settings[card_id].ib_settings.pd,
 					writer_connection_settings[card_id].ib_buffer, 
-                                   RDMA_RQ_SIZE * COMPOSED_IMAGE_SIZE * sizeof(uint16_t), IBV_ACCESS_LOCAL_WRITE);
+                                   writer_settings.receive_queue_size * COMPOSED_IMAGE_SIZE * sizeof(uint16_t), IBV_ACCESS_LOCAL_WRITE);
 	if (writer_connection_settings[card_id].ib_buffer_mr == NULL) {
 		std::cerr << "Failed to register IB memory region." << std::endl;
 		return 1;
 	}
+        std::cout << "IB buffer for card " << card_id << " ready (" << ib_buffer_memory.GetPageSizeString() << " pages) in "
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() << " s" << std::endl;
         return 0;
 }
 
@@ -109,7 +183,8 @@ int close_infiniband(int card_id) {
 	close_ibverbs(writer_connection_settings[card_id].ib_settings);
 
 	// Free memory buffer
-	free(writer_connection_settings[card_id].ib_buffer);
+	writer_connection_settings[card_id].ib_buffer_memory.Free();
+	writer_connection_settings[card_id].ib_buffer = NULL;
         return  0;
 }
 
@@ -129,14 +204,15 @@ int connect_to_power9(int card_id) {
 
 	// Exchange information with remote host
 	ib_comm_settings_t remote;
-	TCP_exchange_IB_parameters(writer_connection_settings[card_id].sockfd,
-			writer_connection_settings[card_id].ib_settings, &remote);
+	if (TCP_exchange_IB_parameters(writer_connection_settings[card_id].sockfd, card_id,
+			writer_connection_settings[card_id].ib_settings, &remote))
+		return 1;
+	writer_connection_settings[card_id].images_per_stream = remote.images_per_stream;
 
 	// Post WRs
 	// Start receiving
   
-        size_t number_of_rqs = RDMA_RQ_SIZE;
-        if (experiment_settings.pixel_depth == 4) number_of_rqs = RDMA_RQ_SIZE / 2;
+        size_t number_of_rqs = receive_queue_images(experiment_settings);
         size_t entry_size    = COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth;
 
 	struct ibv_sge ib_sg_entry;
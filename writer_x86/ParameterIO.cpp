@@ -109,6 +109,11 @@ std::map<std::string, parameter_t> detector_options = {
                                [](nlohmann::json &in) { throw read_only_exception(); },
                                "Number of frames summed into a single image"
                        }},
+        {"summation_stride",{"", PARAMETER_UINT, 0, 5000, false,
+                               [](nlohmann::json &out) { out = experiment_settings.summation_stride; },
+                               [](nlohmann::json &in) { experiment_settings.summation_stride = in.get<uint32_t>(); update_summation(); },
+                               "Number of frames between consecutive images; if lower than summation, images overlap (sliding window); 0 = summation"
+                       }},
         {"pixel_bit_depth",{"", PARAMETER_UINT, 1, 32, true,
                                [](nlohmann::json &out) { out = experiment_settings.pixel_depth * 8; },
                                [](nlohmann::json &in) { throw read_only_exception(); },
@@ -209,6 +214,46 @@ std::map<std::string, parameter_t> detector_options = {
                                [](nlohmann::json &in) {  experiment_settings.min_pixels_per_spot = in.get<uint16_t>(); },
                                "Spots with less pixels than this value are discarded"
                        }},
+        {"spot_finding_box_size", {"", PARAMETER_STRING, 0.0, 0.0, false,
+                               [](nlohmann::json &out) { out = std::to_string(experiment_settings.spot_box_size) + "x" + std::to_string(experiment_settings.spot_box_size); },
+                               [](nlohmann::json &in) { experiment_settings.spot_box_size = std::stoi(in.get<std::string>()); },
+                               "Box for local background of spot finding (pixels)", {"3x3","5x5","7x7","9x9","11x11"}
+                       }},
+        {"spot_finding_min_value",{"", PARAMETER_UINT, 0.0, OVERFLOW_32BIT, false,
+                               [](nlohmann::json &out) { out = experiment_settings.spot_min_pixel_value; },
+                               [](nlohmann::json &in) {  experiment_settings.spot_min_pixel_value = in.get<int32_t>(); },
+                               "Pixels with lower value are not strong (0 = no limit)"
+                       }},
+        {"spot_finding_max_value",{"", PARAMETER_UINT, 0.0, OVERFLOW_32BIT, false,
+                               [](nlohmann::json &out) { out = experiment_settings.spot_max_pixel_value; },
+                               [](nlohmann::json &in) {  experiment_settings.spot_max_pixel_value = in.get<int32_t>(); },
+                               "Pixels with higher value are saturated and not strong (0 = no limit)"
+                       }},
+        {"spot_finding_hot_pixel_fraction",{"", PARAMETER_FLOAT, 0.0, 1.0, false,
+                               [](nlohmann::json &out) { out = experiment_settings.hot_pixel_fraction; },
+                               [](nlohmann::json &in) {  experiment_settings.hot_pixel_fraction = in.get<double>(); },
+                               "Pixels strong in more than this fraction of images are masked as hot (0 = off)"
+                       }},
+        {"spot_finding_ice_ring_exclusion",{"", PARAMETER_BOOL, 0.0, 0.0, false,
+                               [](nlohmann::json &out) { out = writer_settings.exclude_ice_rings; },
+                               [](nlohmann::json &in) {  writer_settings.exclude_ice_rings = in.get<bool>(); },
+                               "Ice rings found in a collection are excluded by spot finding in the following collections"
+                       }},
+        {"hit_finding_min_spots",{"", PARAMETER_UINT, 0.0, 10000.0, false,
+                               [](nlohmann::json &out) { out = writer_settings.hit_min_spots; },
+                               [](nlohmann::json &in) {  writer_settings.hit_min_spots = in.get<uint32_t>(); },
+                               "Images with at least this number of spots are hits (2D spot finding only)"
+                       }},
+        {"hit_finding_min_strong_pixels",{"", PARAMETER_UINT, 0.0, 1000000.0, false,
+                               [](nlohmann::json &out) { out = writer_settings.hit_min_strong_pixels; },
+                               [](nlohmann::json &in) {  writer_settings.hit_min_strong_pixels = in.get<uint32_t>(); },
+                               "Images with at least this number of strong pixels are hits (2D spot finding only)"
+                       }},
+        {"hit_finding_write_only_hits",{"", PARAMETER_BOOL, 0.0, 0.0, false,
+                               [](nlohmann::json &out) { out = writer_settings.write_only_hits; },
+                               [](nlohmann::json &in) {  writer_settings.write_only_hits = in.get<bool>(); },
+                               "Images, which are not hits, are not written (2D spot finding only)"
+                       }},
         {"spot_finding_dimensions", {"", PARAMETER_STRING, 0.0, 0.0, false,
                                [](nlohmann::json &out) { experiment_settings.connect_spots_between_frames? out = "3D": out="2D";},
                                [](nlohmann::json &in) { if (in.get<std::string>() == "2D") experiment_settings.connect_spots_between_frames = false;
@@ -270,22 +315,22 @@ std::map<std::string, parameter_t> detector_options = {
                                "Path on the JF server to output files"
                        }},
         {"pedestalG0_mean", {"ADU", PARAMETER_FLOAT, 0.0, 0.0, true,
-                               [](nlohmann::json &out) { for (int i = 0; i < NMODULES*NCARDS;i++) out.push_back(mean_pedestalG0[i]); },
+                               [](nlohmann::json &out) { for (size_t i = 0; i < detector_geometry.GetModulesNum();i++) out.push_back(mean_pedestalG0[i]); },
                                [](nlohmann::json &in) { throw read_only_exception(); },
                                "Mean pedestal of gain G0 (per modules)"
                        }},
         {"pedestalG1_mean", {"ADU", PARAMETER_FLOAT, 0.0, 0.0, true,
-                               [](nlohmann::json &out) { for (int i = 0; i < NMODULES*NCARDS;i++) out.push_back(mean_pedestalG1[i]); },
+                               [](nlohmann::json &out) { for (size_t i = 0; i < detector_geometry.GetModulesNum();i++) out.push_back(mean_pedestalG1[i]); },
                                [](nlohmann::json &in) { throw read_only_exception(); },
                                "Mean pedestal of gain G1 (per module)"
                        }},
         {"pedestalG2_mean", {"ADU", PARAMETER_FLOAT, 0.0, 0.0, true,
-                               [](nlohmann::json &out) { for (int i = 0; i < NMODULES*NCARDS;i++) out.push_back(mean_pedestalG2[i]); },
+                               [](nlohmann::json &out) { for (size_t i = 0; i < detector_geometry.GetModulesNum();i++) out.push_back(mean_pedestalG2[i]); },
                                [](nlohmann::json &in) { throw read_only_exception(); },
                                "Mean pedestal of gain G2 (per module)"
                        }},
         {"bad_pixels", {"", PARAMETER_FLOAT, 0.0, 0.0, true,
-                               [](nlohmann::json &out) { for (int i = 0; i < NMODULES*NCARDS;i++) out.push_back(bad_pixels[i]); },
+                               [](nlohmann::json &out) { for (size_t i = 0; i < detector_geometry.GetModulesNum();i++) out.push_back(bad_pixels[i]); },
                                [](nlohmann::json &in) { throw read_only_exception(); },
                                "Number of bad pixels (per module)"
                        }},
@@ -305,6 +350,7 @@ void set_default_parameters() {
     experiment_settings.beamline_delay = 180;
 
     experiment_settings.frame_time = 500 / 1e6;
+    experiment_settings.summation_stride = 0;
     experiment_settings.nimages_to_write = 1000;
     experiment_settings.ntrigger = 1;
     experiment_settings.energy_in_keV = 12.4;
@@ -316,28 +362,38 @@ void set_default_parameters() {
     experiment_settings.connect_spots_between_frames = true;
     experiment_settings.strong_pixel = 5.0;
     experiment_settings.min_pixels_per_spot = 3.0;
+    experiment_settings.hot_pixel_fraction = 0.0;
+    experiment_settings.spot_box_size = 7;
+    experiment_settings.spot_min_pixel_value = 0;
+    experiment_settings.spot_max_pixel_value = 0;
     experiment_settings.spot_finding_resolution_limit = 1.5;
+    experiment_settings.excluded_ice_rings = 0;
 
     writer_settings.compression = JF_COMPRESSION_BSHUF_LZ4;
 
     writer_settings.write_mode = JF_WRITE_HDF5;
     writer_settings.images_per_file = 1000;
-    writer_settings.nthreads = NCARDS * 8; // Spawn 8 writer threads per card
+    writer_settings.nthreads = DEFAULT_NCARDS * 8; // Spawn 8 writer threads per card, updated when number of cards is set
     writer_settings.timing_trigger = true;
     writer_settings.hdf18_compat = true;
     writer_settings.default_path = "/mnt/ssd/";
     writer_settings.influxdb_url="http://mx-jungfrau-1:8086";
+    writer_settings.placement_file_name = "";
+    writer_settings.memory_budget = DEFAULT_MEMORY_BUDGET;
+    writer_settings.frame_rate = DEFAULT_FRAME_RATE;
+    writer_settings.exclude_ice_rings = false;
+    writer_settings.hit_min_spots = 10;
+    writer_settings.hit_min_strong_pixels = 0;
+    writer_settings.write_only_hits = false;
 
-    //These parameters are not changeable at the moment
+    // Defaults for the 4M setup, cards beyond are expected to be given at startup (-R)
     writer_connection_settings[0].ib_dev_name = "mlx5_1";
     writer_connection_settings[0].receiver_host = "mx-ic922-1";
     writer_connection_settings[0].receiver_tcp_port = 52320;
 
-    if (NCARDS == 2) {
-        writer_connection_settings[1].ib_dev_name = "mlx5_12";
-        writer_connection_settings[1].receiver_host = "mx-ic922-1";
-        writer_connection_settings[1].receiver_tcp_port = 52321;
-    }
+    writer_connection_settings[1].ib_dev_name = "mlx5_12";
+    writer_connection_settings[1].receiver_host = "mx-ic922-1";
+    writer_connection_settings[1].receiver_tcp_port = 52321;
 
     update_summation();
 }
@@ -353,6 +409,7 @@ void update_summation() {
     // Summation
     if (experiment_settings.summation == 0) experiment_settings.summation = 1;
 
+    // Exposure of one image, overlapping images (summation_stride) are closer in time - see image_time()
     experiment_settings.frame_time = experiment_settings.frame_time_detector * experiment_settings.summation;
     experiment_settings.count_time = experiment_settings.count_time_detector * experiment_settings.summation;
 
@@ -365,8 +422,10 @@ void update_summation() {
         experiment_settings.nimages_to_write =
                 experiment_settings.nimages_to_write_per_trigger * experiment_settings.ntrigger;
 
+    uint64_t triggers = (experiment_settings.ntrigger == 0) ? 1 : experiment_settings.ntrigger;
+
     experiment_settings.nframes_to_collect = experiment_settings.pedestalG0_frames
-                                             + experiment_settings.summation * experiment_settings.nimages_to_write
+                                             + frames_per_trigger(experiment_settings) * triggers
                                              + experiment_settings.beamline_delay /
                                                experiment_settings.frame_time_detector
                                              + experiment_settings.shutter_delay * experiment_settings.ntrigger /
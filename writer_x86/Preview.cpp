@@ -31,36 +31,43 @@
 #define BLUE_MAX 0
 
 int newest_preview_image() {
-    for (int j = MAX_PREVIEW - 1;j >= 0; j-- ) {
-        int count = 0;
-        for (int i = 0; i < NCARDS; i ++) {
-            if (preview_image_available[j*NCARDS+i]) count++;
+    for (int j = writer_settings.max_preview - 1;j >= 0; j-- ) {
+        size_t count = 0;
+        for (size_t i = 0; i < detector_geometry.GetCardsNum(); i ++) {
+            if (preview_image_available[j*detector_geometry.GetCardsNum()+i]) count++;
         }
-        if (count == NCARDS) return j;
+        if (count == detector_geometry.GetCardsNum()) return j;
     }
     return -1;
 }
 
-size_t expected_preview_images() {
-    // Calculate how many preview images to generate
-    size_t preview_stride = int(PREVIEW_FREQUENCY/experiment_settings.frame_time);
+// Every preview_image_stride()-th image is copied to preview, based on time between images
+size_t preview_image_stride() {
+    size_t preview_stride = int(PREVIEW_FREQUENCY/image_time(experiment_settings));
+    if (preview_stride == 0) preview_stride = 1;
 
     // Stride need to be increased, if it would overflow preview buffer
-    if ( MAX_PREVIEW < experiment_settings.nimages_to_write / preview_stride)
-        preview_stride = experiment_settings.nimages_to_write / MAX_PREVIEW;
+    if (writer_settings.max_preview < (experiment_settings.nimages_to_write + preview_stride - 1) / preview_stride)
+        preview_stride = (experiment_settings.nimages_to_write + writer_settings.max_preview - 1) / writer_settings.max_preview;
+    return preview_stride;
+}
 
-    return experiment_settings.nimages_to_write / preview_stride;
+size_t expected_preview_images() {
+    return experiment_settings.nimages_to_write / preview_image_stride();
 }
 
 int update_jpeg_preview(std::vector<uchar> &jpeg_out, size_t image_number, float contrast) {
     cv::setNumThreads(0);
 
-    cv::Mat values(YPIXEL, XPIXEL, CV_8U);
+    size_t xpixel = detector_geometry.GetXPixels();
+    size_t ypixel = detector_geometry.GetYPixels();
+
+    cv::Mat values(ypixel, xpixel, CV_8U);
     
     // Color transformation
-    for (int i = 0; i < YPIXEL; i++) {
-        for (int j = 0; j < XPIXEL; j++) {
-            float tmp = ((float) preview[image_number * PREVIEW_SIZE + i*XPIXEL+j]) / contrast;
+    for (int i = 0; i < ypixel; i++) {
+        for (int j = 0; j < xpixel; j++) {
+            float tmp = ((float) preview[image_number * detector_geometry.GetPixels() + i*xpixel+j]) / contrast;
             if (tmp >= 1.0) 
                values.at<uchar>(i,j) = 255;
             if (tmp <= 0.0)
@@ -71,7 +78,7 @@ int update_jpeg_preview(std::vector<uchar> &jpeg_out, size_t image_number, float
     }
 
 
-    cv::Mat image(YPIXEL, XPIXEL, CV_8UC3);
+    cv::Mat image(ypixel, xpixel, CV_8UC3);
     cv::applyColorMap(values, image,  cv::COLORMAP_VIRIDIS);
 
     cv::imencode(".jpeg", image, jpeg_out);
@@ -81,12 +88,15 @@ int update_jpeg_preview(std::vector<uchar> &jpeg_out, size_t image_number, float
 int update_jpeg_preview_log(std::vector<uchar> &jpeg_out, size_t image_number, float contrast) {
     cv::setNumThreads(0);
 
-    cv::Mat values(YPIXEL, XPIXEL, CV_8U);
+    size_t xpixel = detector_geometry.GetXPixels();
+    size_t ypixel = detector_geometry.GetYPixels();
+
+    cv::Mat values(ypixel, xpixel, CV_8U);
     
     // Color transformation
-    for (int i = 0; i < YPIXEL; i++) {
-        for (int j = 0; j < XPIXEL; j++) {
-            float tmp = preview[image_number * PREVIEW_SIZE + i*XPIXEL+j];
+    for (int i = 0; i < ypixel; i++) {
+        for (int j = 0; j < xpixel; j++) {
+            float tmp = preview[image_number * detector_geometry.GetPixels() + i*xpixel+j];
             if (tmp >= contrast) 
                values.at<uchar>(i,j) = 255;
             if (tmp < 1.0)
@@ -96,7 +106,7 @@ int update_jpeg_preview_log(std::vector<uchar> &jpeg_out, size_t image_number, f
         }
     }
 
-    cv::Mat image(YPIXEL, XPIXEL, CV_8UC3);
+    cv::Mat image(ypixel, xpixel, CV_8UC3);
     cv::applyColorMap(values, image,  cv::COLORMAP_VIRIDIS);
 
     cv::imencode(".jpeg", image, jpeg_out); 
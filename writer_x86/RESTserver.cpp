@@ -20,6 +20,7 @@
 #include <iostream>
 #include <map>
 #include <cmath>
+#include <unistd.h>
 
 #include "JFWriter.h"
 
@@ -365,19 +366,56 @@ void fetch_spot(const Pistache::Rest::Request &request, Pistache::Http::Response
         j["log_meanI"] = spot_statistics.log_mean_intensity;
         j["one_over_d2"] = spot_statistics.mean_one_over_d2;
         j["wilsonB"] = spot_statistics.wilson_B;
+    } else if (variable == "ice_rings") {
+        j["contaminated"] = spot_statistics.ice_ring_contamination;
+        j["rings"] = nlohmann::json::array();
+        for (size_t i = 0; i < spot_statistics.ice_rings.size(); i++) {
+            nlohmann::json ring;
+            ring["d"] = spot_statistics.ice_rings[i].d;
+            ring["count"] = spot_statistics.ice_rings[i].count;
+            ring["background_count"] = spot_statistics.ice_rings[i].background_count;
+            ring["density_ratio"] = spot_statistics.ice_rings[i].density_ratio;
+            ring["contaminated"] = spot_statistics.ice_rings[i].contaminated;
+            ring["excluded"] = spot_statistics.ice_rings[i].excluded;
+            j["rings"].push_back(ring);
+        }
+    } else if (variable == "hits") {
+        j["enabled"] = hit_finding_enabled();
+        j["write_only_hits"] = hit_veto_enabled();
+        j["images"] = hit_statistics.classified;
+        j["hits"] = hit_statistics.hits;
+        j["hit_rate"] = (hit_statistics.classified > 0) ? hit_statistics.hits / (double) hit_statistics.classified : 0.0;
+        j["not_written"] = hit_statistics.vetoed;
+        j["written_unclassified"] = hit_statistics.unclassified;
+    } else if (variable == "overflow") {
+        j["fragments"] = spot_statistics.overflow.fragments;
+        j["pixels"] = spot_statistics.overflow.pixels;
     } else if (variable == "list") {
         for (int i = 0; i < spots.size(); i++) {
             nlohmann::json spot_json;
             spot_json["x"] = spots[i].x;
             spot_json["y"] = spots[i].y;
             spot_json["z"] = spots[i].z;
-            spot_json["module"] = (int)(spots[i].x/1030.0) + 2 * (int)(spots[i].y/514.0);
+            spot_json["module"] = detector_geometry.GetModuleIndex(spots[i].x, spots[i].y);
             spot_json["photons"] = spots[i].photons;
             spot_json["lines"] = spots[i].max_line - spots[i].min_line + 1;
             spot_json["cols"] = spots[i].max_col - spots[i].min_col + 1;
             spot_json["frames"] = spots[i].last_frame - spots[i].first_frame + 1;
             j.push_back(spot_json);
         }
+    } else if (variable == "hot_pixels") {
+        // Hot pixels are marked in the pixel mask by receivers at the end of collection
+        std::vector<uint16_t> pixel_mask(detector_geometry.GetPixels());
+        for (size_t card = 0; card < detector_geometry.GetCardsNum(); card++)
+            geometry_plan.Transform(pixel_mask.data() + detector_geometry.GetCardPixelOffset(card),
+                                    gain_pedestal.pixel_mask.data() + card * NPIXEL);
+        nlohmann::json pixels = nlohmann::json::array();
+        for (size_t i = 0; i < pixel_mask.size(); i++) {
+            if (pixel_mask[i] & (1 << HOT_PIXEL_MASK_BIT))
+                pixels.push_back({i % detector_geometry.GetXPixels(), i / detector_geometry.GetXPixels()});
+        }
+        j["count"] = pixels.size();
+        j["pixels"] = pixels;
     }
 
     pthread_mutex_unlock(&spots_statistics_mutex);
@@ -391,7 +429,7 @@ void fetch_spot_xds(const Pistache::Rest::Request &request, Pistache::Http::Resp
     std::string spot_xds;
 
     for (int i = 0; i < spots.size(); i++) {
-        int module = (int)(spots[i].x/1030.0) + 2 * (int)(spots[i].y/514.0);
+        size_t module = detector_geometry.GetModuleIndex(spots[i].x, spots[i].y);
         spot_xds += std::to_string(spots[i].x) + " " + std::to_string(spots[i].y) + " " + std::to_string(spots[i].z) + " ";
         spot_xds += std::to_string(spots[i].photons) + " " + std::to_string(module) + "\n";
     }
@@ -405,11 +443,69 @@ void allow(const Pistache::Rest::Request &request, Pistache::Http::ResponseWrite
     response.send(Pistache::Http::Code::No_Content);
 }
 
-int main() {
+int main(int argc, char **argv) {
     daq_state = STATE_NOT_INITIALIZED;
 
     set_default_parameters();
 
+    // Startup options: -N placement config file, -M memory budget (GiB), -F expected frame rate (Hz),
+    // -C number of cards, -R receiver of the next card as host:port:ib_device (repeated, in card order)
+    int opt;
+    size_t receivers_given = 0;
+    while ((opt = getopt(argc, argv, ":N:M:F:C:R:")) != EOF) {
+        switch (opt) {
+            case 'C': {
+                int ncards = atoi(optarg);
+                if ((ncards < 1) || (ncards > MAX_NCARDS)) {
+                    std::cerr << "Number of cards must be in range 1-" << MAX_NCARDS << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                detector_geometry = DetectorGeometry(ncards, NMODULES);
+                writer_settings.nthreads = ncards * 8;
+                break;
+            }
+            case 'R': {
+                std::string receiver(optarg);
+                size_t colon1 = receiver.find(':');
+                size_t colon2 = receiver.find(':', colon1 + 1);
+                if ((receivers_given >= MAX_NCARDS) || (colon1 == std::string::npos) || (colon2 == std::string::npos)) {
+                    std::cerr << "Receiver must be given as host:port:ib_device" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                writer_connection_settings[receivers_given].receiver_host = receiver.substr(0, colon1);
+                writer_connection_settings[receivers_given].receiver_tcp_port = atoi(receiver.substr(colon1 + 1, colon2 - colon1 - 1).c_str());
+                writer_connection_settings[receivers_given].ib_dev_name = receiver.substr(colon2 + 1);
+                receivers_given++;
+                break;
+            }
+            case 'N':
+                writer_settings.placement_file_name = std::string(optarg);
+                break;
+            case 'M': {
+                double budget = atof(optarg);
+                if (budget <= 0) {
+                    std::cerr << "Memory budget must be positive" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                writer_settings.memory_budget = budget * 1024L * 1024L * 1024L;
+                break;
+            }
+            case 'F':
+                writer_settings.frame_rate = atof(optarg);
+                if (writer_settings.frame_rate <= 0) {
+                    std::cerr << "Frame rate must be positive" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+        }
+    }
+
+    // Cards beyond 4M default need receiver given explicitly
+    if ((detector_geometry.GetCardsNum() > DEFAULT_NCARDS) && (receivers_given < detector_geometry.GetCardsNum())) {
+        std::cerr << "Receiver (-R) must be given for each of " << detector_geometry.GetCardsNum() << " cards" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
     jfwriter_setup();
 
     Pistache::Address addr(Pistache::Ipv4::any(), Pistache::Port(PISTACHE_PORT));
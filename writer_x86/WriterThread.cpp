@@ -30,24 +30,160 @@ void bshuf_write_uint64_BE(void* buf, uint64_t num);
 void bshuf_write_uint32_BE(void* buf, uint32_t num);
 }
 
-void *run_writer_thread(void* thread_arg) {
-    // Read thread ID
-    writer_thread_arg_t *arg = (writer_thread_arg_t *)thread_arg;
-    int thread_id = arg->thread_id;
-    int card_id   = arg->card_id;
-    size_t local_compressed_size = 0;
+// Copy composed image of one card into its place in the preview of the full detector
+template <class T> void copy_to_preview(int32_t *out, const T *in, size_t npixel) {
+    for (size_t i = 0; i < npixel; i++)
+        out[i] = in[i];
+}
+
+// Images received before all cards reported hit finding result (only if write_only_hits is set)
+// Buffer location and receive request are released, when the image is written or dropped
+struct pending_image_t {
+    uint32_t frame_id;
+    size_t frame_size;
+    uint64_t wr_id;
+    bool repost;      // receive request is posted again after handling the image
+};
+
+static std::vector<pending_image_t> pending_images[MAX_NCARDS];
+static pthread_mutex_t pending_images_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char *ib_buffer_location(int card_id, uint64_t wr_id) {
+    // Location in buffer is based on work request ID
+    return writer_connection_settings[card_id].ib_buffer + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * wr_id;
+}
 
-    // Work request
+// Compress and save image, returns size after compression
+static size_t write_image(char *location, size_t frame_size, uint32_t frame_id, int card_id, char *compression_buffer) {
+    char *output_buffer;
+    size_t output_size;
+
+    // Compress
+    switch(writer_settings.compression) {
+        case JF_COMPRESSION_NONE:
+            // If there is no compression, data are saved directly from the buffer
+            output_buffer = location;
+            output_size = frame_size;
+            break;
+
+        case JF_COMPRESSION_BSHUF_LZ4:
+            // Write bitshuffle header
+            bshuf_write_uint64_BE(compression_buffer, frame_size);
+            bshuf_write_uint32_BE(compression_buffer + 8, LZ4_BLOCK_SIZE);
+            // Compress
+            output_size = bshuf_compress_lz4(location, compression_buffer + 12, frame_size / experiment_settings.pixel_depth, experiment_settings.pixel_depth, LZ4_BLOCK_SIZE) + 12;
+            output_buffer = compression_buffer;
+            break;
+
+        case JF_COMPRESSION_BSHUF_ZSTD:
+            // Write bitshuffle header
+            bshuf_write_uint64_BE(compression_buffer, frame_size);
+            bshuf_write_uint32_BE(compression_buffer + 8, ZSTD_BLOCK_SIZE);
+            // Compress
+            output_size = bshuf_compress_zstd(location, compression_buffer + 12, frame_size / experiment_settings.pixel_depth, experiment_settings.pixel_depth, ZSTD_BLOCK_SIZE) + 12;
+            output_buffer = compression_buffer;
+            break;
+    }
+
+    // Save file according to chosen method
+    switch (writer_settings.write_mode) {
+        case JF_WRITE_HDF5:
+            save_data_hdf(output_buffer, output_size, frame_id, card_id);
+            break;
+        case JF_WRITE_BINARY:
+            save_binary(output_buffer, output_size, frame_id, card_id);
+            break;
+    }
+    return output_size;
+}
+
+static void repost_receive_request(int card_id, uint64_t wr_id) {
     struct ibv_sge ib_sg_entry;
     struct ibv_recv_wr ib_wr, *ib_bad_recv_wr;
 
-    // pointer to packet buffer size and memory key of each packet buffer
+    ib_sg_entry.addr = (uint64_t) ib_buffer_location(card_id, wr_id);
     ib_sg_entry.length = COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth;
-    ib_sg_entry.lkey   = writer_connection_settings[card_id].ib_buffer_mr->lkey;
+    ib_sg_entry.lkey = writer_connection_settings[card_id].ib_buffer_mr->lkey;
 
+    ib_wr.wr_id = wr_id;
     ib_wr.num_sge = 1;
     ib_wr.sg_list = &ib_sg_entry;
     ib_wr.next = NULL;
+    ibv_post_recv(writer_connection_settings[card_id].ib_settings.qp, &ib_wr, &ib_bad_recv_wr);
+}
+
+static bool pending_images_left(int card_id) {
+    pthread_mutex_lock(&pending_images_mutex);
+    bool ret = !pending_images[card_id].empty();
+    pthread_mutex_unlock(&pending_images_mutex);
+    return ret;
+}
+
+// Writes hits and drops misses among pending images. If more than max_pending images are waiting,
+// the oldest ones are written without classification, so receive queue is never exhausted.
+// Returns number of images handled.
+static size_t handle_pending_images(int card_id, size_t max_pending, char *compression_buffer, size_t &compressed_size) {
+    std::vector<pending_image_t> hits, misses, unclassified;
+
+    pthread_mutex_lock(&pending_images_mutex);
+    std::vector<pending_image_t> &pending = pending_images[card_id];
+    size_t i = 0;
+    while (i < pending.size()) {
+        hit_decision_t decision = image_hit_decision(pending[i].frame_id);
+        if (decision == HIT_FOUND)
+            hits.push_back(pending[i]);
+        else if (decision == HIT_MISS)
+            misses.push_back(pending[i]);
+        else if (pending.size() > max_pending)
+            unclassified.push_back(pending[i]);
+        else {
+            i++;
+            continue;
+        }
+        pending.erase(pending.begin() + i);
+    }
+    pthread_mutex_unlock(&pending_images_mutex);
+
+    if (misses.size() + unclassified.size() > 0) {
+        pthread_mutex_lock(&spots_statistics_mutex);
+        hit_statistics.vetoed += misses.size();
+        hit_statistics.unclassified += unclassified.size();
+        pthread_mutex_unlock(&spots_statistics_mutex);
+    }
+
+    hits.insert(hits.end(), unclassified.begin(), unclassified.end());
+    for (i = 0; i < hits.size(); i++)
+        compressed_size += write_image(ib_buffer_location(card_id, hits[i].wr_id), hits[i].frame_size,
+                                       hits[i].frame_id, card_id, compression_buffer);
+
+    hits.insert(hits.end(), misses.begin(), misses.end());
+    for (i = 0; i < hits.size(); i++) {
+        if (hits[i].repost) repost_receive_request(card_id, hits[i].wr_id);
+    }
+    return hits.size();
+}
+
+void *run_writer_thread(void* thread_arg) {
+    // Read card ID
+    writer_thread_arg_t *arg = (writer_thread_arg_t *)thread_arg;
+    int card_id   = arg->card_id;
+    size_t local_compressed_size = 0;
+
+    thread_placement.PinThread("writer" + std::to_string(card_id));
+
+    // Work requests to repost, these are posted together after handling batch of completions
+    struct ibv_sge ib_sg_entry[RDMA_CQ_BATCH];
+    struct ibv_recv_wr ib_wr[RDMA_CQ_BATCH], *ib_bad_recv_wr;
+
+    for (int i = 0; i < RDMA_CQ_BATCH; i++) {
+        // pointer to packet buffer size and memory key of each packet buffer
+        ib_sg_entry[i].length = COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth;
+        ib_sg_entry[i].lkey   = writer_connection_settings[card_id].ib_buffer_mr->lkey;
+
+        ib_wr[i].num_sge = 1;
+        ib_wr[i].sg_list = &ib_sg_entry[i];
+        ib_wr[i].next = NULL;
+    }
 
     // Create buffer to store compression settings
     char *compression_buffer = NULL;
@@ -56,127 +192,131 @@ void *run_writer_thread(void* thread_arg) {
     if (writer_settings.compression == JF_COMPRESSION_BSHUF_ZSTD)
         compression_buffer = (char *) malloc(bshuf_compress_zstd_bound(COMPOSED_IMAGE_SIZE,experiment_settings.pixel_depth, ZSTD_BLOCK_SIZE) + 12);
 
-    // RDMA buffer size is constant, so only half slots are allocated if pixel is 32-bit (with summation)
-    size_t number_of_rqs = RDMA_RQ_SIZE;
-    if (experiment_settings.pixel_depth == 4) number_of_rqs = RDMA_RQ_SIZE / 2;
+    size_t number_of_rqs = receive_queue_images(experiment_settings);
 
     // Lock is necessary for calculating loop condition - number of remaining frames
     pthread_mutex_lock(&remaining_images_mutex[card_id]);
 
     // Calculate how many preview images to generate
-    size_t preview_stride = int(PREVIEW_FREQUENCY/experiment_settings.frame_time);
+    size_t preview_stride = preview_image_stride();
 
-    // Stride need to be increased, if it would overflow preview buffer
-    if ( MAX_PREVIEW < experiment_settings.nimages_to_write / preview_stride)
-        preview_stride = experiment_settings.nimages_to_write / MAX_PREVIEW;
+    // With write_only_hits, images are kept in IB buffer till hit finding result arrives
+    // (at most half of receive queue, and at most HIT_DECISION_TIMEOUT after the last image)
+    bool veto = hit_veto_enabled();
+    size_t max_pending = number_of_rqs / 2;
+    size_t idle_loops = 0;
 
     // Receive data and write to file
-    while (remaining_images[card_id] > 0) {
-        // At the very end of the data collection, no need of adding new work requests
-        bool repost_wr = false;
-        if (remaining_images[card_id] > number_of_rqs) repost_wr = true;
-        remaining_images[card_id]--;
+    while ((remaining_images[card_id] > 0) || (veto && pending_images_left(card_id))) {
+        // Take at most fair share of remaining images, so the last images are not handled by a single thread
+        size_t max_comp = remaining_images[card_id] / (writer_settings.nthreads / detector_geometry.GetCardsNum());
+        if (max_comp > RDMA_CQ_BATCH) max_comp = RDMA_CQ_BATCH;
+        if (max_comp == 0) max_comp = 1;
+        bool all_received = (remaining_images[card_id] == 0);
         pthread_mutex_unlock(&remaining_images_mutex[card_id]);
 
-        // Poll CQ for finished receive requests
-        ibv_wc ib_wc;
-        int num_comp = ibv_poll_cq(writer_connection_settings[card_id].ib_settings.cq, 1, &ib_wc);
-
-        // If no completion finished - wait 100 us
-        while (num_comp == 0) {
-            usleep(100);
-            num_comp = ibv_poll_cq(writer_connection_settings[card_id].ib_settings.cq, 1, &ib_wc);
+        if (veto) {
+            if (handle_pending_images(card_id, max_pending, compression_buffer, local_compressed_size) > 0)
+                idle_loops = 0;
+            // Hit finding results are missing long after the last image arrived
+            if (all_received && (max_pending > 0) && (idle_loops * 100e-6 > HIT_DECISION_TIMEOUT)) {
+                std::cerr << "Hit finding result missing for card " << card_id << ", writing images without classification" << std::endl;
+                max_pending = 0;
+            }
         }
 
+        // Poll CQ for finished receive requests
+        ibv_wc ib_wc[RDMA_CQ_BATCH];
+        int num_comp = ibv_poll_cq(writer_connection_settings[card_id].ib_settings.cq, max_comp, ib_wc);
+
         // Error in CQ polling
         if (num_comp < 0) {
             std::cerr << "Failed polling IB Verbs completion queue" << std::endl;
             exit(EXIT_FAILURE);
         }
 
-        // Error in work completion
-        if (ib_wc.status != IBV_WC_SUCCESS) {
-            std::cerr << "Failed status " << ibv_wc_status_str(ib_wc.status) << " of IB Verbs send request #" << (int)ib_wc.wr_id << " Num comp " << num_comp << std::endl;
-            exit(EXIT_FAILURE);
+        // If no completion finished - wait 100 us and check again, if there are still images to receive
+        if (num_comp == 0) {
+            idle_loops++;
+            usleep(100);
+            pthread_mutex_lock(&remaining_images_mutex[card_id]);
+            continue;
         }
 
-        // Frame ID is saved as immediate value, outside of the buffer
-        uint32_t frame_id = ntohl(ib_wc.imm_data);
-        // Frame length in bytes
-        size_t   frame_size = ib_wc.byte_len;
-        // Location in buffer is based on work request ID
-        char *ib_buffer_location = writer_connection_settings[card_id].ib_buffer
-                                   + COMPOSED_IMAGE_SIZE * experiment_settings.pixel_depth * ib_wc.wr_id;
-
-        // For every i-th frame, save frame content for preview
-        // Although there is risk, that preview might be read, while being written, it is less of a problem
-        // as compared to potentially slowing down data collection
-        // So there is deliberately no mutex in place
-
-        // TODO: Include gaps
-        if (frame_id % preview_stride == 0) {
-            size_t preview_id = frame_id / preview_stride;
-            if (experiment_settings.pixel_depth == 4) {
-                for (int i = 0; i < XPIXEL * YPIXEL / NCARDS; i++)
-                    // Card id needs flipping, to correctly get up-down
-                    preview[preview_id * PREVIEW_SIZE + i+(1-card_id) * (XPIXEL * YPIXEL / NCARDS)] = ((int32_t *) ib_buffer_location)[i];
-            } else {
-                for (int i = 0; i < XPIXEL * YPIXEL / NCARDS; i++)
-                    preview[preview_id * PREVIEW_SIZE + i+(1-card_id) * (XPIXEL * YPIXEL / NCARDS)] = ((int16_t *) ib_buffer_location)[i];
+        // At the very end of the data collection, no need of adding new work requests
+        pthread_mutex_lock(&remaining_images_mutex[card_id]);
+        size_t remaining_before = remaining_images[card_id];
+        remaining_images[card_id] -= num_comp;
+        pthread_mutex_unlock(&remaining_images_mutex[card_id]);
+
+        int nrepost = 0;
+        idle_loops = 0;
+
+        for (int comp = 0; comp < num_comp; comp++) {
+            // Error in work completion
+            if (ib_wc[comp].status != IBV_WC_SUCCESS) {
+                std::cerr << "Failed status " << ibv_wc_status_str(ib_wc[comp].status) << " of IB Verbs send request #" << (int)ib_wc[comp].wr_id << " Num comp " << num_comp << std::endl;
+                exit(EXIT_FAILURE);
             }
-            preview_image_available[preview_id*NCARDS+card_id] = true;
-        }
 
-        char *output_buffer;
-        size_t output_size;
-
-        // Compress
-        switch(writer_settings.compression) {
-            case JF_COMPRESSION_NONE:
-                // If there is no compression, data are saved directly from the buffer
-                output_buffer = ib_buffer_location;
-                output_size = frame_size;
-                break;
-
-            case JF_COMPRESSION_BSHUF_LZ4:
-                // Write bitshuffle header
-                bshuf_write_uint64_BE(compression_buffer, frame_size);
-                bshuf_write_uint32_BE(compression_buffer + 8, LZ4_BLOCK_SIZE);
-                // Compress
-                output_size = bshuf_compress_lz4(ib_buffer_location, compression_buffer + 12, frame_size / experiment_settings.pixel_depth, experiment_settings.pixel_depth, LZ4_BLOCK_SIZE) + 12;
-                output_buffer = compression_buffer;
-                break;
-
-            case JF_COMPRESSION_BSHUF_ZSTD:
-                // Write bitshuffle header
-                bshuf_write_uint64_BE(compression_buffer, frame_size);
-                bshuf_write_uint32_BE(compression_buffer + 8, ZSTD_BLOCK_SIZE);
-                // Compress
-                output_size = bshuf_compress_zstd(ib_buffer_location, compression_buffer + 12, frame_size / experiment_settings.pixel_depth, experiment_settings.pixel_depth, ZSTD_BLOCK_SIZE) + 12;
-                output_buffer = compression_buffer;
-                break;
-        }
+            // Frame ID is saved as immediate value, outside of the buffer
+            uint32_t frame_id = ntohl(ib_wc[comp].imm_data);
+            // Frame length in bytes
+            size_t   frame_size = ib_wc[comp].byte_len;
+            char *location = ib_buffer_location(card_id, ib_wc[comp].wr_id);
+
+            // For every i-th frame, save frame content for preview
+            // Although there is risk, that preview might be read, while being written, it is less of a problem
+            // as compared to potentially slowing down data collection
+            // So there is deliberately no mutex in place
+
+            // TODO: Include gaps
+            if (frame_id % preview_stride == 0) {
+                size_t preview_id = frame_id / preview_stride;
+                // Card 0 is at the bottom of the image
+                int32_t *preview_location = preview + preview_id * detector_geometry.GetPixels()
+                                            + detector_geometry.GetCardPixelOffset(card_id);
+                if (experiment_settings.pixel_depth == 4)
+                    copy_to_preview(preview_location, (int32_t *) location, detector_geometry.GetCardComposedPixels());
+                else
+                    copy_to_preview(preview_location, (int16_t *) location, detector_geometry.GetCardComposedPixels());
+                preview_image_available[preview_id*detector_geometry.GetCardsNum()+card_id] = true;
+            }
+
+            // Post work request again, if there is need of new work request
+            bool repost = (remaining_before - comp > number_of_rqs);
+
+            hit_decision_t decision = HIT_FOUND;
+            if (veto) decision = image_hit_decision(frame_id);
+
+            if (decision == HIT_UNKNOWN) {
+                // Receive request is posted again, when the image is handled
+                pending_image_t image = {frame_id, frame_size, ib_wc[comp].wr_id, repost};
+                pthread_mutex_lock(&pending_images_mutex);
+                pending_images[card_id].push_back(image);
+                pthread_mutex_unlock(&pending_images_mutex);
+                continue;
+            } else if (decision == HIT_FOUND)
+                local_compressed_size += write_image(location, frame_size, frame_id, card_id, compression_buffer);
+            else {
+                pthread_mutex_lock(&spots_statistics_mutex);
+                hit_statistics.vetoed++;
+                pthread_mutex_unlock(&spots_statistics_mutex);
+            }
 
-        // Save file according to chosen method
-        switch (writer_settings.write_mode) {
-            case JF_WRITE_HDF5:
-                save_data_hdf(output_buffer, output_size, frame_id, card_id);
-                break;
-            case JF_WRITE_BINARY:
-                save_binary(output_buffer, output_size, frame_id, card_id);
-                break;
+            if (repost) {
+                // Make new work request with the same ID
+                ib_sg_entry[nrepost].addr = (uint64_t)(location);
+                ib_wr[nrepost].wr_id = ib_wc[comp].wr_id;
+                ib_wr[nrepost].next = NULL;
+                if (nrepost > 0) ib_wr[nrepost - 1].next = &ib_wr[nrepost];
+                nrepost++;
+            }
         }
 
-        local_compressed_size += output_size;
+        if (nrepost > 0)
+            ibv_post_recv(writer_connection_settings[card_id].ib_settings.qp, &ib_wr[0], &ib_bad_recv_wr);
 
-        // Post work request again
-        if (repost_wr) {
-            // Make new work request with the same ID
-            // If there is need of new work request
-            ib_sg_entry.addr = (uint64_t)(ib_buffer_location);
-            ib_wr.wr_id = ib_wc.wr_id;
-            ibv_post_recv(writer_connection_settings[card_id].ib_settings.qp, &ib_wr, &ib_bad_recv_wr);
-        }
         // Mutex needs locking to calculate loop condition
         pthread_mutex_lock(&remaining_images_mutex[card_id]);
     }
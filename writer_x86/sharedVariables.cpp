@@ -19,15 +19,19 @@
 pthread_t *writer_thread = NULL;
 writer_thread_arg_t *writer_thread_arg = NULL;
 
-pthread_t metadata_thread[NCARDS];
-writer_thread_arg_t metadata_thread_arg[NCARDS];
+pthread_t metadata_thread[MAX_NCARDS];
+writer_thread_arg_t metadata_thread_arg[MAX_NCARDS];
 
 writer_settings_t writer_settings;
 gain_pedestal_t gain_pedestal;
-online_statistics_t online_statistics[NCARDS];
+const GeometryPlan geometry_plan(NMODULES);
+DetectorGeometry detector_geometry(DEFAULT_NCARDS, NMODULES);
+
+ThreadPlacement thread_placement;
+online_statistics_t online_statistics[MAX_NCARDS];
 
 experiment_settings_t experiment_settings;
-writer_connection_settings_t writer_connection_settings[NCARDS];
+writer_connection_settings_t writer_connection_settings[MAX_NCARDS];
 
 uint8_t writers_done_per_file;
 pthread_mutex_t writers_done_per_file_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -36,8 +40,8 @@ pthread_cond_t writers_done_per_file_cond = PTHREAD_COND_INITIALIZER;
 size_t total_compressed_size = 0;
 pthread_mutex_t total_compressed_size_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-uint64_t remaining_images[NCARDS];
-pthread_mutex_t remaining_images_mutex[NCARDS];
+uint64_t remaining_images[MAX_NCARDS];
+pthread_mutex_t remaining_images_mutex[MAX_NCARDS];
 
 #ifndef OFFLINE
 sls::Detector *det;
@@ -50,7 +54,7 @@ struct timespec time_start = {0, 0};
 struct timespec time_end = {0, 0};
 
 int32_t *preview;
-std::vector<bool> preview_image_available(MAX_PREVIEW*NCARDS);
+std::vector<bool> preview_image_available;
 
 
 std::vector<spot_t> spots;
@@ -60,3 +64,6 @@ std::vector<double> spot_count_per_image;
 spot_statistics_t spot_statistics;
 int spot_statistics_sequence = 0;
 pthread_mutex_t spots_statistics_mutex;
+
+std::vector<image_hit_t> image_hits;
+hit_statistics_t hit_statistics;